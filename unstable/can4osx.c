@@ -42,29 +42,35 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "can4osx.h"
 #include "can4osx_debug.h"
 #include "can4osx_internal.h"
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include "can4osx_usb_core.h"
+#include "can4osx_usb_emu.h"
 
 // Hardeware specific headers
 #include "kvaserLeaf.h"
 #include "kvaserLeafPro.h"
 #include "ixxatUsbFd.h"
+#include "virtualCan.h"
+
 
+Can4osxUsbDeviceHandleEntry **can4osxUsbDeviceHandle[CAN4OSX_MAX_CHANNEL_COUNT / CAN4OSX_TABLE_CHUNK];
 
-Can4osxUsbDeviceHandleEntry can4osxUsbDeviceHandle[CAN4OSX_MAX_CHANNEL_COUNT];
+// Slots in use, a slot is filled before the count takes it in
+static _Atomic UInt32 can4osxMaxChannelCount = 0;
 
-static UInt32 can4osxMaxChannelCount = 0;
+// Slots of removed devices below the count, in slot order
+static Can4osxUsbDeviceHandleEntry *pCan4osxFreeChannels = NULL;
 
+// Entries of removed devices that were replaced, never freed
+static Can4osxUsbDeviceHandleEntry *pCan4osxRetiredChannels = NULL;
 
-static CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[] =
+
+const CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[] =
 {
 	// Vendor Id, Product Id
 	{0x0bfd, 0x0120}, //Kvaser Leaf Light v.2
@@ -72,24 +78,20 @@ static CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[] =
 	{0x0bfd, 0x0108}, //Kvaser USBcan Pro 2xHS v.2
 	{0x0bfd, 0x000E}, //Kvaser Leaf SemiPro HS
 	{0x08d8, 0x0017}, //IXXAT USB-to-CAN FD
+	{VIRTUAL_VENDOR_ID, VIRTUAL_PRODUCT_ID}, //Virtual CAN bus
 };
 
 
+const UInt32 can4osxSupportedDeviceCount = sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T);
+
+
 // Internal stuff
-static IONotificationPortRef can4osxUsbNotificationPortRef = 0;
-static io_iterator_t can4osxIoIterator[(sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T))];
 static dispatch_semaphore_t semaCan4osxStart = NULL;
 static dispatch_queue_t queueCan4osx = NULL;
 
 
-static void CAN4OSX_CanInitializeLibrary(void);
-static void CAN4OSX_DeviceAdded(void *refCon, io_iterator_t iterator);
-static IOReturn CAN4OSX_ConfigureDevice(IOUSBDeviceInterface182 **dev);
-static IOReturn CAN4OSX_FindInterfaces(Can4osxUsbDeviceHandleEntry *handle);
-static void CAN4OSX_DeviceNotification(void *refCon, io_service_t service, natural_t messageType, void *messageArgument);
 static CanHandle CAN4OSX_CheckHandle(const CanHandle hnd);
-static IOReturn CAN4OSX_CreateEndpointBuffer( const CanHandle hnd );
-static IOReturn CAN4OSX_Dealloc(Can4osxUsbDeviceHandleEntry	*self);
+static void CAN4OSX_RunExclusive(Can4osxUsbDeviceHandleEntry *pSelf, const CanHandle hnd, dispatch_block_t block);
 
 bool bIsLoaded = false;
 
@@ -121,7 +123,7 @@ void canInitializeLibrary (
 	dispatch_set_target_queue(queueCan4osx, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
 	//Get a own thread where the usb stuff runs
 	dispatch_async(queueCan4osx, ^(void) {
-		CAN4OSX_CanInitializeLibrary();
+		CAN4OSX_usbDriverThread(semaCan4osxStart);
 	});
 	// Wait here until the background usb task is done
 	dispatch_semaphore_wait(semaCan4osxStart, DISPATCH_TIME_FOREVER);
@@ -148,7 +150,14 @@ canStatus canBusOn(
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
+
+		// canReadStatus reports overruns from here on
+		self->rxHwOverrunsSeen = atomic_load(&self->rxHwOverruns);
+		if ( self->canEventMsgBuff != NULL )  {
+			self->rxSwOverrunsSeen = CAN4OSX_CanEventBufferDropped(self->canEventMsgBuff);
+		}
+
 		return(self->hwFunctions.can4osxhwCanBusOnRef(hnd));
 	}
 }
@@ -170,7 +179,7 @@ canStatus canBusOff(
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 		return(pSelf->hwFunctions.can4osxhwCanBusOffRef(hnd));
 	}
 }
@@ -190,23 +199,71 @@ CanHandle canOpenChannel(
 		int flags
 	)
 {
-	if ( CAN4OSX_CheckHandle(channel) == -1 )  {
+	if ( (channel < 0) || ((UInt32)channel >= atomic_load(&can4osxMaxChannelCount)) ||
+		 (CAN4OSX_CHANNEL(channel)->channelNumber == -1) )  {
 		return(canERR_NOCHANNELS);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[channel];
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(channel);
 		if (pSelf->hwFunctions.can4osxhwCanOpenChannel != NULL)  {
-			pSelf->hwFunctions.can4osxhwCanOpenChannel(channel, flags);
+			CanHandle ret = pSelf->hwFunctions.can4osxhwCanOpenChannel(channel, flags);
+			if (ret < 0)  {
+				return(ret);
+			}
 		}
 
-		return(CanHandle)channel;
+		return(CAN4OSX_HANDLE(pSelf));
 	}
 }
 
+
+/******************************************************************************/
+/**
+ * \brief canClose - closes the handle
+ *
+ * Takes the channel off the bus and stops its notifications. The handle is
+ * stale afterwards, canOpenChannel gives a new one for the channel.
+ *
+ * \return canStatus
+ *
+ */
 canStatus canClose(
 		const CanHandle hndl
 	)
 {
-	return(0);//FIXME
+	if ( CAN4OSX_CheckHandle(hndl) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hndl);
+
+		(void)pSelf->hwFunctions.can4osxhwCanBusOffRef(hndl);
+		pSelf->notifyCallback = NULL;
+
+		atomic_fetch_add(&pSelf->generation, 1u);
+		CAN4OSX_WakeWaiters(pSelf);
+
+		return(canOK);
+	}
+}
+
+
+#ifdef __APPLE__
+/* Posts the notification of canSetNotify, once per USB transfer */
+static void CAN4OSX_PostNotification(
+		CanHandle hnd,
+		void *ctx,
+		unsigned int flags,
+		UInt32 count
+	)
+{
+Can4osxUsbDeviceHandleEntry *self = (Can4osxUsbDeviceHandleEntry *)ctx;
+
+	(void)hnd;
+	(void)flags;
+	(void)count;
+
+	if (self->canNotification.notifacionCenter)  {
+		CFNotificationCenterPostNotification (self->canNotification.notifacionCenter, self->canNotification.notificationString, NULL, NULL, true);
+	}
 }
 
 
@@ -221,7 +278,10 @@ canStatus canSetNotify(
 		return(canERR_INVHANDLE);
 	} else {
 
-		Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
+
+		// Stop the posts before the strings change
+		self->notifyCallback = NULL;
 
 		if ( notifyFlags )  {
 			CFStringRef temp = self->canNotification.notificationString;
@@ -232,13 +292,75 @@ canStatus canSetNotify(
 			if ( temp )  {
 				CFRelease(temp);
 			}
+
+			return(canSetNotifyCallback(hnd, CAN4OSX_PostNotification, self, notifyFlags));
 		} else {
 			self->canNotification.notifacionCenter = NULL;
-			CFRelease( self->canNotification.notificationString );
+			if ( self->canNotification.notificationString )  {
+				CFRelease( self->canNotification.notificationString );
+				self->canNotification.notificationString = NULL;
+			}
 		}
 		return(0);
 	}
 }
+#else
+/* There is no notification center, canSetNotifyCallback does the job */
+canStatus canSetNotify(
+		const CanHandle hnd,
+		CanNotificationType notifyStruct,
+		unsigned int notifyFlags,
+		void *tag
+	)
+{
+	(void)notifyStruct;
+	(void)notifyFlags;
+	(void)tag;
+
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	}
+
+	return(canERR_NOT_IMPLEMENTED);
+}
+#endif
+
+
+/******************************************************************************/
+/**
+ * \brief canSetNotifyCallback - set a notification callback
+ *
+ * fn is called from the driver thread once per received USB transfer which
+ * contained events in flags (canNOTIFY_RX, canNOTIFY_TX, canNOTIFY_STATUS),
+ * count is the number of new frames. The callback must not block. Passing
+ * NULL for fn or 0 for flags removes the callback.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canSetNotifyCallback(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanNotifyCallback fn,
+		void *ctx,
+		unsigned int flags
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+		pSelf->notifyCallback = NULL;
+
+		if ( (fn != NULL) && (flags != 0u) )  {
+			pSelf->notifyContext = ctx;
+			pSelf->notifyFlags = flags;
+			pSelf->notifyCallback = fn;
+		}
+
+		return(canOK);
+	}
+}
 
 
 canStatus canSetBusParams(
@@ -254,7 +376,7 @@ canStatus canSetBusParams(
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 		if (NULL != pSelf->hwFunctions.can4osxhwCanSetBusParamsRef)  {
 			return(pSelf->hwFunctions.can4osxhwCanSetBusParamsRef(hnd,freq,tseg1,tseg2,sjw,noSamp,syncmode));
 		} else {
@@ -275,7 +397,7 @@ canStatus canSetBusParamsFd(
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 		if (NULL != pSelf->hwFunctions.can4osxhwCanSetBusParamsFdRef)  {
 			return(pSelf->hwFunctions.can4osxhwCanSetBusParamsFdRef(hnd,freq_brs,tseg1,tseg2,sjw));
 		} else {
@@ -306,581 +428,1625 @@ canStatus canRead (
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		return(pSelf->hwFunctions.can4osxhwCanReadRef(hnd,id,msg,dlc,flag,time));
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		canStatus status = pSelf->hwFunctions.can4osxhwCanReadRef(hnd,id,msg,dlc,flag,time);
+
+		if ( (status == canERR_NOMSG) && (pSelf->canEventMsgBuff != NULL) )  {
+			CAN4OSX_ClearCanEventBufferFd(pSelf->canEventMsgBuff);
+		}
+
+		return(status);
 	}
 }
 
 
 /******************************************************************************/
 /**
- * \brief canWrite - write a CAN message
+ * \brief canReadNs - read a CAN message with its 64 bit time
  *
- * This function writes a CAN message to the given handle.
+ * Like canRead, time gets the receive time in nanoseconds since the device
+ * timer started. The device timer is extended to 64 bit by the driver, it
+ * does not wrap. canERR_NOT_IMPLEMENTED for a device whose timer rate is
+ * not known, the frame stays in the queue.
  *
  * \return canStatus
  *
  */
- canStatus canWrite (
+canStatus canReadNs (
 		const CanHandle hnd, /**< handle to the CAN channel */
-		UInt32 id,
+		UInt32 *id,
 		void *msg,
-		UInt16 dlc,
-		UInt32 flag
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt64 *time
 	)
 {
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		return(pSelf->hwFunctions.can4osxhwCanWriteRef(hnd,id,msg,dlc,flag));
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		CanMsg canMsg;
+
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
+		}
+
+		if ( pSelf->deviceTimeUnknown )  {
+			return(canERR_NOT_IMPLEMENTED);
+		}
+
+		if ( !CAN4OSX_ReadCanEventBuffer(pSelf->canEventMsgBuff, &canMsg) )  {
+			CAN4OSX_ClearCanEventBufferFd(pSelf->canEventMsgBuff);
+			return(canERR_NOMSG);
+		}
+
+		*id = canMsg.canId;
+		*dlc = canMsg.canDlc;
+		*time = canMsg.canTimestamp;
+		*flag = canMsg.canFlags;
+		memcpy(msg, canMsg.canData, *dlc);
+
+		return(canOK);
 	}
 }
 
 
-canStatus canReadStatus	(
+/******************************************************************************/
+/**
+ * \brief canReadHostNs - read a CAN message with its host time
+ *
+ * Like canReadNs, but time is the receive time mapped to the host
+ * CLOCK_MONOTONIC in nanoseconds, see canGetClockSync for the error.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadHostNs (
 		const CanHandle hnd, /**< handle to the CAN channel */
-		UInt32 *const flags
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt64 *time
 	)
 {
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		CanMsg canMsg;
 
-		*flags = 0;
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
+		}
 
-		switch ( pSelf->canState.canState ) {
-			case CHIPSTAT_ERROR_ACTIVE:
-				*flags = canSTAT_ERROR_ACTIVE;
-				break;
-			case CHIPSTAT_BUSOFF:
-				*flags = canSTAT_BUS_OFF;
-				break;
-			case CHIPSTAT_ERROR_PASSIVE:
-				*flags = canSTAT_ERROR_PASSIVE;
-				break;
-			default:
-				break;
+		if ( !CAN4OSX_ReadCanEventBuffer(pSelf->canEventMsgBuff, &canMsg) )  {
+			CAN4OSX_ClearCanEventBufferFd(pSelf->canEventMsgBuff);
+			return(canERR_NOMSG);
 		}
 
+		*id = canMsg.canId;
+		*dlc = canMsg.canDlc;
+		*time = canMsg.canHostTimestamp;
+		*flag = canMsg.canFlags;
+		memcpy(msg, canMsg.canData, *dlc);
+
 		return(canOK);
 	}
 }
 
 
-canStatus canGetChannelData(
-		const CanHandle hnd,
-		SInt32 item,
-		void* pBuffer,
-		size_t bufsize
+/******************************************************************************/
+/**
+ * \brief canReadWait - read a CAN message, wait for one if needed
+ *
+ * This function reads a CAN message from the given handle. If there is none
+ * the caller is blocked until the driver receives one or timeout ms passed.
+ * A timeout of 0xFFFFFFFF waits forever. canClose or the removal of the
+ * device end the wait with canERR_INVHANDLE.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadWait (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt32 *time,
+		UInt32 timeout
 	)
 {
 	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
 		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		CanMsg canMsg;
 
-		if (NULL == pBuffer)  {
-			return(canERR_NOMEM);
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
 		}
 
-		if (bufsize <= 0)  {
-			return(canERR_NOMEM);
+		if ( !CAN4OSX_ReadCanEventBufferWait(pSelf->canEventMsgBuff, &canMsg, timeout) )  {
+			// Closed or removed while it waited, the descriptor stays readable
+			if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+				return(canERR_INVHANDLE);
+			}
+			CAN4OSX_ClearCanEventBufferFd(pSelf->canEventMsgBuff);
+			return(canERR_TIMEOUT);
 		}
 
-		memset(pBuffer, 0, bufsize);
+		*id = canMsg.canId;
+		*dlc = canMsg.canDlc;
+		*time = CAN4OSX_TIME_US(canMsg.canTimestamp);
+		*flag = canMsg.canFlags;
+		memcpy(msg, canMsg.canData, *dlc);
 
-		return(CAN4OSX_GetChannelData(pSelf,item,pBuffer,bufsize));
+		return(canOK);
 	}
 }
 
 
-canStatus canGetNumberOfChannels (int *channelCount)
+/******************************************************************************/
+/**
+ * \brief canReadBatch - read several CAN messages
+ *
+ * This function reads up to max CAN messages from the given handle with a
+ * single access to the receive buffer.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadBatch (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanFrame *frames,
+		UInt32 max,
+		UInt32 *count
+	)
 {
-	if (NULL == channelCount)  {
-		return(canERR_NOMEM);
-	}
-
-	*channelCount = can4osxMaxChannelCount;
-
-	return(canOK);
-}
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 
+		if ( (frames == NULL) || (count == NULL) )  {
+			return(canERR_PARAM);
+		}
 
-// Internal
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
+		}
 
-static void CAN4OSX_CanInitializeLibrary(
-		void
-	)
-{
-UInt16 loopCount = 0;
+		*count = CAN4OSX_ReadCanEventBufferBatch(pSelf->canEventMsgBuff, frames, max);
 
-CFMutableDictionaryRef 	can4osxUsbMatchingDictRef;
-CFRunLoopSourceRef		can4osxRunLoopSourceRef;
-CFNumberRef				numberRef;
+		if ( *count == 0u )  {
+			CAN4OSX_ClearCanEventBufferFd(pSelf->canEventMsgBuff);
+			return(canERR_NOMSG);
+		}
 
-	//Set all channels inactive
-	for (loopCount = 0; loopCount < CAN4OSX_MAX_CHANNEL_COUNT; loopCount++ ) {
-		can4osxUsbDeviceHandle[loopCount].channelNumber = -1;
+		return(canOK);
 	}
-
-	can4osxUsbNotificationPortRef = IONotificationPortCreate(kIOMasterPortDefault);
-	can4osxRunLoopSourceRef = IONotificationPortGetRunLoopSource(can4osxUsbNotificationPortRef);
-
-	CFRunLoopAddSource(CFRunLoopGetCurrent(), can4osxRunLoopSourceRef, kCFRunLoopDefaultMode);
+}
 
 
-	for ( loopCount = 0; loopCount < (sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T)); loopCount++ ) {
+/******************************************************************************/
+/**
+ * \brief canReadPeek - look at received CAN messages without copying them
+ *
+ * frames points into the receive buffer at the oldest message, count messages
+ * follow each other in memory, canRxFrameNext steps from one to the next. They
+ * stay in the buffer until canReadRelease. Not available with
+ * canOVERRUN_DROP_OLDEST, the driver would overwrite the messages.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadPeek (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const CanRxFrame **frames,
+		UInt32 *count
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 
-		can4osxUsbMatchingDictRef = IOServiceMatching(kIOUSBDeviceClassName);
+		if ( (frames == NULL) || (count == NULL) )  {
+			return(canERR_PARAM);
+		}
 
-		// IOUSBDevice and its subclasses
-		if (can4osxUsbMatchingDictRef == NULL)  {
-			CAN4OSX_DEBUG_PRINT("%s : IOServiceMatching ret: NULL.\n",__func__);
-			return;
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
 		}
 
-		// Create a CFNumber for the idVendor and set the value in the dictionary
-		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].vendorId );
-		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBVendorID), numberRef);
-		CFRelease(numberRef);
+		if ( pSelf->canEventMsgBuff->dropOldest )  {
+			return(canERR_NOT_IMPLEMENTED);
+		}
 
-		// Create a CFNumber for the idProduct and set the value in the dictionary
-		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].productId);
-		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBProductID), numberRef);
-		CFRelease(numberRef);
+		*count = CAN4OSX_PeekCanEventBufferRun(pSelf->canEventMsgBuff, frames);
 
-		IOServiceAddMatchingNotification(can4osxUsbNotificationPortRef, kIOFirstMatchNotification, can4osxUsbMatchingDictRef, CAN4OSX_DeviceAdded, NULL, &can4osxIoIterator[loopCount]);
+		if ( *count == 0u )  {
+			CAN4OSX_ClearCanEventBufferFd(pSelf->canEventMsgBuff);
+			return(canERR_NOMSG);
+		}
 
+		return(canOK);
+	}
+}
 
-		numberRef = NULL;
 
-		CAN4OSX_DeviceAdded(NULL, can4osxIoIterator[loopCount]);
+/******************************************************************************/
+/**
+ * \brief canReadRelease - give looked at CAN messages back
+ *
+ * Removes the oldest count messages from the receive buffer, usually the ones
+ * returned by the last canReadPeek. Pointers to them must not be used anymore.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadRelease (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 count
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 
-	}
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
+		}
 
-	dispatch_semaphore_signal(semaCan4osxStart);
-	CFRunLoopRun();
+		if ( CAN4OSX_ReleaseCanEventBufferRun(pSelf->canEventMsgBuff, count) != count )  {
+			return(canERR_PARAM);
+		}
 
-	// if the runloop is stopped release
-	for ( loopCount = 0; loopCount < (sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T)); loopCount++ ) {
-		IOObjectRelease(can4osxIoIterator[loopCount]);
+		return(canOK);
 	}
-
-	IONotificationPortDestroy(can4osxUsbNotificationPortRef);
-
 }
 
 
 /******************************************************************************/
 /**
- * \internal
- * \brief CAN4OSX_CheckHandle - checks if the handle is valid
+ * \brief canWrite - write a CAN message
  *
- * This function checks if the given handle is valid
+ * This function writes a CAN message to the given handle. If the transmit
+ * queue of the channel is full, the message is not queued and
+ * canERR_TXBUFOFL is returned.
  *
  * \return canStatus
  *
  */
-static CanHandle CAN4OSX_CheckHandle(
-		const CanHandle hnd
+ canStatus canWrite (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 id,
+		void *msg,
+		UInt16 dlc,
+		UInt32 flag
 	)
 {
-	if (hnd >= CAN4OSX_MAX_CHANNEL_COUNT)  {
-		return(-1);
-	}
-
-	if (can4osxUsbDeviceHandle[hnd].channelNumber == -1)  {
-		return(-1);
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		return(pSelf->hwFunctions.can4osxhwCanWriteRef(hnd,id,msg,dlc,flag));
 	}
-
-	return(hnd);
 }
 
 
-static void CAN4OSX_DeviceAdded(
-		void *refCon,
-		io_iterator_t iterator
+/******************************************************************************/
+/**
+ * \brief canWriteBatch - write several CAN messages
+ *
+ * This function queues count CAN messages on the given handle at once, so the
+ * driver can pack them into as few USB transfers as possible. sent returns
+ * the number of messages accepted; if the transmit buffer runs full the
+ * remaining messages are not queued and canERR_TXBUFOFL is returned.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canWriteBatch (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const CanFrame *frames,
+		UInt32 count,
+		UInt32 *sent
 	)
 {
-kern_return_t kernRetVal;
-SInt32                 score;
-HRESULT                result;
-UInt16                 productId;
-
-io_service_t           can4osxUsbDevice;
-IOCFPlugInInterface  **can4osxPluginInterface = NULL;
-Can4osxUsbDeviceHandleEntry *pDevice;
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		UInt32 i;
 
-	while ( (can4osxUsbDevice = IOIteratorNext(iterator) ) )  {
+		if ( (frames == NULL) || (sent == NULL) )  {
+			return(canERR_PARAM);
+		}
 
-		CAN4OSX_DEBUG_PRINT("%s : Device added\n", __func__);
+		if ( pSelf->hwFunctions.can4osxhwCanWriteBatchRef != NULL )  {
+			return(pSelf->hwFunctions.can4osxhwCanWriteBatchRef(hnd, frames, count, sent));
+		}
 
-		if (can4osxMaxChannelCount >= CAN4OSX_MAX_CHANNEL_COUNT)  {
-			CAN4OSX_DEBUG_PRINT("%s : max Channel reached\n", __func__);
-			return;
+		// No batch support in the driver, fall back to single writes
+		*sent = 0;
+		for ( i = 0; i < count; i++ )  {
+			canStatus status = pSelf->hwFunctions.can4osxhwCanWriteRef(hnd, frames[i].id, (void*)frames[i].msg, frames[i].dlc, frames[i].flag);
+			if ( status != canOK )  {
+				return(status);
+			}
+			(*sent)++;
 		}
 
+		return(canOK);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canWaitForEvent - wait for events on several handles
+ *
+ * This function blocks until at least one of the handles has received data
+ * (canNOTIFY_RX), got a transmit completion (canNOTIFY_TX) or changed its
+ * status (canNOTIFY_STATUS), or until timeout ms passed. readyFlags must
+ * hold count entries and gets the flags of each handle. TX and status events
+ * are reported once, RX is reported as long as there is data to read.
+ *
+ * \return canStatus, canERR_TIMEOUT if no handle became ready,
+ * canERR_INVHANDLE if a handle was closed or its device removed
+ *
+ */
+canStatus canWaitForEvent (
+		const CanHandle *hnds,
+		UInt32 count,
+		UInt32 *readyFlags,
+		UInt32 timeout
+	)
+{
+UInt32 i;
+int ready;
+
+	if ( (hnds == NULL) || (readyFlags == NULL) || (count == 0u) )  {
+		return(canERR_PARAM);
+	}
+
+	for ( i = 0u; i < count; i++ )  {
+		if ( CAN4OSX_CheckHandle(hnds[i]) == -1 )  {
+			return(canERR_INVHANDLE);
+		}
+	}
+
+	ready = CAN4OSX_WaitForEvent(hnds, count, readyFlags, timeout);
+	if ( ready < 0 )  {
+		return((canStatus)ready);
+	}
+	if ( ready == 0 )  {
+		return(canERR_TIMEOUT);
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canOpenGroup - read several channels as one stream
+ *
+ * The frames of the channels come out of canReadGroup merged by their host
+ * time, so channels of different adapters line up as well. A frame is handed
+ * out once every channel has a later one waiting, or windowUs after it was
+ * received. The window has to cover the USB latency of the slowest channel,
+ * frames arriving later than that may come out of order. The channels must
+ * not be read directly while they are in a group.
+ *
+ * \return the group handle, negative canStatus on error
+ *
+ */
+CanGroupHandle canOpenGroup(
+		const CanHandle *hnds,
+		UInt32 count,
+		UInt32 windowUs
+	)
+{
+UInt32 i;
+
+	if ( hnds == NULL )  {
+		return(canERR_PARAM);
+	}
+
+	for ( i = 0u; i < count; i++ )  {
+		if ( CAN4OSX_CheckHandle(hnds[i]) == -1 )  {
+			return(canERR_INVHANDLE);
+		}
+	}
+
+	return(CanGroupHandle)CAN4OSX_OpenGroup(hnds, count, (UInt64)windowUs * 1000u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canCloseGroup - end a group
+ *
+ * Frames the group took out of the channels but did not hand out yet are
+ * lost, the channels can be read directly again.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canCloseGroup(
+		const CanGroupHandle grp
+	)
+{
+CAN4OSX_GROUP_T *pGroup = CAN4OSX_GetGroup(grp);
+
+	if ( pGroup == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	CAN4OSX_CloseGroup(pGroup);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadGroup - read the earliest frame of a group
+ *
+ * Like canReadHostNs, hnd gets the channel the frame was received on. Returns
+ * canERR_NOMSG while the earliest frame still waits in the reorder window,
+ * canERR_INVHANDLE with the channel in hnd if it was closed or removed.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadGroup(
+		const CanGroupHandle grp,
+		CanHandle *hnd,
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt64 *time
+	)
+{
+	return(canReadGroupWait(grp, hnd, id, msg, dlc, flag, time, 0u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadGroupWait - read the earliest frame of a group, wait for one
+ *
+ * Like canReadGroup, but blocks until a frame is due or timeout ms passed.
+ * A timeout of 0xFFFFFFFF waits forever. If a channel of the group was
+ * closed or its device removed, hnd gets its handle and the call returns
+ * canERR_INVHANDLE.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canReadGroupWait(
+		const CanGroupHandle grp,
+		CanHandle *hnd,
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt64 *time,
+		UInt32 timeout
+	)
+{
+CAN4OSX_GROUP_T *pGroup = CAN4OSX_GetGroup(grp);
+CanMsg canMsg;
+int found;
+
+	if ( pGroup == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	found = CAN4OSX_ReadGroupWait(pGroup, &canMsg, hnd, timeout);
+	if ( found < 0 )  {
+		return((canStatus)found);
+	}
+	if ( found == 0 )  {
+		return((timeout == 0u) ? canERR_NOMSG : canERR_TIMEOUT);
+	}
+
+	*id = canMsg.canId;
+	*dlc = canMsg.canDlc;
+	*time = canMsg.canHostTimestamp;
+	*flag = canMsg.canFlags;
+	memcpy(msg, canMsg.canData, *dlc);
+
+	return(canOK);
+}
+
+
+canStatus canReadStatus	(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 *const flags
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+		*flags = 0;
+
+		switch ( pSelf->canState.canState ) {
+			case CHIPSTAT_ERROR_ACTIVE:
+				*flags = canSTAT_ERROR_ACTIVE;
+				break;
+			case CHIPSTAT_BUSOFF:
+				*flags = canSTAT_BUS_OFF;
+				break;
+			case CHIPSTAT_ERROR_PASSIVE:
+				*flags = canSTAT_ERROR_PASSIVE;
+				break;
+			default:
+				break;
+		}
+
+		if ( atomic_load(&pSelf->rxHwOverruns) != pSelf->rxHwOverrunsSeen )  {
+			*flags |= canSTAT_HW_OVERRUN;
+		}
+		if ( (pSelf->canEventMsgBuff != NULL) &&
+			 (CAN4OSX_CanEventBufferDropped(pSelf->canEventMsgBuff) != pSelf->rxSwOverrunsSeen) )  {
+			*flags |= canSTAT_SW_OVERRUN;
+		}
+
+		return(canOK);
+	}
+}
+
+
+canStatus canGetChannelData(
+		const CanHandle hnd,
+		SInt32 item,
+		void* pBuffer,
+		size_t bufsize
+	)
+{
+	// Like with canlib a channel number, the handles of the channel do as well
+	if ( (hnd < 0) || (((UInt32)hnd & CAN4OSX_HANDLE_INDEX_MASK) >= CAN4OSX_ChannelCount()) ||
+		 (CAN4OSX_CHANNEL(hnd)->channelNumber == -1) )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+		if (NULL == pBuffer)  {
+			return(canERR_NOMEM);
+		}
+
+		if (bufsize <= 0)  {
+			return(canERR_NOMEM);
+		}
+
+		memset(pBuffer, 0, bufsize);
+
+		return(CAN4OSX_GetChannelData(pSelf,item,pBuffer,bufsize));
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetEventFd - get a pollable descriptor for a channel
+ *
+ * The descriptor becomes readable when a message arrives while the receive
+ * buffer is empty. It is edge triggered: a burst of messages makes it
+ * readable once, it is rearmed when canRead, canReadBatch or canReadWait
+ * find the buffer empty. Do not read from or close the descriptor.
+ *
+ * \return descriptor or a negative canStatus
+ *
+ */
+int canGetEventFd (
+		const CanHandle hnd /**< handle to the CAN channel */
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		int fd;
+
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
+		}
+
+		fd = CAN4OSX_GetCanEventBufferFd(pSelf->canEventMsgBuff);
+		if ( fd < 0 )  {
+			return(canERR_NOMEM);
+		}
+
+		return(fd);
+	}
+}
+
+
+canStatus canGetNumberOfChannels (int *channelCount)
+{
+	if (NULL == channelCount)  {
+		return(canERR_NOMEM);
+	}
+
+	*channelCount = (int)atomic_load(&can4osxMaxChannelCount);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetUsbStatistics - read the transfer statistics
+ *
+ * Copies the USB transfer statistics of the device behind the handle.
+ * bufsize is the size of the callers structure, so older callers keep
+ * working when the structure grows.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetUsbStatistics(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanUsbStatistics *stat,
+		size_t bufsize
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+		if ( (stat == NULL) || (bufsize == 0) )  {
+			return(canERR_PARAM);
+		}
+
+		if ( bufsize > sizeof(CanUsbStatistics) )  {
+			bufsize = sizeof(CanUsbStatistics);
+		}
+
+		memcpy(stat, &pSelf->usbStatistics, bufsize);
+
+		return(canOK);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetClockSync - read how the device timer relates to the host clock
+ *
+ * The driver fits a line through the smallest host minus device offsets seen
+ * per second, over the last 16 seconds. errorNs is the largest distance of
+ * such a point to the line, the bound of the error of canReadHostNs times.
+ * bufsize is the size of the callers structure, like in canGetUsbStatistics.
+ * canERR_NOT_IMPLEMENTED for a device whose timer rate is not known.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetClockSync(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanClockSync *sync,
+		size_t bufsize
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		__block CanClockSync clockSync;
+
+		if ( (sync == NULL) || (bufsize == 0) )  {
+			return(canERR_PARAM);
+		}
+
+		if ( pSelf->deviceTimeUnknown )  {
+			return(canERR_NOT_IMPLEMENTED);
+		}
+
+		memset(&clockSync, 0, sizeof(clockSync));
+
+		// The decoders update the fit, take it in one piece
+		CAN4OSX_usbRunOnDriverThread(^{
+			CAN4OSX_CLOCK_SYNC_T *pSync = &pSelf->clockSync;
+
+			if ( pSync->pointCount != 0u )  {
+				UInt32 newest = (pSync->pointNext + CAN4OSX_CLOCK_SYNC_POINTS - 1u) % CAN4OSX_CLOCK_SYNC_POINTS;
+
+				clockSync.offsetNs = pSync->fitOffset +
+					(SInt64)(pSync->fitDrift * (double)(SInt64)(pSync->pointDev[newest] - pSync->fitBase));
+				clockSync.driftPpb = (SInt32)(pSync->fitDrift * 1e9);
+				clockSync.errorNs = (pSync->fitError > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (UInt32)pSync->fitError;
+				clockSync.points = pSync->pointCount;
+			}
+		});
+
+		if ( bufsize > sizeof(CanClockSync) )  {
+			bufsize = sizeof(CanClockSync);
+		}
+
+		memcpy(sync, &clockSync, bufsize);
+
+		return(canOK);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canSetQueueSize - set the depth of the receive and transmit buffer
+ *
+ * Both depths are given in frames and rounded up to the next power of two, the
+ * receive depth counts classic frames, FD frames take more room. 0 keeps the
+ * buffer as it is. Waiting frames are moved to the new buffer as far as they
+ * fit. No other thread may read from or write to the channel meanwhile, best
+ * call it right after canOpenChannel. The high-water marks start again at 0.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canSetQueueSize(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 rxFrames,
+		UInt32 txFrames
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		canStatus status = canOK;
+
+		if ( (rxFrames > CAN4OSX_QUEUE_SIZE_MAX) || (txFrames > CAN4OSX_QUEUE_SIZE_MAX) )  {
+			return(canERR_PARAM);
+		}
+
+		if ( txFrames != 0u )  {
+			UInt32 frames = 1u;
+
+			if ( pSelf->hwFunctions.can4osxhwCanSetTxQueueSizeRef == NULL )  {
+				return(canERR_NOT_IMPLEMENTED);
+			}
+
+			while ( frames < txFrames )  {
+				frames <<= 1u;
+			}
+
+			status = pSelf->hwFunctions.can4osxhwCanSetTxQueueSizeRef(hnd, frames);
+			if ( status != canOK )  {
+				return(status);
+			}
+		}
+
+		if ( rxFrames != 0u )  {
+			UInt32 frames = 1u;
+			__block CAN_EVENT_MSG_BUF_T *bufferRef;
+
+			while ( frames < rxFrames )  {
+				frames <<= 1u;
+			}
+
+			bufferRef = CAN4OSX_CreateCanEventBuffer(frames);
+			if ( bufferRef == NULL )  {
+				return(canERR_NOMEM);
+			}
+
+			// Swap while no producer runs
+			CAN4OSX_RunExclusive(pSelf, hnd, ^{
+				CAN_EVENT_MSG_BUF_T *oldRef = pSelf->canEventMsgBuff;
+
+				if ( oldRef != NULL )  {
+					CAN4OSX_MoveCanEventBuffer(bufferRef, oldRef);
+				}
+				pSelf->canEventMsgBuff = bufferRef;
+				bufferRef = oldRef;
+			});
+
+			CAN4OSX_ReleaseCanEventBuffer(bufferRef);
+		}
+
+		return(status);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetQueueStatistics - read depth and high-water marks of the buffers
+ *
+ * The receive high-water mark is the largest number of frames the reader found
+ * waiting. The high-water marks and overrun counters belong to the channel,
+ * they count from the time the device was attached and canOpenChannel or
+ * canClose do not reset them. bufsize is the size of the callers structure,
+ * like in canGetUsbStatistics.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetQueueStatistics(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanQueueStatistics *stat,
+		size_t bufsize
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		CanQueueStatistics queueStatistics;
+
+		if ( (stat == NULL) || (bufsize == 0) )  {
+			return(canERR_PARAM);
+		}
+
+		memset(&queueStatistics, 0, sizeof(queueStatistics));
+
+		if ( pSelf->canEventMsgBuff != NULL )  {
+			queueStatistics.rxQueueSize = CAN4OSX_CanEventBufferFrames(pSelf->canEventMsgBuff);
+			queueStatistics.rxHighWater = pSelf->canEventMsgBuff->framesHighWater;
+			queueStatistics.rxSwOverruns = CAN4OSX_CanEventBufferDropped(pSelf->canEventMsgBuff);
+		}
+
+		queueStatistics.rxHwOverruns = atomic_load(&pSelf->rxHwOverruns);
+
+		if ( pSelf->hwFunctions.can4osxhwCanGetTxQueueStatRef != NULL )  {
+			pSelf->hwFunctions.can4osxhwCanGetTxQueueStatRef(hnd, &queueStatistics.txQueueSize, &queueStatistics.txHighWater);
+		}
+
+		if ( bufsize > sizeof(CanQueueStatistics) )  {
+			bufsize = sizeof(CanQueueStatistics);
+		}
+
+		memcpy(stat, &queueStatistics, bufsize);
+
+		return(canOK);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canSetOverrunPolicy - choose what a full receive buffer drops
+ *
+ * canOVERRUN_DROP_NEWEST, the default, keeps the waiting frames and drops the
+ * arriving ones. canOVERRUN_DROP_OLDEST drops the oldest waiting frames to make
+ * room, readers then publish their progress with a compare exchange. Either way
+ * the first frame delivered after the gap carries canMSGERR_SW_OVERRUN. No
+ * other thread may read from the channel meanwhile.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canSetOverrunPolicy(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		int policy
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+		if ( (policy != canOVERRUN_DROP_NEWEST) && (policy != canOVERRUN_DROP_OLDEST) )  {
+			return(canERR_PARAM);
+		}
+
+		if ( pSelf->canEventMsgBuff == NULL )  {
+			return(canERR_INTERNAL);
+		}
+
+		// The producer reads the policy for every frame, change it in between
+		CAN4OSX_RunExclusive(pSelf, hnd, ^{
+			pSelf->canEventMsgBuff->dropOldest = (policy == canOVERRUN_DROP_OLDEST);
+		});
+
+		return(canOK);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canSetAcceptanceFilter - set code and mask of the acceptance filter
+ *
+ * The filter is applied to received frames before they are buffered. A mask of
+ * zero accepts all ids of the type. Devices that can filter themselves get the
+ * filter pushed as far as they support it.
+ *
+ * \return canStatus
+ */
+canStatus canSetAcceptanceFilter(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 code,
+		UInt32 mask,
+		int is_extended
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		canStatus status = CAN4OSX_FilterSetCodeMask(pSelf, code, mask, is_extended);
+
+		if ( (status == canOK) && (pSelf->hwFunctions.can4osxhwCanSetAcceptanceFilterRef != NULL) )  {
+			status = pSelf->hwFunctions.can4osxhwCanSetAcceptanceFilterRef(hnd);
+		}
+
+		return(status);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canAccept - change one part of the acceptance filter
+ *
+ * canFILTER_ACCEPT switches the id type to an explicit list, only ids accepted
+ * this way pass afterwards. canFILTER_REJECT removes an id from the list or
+ * blocks it when code and mask are used. Extended ids are marked with
+ * canFILTER_EXT_ID in envelope.
+ *
+ * \return canStatus
+ */
+canStatus canAccept(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const long envelope,
+		const unsigned int flag
+	)
+{
+	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+		return(canERR_INVHANDLE);
+	} else {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+		UInt32 value = (UInt32)envelope;
+		int isExtended = (flag == canFILTER_SET_CODE_EXT) || (flag == canFILTER_SET_MASK_EXT);
+		canStatus status = canOK;
+		UInt32 code;
+		UInt32 mask;
+
+		switch (flag)  {
+			case canFILTER_NULL_MASK:
+				CAN4OSX_FilterRelease(pSelf);
+				break;
+
+			case canFILTER_ACCEPT:
+			case canFILTER_REJECT:
+				status = CAN4OSX_FilterSetId(pSelf, value & ~canFILTER_EXT_ID,
+											 (value & canFILTER_EXT_ID) != 0u,
+											 (flag == canFILTER_ACCEPT));
+				break;
 
-		kernRetVal = IOCreatePlugInInterfaceForService(can4osxUsbDevice, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID,
-											   &can4osxPluginInterface, &score);
+			case canFILTER_SET_CODE_STD:
+			case canFILTER_SET_CODE_EXT:
+				CAN4OSX_FilterGetCodeMask(pSelf, &code, &mask, isExtended);
+				status = CAN4OSX_FilterSetCodeMask(pSelf, value, mask, isExtended);
+				break;
+
+			case canFILTER_SET_MASK_STD:
+			case canFILTER_SET_MASK_EXT:
+				CAN4OSX_FilterGetCodeMask(pSelf, &code, &mask, isExtended);
+				status = CAN4OSX_FilterSetCodeMask(pSelf, code, value, isExtended);
+				break;
 
-		if ((kIOReturnSuccess != kernRetVal) || !can4osxPluginInterface)  {
-			CAN4OSX_DEBUG_PRINT("%s : IOCreatePlugInInterfaceForService ret: 0x%08x.\n",__func__,kernRetVal);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
+			default:
+				return(canERR_PARAM);
 		}
 
-		pDevice = &can4osxUsbDeviceHandle[can4osxMaxChannelCount];
+		if ( (status == canOK) && (pSelf->hwFunctions.can4osxhwCanSetAcceptanceFilterRef != NULL) )  {
+			status = pSelf->hwFunctions.can4osxhwCanSetAcceptanceFilterRef(hnd);
+		}
 
-		// Use the plugin interface to retrieve the device interface.
-		result = (*can4osxPluginInterface)->QueryInterface(can4osxPluginInterface, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID),
-												 (LPVOID*) &(pDevice->can4osxDeviceInterface));
+		return(status);
+	}
+}
 
-		// Now done with the plugin interface.
-		(*can4osxPluginInterface)->Release(can4osxPluginInterface);
 
-		if (result || (pDevice->can4osxDeviceInterface == NULL) )  {
-			CAN4OSX_DEBUG_PRINT("%s : Could not create interface\n", __func__);
-			IODestroyPlugInInterface(can4osxPluginInterface);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
-		}
+// Internal
 
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_CheckHandle - checks if the handle is valid
+ *
+ * This function checks if the given handle is valid
+ *
+ * \return canStatus
+ *
+ */
+static CanHandle CAN4OSX_CheckHandle(
+		const CanHandle hnd
+	)
+{
+	if (CAN4OSX_GetHandleEntry(hnd) == NULL)  {
+		return(-1);
+	}
 
-		// Open the device to change its state
-		kernRetVal = (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->USBDeviceOpen(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-		if (kernRetVal != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to open device: %08x\n", __func__,kernRetVal);
-			(void) (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->Release(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-			IODestroyPlugInInterface(can4osxPluginInterface);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
-		}
+	return(hnd);
+}
 
-		//Configure device
-		kernRetVal = CAN4OSX_ConfigureDevice(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-		if (kernRetVal != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to configure device: %08x\n", __func__,kernRetVal);
-			(void) (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->USBDeviceClose(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-			(void) (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->Release(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-			IODestroyPlugInInterface(can4osxPluginInterface);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
-		}
 
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_RunExclusive - run a block while no producer of the receive ring runs
+ *
+ * The USB decoders fill the ring on the driver thread, other backends name
+ * their own way to keep their producers out.
+ *
+ */
+static void CAN4OSX_RunExclusive(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		const CanHandle hnd,
+		dispatch_block_t block
+	)
+{
+	if ( pSelf->hwFunctions.can4osxhwRunExclusiveRef != NULL )  {
+		pSelf->hwFunctions.can4osxhwRunExclusiveRef(hnd, block);
+	} else {
+		CAN4OSX_usbRunOnDriverThread(block);
+	}
+}
 
-		/*kernRetVal = */CAN4OSX_FindInterfaces(pDevice);
 
-		kernRetVal = IOServiceAddInterestNotification(can4osxUsbNotificationPortRef,			// notifyPort
-											  can4osxUsbDevice,                                 // service
-											  kIOGeneralInterest,                               // interestType
-											  CAN4OSX_DeviceNotification,                       // callback
-											  &can4osxUsbDeviceHandle[can4osxMaxChannelCount],	// refCon
-											  &(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxNotification)	// notification
-											  );
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_GetHandleEntry - the channel of a handle
+ *
+ * A slot lookup and a compare of the generation, no search.
+ *
+ * \return the entry, NULL if the handle is invalid or stale
+ *
+ */
+Can4osxUsbDeviceHandleEntry* CAN4OSX_GetHandleEntry(
+		const CanHandle hnd
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+UInt32 index = (UInt32)hnd & CAN4OSX_HANDLE_INDEX_MASK;
 
-		if (KERN_SUCCESS != kernRetVal)  {
-			CAN4OSX_DEBUG_PRINT("%s : IOServiceAddInterestNotification ret: 0x%08x.\n",__func__,kernRetVal);
-		}
+	if ( (hnd < 0) || (index >= atomic_load(&can4osxMaxChannelCount)) )  {
+		return(NULL);
+	}
 
-		pDevice->channelNumber = can4osxMaxChannelCount;
+	pSelf = CAN4OSX_CHANNEL(index);
+	if ( (pSelf->channelNumber == -1) ||
+		 (((UInt32)hnd >> CAN4OSX_HANDLE_INDEX_BITS) != (atomic_load(&pSelf->generation) & CAN4OSX_HANDLE_GEN_MASK)) )  {
+		return(NULL);
+	}
 
-		// Done with this USB device; release the reference added by IOIteratorNext
-		(void)IOObjectRelease(can4osxUsbDevice);
+	return(pSelf);
+}
 
-		// Set up buffer for sending and receiving
-		(void)CAN4OSX_CreateEndpointBuffer(can4osxMaxChannelCount);
 
-		pDevice->canEventMsgBuff = CAN4OSX_CreateCanEventBuffer(1000);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_ChannelCount - slots of the channel table in use
+ *
+ * \return number of channels, the removed ones included
+ *
+ */
+UInt32 CAN4OSX_ChannelCount(
+		void
+	)
+{
+	return(atomic_load(&can4osxMaxChannelCount));
+}
 
-		pDevice->endpoitBulkOutBusy = FALSE;
 
-		// FIXME
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_FreeChannel - put the slot of a removed channel on the free list
+ *
+ * The list is in slot order, the lowest slots are used first.
+ *
+ */
+static void CAN4OSX_FreeChannel(
+		Can4osxUsbDeviceHandleEntry *pEntry
+	)
+{
+Can4osxUsbDeviceHandleEntry **ppNext = &pCan4osxFreeChannels;
 
-		// Read out the product ID of the device
-		productId = 0u;
-		(*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->GetDeviceProduct(pDevice->can4osxDeviceInterface, &productId);
+	while ( (*ppNext != NULL) && ((*ppNext)->channelIndex < pEntry->channelIndex) )  {
+		ppNext = &(*ppNext)->pNextFree;
+	}
 
-		CAN4OSX_DEBUG_PRINT("Found a Device with productId: %X\n", (UInt16)productId);
+	pEntry->pNextFree = *ppNext;
+	pEntry->slotFree = true;
+	*ppNext = pEntry;
+}
 
-		switch (productId) {
-			case 0x0120: /* Kvaser Leaf Light v.2 */
-				pDevice->hwFunctions = leafHardwareFunctions;
-				break;
-			case 0x0107:
-			case 0x0108:
-				pDevice->hwFunctions = leafProHardwareFunctions;
-				break;
-			case 0x0017: /* IXXAT USB-TO-CAN FD Automotive  */
-				pDevice->hwFunctions = ixxUsbFdHardwareFunctions;
-			 	break;
-			default:
-				pDevice->hwFunctions = leafHardwareFunctions;
-				break;
-		}
 
-		if (pDevice->hwFunctions.can4osxhwInitRef != NULL)  {
-			can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannelCount = 0u;
-		 	can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannel = 0u;
-			pDevice->hwFunctions.can4osxhwInitRef(can4osxMaxChannelCount);
-		 	if (can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannelCount > 1u)  {
-			UInt8 maxChannel = can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannelCount;
-				CAN4OSX_DEBUG_PRINT("Multichannel device found with %d channels\n", maxChannel);
-				for (UInt8 i = 1u; i < maxChannel; i++)  {
-			        can4osxMaxChannelCount++;
-					if (can4osxMaxChannelCount >= CAN4OSX_MAX_CHANNEL_COUNT)  {
-						CAN4OSX_DEBUG_PRINT("%s : max Channel reached\n", __func__);
-						return;
-					}
-		   			memcpy(&can4osxUsbDeviceHandle[can4osxMaxChannelCount], &can4osxUsbDeviceHandle[can4osxMaxChannelCount - 1], sizeof(Can4osxUsbDeviceHandleEntry));
-			  		can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannel++;
-					can4osxUsbDeviceHandle[can4osxMaxChannelCount].channelNumber = can4osxMaxChannelCount;
-				 	pDevice++;
-				  	pDevice->canEventMsgBuff = CAN4OSX_CreateCanEventBuffer(1000);
-				  	pDevice->hwFunctions.can4osxhwInitRef(can4osxMaxChannelCount);
-				}
-			}
-		}
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TakeChannel - take the slot of an entry off the free list
+ *
+ */
+static void CAN4OSX_TakeChannel(
+		Can4osxUsbDeviceHandleEntry *pEntry
+	)
+{
+Can4osxUsbDeviceHandleEntry **ppNext = &pCan4osxFreeChannels;
 
-		can4osxMaxChannelCount++;
+	if (!pEntry->slotFree)  {
+		return;
+	}
 
+	while (*ppNext != pEntry)  {
+		ppNext = &(*ppNext)->pNextFree;
 	}
+
+	*ppNext = pEntry->pNextFree;
+	pEntry->pNextFree = NULL;
+	pEntry->slotFree = false;
 }
 
 
-static IOReturn CAN4OSX_ConfigureDevice(
-		IOUSBDeviceInterface182 **dev
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_NewChannel - a clean entry for a slot, not in the table yet
+ *
+ * The chunk of the slot is allocated on the first use. The entry starts with
+ * the generation of the entry the slot has now, so the handles of a removed
+ * device stay stale.
+ *
+ * \return pointer to the entry, NULL if the table is full
+ *
+ */
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_NewChannel(
+		UInt32 index
 	)
 {
-UInt8 numConfig;
-IOReturn kr;
-IOUSBConfigurationDescriptorPtr configDesc;
+Can4osxUsbDeviceHandleEntry **ppChunk;
+Can4osxUsbDeviceHandleEntry *pEntry;
 
-	/*kr = */(*dev)->GetNumberOfConfigurations(dev, &numConfig);
-	if (!numConfig)  {
-		return(-1);
+	if (index >= CAN4OSX_MAX_CHANNEL_COUNT)  {
+		CAN4OSX_DEBUG_PRINT("%s : max Channel reached\n", __func__);
+		return(NULL);
 	}
-	//Get the configuration descriptor for index 0
-	kr = (*dev)->GetConfigurationDescriptorPtr(dev, 0, &configDesc);
-	if (kr)  {
-		CAN4OSX_DEBUG_PRINT("%s : Could not get configuration descriptor for index %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
-		return(-1);
+
+	ppChunk = can4osxUsbDeviceHandle[index >> CAN4OSX_TABLE_CHUNK_BITS];
+	if (ppChunk == NULL)  {
+		ppChunk = calloc(CAN4OSX_TABLE_CHUNK, sizeof(Can4osxUsbDeviceHandleEntry *));
+		if (ppChunk == NULL)  {
+			return(NULL);
+		}
+		can4osxUsbDeviceHandle[index >> CAN4OSX_TABLE_CHUNK_BITS] = ppChunk;
 	}
-	//Set the device’s configuration.
-	kr = (*dev)->SetConfiguration(dev, configDesc->bConfigurationValue);
-	if (kr)  {
-		CAN4OSX_DEBUG_PRINT("%s : Could not set configuration to value %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
-		return(-1);
+
+	pEntry = calloc(1u, sizeof(Can4osxUsbDeviceHandleEntry));
+	if (pEntry == NULL)  {
+		return(NULL);
 	}
-	return(kIOReturnSuccess);
+	pEntry->channelNumber = -1;
+	pEntry->channelIndex = index;
+	if (CAN4OSX_CHANNEL(index) != NULL)  {
+		atomic_init(&pEntry->generation, atomic_load(&CAN4OSX_CHANNEL(index)->generation));
+	}
+
+	return(pEntry);
 }
 
 
-static IOReturn CAN4OSX_FindInterfaces(
-		Can4osxUsbDeviceHandleEntry *handle
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_SetChannel - put a new entry into its slot
+ *
+ * The entry takes the place of the old one on the free list as well. The old
+ * entry is retired and kept with its receive ring, descriptor and private
+ * data: an application thread may still be inside a call with it, or poll
+ * its descriptor, and the library can not tell when it stopped.
+ *
+ */
+static void CAN4OSX_SetChannel(
+		Can4osxUsbDeviceHandleEntry *pEntry
 	)
 {
-IOReturn ret, ret2;
-IOUSBFindInterfaceRequest request;
-io_iterator_t iterator;
-io_service_t usbInterface;
-IOCFPlugInInterface **plugInInterface = NULL;
-CAN4OSX_USB_INTERFACE **interface = NULL;
-HRESULT result;
-SInt32 score;
-UInt8 interfaceNumEndpoints;
-IOUSBDeviceInterface182 **device = handle->can4osxDeviceInterface;
-int loopCount = 1;
+Can4osxUsbDeviceHandleEntry *pOld = CAN4OSX_CHANNEL(pEntry->channelIndex);
 
-CFRunLoopSourceRef runLoopSource;
+	// One pointer store, a reader finds either entry with channelNumber -1
+	CAN4OSX_CHANNEL(pEntry->channelIndex) = pEntry;
+
+	if (pOld != NULL)  {
+		if (pOld->slotFree)  {
+			CAN4OSX_TakeChannel(pOld);
+			CAN4OSX_FreeChannel(pEntry);
+		}
+		pOld->pNextFree = pCan4osxRetiredChannels;
+		pCan4osxRetiredChannels = pOld;
+	}
+}
 
-	request.bInterfaceClass	= kIOUSBFindInterfaceDontCare;
-	request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
-	request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
-	request.bAlternateSetting  = kIOUSBFindInterfaceDontCare;
 
-	//Get an iterator for the interfaces on the device
-	ret = (*device)->CreateInterfaceIterator(device, &request, &iterator);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_AllocChannel - a clean entry in a slot that is not in use
+ *
+ * The slot is not taken in by the count yet.
+ *
+ * \return pointer to the entry, NULL if the table is full
+ *
+ */
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_AllocChannel(
+		UInt32 index
+	)
+{
+Can4osxUsbDeviceHandleEntry *pEntry = CAN4OSX_NewChannel(index);
 
-	if ( ret != kIOReturnSuccess )  {
-		CAN4OSX_DEBUG_PRINT("%s : Could not create InterfaceIterator\n",__func__);
-		return(ret);
+	if (pEntry != NULL)  {
+		CAN4OSX_SetChannel(pEntry);
 	}
 
-	while ((usbInterface = IOIteratorNext(iterator)))  {
-		//Create an intermediate plug-in
-		ret = IOCreatePlugInInterfaceForService(usbInterface,
-											   kIOUSBInterfaceUserClientTypeID,
-											   kIOCFPlugInInterfaceID,
-											   &plugInInterface, &score);
-		//Release the usbInterface object after getting the plug-in
-		(void)IOObjectRelease(usbInterface);
+	return(pEntry);
+}
+
 
-		if ((ret != kIOReturnSuccess) || !plugInInterface)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to create a plug-in\n", __func__);
-			break;
-		}
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_SlotsFree - check that slots are free for a device
+ *
+ * \return true if the count slots from index on are on the free list or
+ * behind the table
+ *
+ */
+static Boolean CAN4OSX_SlotsFree(
+		UInt32 index,
+		UInt32 count
+	)
+{
+UInt32 i;
 
-		//Now create the device interface for the interface
-		result = (*plugInInterface)->QueryInterface(plugInInterface, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID *) &interface);
-		//No longer need the intermediate plug-in
-		(*plugInInterface)->Release(plugInInterface);
-		if (result || !interface)  {
-			CAN4OSX_DEBUG_PRINT("%s : Could not create a device interface for the interface (%08x)\n", __func__,(int) result);
+	for (i = index; i < index + count; i++)  {
+		if (i >= atomic_load(&can4osxMaxChannelCount))  {
 			break;
 		}
+		if (!CAN4OSX_CHANNEL(i)->slotFree)  {
+			return(false);
+		}
+	}
 
-		//Now open the interface. This will cause the pipes associated with
-		//the endpoints in the interface descriptor to be instantiated
-		ret = (*interface)->USBInterfaceOpen(interface);
-		if (ret != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to open interface (%08x)\n", __func__,ret);
-			(void) (*interface)->Release(interface);
-			continue;
-		}
-
-		//Get the number of endpoints associated with this interface
-		ret = (*interface)->GetNumEndpoints(interface, &interfaceNumEndpoints);
-		if (ret != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to get number of endpoints (%08x)\n",__func__ ,ret);
-			(void) (*interface)->USBInterfaceClose(interface);
-			(void) (*interface)->Release(interface);
-			continue;
-		}
-
-		CAN4OSX_DEBUG_PRINT("%s : Interface has %d endpoints\n",__func__, interfaceNumEndpoints);
-
-		// Reset the endpoint numbers
-		handle->endpointNumberBulkIn = 0u;
-		handle->endpointNumberBulkOut = 0u;
-
-		for (loopCount = 1; loopCount <= interfaceNumEndpoints; loopCount++ ) {
-			UInt8 direction;
-			UInt8 number;
-			UInt8 transferType;
-			UInt16 maxPacketSize;
-			UInt8 interval;
-
-			ret2 = (*interface)->GetPipeProperties(interface, loopCount, &direction, &number, &transferType, &maxPacketSize, &interval);
-
-			if (ret2 != kIOReturnSuccess)  {
-				CAN4OSX_DEBUG_PRINT("%s : Unable to get properties of pipe %d (%08x)\n",__func__ ,loopCount, ret2);
-			} else {
-				if ( (direction == kUSBOut) && (transferType == kUSBBulk) )  {
-					CAN4OSX_DEBUG_PRINT("%s : Found BulkOut endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
-					if (handle->endpointNumberBulkOut == 0)  {
-						handle->endpointNumberBulkOut = loopCount;
-						handle->endpointMaxSizeBulkOut = maxPacketSize;
-					}
-				}
+	return(true);
+}
 
-				if ( (direction == kUSBIn) && (transferType == kUSBBulk) )  {
-					CAN4OSX_DEBUG_PRINT("%s : Found BulkIn endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
-					if (handle->endpointNumberBulkIn == 0u)  {
-						handle->endpointNumberBulkIn = loopCount;
-						handle->endpointMaxSizeBulkIn = maxPacketSize;
-					}
-				}
-			}
-		}
 
-		ret = (*interface)->CreateInterfaceAsyncEventSource(interface, &runLoopSource);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_MoveChannel - put the first entry of a device into another slot
+ *
+ * For a device with more channels than free slots behind the one it got from
+ * CAN4OSX_usbNextDevice. The entry keeps its address, it changes places with
+ * the entry of the new slot. Both get the higher generation of the two, so no
+ * handle either slot gave out fits them.
+ *
+ * \return true if the entry moved
+ *
+ */
+static Boolean CAN4OSX_MoveChannel(
+		Can4osxUsbDeviceHandleEntry *pEntry,
+		UInt32 index
+	)
+{
+Can4osxUsbDeviceHandleEntry *pOther;
+UInt32 from = pEntry->channelIndex;
+UInt32 generation;
 
-		if (ret != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to create asynchronous event source (%08x)\n", __func__,ret);
-			(void) (*interface)->USBInterfaceClose(interface);
-			(void) (*interface)->Release(interface);
-			continue;
-		}
-		CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
-		CAN4OSX_DEBUG_PRINT("%s : Asynchronous event source added to run loop\n", __func__);
+	if (index == from)  {
+		return(true);
+	}
+
+	pOther = CAN4OSX_AllocChannel(index);
+	if (pOther == NULL)  {
+		return(false);
+	}
 
-		//Save the interface
-		handle->can4osxInterfaceInterface = interface;
+	CAN4OSX_TakeChannel(pEntry);
+	CAN4OSX_TakeChannel(pOther);
 
-		//Right now only the first interface is supported
-		break;
+	generation = atomic_load(&pEntry->generation);
+	if (generation < atomic_load(&pOther->generation))  {
+		generation = atomic_load(&pOther->generation);
 	}
-	return(ret);
+	atomic_store(&pEntry->generation, generation);
+	atomic_store(&pOther->generation, generation);
+
+	pEntry->channelIndex = index;
+	pOther->channelIndex = from;
+	CAN4OSX_CHANNEL(index) = pEntry;
+	CAN4OSX_CHANNEL(from) = pOther;
+
+	// The old slot is below the count, it stays free
+	CAN4OSX_FreeChannel(pOther);
+
+	return(true);
 }
 
 
-static void CAN4OSX_DeviceNotification(
-		void *refCon, io_service_t service,
-		natural_t messageType,
-		void *messageArgument
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_FindSlots - the first slot of count free ones in a row
+ *
+ * \return the slot, the end of the table if no gap is large enough
+ *
+ */
+static UInt32 CAN4OSX_FindSlots(
+		UInt32 count
 	)
 {
-Can4osxUsbDeviceHandleEntry	*pSelf = (Can4osxUsbDeviceHandleEntry *) refCon;
+Can4osxUsbDeviceHandleEntry *pEntry;
 
-	if (messageType == kIOMessageServiceIsTerminated)  {
-		CAN4OSX_DEBUG_PRINT("%s : Device removed. Channel number %d\n",__func__, pSelf->channelNumber);
-
-		CAN4OSX_Dealloc(pSelf);
-
-		pSelf->channelNumber = -1;
+	for (pEntry = pCan4osxFreeChannels; pEntry != NULL; pEntry = pEntry->pNextFree)  {
+		if (CAN4OSX_SlotsFree(pEntry->channelIndex, count))  {
+			return(pEntry->channelIndex);
+		}
 	}
+
+	return(atomic_load(&can4osxMaxChannelCount));
 }
 
 
-static IOReturn CAN4OSX_CreateEndpointBuffer(
-		const CanHandle hnd
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbSupportedDevice - check the ids of a USB device
+ *
+ * \return true if one of the drivers handles the device
+ *
+ */
+Boolean CAN4OSX_usbSupportedDevice(
+		UInt16 vendorId,
+		UInt16 productId
 	)
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-
-	pSelf->endpointBufferBulkInRef = calloc( 1 , pSelf->endpointMaxSizeBulkIn);
+UInt32 i;
 
-	pSelf->endpointBufferBulkOutRef = calloc( 1 , pSelf->endpointMaxSizeBulkOut);
+	for ( i = 0u; i < can4osxSupportedDeviceCount; i++ )  {
+		if ( (can4osxSupportedDevices[i].vendorId == vendorId) &&
+			 (can4osxSupportedDevices[i].productId == productId) )  {
+			return(true);
+		}
+	}
 
-	return(kIOReturnSuccess);
+	return(false);
 }
 
 
-static IOReturn CAN4OSX_Dealloc(
-		Can4osxUsbDeviceHandleEntry	*pSelf
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbNextDevice - get the entry for a new device
+ *
+ * The lowest slot a removed device left behind, else a new one at the end of
+ * the table. The transport sets up the pipes of the device in this entry before it
+ * calls CAN4OSX_usbAddDevice.
+ *
+ * \return pointer to the entry, NULL if all channels are taken
+ *
+ */
+Can4osxUsbDeviceHandleEntry* CAN4OSX_usbNextDevice(
+		void
 	)
 {
-kern_return_t retval;
+	if (pCan4osxFreeChannels != NULL)  {
+		return(CAN4OSX_AllocChannel(pCan4osxFreeChannels->channelIndex));
+	}
+
+	return(CAN4OSX_AllocChannel(atomic_load(&can4osxMaxChannelCount)));
+}
 
-	// Release the usb stuff
 
-	if (pSelf->can4osxDeviceInterface)  {
-		/*retval = */(*pSelf->can4osxDeviceInterface)->Release(pSelf->can4osxDeviceInterface);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbAddDevice - start the driver of a new device
+ *
+ * Called by the transport on the driver thread once the entry of
+ * CAN4OSX_usbNextDevice has its pipes. The driver is picked by the product
+ * id, a multi channel device takes the following entries as well. When the
+ * table runs out of slots, the channel count of the device is cut down to
+ * the entries it got.
+ *
+ */
+void CAN4OSX_usbAddDevice(
+		Can4osxUsbDeviceHandleEntry *pDevice,
+		UInt16 productId
+	)
+{
+UInt32 index = pDevice->channelIndex;
+UInt32 maxChannel = 1u;
+UInt32 created = 1u;
+UInt32 i;
+Can4osxUsbDeviceHandleEntry next;
+
+	// Set up buffer for sending and receiving, not for the virtual device
+	if (pDevice->usbTransport != NULL)  {
+		(void)CAN4OSX_usbCreateEndpointBuffer(pDevice);
 	}
 
-	//if(self->can4osxInterfaceInterface) {
-	//	(void)(*self->can4osxInterfaceInterface)->Release(self->can4osxInterfaceInterface);
-	//}
+	pDevice->canEventMsgBuff = CAN4OSX_CreateCanEventBuffer(CAN4OSX_RX_QUEUE_SIZE);
 
+	CAN4OSX_DEBUG_PRINT("Found a Device with productId: %X\n", (UInt16)productId);
 
-	if(pSelf->endpointBufferBulkInRef)  {
-		free(pSelf->endpointBufferBulkInRef);
+	switch (productId) {
+		case 0x0120: /* Kvaser Leaf Light v.2 */
+			pDevice->hwFunctions = leafHardwareFunctions;
+			break;
+		case 0x0107:
+		case 0x0108:
+			pDevice->hwFunctions = leafProHardwareFunctions;
+			break;
+		case 0x0017: /* IXXAT USB-TO-CAN FD Automotive  */
+			pDevice->hwFunctions = ixxUsbFdHardwareFunctions;
+		 	break;
+		case VIRTUAL_PRODUCT_ID:
+			pDevice->hwFunctions = virtualHardwareFunctions;
+			break;
+		default:
+			pDevice->hwFunctions = leafHardwareFunctions;
+			break;
 	}
 
-	if(pSelf->endpointBufferBulkOutRef)  {
-		free(pSelf->endpointBufferBulkOutRef);
+	if (pDevice->hwFunctions.can4osxhwInitRef != NULL)  {
+		pDevice->deviceChannelCount = 0u;
+	 	pDevice->deviceChannel = 0u;
+		pDevice->hwFunctions.can4osxhwInitRef((CanHandle)index);
+	 	if (pDevice->deviceChannelCount > 1)  {
+			maxChannel = (UInt32)pDevice->deviceChannelCount;
+			CAN4OSX_DEBUG_PRINT("Multichannel device found with %u channels\n", maxChannel);
+
+			// The channels of a device take slots in a row
+			if (!CAN4OSX_SlotsFree(index + 1u, maxChannel - 1u))  {
+				(void)CAN4OSX_MoveChannel(pDevice, CAN4OSX_FindSlots(maxChannel));
+				index = pDevice->channelIndex;
+			}
+		}
 	}
 
-	// Release the notification
+	CAN4OSX_TakeChannel(pDevice);
+
+	for (i = 1u; i < maxChannel; i++)  {
+	Can4osxUsbDeviceHandleEntry *pNext;
+
+		if (!CAN4OSX_SlotsFree(index + i, 1u))  {
+			break;
+		}
+		pNext = CAN4OSX_NewChannel(index + i);
+		if (pNext == NULL)  {
+			break;
+		}
+
+		// A copy of the channel before, the slot keeps its generation
+		memcpy(&next, pDevice, sizeof(Can4osxUsbDeviceHandleEntry));
+		next.deviceChannel++;
+		next.channelIndex = index + i;
+		next.slotFree = false;
+		next.pNextFree = NULL;
+		atomic_init(&next.generation, atomic_load(&pNext->generation));
+		atomic_init(&next.usbTransportChannel, NULL);
+		// The endpoint buffers stay with the channel that allocated them
+		next.endpointBufferBulkInRef = NULL;
+		next.endpointBufferBulkOutRef = NULL;
+		memcpy(pNext, &next, sizeof(Can4osxUsbDeviceHandleEntry));
+		CAN4OSX_SetChannel(pNext);
+		CAN4OSX_TakeChannel(pNext);
+
+		pNext->canEventMsgBuff = CAN4OSX_CreateCanEventBuffer(CAN4OSX_RX_QUEUE_SIZE);
+		pNext->hwFunctions.can4osxhwInitRef((CanHandle)(index + i));
+		pDevice = pNext;
+		created++;
+	}
 
-	retval = IOObjectRelease(pSelf->can4osxNotification);
+	// Out of slots, the device only has the channels it got
+	if (created < maxChannel)  {
+		CAN4OSX_DEBUG_PRINT("%s : only %u of %u channels added\n", __func__, created, maxChannel);
+		for (i = 0u; i < created; i++)  {
+			CAN4OSX_CHANNEL(index + i)->deviceChannelCount = (int)created;
+		}
+	}
 
-	// FIXME test return value
-	if (0)  {
-		return(retval);
+	// The device is complete, the readers may see it
+	for (i = 0u; i < created; i++)  {
+		CAN4OSX_CHANNEL(index + i)->channelNumber = (int)(index + i);
+	}
+	if (index + created > atomic_load(&can4osxMaxChannelCount))  {
+		atomic_store(&can4osxMaxChannelCount, index + created);
 	}
+}
+
 
-	// Now release  the dive internal stuff
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_AddVirtualDevices - add the devices without USB side
+ *
+ * Called by the driver thread after the devices present at start, so the
+ * virtual channels come after the real ones like with canlib. The emulated
+ * USB devices come first, they stand in for real ones.
+ *
+ */
+void CAN4OSX_AddVirtualDevices(
+		void
+	)
+{
+UInt32 i;
 
-	// FIXME with the channelnumber
+#if CAN4OSX_USB_EMULATION
+	CAN4OSX_usbEmuAttachDevices();
+#endif
 
-	pSelf->hwFunctions.can4osxhwCanCloseRef(pSelf->channelNumber);
+	for ( i = 0u; i < can4osxSupportedDeviceCount; i++ )  {
+		if ( can4osxSupportedDevices[i].vendorId == VIRTUAL_VENDOR_ID )  {
+			Can4osxUsbDeviceHandleEntry *pDevice = CAN4OSX_usbNextDevice();
 
-	return(retval);
+			if (pDevice == NULL)  {
+				return;
+			}
 
+			CAN4OSX_usbAddDevice(pDevice, (UInt16)can4osxSupportedDevices[i].productId);
+		}
+	}
 }
 
 
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbRemoveDevice - stop the driver of a removed device
+ *
+ * Called by the transport on the driver thread after it let go of the
+ * device. The channel is invalid afterwards, the slots of the device go on
+ * the free list with the last of its channels.
+ *
+ */
+void CAN4OSX_usbRemoveDevice(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+UInt32 first = pSelf->channelIndex - pSelf->deviceChannel;
+UInt32 count = (pSelf->deviceChannelCount > 1) ? (UInt32)pSelf->deviceChannelCount : 1u;
+UInt32 i;
+
+	CAN4OSX_usbReleaseEndpointBuffer(pSelf);
+
+	CAN4OSX_FilterRelease(pSelf);
+
+	if (pSelf->hwFunctions.can4osxhwCanCloseRef != NULL)  {
+		pSelf->hwFunctions.can4osxhwCanCloseRef((CanHandle)pSelf->channelIndex);
+	}
+
+	// The handles of the channel are stale from here on
+	pSelf->channelNumber = -1;
+	atomic_fetch_add(&pSelf->generation, 1u);
+	CAN4OSX_WakeWaiters(pSelf);
+
+	// The slots are free once the last channel of the device is gone
+	if (first + count > atomic_load(&can4osxMaxChannelCount))  {
+		count = atomic_load(&can4osxMaxChannelCount) - first;
+	}
+	for (i = 0u; i < count; i++)  {
+		if (CAN4OSX_CHANNEL(first + i)->channelNumber != -1)  {
+			return;
+		}
+	}
+	for (i = 0u; i < count; i++)  {
+		CAN4OSX_FreeChannel(CAN4OSX_CHANNEL(first + i));
+	}
+}
@@ -45,9 +45,31 @@
 #ifndef CAN4OSX_H
 # define CAN4OSX_H
 
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
-
-#define CAN4OSX_MAX_CHANNEL_COUNT 5
+#else
+/* the MacTypes used by the API, so the portable parts build elsewhere */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t  UInt8;
+typedef int8_t   SInt8;
+typedef uint16_t UInt16;
+typedef int16_t  SInt16;
+typedef uint32_t UInt32;
+typedef int32_t  SInt32;
+typedef uint64_t UInt64;
+typedef int64_t  SInt64;
+typedef unsigned char Boolean;
+
+/* canSetNotify posts to a CFNotificationCenter, there is none */
+typedef const void *CFNotificationCenterRef;
+typedef const void *CFStringRef;
+#endif
+
+/* upper bound of the channel table, the entries are added as devices come */
+#define CAN4OSX_MAX_CHANNEL_COUNT 4096
 
 // KVASER LEAF STUFF
 
@@ -115,6 +137,20 @@
 #define canNOTIFY_ENVVAR        0x0010      // Notify on Envvar change
 
 
+//
+// These are used in the call to canAccept().
+//
+#define canFILTER_NULL_MASK     0           // Remove the filter, accept everything
+#define canFILTER_ACCEPT        1           // Accept the id in envelope (id list)
+#define canFILTER_REJECT        2           // Reject the id in envelope
+#define canFILTER_SET_CODE_STD  3           // Set the code for standard ids
+#define canFILTER_SET_MASK_STD  4           // Set the mask for standard ids
+#define canFILTER_SET_CODE_EXT  5           // Set the code for extended ids
+#define canFILTER_SET_MASK_EXT  6           // Set the mask for extended ids
+
+#define canFILTER_EXT_ID        0x80000000  // Or'ed to the envelope of canFILTER_ACCEPT/REJECT for an extended id
+
+
 #define canMSG_MASK             0x00ff      // Used to mask the non-info bits
 #define canMSG_RTR              0x0001      // Message is a remote request
 #define canMSG_STD              0x0002      // Message has a standard ID
@@ -125,6 +161,15 @@
 #define canMSG_TXACK            0x0040      // Message is a TX ACK (msg is really sent)
 #define canMSG_TXRQ             0x0080      // Message is a TX REQUEST (msg is transfered to the chip)
 
+#define canMSGERR_MASK          0xff00      // Used to mask the error bits
+#define canMSGERR_HW_OVERRUN    0x0200      // The device lost frames before this one
+#define canMSGERR_SW_OVERRUN    0x0400      // The receive buffer lost frames before this one
+#define canMSGERR_OVERRUN       0x0600      // Any overrun condition
+
+// These are used in the call to canSetOverrunPolicy().
+#define canOVERRUN_DROP_NEWEST  0           // A full receive buffer drops arriving frames
+#define canOVERRUN_DROP_OLDEST  1           // Arriving frames replace the oldest waiting ones
+
 #define canFDMSG_MASK            0xff0000
 #define canFDMSG_FDF             0x010000    ///< Message is an FD message (CAN FD)
 #define canFDMSG_BRS             0x020000    ///< Message is sent/received with bit rate switch (CAN FD)
@@ -145,6 +190,7 @@
 
 #define canOPEN_EXCLUSIVE           0x0008
 #define canOPEN_REQUIRE_EXTENDED    0x0010
+#define canOPEN_ACCEPT_VIRTUAL      0x0020
 
 # define canOPEN_CAN_FD             0x0400
 
@@ -165,6 +211,7 @@
 #define canCHANNELDATA_DEVDESCR_ASCII             26
 
 
+#define canCHANNEL_CAP_VIRTUAL           0x00010000L ///< Channel is virtual
 #define canCHANNEL_CAP_CAN_FD            0x00080000L ///< CAN-FD ISO compliant channel
 #define canCHANNEL_CAP_CAN_FD_NONISO     0x00100000L ///< CAN-FD NON-ISO compliant channel
 #define canCHANNEL_CAP_SILENT_MODE       0x00200000L ///< Channel supports Silent mode
@@ -223,6 +270,8 @@ typedef enum {
 
 typedef int CanHandle;
 
+typedef int CanGroupHandle;
+
 
 
 
@@ -234,6 +283,60 @@ typedef struct {
     CFStringRef notificationString;
 } CanNotificationType;
 
+/* Called from the driver thread once per USB transfer, count is the number of
+   new frames, flags the canNOTIFY_xxx events of the transfer */
+typedef void (*CanNotifyCallback)(CanHandle hnd, void *ctx, unsigned int flags, UInt32 count);
+
+/* A single CAN frame, used by the batch read/write functions */
+typedef struct {
+    UInt32 id;
+    UInt32 flag;
+    UInt32 time;        /* microseconds, wraps after about 71 minutes */
+    UInt16 dlc;
+    UInt8  msg[64];
+} CanFrame;
+
+/* A received frame inside the receive buffer, see canReadPeek. Only canDlc
+   data bytes are stored, canRxFrameNext steps to the following frame */
+typedef struct {
+    UInt16 recordSize;  /* bytes up to the next frame */
+    UInt8  canDlc;
+    UInt8  canChannel;
+    UInt32 canFlags;
+    UInt64 canTimestamp;    /* nanoseconds, device timer */
+    UInt64 canHostTimestamp;/* nanoseconds, host CLOCK_MONOTONIC */
+    UInt32 canId;
+    UInt8  canData[];
+} CanRxFrame;
+
+#define canRxFrameNext(frame) \
+	((const CanRxFrame *)((const UInt8 *)(frame) + (frame)->recordSize))
+
+/* How the device timer of a channel relates to the host clock */
+typedef struct {
+    SInt64 offsetNs;        /* host CLOCK_MONOTONIC minus device time at the newest point */
+    SInt32 driftPpb;        /* device timer rate error, parts per billion */
+    UInt32 errorNs;         /* largest distance of a sync point to the fit */
+    UInt32 points;          /* sync points in the fit, 0 before the first second */
+} CanClockSync;
+
+/* Transfer statistics of the USB device behind a channel */
+typedef struct {
+    UInt32 bulkInBuffers;   /* reads kept in flight on the IN endpoint */
+    UInt32 bulkInTransfers; /* completed IN transfers */
+    UInt32 bulkInDry;       /* completions with no other read queued */
+} CanUsbStatistics;
+
+/* Depth and fill level of the receive and transmit buffers of a channel */
+typedef struct {
+    UInt32 rxQueueSize;     /* classic frames the receive buffer holds */
+    UInt32 rxHighWater;     /* most frames found waiting by the reader */
+    UInt32 txQueueSize;     /* frames the transmit buffer holds */
+    UInt32 txHighWater;     /* most frames queued for sending at once */
+    UInt32 rxSwOverruns;    /* frames lost because the receive buffer was full */
+    UInt32 rxHwOverruns;    /* overruns reported by the device */
+} CanQueueStatistics;
+
 
 void canInitializeLibrary (void);
 
@@ -248,18 +351,84 @@ canStatus canBusOff (const CanHandle hndl);
 /* Needed to setup a notififaction to the nofication center */
 canStatus canSetNotify (const CanHandle hnd, CanNotificationType notifyStruct, unsigned int notifyFlags, void *tag);
 
+/* Installs a plain C callback for the canNOTIFY_xxx events in flags, fn NULL removes it */
+canStatus canSetNotifyCallback (const CanHandle hnd, CanNotifyCallback fn, void *ctx, unsigned int flags);
+
 canStatus canSetBusParams (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
 
 canStatus canSetBusParamsFd(const CanHandle hnd, SInt32 freq_brs, UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
 
+/* time is in microseconds, canReadNs has the full resolution and range */
 canStatus canRead (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
 
+/* Like canRead, time is the 64 bit receive time in nanoseconds of the device
+   timer, canERR_NOT_IMPLEMENTED when its rate is not known */
+canStatus canReadNs (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt64 *time);
+
+/* Like canReadNs, time is the receive time on the host CLOCK_MONOTONIC */
+canStatus canReadHostNs (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt64 *time);
+
+/* Like canRead, but waits up to timeout ms for a message, 0xFFFFFFFF waits forever */
+canStatus canReadWait (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time, UInt32 timeout);
+
+/* Reads up to max frames at once, count returns the number of frames read */
+canStatus canReadBatch (const CanHandle hnd, CanFrame *frames, UInt32 max, UInt32 *count);
+
+/* Points frames at the oldest received frames without copying them, count gets
+   how many follow each other in memory. They stay valid until canReadRelease */
+canStatus canReadPeek (const CanHandle hnd, const CanRxFrame **frames, UInt32 *count);
+
+/* Hands the first count frames of the last canReadPeek back to the receive buffer */
+canStatus canReadRelease (const CanHandle hnd, UInt32 count);
+
 canStatus canWrite (const CanHandle hnd,UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
 
+/* Queues count frames at once, sent returns the number of frames queued */
+canStatus canWriteBatch (const CanHandle hnd, const CanFrame *frames, UInt32 count, UInt32 *sent);
+
 canStatus canReadStatus	(const CanHandle hnd, UInt32 *const flags);
 
+/* Waits up to timeout ms until one of the count handles has an event, readyFlags
+   gets the canNOTIFY_RX/TX/STATUS flags of every handle, 0xFFFFFFFF waits forever */
+canStatus canWaitForEvent (const CanHandle *hnds, UInt32 count, UInt32 *readyFlags, UInt32 timeout);
+
+/* Reads the count channels as one stream in host time order, see canReadGroup.
+   A frame waits up to windowUs for earlier ones of idle channels. Returns the
+   group or a negative canStatus */
+CanGroupHandle canOpenGroup (const CanHandle *hnds, UInt32 count, UInt32 windowUs);
+
+canStatus canCloseGroup (const CanGroupHandle grp);
+
+/* Like canReadHostNs on the earliest frame of the group, hnd gets its channel */
+canStatus canReadGroup (const CanGroupHandle grp, CanHandle *hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt64 *time);
+
+/* Like canReadGroup, but waits up to timeout ms, 0xFFFFFFFF waits forever */
+canStatus canReadGroupWait (const CanGroupHandle grp, CanHandle *hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt64 *time, UInt32 timeout);
+
 canStatus canGetChannelData(const CanHandle hnd, SInt32 item, void* pBuffer, size_t bufsize);
 
 canStatus canGetNumberOfChannels(int *channelCount);
 
+/* Descriptor for poll/kqueue/epoll, readable when frames arrive, negative canStatus on error */
+int canGetEventFd (const CanHandle hnd);
+
+canStatus canGetUsbStatistics(const CanHandle hnd, CanUsbStatistics *stat, size_t bufsize);
+
+canStatus canGetClockSync(const CanHandle hnd, CanClockSync *sync, size_t bufsize);
+
+/* Sets the depth of the receive and transmit buffer in frames, rounded up to a
+   power of two, 0 keeps a buffer as it is. Call it before the channel is used */
+canStatus canSetQueueSize (const CanHandle hnd, UInt32 rxFrames, UInt32 txFrames);
+
+canStatus canGetQueueStatistics(const CanHandle hnd, CanQueueStatistics *stat, size_t bufsize);
+
+/* What a full receive buffer does with arriving frames, one of canOVERRUN_xxx */
+canStatus canSetOverrunPolicy (const CanHandle hnd, int policy);
+
+/* Received frames pass if (id & mask) == (code & mask), is_extended selects the id type */
+canStatus canSetAcceptanceFilter (const CanHandle hnd, UInt32 code, UInt32 mask, int is_extended);
+
+/* Changes one part of the acceptance filter, flag is one of canFILTER_xxx */
+canStatus canAccept (const CanHandle hnd, const long envelope, const unsigned int flag);
+
 #endif /* CAN4OSX_H */
@@ -44,140 +44,2291 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
+#include "can4osx_debug.h"
+
+
+/* a reader blocked on the receive ring looks again after this, see
+   CAN4OSX_ReadCanEventBufferWait */
+#define CAN4OSX_READ_RECHECK_NS 1000000u
+
+/* shared by all handles, canWaitForEvent may wait on any set of them */
+static pthread_mutex_t can4osxEventMutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef __APPLE__
+static pthread_cond_t can4osxEventCond = PTHREAD_COND_INITIALIZER;
+#else
+/* waits on CLOCK_MONOTONIC like CAN4OSX_HostNs, set up by CAN4OSX_EventCond */
+static pthread_cond_t can4osxEventCond;
+static pthread_once_t can4osxEventCondOnce = PTHREAD_ONCE_INIT;
+#endif
+static _Atomic UInt32 can4osxEventWaiters = 0u;
+
+/* host time the bulk in transfer being decoded completed, driver thread only */
+static UInt64 can4osxTransferHostNs = 0u;
+
+/* a thread in CAN4OSX_SemaphoreWait on virtual time, lives on its stack */
+typedef struct CAN4OSX_CLOCK_WAITER_S {
+    struct CAN4OSX_CLOCK_WAITER_S *pNext;
+    dispatch_semaphore_t sema;
+    UInt64 deadlineNs;
+    Boolean expired;        /* CAN4OSX_ClockAdvance signalled sema */
+} CAN4OSX_CLOCK_WAITER_T;
+
+/* virtual time, set once before the library starts */
+static Boolean can4osxClockVirtual = false;
+static _Atomic UInt64 can4osxClockNs = 0u;
+static pthread_mutex_t can4osxClockMutex = PTHREAD_MUTEX_INITIALIZER;
+static CAN4OSX_CLOCK_WAITER_T *pCan4osxClockWaiters = NULL;
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CreateCanEventBuffer - create a receive ring
+*
+* The ring is used by exactly one producer (the USB run loop) and one consumer
+* (the reading thread), so no lock is needed. Frames are stored with their
+* real length, bufferSize is the number of classic frames that fit, the byte
+* size is rounded up to the next power of two. One FD record of slack follows
+* the ring, with canOVERRUN_DROP_OLDEST a reader may see a half overwritten
+* record and its copy must stay inside the allocation.
+*
+* \return pointer to the new buffer or NULL
+*/
+CAN_EVENT_MSG_BUF_T* CAN4OSX_CreateCanEventBuffer(
+		UInt32 bufferSize
+	)
+{
+CAN_EVENT_MSG_BUF_T* bufferRef = NULL;
+UInt32 size = CAN4OSX_CACHE_LINE_SIZE;
+
+	// At least room for a few FD frames
+	while ( (size < (bufferSize * CAN4OSX_RX_RECORD_SIZE(8u))) ||
+			(size < (4u * CAN4OSX_RX_RECORD_SIZE(CAN4OSX_CAN_MAX_MSG_LEN))) )  {
+		size <<= 1u;
+	}
+
+	if ( posix_memalign((void **)&bufferRef, CAN4OSX_CACHE_LINE_SIZE, sizeof(CAN_EVENT_MSG_BUF_T)) != 0 )  {
+		return(NULL);
+	}
+
+	bufferRef->bufferSize = size;
+	bufferRef->bufferMask = size - 1u;
+	atomic_init(&bufferRef->bufferHead, 0u);
+	atomic_init(&bufferRef->bufferTail, 0u);
+	atomic_init(&bufferRef->framesIn, 0u);
+	atomic_init(&bufferRef->framesOut, 0u);
+	atomic_init(&bufferRef->framesDropped, 0u);
+	atomic_init(&bufferRef->framesEvicted, 0u);
+	bufferRef->dropOldest = 0u;
+	bufferRef->overrunPending = 0u;
+	bufferRef->bufferTailCache = 0u;
+	bufferRef->bufferHeadReserved = 0u;
+	bufferRef->bufferHeadCache = 0u;
+	bufferRef->bufferTailOwn = 0u;
+	bufferRef->framesHighWater = 0u;
+	atomic_init(&bufferRef->readWaiters, 0u);
+	atomic_init(&bufferRef->readCancel, 0u);
+	bufferRef->eventFdRead = -1;
+	atomic_init(&bufferRef->eventFdWrite, -1);
+	atomic_init(&bufferRef->eventFdSignalled, 0u);
+
+	if ( posix_memalign((void **)&bufferRef->bufferRef, CAN4OSX_CACHE_LINE_SIZE,
+						size + CAN4OSX_RX_RECORD_SIZE(CAN4OSX_CAN_MAX_MSG_LEN)) != 0 )  {
+		free(bufferRef);
+		bufferRef = NULL;
+		return(NULL);
+	}
+
+	bufferRef->readSema = dispatch_semaphore_create(0);
+
+	if ( bufferRef->readSema == NULL )  {
+		free(bufferRef->bufferRef);
+		free(bufferRef);
+		return(NULL);
+	}
+
+	return(bufferRef);
+}
+
+
+/******************************************************************************/
+void CAN4OSX_ReleaseCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+	if ( bufferRef != NULL )  {
+		if ( bufferRef->readSema != NULL )  {
+			dispatch_release(bufferRef->readSema);
+		}
+
+		if ( atomic_load(&bufferRef->eventFdWrite) >= 0 )  {
+			if ( atomic_load(&bufferRef->eventFdWrite) != bufferRef->eventFdRead )  {
+				close(atomic_load(&bufferRef->eventFdWrite));
+			}
+			close(bufferRef->eventFdRead);
+		}
+
+		free(bufferRef->bufferRef);
+		bufferRef->bufferRef = NULL;
+
+		free(bufferRef);
+		bufferRef = NULL;
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SignalCanEventBufferFd(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		int fd
+	)
+{
+	// Only the first message after the consumer saw the ring empty writes
+	if ( atomic_exchange(&bufferRef->eventFdSignalled, 1u) == 0u )  {
+#ifdef __linux__
+		UInt64 one = 1u;
+		(void)write(fd, &one, sizeof(one));
+#else
+		UInt8 one = 1u;
+		(void)write(fd, &one, sizeof(one));
+#endif
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_EvictCanEventBuffer - drop the oldest record, dropOldest only
+*
+* The consumer publishes its tail with a compare exchange in this mode, so
+* either it or we get the record. Losing the race is fine, the consumer made
+* room then.
+*/
+static void CAN4OSX_EvictCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+UInt32 tail = bufferRef->bufferTailCache;
+CAN4OSX_RX_RECORD_T *pRecord = (CAN4OSX_RX_RECORD_T *)&bufferRef->bufferRef[tail & bufferRef->bufferMask];
+
+	if ( atomic_compare_exchange_strong_explicit(&bufferRef->bufferTail, &tail, tail + pRecord->recordSize,
+												 memory_order_acq_rel, memory_order_acquire) )  {
+		tail += pRecord->recordSize;
+		if ( pRecord->canDlc != CAN4OSX_RX_RECORD_PAD )  {
+			atomic_fetch_add_explicit(&bufferRef->framesEvicted, 1u, memory_order_relaxed);
+			atomic_fetch_add_explicit(&bufferRef->framesDropped, 1u, memory_order_relaxed);
+		}
+	}
+
+	bufferRef->bufferTailCache = tail;
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReserveCanEventBuffer - get room for a message in the ring
+*
+* recordSize and canDlc of the returned record are set, canChannel and
+* canFlags are 0. The decoder fills in the rest right in the ring and
+* publishes it with CAN4OSX_CommitCanEventBuffer, a reservation that is not
+* committed is simply taken again by the next one. A record never wraps, if
+* it does not fit in front of the ring end the rest is skipped with a pad
+* record. A full ring drops the message and marks the next stored one with
+* canMSGERR_SW_OVERRUN, with dropOldest the oldest records make room instead.
+* Must only be called from the producer side.
+*
+* \return pointer to the record or NULL if the buffer is full
+*/
+CAN4OSX_RX_RECORD_T* CAN4OSX_ReserveCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt8 canDlc
+	)
+{
+UInt32 head = atomic_load_explicit(&bufferRef->bufferHead, memory_order_relaxed);
+UInt32 offset = head & bufferRef->bufferMask;
+UInt32 size = CAN4OSX_RX_RECORD_SIZE(canDlc);
+UInt32 pad = 0u;
+CAN4OSX_RX_RECORD_T *pRecord;
+
+	if ( (offset + size) > bufferRef->bufferSize )  {
+		pad = bufferRef->bufferSize - offset;
+	}
+
+	if ( (head + pad + size - bufferRef->bufferTailCache) > bufferRef->bufferSize )  {
+		bufferRef->bufferTailCache = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+		while ( (head + pad + size - bufferRef->bufferTailCache) > bufferRef->bufferSize )  {
+			if ( !bufferRef->dropOldest )  {
+				atomic_store_explicit(&bufferRef->framesDropped, atomic_load_explicit(&bufferRef->framesDropped, memory_order_relaxed) + 1u, memory_order_relaxed);
+				bufferRef->overrunPending |= canMSGERR_SW_OVERRUN;
+				return(NULL);
+			}
+			CAN4OSX_EvictCanEventBuffer(bufferRef);
+		}
+	}
+
+	if ( pad != 0u )  {
+		pRecord = (CAN4OSX_RX_RECORD_T *)&bufferRef->bufferRef[offset];
+		pRecord->recordSize = (UInt16)pad;
+		pRecord->canDlc = CAN4OSX_RX_RECORD_PAD;
+		head += pad;
+		offset = 0u;
+	}
+
+	bufferRef->bufferHeadReserved = head + size;
+
+	pRecord = (CAN4OSX_RX_RECORD_T *)&bufferRef->bufferRef[offset];
+	pRecord->recordSize = (UInt16)size;
+	pRecord->canDlc = canDlc;
+	pRecord->canChannel = 0u;
+	pRecord->canFlags = 0u;
+
+	return(pRecord);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CommitCanEventBuffer - publish the reserved record
+*
+* pRecord is the record returned by the last CAN4OSX_ReserveCanEventBuffer.
+* Wakes a waiting reader and the pollable descriptor. Must only be called
+* from the producer side.
+*/
+void CAN4OSX_CommitCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CAN4OSX_RX_RECORD_T *pRecord
+	)
+{
+int fd;
+
+	// Frames lost in front of this one
+	pRecord->canFlags |= bufferRef->overrunPending;
+	bufferRef->overrunPending = 0u;
+
+	atomic_store_explicit(&bufferRef->framesIn, atomic_load_explicit(&bufferRef->framesIn, memory_order_relaxed) + 1u, memory_order_relaxed);
+	atomic_store_explicit(&bufferRef->bufferHead, bufferRef->bufferHeadReserved, memory_order_release);
+
+	// No fence, a reader registering meanwhile looks again by itself
+	if ( atomic_load_explicit(&bufferRef->readWaiters, memory_order_relaxed) != 0u )  {
+		dispatch_semaphore_signal(bufferRef->readSema);
+	}
+
+	fd = atomic_load_explicit(&bufferRef->eventFdWrite, memory_order_acquire);
+	if ( fd >= 0 )  {
+		CAN4OSX_SignalCanEventBufferFd(bufferRef, fd);
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_WriteCanEventBuffer - append a message to the ring
+*
+* Copies the header and canDlc data bytes of a prepared message, decoders
+* better fill the record in place with CAN4OSX_ReserveCanEventBuffer. Must
+* only be called from the producer side.
+*
+* \return 1 if the message was stored, 0 if the buffer is full
+*/
+UInt8 CAN4OSX_WriteCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		const CanMsg *pEvent
+	)
+{
+CAN4OSX_RX_RECORD_T *pRecord = CAN4OSX_ReserveCanEventBuffer(bufferRef, pEvent->canDlc);
+
+	if ( pRecord == NULL )  {
+		return(0);
+	}
+
+	pRecord->canChannel = pEvent->canChannel;
+	pRecord->canFlags = pEvent->canFlags;
+	pRecord->canId = pEvent->canId;
+	pRecord->canTimestamp = pEvent->canTimestamp;
+	pRecord->canHostTimestamp = pEvent->canHostTimestamp;
+	memcpy(pRecord->canData, pEvent->canData, pEvent->canDlc);
+
+	CAN4OSX_CommitCanEventBuffer(bufferRef, pRecord);
+
+	return(1);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_PeekCanEventBuffer - find the oldest record in the ring
+*
+* Steps over a pad record, tail is moved behind it. The producer publishes a
+* pad record only together with the record that follows it. taken is the
+* number of frames read but not yet given back with the consume. With
+* dropOldest the record may be overwritten while it is read, the consume
+* detects that and the caller starts over.
+*
+* \return pointer to the record or NULL if the buffer is empty
+*/
+static CAN4OSX_RX_RECORD_T* CAN4OSX_PeekCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 *pTail,
+		UInt32 taken
+	)
+{
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt32 frames;
+
+	// The producer may have moved the tail past our cached head, see CAN4OSX_EvictCanEventBuffer
+	if ( (SInt32)(bufferRef->bufferHeadCache - *pTail) <= 0 )  {
+		bufferRef->bufferHeadCache = atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire);
+		if ( (SInt32)(bufferRef->bufferHeadCache - *pTail) <= 0 )  {
+			return(NULL);
+		}
+
+		// framesIn shares the cache line of the head we just loaded
+		frames = atomic_load_explicit(&bufferRef->framesIn, memory_order_relaxed) -
+				 atomic_load_explicit(&bufferRef->framesOut, memory_order_relaxed) -
+				 atomic_load_explicit(&bufferRef->framesEvicted, memory_order_relaxed) - taken;
+		if ( frames > bufferRef->framesHighWater )  {
+			bufferRef->framesHighWater = frames;
+		}
+	}
+
+	pRecord = (CAN4OSX_RX_RECORD_T *)&bufferRef->bufferRef[*pTail & bufferRef->bufferMask];
+	if ( pRecord->canDlc == CAN4OSX_RX_RECORD_PAD )  {
+		*pTail += pRecord->recordSize;
+		pRecord = (CAN4OSX_RX_RECORD_T *)&bufferRef->bufferRef[*pTail & bufferRef->bufferMask];
+	}
+
+	return(pRecord);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ConsumeCanEventBuffer - give records back to the producer
+*
+* start is the tail the records were read from. With dropOldest the producer
+* may have evicted some of them meanwhile, then nothing is consumed.
+*
+* \return 1 if the records were consumed, 0 if they have to be read again
+*/
+static UInt8 CAN4OSX_ConsumeCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 start,
+		UInt32 tail,
+		UInt32 frames
+	)
+{
+	if ( bufferRef->dropOldest )  {
+		if ( !atomic_compare_exchange_strong_explicit(&bufferRef->bufferTail, &start, tail,
+													  memory_order_acq_rel, memory_order_relaxed) )  {
+			return(0);
+		}
+		atomic_store_explicit(&bufferRef->framesOut, atomic_load_explicit(&bufferRef->framesOut, memory_order_relaxed) + frames, memory_order_relaxed);
+	} else {
+		atomic_store_explicit(&bufferRef->framesOut, atomic_load_explicit(&bufferRef->framesOut, memory_order_relaxed) + frames, memory_order_relaxed);
+		atomic_store_explicit(&bufferRef->bufferTail, tail, memory_order_release);
+	}
+
+	bufferRef->bufferTailOwn = tail;
+
+	return(1);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_StartReadCanEventBuffer - tail to start a read at
+*
+* *pFlags gets canMSGERR_SW_OVERRUN if the producer evicted records since the
+* last read, the first frame delivered carries it.
+*/
+static UInt32 CAN4OSX_StartReadCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 *pFlags
+	)
+{
+UInt32 tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+
+	*pFlags = (tail != bufferRef->bufferTailOwn) ? canMSGERR_SW_OVERRUN : 0u;
+
+	return(tail);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReadCanEventBuffer - take the oldest message from the ring
+*
+* Must only be called from the consumer side.
+*
+* \return 1 if a message was read, 0 if the buffer is empty
+*/
+UInt8 CAN4OSX_ReadCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanMsg* readEvent
+	)
+{
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt32 start;
+UInt32 tail;
+UInt32 flags;
+UInt8 dlc;
+
+	for (;;)  {
+		start = CAN4OSX_StartReadCanEventBuffer(bufferRef, &flags);
+		tail = start;
+		pRecord = CAN4OSX_PeekCanEventBuffer(bufferRef, &tail, 0u);
+
+		if ( pRecord == NULL )  {
+			if ( !bufferRef->dropOldest || (atomic_load(&bufferRef->bufferTail) == start) )  {
+				return(0);
+			}
+			continue;
+		}
+
+		// Only a record being overwritten can claim more, the consume drops it then
+		dlc = pRecord->canDlc;
+		if ( dlc > CAN4OSX_CAN_MAX_MSG_LEN )  {
+			dlc = CAN4OSX_CAN_MAX_MSG_LEN;
+		}
+
+		readEvent->canTimestamp = pRecord->canTimestamp;
+		readEvent->canHostTimestamp = pRecord->canHostTimestamp;
+		readEvent->canId = pRecord->canId;
+		readEvent->canFlags = pRecord->canFlags | flags;
+		readEvent->canDlc = dlc;
+		readEvent->canChannel = pRecord->canChannel;
+		memcpy(readEvent->canData, pRecord->canData, dlc);
+
+		if ( CAN4OSX_ConsumeCanEventBuffer(bufferRef, start, tail + pRecord->recordSize, 1u) )  {
+			return(1);
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReadCanEventBufferWait - take a message, wait if there is none
+*
+* Blocks up to timeout milliseconds (0xFFFFFFFF waits forever) until the
+* producer stores a message. Must only be called from the consumer side.
+*
+* The producer does not fence its commit against the registration in
+* readWaiters, a commit racing with it may not signal. So the first wait
+* ends after CAN4OSX_READ_RECHECK_NS and the ring is read again, the head
+* of that commit is visible by then.
+*
+* \return 1 if a message was read, 0 on timeout or when the wait was
+* cancelled
+*/
+UInt8 CAN4OSX_ReadCanEventBufferWait(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanMsg* readEvent,
+		UInt32 timeout
+	)
+{
+UInt64 endNs = UINT64_MAX;
+UInt8 retval = 0;
+UInt32 cancel = atomic_load(&bufferRef->readCancel);
+Boolean recheck = true;
+
+	if ( CAN4OSX_ReadCanEventBuffer(bufferRef, readEvent) )  {
+		return(1);
+	}
+
+	if ( timeout == 0u )  {
+		return(0);
+	}
+
+	if ( timeout != 0xFFFFFFFFu )  {
+		endNs = CAN4OSX_HostNs() + ((UInt64)timeout * NSEC_PER_MSEC);
+	}
+
+	// Pairs with the fence in CAN4OSX_CancelCanEventBufferWait
+	atomic_fetch_add(&bufferRef->readWaiters, 1u);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	for (;;)  {
+		UInt64 waitNs = UINT64_MAX;
+
+		if ( CAN4OSX_ReadCanEventBuffer(bufferRef, readEvent) )  {
+			retval = 1;
+			break;
+		}
+		if ( atomic_load(&bufferRef->readCancel) != cancel )  {
+			break;
+		}
+		if ( endNs != UINT64_MAX )  {
+			UInt64 nowNs = CAN4OSX_HostNs();
+
+			waitNs = (endNs > nowNs) ? (endNs - nowNs) : 0u;
+		}
+		// The recheck runs on the host clock, a shorter timeout reads again anyway
+		if ( recheck && (waitNs > CAN4OSX_READ_RECHECK_NS) )  {
+			recheck = false;
+			(void)dispatch_semaphore_wait(bufferRef->readSema, dispatch_time(DISPATCH_TIME_NOW, (int64_t)CAN4OSX_READ_RECHECK_NS));
+			continue;
+		}
+		// A left over signal only costs another pass through the loop
+		if ( CAN4OSX_SemaphoreWait(bufferRef->readSema, waitNs) != 0 )  {
+			retval = CAN4OSX_ReadCanEventBuffer(bufferRef, readEvent);
+			break;
+		}
+	}
+
+	atomic_fetch_sub(&bufferRef->readWaiters, 1u);
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CancelCanEventBufferWait - wake the readers of a buffer
+*
+* For a handle that was closed or a device that was removed: the readers
+* blocked in CAN4OSX_ReadCanEventBufferWait return, a descriptor from
+* canGetEventFd turns readable. Safe from any thread.
+*/
+void CAN4OSX_CancelCanEventBufferWait(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+UInt32 waiters;
+int fd;
+
+	if ( bufferRef == NULL )  {
+		return;
+	}
+
+	atomic_fetch_add(&bufferRef->readCancel, 1u);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	// A reader that counted itself in after the load sees readCancel
+	for ( waiters = atomic_load(&bufferRef->readWaiters); waiters > 0u; waiters-- )  {
+		dispatch_semaphore_signal(bufferRef->readSema);
+	}
+
+	fd = atomic_load(&bufferRef->eventFdWrite);
+	if ( fd >= 0 )  {
+		CAN4OSX_SignalCanEventBufferFd(bufferRef, fd);
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReadCanEventBufferBatch - take several messages from the ring
+*
+* Copies up to maxFrames messages into pFrames. The producer index is read
+* at most once more and the consumer index is published only once for the
+* whole batch. Must only be called from the consumer side.
+*
+* \return number of messages read
+*/
+UInt32 CAN4OSX_ReadCanEventBufferBatch(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanFrame* pFrames,
+		UInt32 maxFrames
+	)
+{
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt32 start;
+UInt32 tail;
+UInt32 flags;
+UInt32 count;
+UInt8 dlc;
+
+	for (;;)  {
+		start = CAN4OSX_StartReadCanEventBuffer(bufferRef, &flags);
+		tail = start;
+		count = 0u;
+
+		while ( count < maxFrames )  {
+			pRecord = CAN4OSX_PeekCanEventBuffer(bufferRef, &tail, count);
+			if ( pRecord == NULL )  {
+				break;
+			}
+
+			dlc = pRecord->canDlc;
+			if ( dlc > CAN4OSX_CAN_MAX_MSG_LEN )  {
+				dlc = CAN4OSX_CAN_MAX_MSG_LEN;
+			}
+
+			pFrames[count].id = pRecord->canId;
+			pFrames[count].flag = pRecord->canFlags | flags;
+			pFrames[count].time = CAN4OSX_TIME_US(pRecord->canTimestamp);
+			pFrames[count].dlc = dlc;
+			memcpy(pFrames[count].msg, pRecord->canData, dlc);
+
+			tail += pRecord->recordSize;
+			flags = 0u;
+			count++;
+		}
+
+		if ( count == 0u )  {
+			if ( !bufferRef->dropOldest || (atomic_load(&bufferRef->bufferTail) == start) )  {
+				return(0u);
+			}
+			continue;
+		}
+
+		// With dropOldest the whole batch is read again if the producer took a part of it
+		if ( CAN4OSX_ConsumeCanEventBuffer(bufferRef, start, tail, count) )  {
+			return(count);
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_PeekCanEventBufferRun - look at messages without copying them
+*
+* *ppRecord points at the oldest record, the others of the run follow it in
+* memory up to the newest one or the ring end. Nothing is consumed, see
+* CAN4OSX_ReleaseCanEventBufferRun. Must only be called from the consumer
+* side and not with dropOldest, the producer could overwrite the records.
+*
+* \return number of records in the run, 0 if the buffer is empty
+*/
+UInt32 CAN4OSX_PeekCanEventBufferRun(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		const CAN4OSX_RX_RECORD_T **ppRecord
+	)
+{
+UInt32 tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+CAN4OSX_RX_RECORD_T *pRecord = CAN4OSX_PeekCanEventBuffer(bufferRef, &tail, 0u);
+UInt32 count = 0u;
+UInt32 end;
+
+	if ( pRecord == NULL )  {
+		return(0u);
+	}
+
+	*ppRecord = pRecord;
+
+	end = tail - (tail & bufferRef->bufferMask) + bufferRef->bufferSize;
+	if ( (SInt32)(bufferRef->bufferHeadCache - end) < 0 )  {
+		end = bufferRef->bufferHeadCache;
+	}
+
+	while ( tail != end )  {
+		pRecord = (CAN4OSX_RX_RECORD_T *)&bufferRef->bufferRef[tail & bufferRef->bufferMask];
+		if ( pRecord->canDlc == CAN4OSX_RX_RECORD_PAD )  {
+			break;
+		}
+		tail += pRecord->recordSize;
+		count++;
+	}
+
+	return(count);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReleaseCanEventBufferRun - consume looked at messages
+*
+* Gives the oldest frames records back to the producer, at most as many as
+* are in the ring. Must only be called from the consumer side.
+*
+* \return number of messages consumed
+*/
+UInt32 CAN4OSX_ReleaseCanEventBufferRun(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 frames
+	)
+{
+UInt32 start = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+UInt32 tail = start;
+UInt32 count = 0u;
+CAN4OSX_RX_RECORD_T *pRecord;
+
+	while ( count < frames )  {
+		pRecord = CAN4OSX_PeekCanEventBuffer(bufferRef, &tail, count);
+		if ( pRecord == NULL )  {
+			break;
+		}
+		tail += pRecord->recordSize;
+		count++;
+	}
+
+	if ( count > 0u )  {
+		(void)CAN4OSX_ConsumeCanEventBuffer(bufferRef, start, tail, count);
+	}
+
+	return(count);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CanEventBufferCount - number of messages in the ring
+*
+* Can be called from any thread, the result is only a snapshot.
+*
+* \return number of messages
+*/
+UInt32 CAN4OSX_CanEventBufferCount(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+// Read the consumer side counts first, the difference can not become negative
+UInt32 framesOut = atomic_load_explicit(&bufferRef->framesOut, memory_order_acquire) +
+				   atomic_load_explicit(&bufferRef->framesEvicted, memory_order_acquire);
+
+	return(atomic_load_explicit(&bufferRef->framesIn, memory_order_acquire) - framesOut);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CanEventBufferFrames - capacity of the ring
+*
+* \return number of classic frames the ring holds
+*/
+UInt32 CAN4OSX_CanEventBufferFrames(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+	return(bufferRef->bufferSize / CAN4OSX_RX_RECORD_SIZE(8u));
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CanEventBufferDropped - frames lost to a full ring
+*
+* Can be called from any thread.
+*
+* \return number of dropped and evicted frames since the ring was created
+*/
+UInt32 CAN4OSX_CanEventBufferDropped(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+	return(atomic_load_explicit(&bufferRef->framesDropped, memory_order_relaxed));
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CountHwOverrun - the device reported lost frames
+*
+* Called by the decoders on the driver thread before the frame is filtered,
+* the next frame stored gets canMSGERR_HW_OVERRUN.
+*/
+void CAN4OSX_CountHwOverrun(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+	atomic_store_explicit(&pSelf->rxHwOverruns, atomic_load_explicit(&pSelf->rxHwOverruns, memory_order_relaxed) + 1u, memory_order_relaxed);
+
+	if ( pSelf->canEventMsgBuff != NULL )  {
+		pSelf->canEventMsgBuff->overrunPending |= canMSGERR_HW_OVERRUN;
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_TicksToNs - convert device timer ticks
+*
+* \return ticks of a timer running at freq Hz in nanoseconds
+*/
+UInt64 CAN4OSX_TicksToNs(
+		UInt64 ticks,
+		UInt32 freq
+	)
+{
+	// Split up, ticks * 1e9 would overflow after a few hours
+	return(((ticks / freq) * 1000000000u) + (((ticks % freq) * 1000000000u) / freq));
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_InitTimeBase - set up the timer of a device
+*
+* bits is the width of the free running device timer, freq its rate in Hz.
+*/
+void CAN4OSX_InitTimeBase(
+		CAN4OSX_TIME_BASE_T *pTimeBase,
+		UInt32 bits,
+		UInt32 freq
+	)
+{
+	pTimeBase->timerMask = (bits >= 64u) ? ~0ull : ((1ull << bits) - 1u);
+	pTimeBase->timerLast = 0u;
+	pTimeBase->timerWraps = 0u;
+	pTimeBase->timerFreq = freq;
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_TimeBaseNs - extend a raw timer value
+*
+* A value more than half the timer range below the last one is taken as a
+* wrap of the device timer, so at least one frame or CAN4OSX_TimeBaseWrapped
+* per half timer period is needed. A smaller step back is a reordered frame,
+* it does not move the last value. Called by the decoders on the driver
+* thread.
+*
+* \return time since the device timer started in nanoseconds
+*/
+UInt64 CAN4OSX_TimeBaseNs(
+		CAN4OSX_TIME_BASE_T *pTimeBase,
+		UInt64 ticks
+	)
+{
+	ticks &= pTimeBase->timerMask;
+
+	if ( ticks >= pTimeBase->timerLast )  {
+		pTimeBase->timerLast = ticks;
+	} else if ( (pTimeBase->timerLast - ticks) > (pTimeBase->timerMask >> 1u) )  {
+		pTimeBase->timerWraps++;
+		pTimeBase->timerLast = ticks;
+	}
+
+	if ( pTimeBase->timerMask != ~0ull )  {
+		ticks += pTimeBase->timerWraps * (pTimeBase->timerMask + 1u);
+	}
+
+	return(CAN4OSX_TicksToNs(ticks, pTimeBase->timerFreq));
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_TimeBaseWrapped - the device reported timer wraps
+*
+* For devices that send an event when their timer wraps, frames may then be
+* further apart than a timer period.
+*/
+void CAN4OSX_TimeBaseWrapped(
+		CAN4OSX_TIME_BASE_T *pTimeBase,
+		UInt32 wraps
+	)
+{
+	pTimeBase->timerWraps += wraps;
+	// The next value is after the wrap, it must not count again
+	pTimeBase->timerLast = 0u;
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_HostNs - read the host clock
+*
+* \return CLOCK_MONOTONIC in nanoseconds, the virtual time if enabled
+*/
+UInt64 CAN4OSX_HostNs(
+		void
+	)
+{
+struct timespec now;
+
+	if ( can4osxClockVirtual )  {
+		return(atomic_load(&can4osxClockNs));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return(((UInt64)now.tv_sec * 1000000000u) + (UInt64)now.tv_nsec);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClockSetVirtual - run the library on virtual time
+*
+* The host clock stands at 0 and only CAN4OSX_ClockAdvance moves it. Time
+* stamps, timeouts and the simulated devices then follow the virtual time, so
+* a test runs as fast as the host can process the traffic. Meant for the
+* virtual and emulated devices, real hardware keeps its own pace. Has to be
+* called before canInitializeLibrary.
+*/
+void CAN4OSX_ClockSetVirtual(
+		Boolean enable
+	)
+{
+	atomic_store(&can4osxClockNs, 0u);
+	can4osxClockVirtual = enable;
+}
+
+
+/******************************************************************************/
+#ifndef __APPLE__
+static void CAN4OSX_EventCondInit(
+		void
+	)
+{
+pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&can4osxEventCond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+#endif
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_EventCond - the condition of the event waits
+*
+* Off macOS it is set up on the first use, a condition on CLOCK_MONOTONIC
+* has no static initializer.
+*
+* \return pointer to can4osxEventCond
+*/
+static pthread_cond_t* CAN4OSX_EventCond(
+		void
+	)
+{
+#ifndef __APPLE__
+	pthread_once(&can4osxEventCondOnce, CAN4OSX_EventCondInit);
+#endif
+
+	return(&can4osxEventCond);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClockAdvance - move the virtual time forward
+*
+* Wakes every wait whose timeout has passed by then. The woken threads run
+* on their own, the call does not wait for them.
+*/
+void CAN4OSX_ClockAdvance(
+		UInt64 ns
+	)
+{
+CAN4OSX_CLOCK_WAITER_T **ppWaiter;
+UInt64 nowNs;
+
+	if ( !can4osxClockVirtual )  {
+		return;
+	}
+
+	pthread_mutex_lock(&can4osxClockMutex);
+
+	nowNs = atomic_fetch_add(&can4osxClockNs, ns) + ns;
+
+	ppWaiter = &pCan4osxClockWaiters;
+	while ( *ppWaiter != NULL )  {
+		CAN4OSX_CLOCK_WAITER_T *pWaiter = *ppWaiter;
+
+		if ( pWaiter->deadlineNs <= nowNs )  {
+			// Not touched after the signal, the waiter may be gone then
+			*ppWaiter = pWaiter->pNext;
+			pWaiter->expired = true;
+			dispatch_semaphore_signal(pWaiter->sema);
+		} else {
+			ppWaiter = &pWaiter->pNext;
+		}
+	}
+
+	pthread_mutex_unlock(&can4osxClockMutex);
+
+	// The condition waits check the time themselves
+	pthread_mutex_lock(&can4osxEventMutex);
+	pthread_cond_broadcast(CAN4OSX_EventCond());
+	pthread_mutex_unlock(&can4osxEventMutex);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_SemaphoreWait - dispatch_semaphore_wait on the host clock
+*
+* timeoutNs is relative, UINT64_MAX waits forever. On virtual time the
+* timeout ends with CAN4OSX_ClockAdvance, which signals the semaphore once
+* for it. Woken by the clock, a second signal still there is the one waited
+* for, without it the clock took the place of nothing.
+*
+* \return 0 if signalled, non zero on timeout
+*/
+long CAN4OSX_SemaphoreWait(
+		dispatch_semaphore_t sema,
+		UInt64 timeoutNs
+	)
+{
+CAN4OSX_CLOCK_WAITER_T waiter;
+long retval;
+
+	if ( timeoutNs == UINT64_MAX )  {
+		return(dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER));
+	}
+
+	if ( !can4osxClockVirtual )  {
+		return(dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeoutNs)));
+	}
+
+	retval = dispatch_semaphore_wait(sema, DISPATCH_TIME_NOW);
+	if ( (retval == 0) || (timeoutNs == 0u) )  {
+		return(retval);
+	}
+
+	waiter.sema = sema;
+	waiter.expired = false;
+
+	pthread_mutex_lock(&can4osxClockMutex);
+	waiter.deadlineNs = atomic_load(&can4osxClockNs) + timeoutNs;
+	waiter.pNext = pCan4osxClockWaiters;
+	pCan4osxClockWaiters = &waiter;
+	pthread_mutex_unlock(&can4osxClockMutex);
+
+	(void)dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
+
+	pthread_mutex_lock(&can4osxClockMutex);
+	if ( waiter.expired )  {
+		retval = dispatch_semaphore_wait(sema, DISPATCH_TIME_NOW);
+	} else {
+		CAN4OSX_CLOCK_WAITER_T **ppWaiter = &pCan4osxClockWaiters;
+
+		while ( *ppWaiter != &waiter )  {
+			ppWaiter = &(*ppWaiter)->pNext;
+		}
+		*ppWaiter = waiter.pNext;
+		retval = 0;
+	}
+	pthread_mutex_unlock(&can4osxClockMutex);
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_EventCondWait - wait on can4osxEventCond until endNs
+*
+* Called with can4osxEventMutex held, endNs is on the host clock, UINT64_MAX
+* waits forever. On virtual time CAN4OSX_ClockAdvance wakes the waits.
+*
+* \return 0 if woken before endNs, non zero at endNs
+*/
+static int CAN4OSX_EventCondWait(
+		UInt64 endNs
+	)
+{
+struct timespec deadline;
+UInt64 nowNs;
+UInt64 waitNs;
+
+	if ( endNs == UINT64_MAX )  {
+		return(pthread_cond_wait(CAN4OSX_EventCond(), &can4osxEventMutex));
+	}
+
+	nowNs = CAN4OSX_HostNs();
+	if ( nowNs >= endNs )  {
+		return(1);
+	}
+
+	if ( can4osxClockVirtual )  {
+		return(pthread_cond_wait(CAN4OSX_EventCond(), &can4osxEventMutex));
+	}
+
+	waitNs = endNs - nowNs;
+
+#ifdef __APPLE__
+	// Relative, a step of the wall clock does not move it
+	deadline.tv_sec = (time_t)(waitNs / 1000000000u);
+	deadline.tv_nsec = (long)(waitNs % 1000000000u);
+
+	return(pthread_cond_timedwait_relative_np(&can4osxEventCond, &can4osxEventMutex, &deadline));
+#else
+	// The condition waits on the monotonic clock, see CAN4OSX_EventCond
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)(waitNs / 1000000000u);
+	deadline.tv_nsec += (long)(waitNs % 1000000000u);
+	if ( deadline.tv_nsec >= 1000000000 )  {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	return(pthread_cond_timedwait(CAN4OSX_EventCond(), &can4osxEventMutex, &deadline));
+#endif
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClockSyncTransfer - a bulk in transfer completed
+*
+* Takes the host time the frames of the transfer are paired with. Called on
+* the driver thread before the transfer is decoded.
+*/
+void CAN4OSX_ClockSyncTransfer(
+		void
+	)
+{
+	can4osxTransferHostNs = CAN4OSX_HostNs();
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClockSyncTransferNs - host time of the current transfer
+*
+* The receive time of frames from a device whose timer rate is not known,
+* see deviceTimeUnknown. Only for the driver thread.
+*/
+UInt64 CAN4OSX_ClockSyncTransferNs(
+		void
+	)
+{
+	return(can4osxTransferHostNs);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClockSyncFit - least squares line through the points
+*/
+static void CAN4OSX_ClockSyncFit(
+		CAN4OSX_CLOCK_SYNC_T *pSync
+	)
+{
+UInt32 first = (pSync->pointNext + CAN4OSX_CLOCK_SYNC_POINTS - pSync->pointCount) % CAN4OSX_CLOCK_SYNC_POINTS;
+UInt64 base = pSync->pointDev[first];
+SInt64 offset = pSync->pointOffset[first];
+double n = (double)pSync->pointCount;
+double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+double x, y, denom, drift = 0.0, intercept, error = 0.0;
+UInt32 i, k;
+
+	// Relative to the oldest point, so the doubles stay small
+	for ( i = 0u; i < pSync->pointCount; i++ )  {
+		k = (first + i) % CAN4OSX_CLOCK_SYNC_POINTS;
+		x = (double)(pSync->pointDev[k] - base);
+		y = (double)(pSync->pointOffset[k] - offset);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	denom = (n * sxx) - (sx * sx);
+	if ( (pSync->pointCount > 1u) && (denom > 0.0) )  {
+		drift = ((n * sxy) - (sx * sy)) / denom;
+	}
+	intercept = (sy - (drift * sx)) / n;
+
+	for ( i = 0u; i < pSync->pointCount; i++ )  {
+		k = (first + i) % CAN4OSX_CLOCK_SYNC_POINTS;
+		x = (double)(pSync->pointDev[k] - base);
+		y = (double)(pSync->pointOffset[k] - offset) - (intercept + (drift * x));
+		if ( y < 0.0 )  {
+			y = -y;
+		}
+		if ( y > error )  {
+			error = y;
+		}
+	}
+
+	pSync->fitBase = base;
+	pSync->fitOffset = offset + (SInt64)intercept;
+	pSync->fitDrift = drift;
+	pSync->fitError = (UInt64)error;
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClockSyncNs - map a device time to the host clock
+*
+* Every frame is a sample, paired with the completion time of its transfer.
+* Per CAN4OSX_CLOCK_SYNC_INTERVAL the sample with the least latency becomes
+* a point of the fit, the last CAN4OSX_CLOCK_SYNC_POINTS points give offset
+* and drift. Until the first point the best sample so far is used. Called by
+* the decoders on the driver thread.
+*
+* \return deviceNs in the CAN4OSX_HostNs domain
+*/
+UInt64 CAN4OSX_ClockSyncNs(
+		CAN4OSX_CLOCK_SYNC_T *pSync,
+		UInt64 deviceNs
+	)
+{
+UInt64 hostNs = can4osxTransferHostNs;
+SInt64 offset = (SInt64)(hostNs - deviceNs);
+SInt64 predicted;
+
+	if ( pSync->pointCount != 0u )  {
+		predicted = pSync->fitOffset + (SInt64)(pSync->fitDrift * (double)(SInt64)(deviceNs - pSync->fitBase));
+
+		// Timer reset or host sleep, the points do not fit anymore
+		if ( ((offset - predicted) > CAN4OSX_CLOCK_SYNC_RESET) || ((predicted - offset) > CAN4OSX_CLOCK_SYNC_RESET) )  {
+			pSync->pointCount = 0u;
+			pSync->pointNext = 0u;
+			pSync->intervalValid = 0u;
+		}
+	}
+
+	if ( !pSync->intervalValid )  {
+		pSync->intervalValid = 1u;
+		pSync->intervalEnd = hostNs + CAN4OSX_CLOCK_SYNC_INTERVAL;
+		pSync->intervalDev = deviceNs;
+		pSync->intervalOffset = offset;
+	} else if ( offset < pSync->intervalOffset )  {
+		pSync->intervalDev = deviceNs;
+		pSync->intervalOffset = offset;
+	}
+
+	if ( (SInt64)(hostNs - pSync->intervalEnd) >= 0 )  {
+		pSync->pointDev[pSync->pointNext] = pSync->intervalDev;
+		pSync->pointOffset[pSync->pointNext] = pSync->intervalOffset;
+		pSync->pointNext = (pSync->pointNext + 1u) % CAN4OSX_CLOCK_SYNC_POINTS;
+		if ( pSync->pointCount < CAN4OSX_CLOCK_SYNC_POINTS )  {
+			pSync->pointCount++;
+		}
+		pSync->intervalValid = 0u;
+
+		CAN4OSX_ClockSyncFit(pSync);
+	}
+
+	if ( pSync->pointCount == 0u )  {
+		return(deviceNs + pSync->intervalOffset);
+	}
+
+	return(deviceNs + pSync->fitOffset + (SInt64)(pSync->fitDrift * (double)(SInt64)(deviceNs - pSync->fitBase)));
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_MoveCanEventBuffer - hand the content of a ring to a new one
+*
+* Moves the waiting messages, as many as fit, the drop counter and policy and
+* the pollable descriptor from oldRef to newRef. Messages that do not fit are
+* counted as dropped. Neither the producer nor the consumer may use the rings
+* meanwhile, oldRef can be released afterwards.
+*/
+void CAN4OSX_MoveCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* newRef,
+		CAN_EVENT_MSG_BUF_T* oldRef
+	)
+{
+CanMsg canMsg;
+
+	while ( CAN4OSX_ReadCanEventBuffer(oldRef, &canMsg) )  {
+		if ( !CAN4OSX_WriteCanEventBuffer(newRef, &canMsg) )  {
+			atomic_fetch_add(&newRef->framesDropped, CAN4OSX_CanEventBufferCount(oldRef));
+			break;
+		}
+	}
+
+	atomic_fetch_add(&newRef->framesDropped, atomic_load(&oldRef->framesDropped));
+	newRef->overrunPending |= oldRef->overrunPending;
+	newRef->dropOldest = oldRef->dropOldest;
+
+	newRef->eventFdRead = oldRef->eventFdRead;
+	atomic_store(&newRef->eventFdWrite, atomic_load(&oldRef->eventFdWrite));
+	atomic_store(&newRef->eventFdSignalled, atomic_load(&oldRef->eventFdSignalled));
+
+	oldRef->eventFdRead = -1;
+	atomic_store(&oldRef->eventFdWrite, -1);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_GetCanEventBufferFd - get the pollable descriptor of the ring
+*
+* The descriptor is created on the first call, an eventfd on Linux and the
+* read end of a non blocking pipe elsewhere. It becomes readable when a
+* message arrives in the empty ring. Must be called from the consumer side.
+*
+* \return descriptor or -1
+*/
+int CAN4OSX_GetCanEventBufferFd(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+int fdWrite;
+
+	if ( atomic_load(&bufferRef->eventFdWrite) >= 0 )  {
+		return(bufferRef->eventFdRead);
+	}
+
+#ifdef __linux__
+	bufferRef->eventFdRead = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ( bufferRef->eventFdRead < 0 )  {
+		return(-1);
+	}
+	fdWrite = bufferRef->eventFdRead;
+#else
+	{
+		int fds[2];
+
+		if ( pipe(fds) != 0 )  {
+			return(-1);
+		}
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		bufferRef->eventFdRead = fds[0];
+		fdWrite = fds[1];
+	}
+#endif
+
+	atomic_store_explicit(&bufferRef->eventFdWrite, fdWrite, memory_order_release);
+
+	// Messages may already be waiting
+	if ( CAN4OSX_CanEventBufferCount(bufferRef) != 0u )  {
+		CAN4OSX_SignalCanEventBufferFd(bufferRef, fdWrite);
+	}
+
+	return(bufferRef->eventFdRead);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ClearCanEventBufferFd - rearm the descriptor
+*
+* Called by the read functions when they found the ring empty. Drains the
+* descriptor so the next message makes it readable again.
+*/
+void CAN4OSX_ClearCanEventBufferFd(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+int fdWrite = atomic_load_explicit(&bufferRef->eventFdWrite, memory_order_acquire);
+UInt8 drain[64];
+
+	if ( (fdWrite < 0) || (atomic_load(&bufferRef->eventFdSignalled) == 0u) )  {
+		return;
+	}
+
+	while ( read(bufferRef->eventFdRead, drain, sizeof(drain)) > 0 )  {
+	}
+
+	atomic_store(&bufferRef->eventFdSignalled, 0u);
+
+	// A message stored while we drained did not write, do it for it
+	if ( CAN4OSX_CanEventBufferCount(bufferRef) != 0u )  {
+		CAN4OSX_SignalCanEventBufferFd(bufferRef, fdWrite);
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_NotifyEvent - mark events on a handle
+*
+* Called by the decode paths. Sets the flags (canNOTIFY_xxx) on the handle
+* and wakes canWaitForEvent, the condition is only touched if somebody waits.
+* canNOTIFY_RX counts a frame for the callback, so it is only passed for a
+* frame that was committed to the receive ring.
+*/
+void CAN4OSX_NotifyEvent(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		UInt32 flags
+	)
+{
+	pSelf->notifyPendingFlags |= flags;
+	if ( flags & canNOTIFY_RX )  {
+		pSelf->notifyPendingFrames++;
+	}
+
+	atomic_fetch_or(&pSelf->eventFlags, flags);
+
+	if ( atomic_load(&can4osxEventWaiters) != 0u )  {
+		pthread_mutex_lock(&can4osxEventMutex);
+		pthread_cond_broadcast(CAN4OSX_EventCond());
+		pthread_mutex_unlock(&can4osxEventMutex);
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_WakeWaiters - wake every thread that waits on a channel
+*
+* Called after the handle is closed or the device removed, the generation
+* of the entry already changed. The readers of the ring return and the
+* event waiters check their handles again.
+*/
+void CAN4OSX_WakeWaiters(
+		Can4osxUsbDeviceHandleEntry* pSelf
+	)
+{
+	CAN4OSX_CancelCanEventBufferWait(pSelf->canEventMsgBuff);
+
+	pthread_mutex_lock(&can4osxEventMutex);
+	pthread_cond_broadcast(CAN4OSX_EventCond());
+	pthread_mutex_unlock(&can4osxEventMutex);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_FlushNotify - call the notification callbacks
+*
+* Called by the completion handlers when a USB transfer is done. Calls the
+* callback of every channel of the device which got events in the transfer.
+*/
+void CAN4OSX_FlushNotify(
+		Can4osxUsbDeviceHandleEntry* pSelf
+	)
+{
+int channels = pSelf->deviceChannelCount - pSelf->deviceChannel;
+int i;
+
+	// Multi channel devices decode into the following entries as well
+	if ( channels < 1 )  {
+		channels = 1;
+	}
+	if ( channels > (int)(CAN4OSX_ChannelCount() - pSelf->channelIndex) )  {
+		channels = (int)(CAN4OSX_ChannelCount() - pSelf->channelIndex);
+	}
+
+	for ( i = 0; i < channels; i++ )  {
+		Can4osxUsbDeviceHandleEntry *pEntry = CAN4OSX_CHANNEL(pSelf->channelIndex + i);
+		CanNotifyCallback callback = pEntry->notifyCallback;
+		UInt32 flags = pEntry->notifyPendingFlags & pEntry->notifyFlags;
+
+		if ( (callback != NULL) && (flags != 0u) )  {
+			callback(CAN4OSX_HANDLE(pEntry), pEntry->notifyContext, flags, pEntry->notifyPendingFrames);
+		}
+
+		pEntry->notifyPendingFlags = 0u;
+		pEntry->notifyPendingFrames = 0u;
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \internal
+* \brief CAN4OSX_CollectEvents - take the events of the handles
+*
+* The handles are looked up again on every call, they may have been closed
+* or their device removed since the caller checked them.
+*
+* \return number of handles with events, canERR_INVHANDLE for a stale one
+*/
+static int CAN4OSX_CollectEvents(
+		const CanHandle *pHandles,
+		UInt32 count,
+		UInt32 *pReadyFlags
+	)
+{
+int ready = 0;
+UInt32 i;
+
+	for ( i = 0u; i < count; i++ )  {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetHandleEntry(pHandles[i]);
+		UInt32 flags;
+
+		if ( pSelf == NULL )  {
+			return(canERR_INVHANDLE);
+		}
+
+		// RX is a level, everything else is reported once
+		flags = atomic_exchange(&pSelf->eventFlags, 0u) & ~canNOTIFY_RX;
+
+		if ( (pSelf->canEventMsgBuff != NULL) &&
+			 (CAN4OSX_CanEventBufferCount(pSelf->canEventMsgBuff) != 0u) )  {
+			flags |= canNOTIFY_RX;
+		}
+
+		pReadyFlags[i] = flags;
+		if ( flags != 0u )  {
+			ready++;
+		}
+	}
+
+	return(ready);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_WaitForEvent - wait until one of the handles has an event
+*
+* pReadyFlags gets the canNOTIFY_xxx flags of every handle. Waits up to
+* timeout ms, 0xFFFFFFFF waits forever.
+*
+* \return number of handles with events, 0 on timeout, canERR_INVHANDLE if
+* one of the handles went stale
+*/
+int CAN4OSX_WaitForEvent(
+		const CanHandle *pHandles,
+		UInt32 count,
+		UInt32 *pReadyFlags,
+		UInt32 timeout
+	)
+{
+UInt64 endNs = UINT64_MAX;
+int ready;
+
+	ready = CAN4OSX_CollectEvents(pHandles, count, pReadyFlags);
+	if ( (ready != 0) || (timeout == 0u) )  {
+		return(ready);
+	}
+
+	if ( timeout != 0xFFFFFFFFu )  {
+		endNs = CAN4OSX_HostNs() + ((UInt64)timeout * 1000000u);
+	}
+
+	pthread_mutex_lock(&can4osxEventMutex);
+	atomic_fetch_add(&can4osxEventWaiters, 1u);
+
+	for (;;)  {
+		// Check after registering, a notifier either sees us or we see its flags
+		ready = CAN4OSX_CollectEvents(pHandles, count, pReadyFlags);
+		if ( ready != 0 )  {
+			break;
+		}
+
+		if ( CAN4OSX_EventCondWait(endNs) != 0 )  {
+			ready = CAN4OSX_CollectEvents(pHandles, count, pReadyFlags);
+			break;
+		}
+	}
+
+	atomic_fetch_sub(&can4osxEventWaiters, 1u);
+	pthread_mutex_unlock(&can4osxEventMutex);
+
+	return(ready);
+}
+
+
+/******************************************************************************/
+/* channel groups
+ *
+ * Every member has its next frame taken out of its receive buffer. The
+ * earliest of these heads is handed out once every member has one, no member
+ * can deliver an earlier frame then. An idle member would stall the others,
+ * so a head is also handed out once it is windowNs older than the host clock.
+ * The members are merged by canHostTimestamp, which puts channels of
+ * different adapters on one time line.
+ */
+
+static CAN4OSX_GROUP_T can4osxGroup[CAN4OSX_MAX_GROUP_COUNT];
+
+/* serializes open and close, reading a group does not take it */
+static pthread_mutex_t can4osxGroupMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_OpenGroup - take a free group for the given channels
+*
+* A channel can be member of one group only.
+*
+* \return group number, canERR_PARAM or canERR_NOHANDLES
+*/
+int CAN4OSX_OpenGroup(
+		const CanHandle *pHandles,
+		UInt32 count,
+		UInt64 windowNs
+	)
+{
+int group = canERR_NOHANDLES;
+UInt32 g;
+UInt32 i;
+UInt32 j;
+
+	if ( (count == 0u) || (count > CAN4OSX_MAX_GROUP_MEMBERS) )  {
+		return(canERR_PARAM);
+	}
+
+	pthread_mutex_lock(&can4osxGroupMutex);
+
+	for ( g = 0u; g < CAN4OSX_MAX_GROUP_COUNT; g++ )  {
+		CAN4OSX_GROUP_T *pGroup = &can4osxGroup[g];
+
+		if ( !pGroup->inUse )  {
+			if ( group < 0 )  {
+				group = (int)g;
+			}
+			continue;
+		}
+
+		for ( i = 0u; i < count; i++ )  {
+			for ( j = 0u; j < pGroup->memberCount; j++ )  {
+				// A stale handle of the channel counts as well
+				if ( ((pGroup->member[j] ^ pHandles[i]) & CAN4OSX_HANDLE_INDEX_MASK) == 0 )  {
+					pthread_mutex_unlock(&can4osxGroupMutex);
+					return(canERR_PARAM);
+				}
+			}
+		}
+	}
+
+	for ( i = 0u; i < count; i++ )  {
+		for ( j = i + 1u; j < count; j++ )  {
+			if ( ((pHandles[i] ^ pHandles[j]) & CAN4OSX_HANDLE_INDEX_MASK) == 0 )  {
+				group = canERR_PARAM;
+			}
+		}
+	}
+
+	if ( group >= 0 )  {
+		CAN4OSX_GROUP_T *pGroup = &can4osxGroup[group];
+
+		memset(pGroup, 0, sizeof(CAN4OSX_GROUP_T));
+		memcpy(pGroup->member, pHandles, count * sizeof(CanHandle));
+		pGroup->memberCount = count;
+		pGroup->windowNs = windowNs;
+		pGroup->inUse = 1u;
+	}
+
+	pthread_mutex_unlock(&can4osxGroupMutex);
+
+	return(group);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_GetGroup - look up an open group
+*
+* \return pointer to the group, NULL if it is not open
+*/
+CAN4OSX_GROUP_T* CAN4OSX_GetGroup(
+		int group
+	)
+{
+	if ( (group < 0) || (group >= CAN4OSX_MAX_GROUP_COUNT) || !can4osxGroup[group].inUse )  {
+		return(NULL);
+	}
 
-#include <sys/time.h>
+	return(&can4osxGroup[group]);
+}
 
-#include "can4osx_internal.h"
-#include "can4osx_usb_core.h"
-#include "can4osx_debug.h"
 
+/******************************************************************************/
+/**
+* \brief CAN4OSX_CloseGroup - give a group back
+*
+* Heads not read yet are dropped, the rest stays in the member buffers.
+*/
+void CAN4OSX_CloseGroup(
+		CAN4OSX_GROUP_T *pGroup
+	)
+{
+	pthread_mutex_lock(&can4osxGroupMutex);
+	pGroup->inUse = 0u;
+	pGroup->memberCount = 0u;
+	pthread_mutex_unlock(&can4osxGroupMutex);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_GroupNext - find the head to hand out
+*
+* Refills the heads of the members and picks the earliest. pReleaseNs gets
+* the host time it may go out at the latest, UINT64_MAX if there is none.
+* The members are looked up on every call, *pNext gets the first one that
+* was closed or removed.
+*
+* \return 1 if *pNext may be handed out now, canERR_INVHANDLE for a stale
+* member
+*/
+static int CAN4OSX_GroupNext(
+		CAN4OSX_GROUP_T *pGroup,
+		UInt32 *pNext,
+		UInt64 *pReleaseNs
+	)
+{
+UInt32 next = pGroup->memberCount;
+UInt8 complete = 1u;
+UInt32 i;
+
+	for ( i = 0u; i < pGroup->memberCount; i++ )  {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetHandleEntry(pGroup->member[i]);
+
+		if ( pSelf == NULL )  {
+			*pNext = i;
+			*pReleaseNs = UINT64_MAX;
+			return(canERR_INVHANDLE);
+		}
+
+		if ( !pGroup->headValid[i] )  {
+			CAN_EVENT_MSG_BUF_T *bufferRef = pSelf->canEventMsgBuff;
+
+			if ( (bufferRef == NULL) || !CAN4OSX_ReadCanEventBuffer(bufferRef, &pGroup->head[i]) )  {
+				if ( bufferRef != NULL )  {
+					CAN4OSX_ClearCanEventBufferFd(bufferRef);
+				}
+				complete = 0u;
+				continue;
+			}
+			pGroup->headValid[i] = 1u;
+		}
+
+		if ( (next == pGroup->memberCount) ||
+			 (pGroup->head[i].canHostTimestamp < pGroup->head[next].canHostTimestamp) )  {
+			next = i;
+		}
+	}
+
+	if ( next == pGroup->memberCount )  {
+		*pReleaseNs = UINT64_MAX;
+		return(0);
+	}
+
+	*pNext = next;
+	*pReleaseNs = pGroup->head[next].canHostTimestamp + pGroup->windowNs;
+
+	// Only look at the clock if some member is idle
+	if ( complete || (*pReleaseNs <= CAN4OSX_HostNs()) )  {
+		return(1);
+	}
 
-static UInt8 CAN4OSX_TestFullCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef);
-static UInt8 CAN4OSX_TestEmptyCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef);
+	return(0);
+}
 
 
 /******************************************************************************/
-CAN_EVENT_MSG_BUF_T* CAN4OSX_CreateCanEventBuffer(
-		UInt32 bufferSize
+static void CAN4OSX_GroupTake(
+		CAN4OSX_GROUP_T *pGroup,
+		UInt32 next,
+		CanMsg *pMsg,
+		CanHandle *pHandle
 	)
 {
-	CAN_EVENT_MSG_BUF_T* bufferRef = malloc(sizeof(CAN_EVENT_MSG_BUF_T));
-	if ( bufferRef == NULL )  {
-		return(NULL);
+	*pMsg = pGroup->head[next];
+	*pHandle = pGroup->member[next];
+	pGroup->headValid[next] = 0u;
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReadGroup - read the next frame of a group
+*
+* pHandle gets the channel the frame was received on, or the stale member.
+*
+* \return 1 if a frame was read, 0 if none is due yet, canERR_INVHANDLE if a
+* member was closed or removed
+*/
+int CAN4OSX_ReadGroup(
+		CAN4OSX_GROUP_T *pGroup,
+		CanMsg *pMsg,
+		CanHandle *pHandle
+	)
+{
+UInt64 releaseNs;
+UInt32 next;
+int found;
+
+	found = CAN4OSX_GroupNext(pGroup, &next, &releaseNs);
+	if ( found == canERR_INVHANDLE )  {
+		*pHandle = pGroup->member[next];
+	}
+	if ( found != 1 )  {
+		return(found);
 	}
 
-	bufferRef->bufferSize = bufferSize;
-	bufferRef->bufferCount = 0;
-	bufferRef->bufferFirst = 0;
+	CAN4OSX_GroupTake(pGroup, next, pMsg, pHandle);
 
-	bufferRef->canMsgRef = malloc(bufferSize * sizeof(CanMsg));
+	return(1);
+}
 
-	if ( bufferRef->canMsgRef == NULL )  {
-		free(bufferRef);
-		bufferRef = NULL;
-		return(NULL);
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_ReadGroupWait - read the next frame of a group, wait for it
+*
+* Waits up to timeout ms, 0xFFFFFFFF waits forever. Wakes up for every
+* received frame and when the earliest head leaves the reorder window.
+*
+* \return 1 if a frame was read, 0 on timeout, canERR_INVHANDLE if a member
+* was closed or removed, *pHandle gets it
+*/
+int CAN4OSX_ReadGroupWait(
+		CAN4OSX_GROUP_T *pGroup,
+		CanMsg *pMsg,
+		CanHandle *pHandle,
+		UInt32 timeout
+	)
+{
+UInt64 endNs = UINT64_MAX;
+UInt64 releaseNs;
+UInt64 nowNs;
+UInt32 next = 0u;
+int found;
+
+	found = CAN4OSX_ReadGroup(pGroup, pMsg, pHandle);
+	if ( (found != 0) || (timeout == 0u) )  {
+		return(found);
 	}
 
-	bufferRef->bufferGDCqueueRef = dispatch_queue_create("com.can4osx.caneventqueue", 0);
-	if ( bufferRef->bufferGDCqueueRef == NULL )  {
-		CAN4OSX_ReleaseCanEventBuffer(bufferRef);
-		return(NULL);
+	if ( timeout != 0xFFFFFFFFu )  {
+		endNs = CAN4OSX_HostNs() + ((UInt64)timeout * 1000000u);
 	}
 
-	return(bufferRef);
+	pthread_mutex_lock(&can4osxEventMutex);
+	atomic_fetch_add(&can4osxEventWaiters, 1u);
+
+	for (;;)  {
+		// Check after registering, a notifier either sees us or we see its frame
+		found = CAN4OSX_GroupNext(pGroup, &next, &releaseNs);
+		if ( found != 0 )  {
+			break;
+		}
+
+		nowNs = CAN4OSX_HostNs();
+		if ( nowNs >= endNs )  {
+			break;
+		}
+		if ( releaseNs > endNs )  {
+			releaseNs = endNs;
+		}
+
+		(void)CAN4OSX_EventCondWait(releaseNs);
+	}
+
+	atomic_fetch_sub(&can4osxEventWaiters, 1u);
+	pthread_mutex_unlock(&can4osxEventMutex);
+
+	if ( found == 1 )  {
+		CAN4OSX_GroupTake(pGroup, next, pMsg, pHandle);
+	} else if ( found == canERR_INVHANDLE )  {
+		*pHandle = pGroup->member[next];
+	}
+
+	return(found);
 }
 
 
 /******************************************************************************/
-void CAN4OSX_ReleaseCanEventBuffer(
-		CAN_EVENT_MSG_BUF_T* bufferRef
+/* acceptance filter
+ *
+ * The filter is copied on every change and the new copy is published with one
+ * pointer exchange, so the decoder never sees a half updated filter. The old
+ * copy is freed as soon as no decoder is inside CAN4OSX_FilterAccept anymore.
+ */
+
+#define CAN4OSX_FILTER_EMPTY	0xFFFFFFFFu
+#define CAN4OSX_FILTER_STD_MASK	0x7FFu
+#define CAN4OSX_FILTER_EXT_MASK	0x1FFFFFFFu
+
+/* serializes the writers, the decoder does not take it */
+static pthread_mutex_t can4osxFilterMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_FilterHash(
+		UInt32 id
 	)
 {
-	if ( bufferRef != NULL )  {
-		if (bufferRef->bufferGDCqueueRef != NULL)  {
-			dispatch_release(bufferRef->bufferGDCqueueRef);
+	id ^= id >> 16;
+	id *= 0x45d9f3bu;
+	id ^= id >> 16;
+
+	return(id);
+}
+
+
+/******************************************************************************/
+static Boolean CAN4OSX_FilterExtFind(
+		const CAN4OSX_FILTER_T *pFilter,
+		UInt32 id
+	)
+{
+UInt32 mask = pFilter->extSetSize - 1u;
+UInt32 i;
+
+	if ( pFilter->extSetCount == 0u )  {
+		return(false);
+	}
+
+	for ( i = CAN4OSX_FilterHash(id) & mask; pFilter->extSet[i] != CAN4OSX_FILTER_EMPTY; i = (i + 1u) & mask )  {
+		if ( pFilter->extSet[i] == id )  {
+			return(true);
 		}
-		free(bufferRef->canMsgRef);
-		bufferRef->canMsgRef = NULL;
+	}
 
-		free(bufferRef);
-		bufferRef = NULL;
+	return(false);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_FilterExtInsert(
+		CAN4OSX_FILTER_T *pFilter,
+		UInt32 id
+	)
+{
+UInt32 mask = pFilter->extSetSize - 1u;
+UInt32 i;
+
+	for ( i = CAN4OSX_FilterHash(id) & mask; pFilter->extSet[i] != CAN4OSX_FILTER_EMPTY; i = (i + 1u) & mask )  {
+		if ( pFilter->extSet[i] == id )  {
+			return;
+		}
 	}
+
+	pFilter->extSet[i] = id;
+	pFilter->extSetCount++;
 }
 
 
 /******************************************************************************/
-static UInt8 CAN4OSX_TestFullCanEventBuffer(
-		CAN_EVENT_MSG_BUF_T* bufferRef
+static void CAN4OSX_FilterBuildStd(
+		CAN4OSX_FILTER_T *pFilter
 	)
 {
-	if (bufferRef->bufferCount == bufferRef->bufferSize)  {
-		return(1);
+UInt32 id;
+
+	memset(pFilter->stdAccept, 0, sizeof(pFilter->stdAccept));
+
+	for ( id = 0u; id < CAN4OSX_FILTER_STD_IDS; id++ )  {
+		if ( ((id ^ pFilter->stdCode) & pFilter->stdMask) == 0u )  {
+			pFilter->stdAccept[id >> 5] |= (1u << (id & 31u));
+		}
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_FilterFree(
+		CAN4OSX_FILTER_T *pFilter
+	)
+{
+	if ( pFilter != NULL )  {
+		free(pFilter->extSet);
+		free(pFilter);
+	}
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_FilterCopy - private copy of a filter to change
+*
+* pOld NULL gives a filter that accepts everything. The extended set is
+* rebuilt with room for one more id and without skipId.
+*
+* \return the new filter or NULL
+*/
+static CAN4OSX_FILTER_T* CAN4OSX_FilterCopy(
+		const CAN4OSX_FILTER_T *pOld,
+		UInt32 skipId
+	)
+{
+CAN4OSX_FILTER_T *pNew = calloc(1, sizeof(CAN4OSX_FILTER_T));
+UInt32 count = 1u;
+UInt32 i;
+
+	if ( pNew == NULL )  {
+		return(NULL);
+	}
+
+	if ( pOld == NULL )  {
+		CAN4OSX_FilterBuildStd(pNew);
 	} else {
-		return(0);
+		*pNew = *pOld;
+		count += pOld->extSetCount;
+	}
+
+	/* keep the set at most half full */
+	pNew->extSetCount = 0u;
+	pNew->extSetSize = 16u;
+	while ( pNew->extSetSize < (2u * count) )  {
+		pNew->extSetSize <<= 1;
+	}
+
+	pNew->extSet = malloc(pNew->extSetSize * sizeof(UInt32));
+	if ( pNew->extSet == NULL )  {
+		free(pNew);
+		return(NULL);
+	}
+	memset(pNew->extSet, 0xFF, pNew->extSetSize * sizeof(UInt32));
+
+	if ( (pOld != NULL) && (pOld->extSetCount != 0u) )  {
+		for ( i = 0u; i < pOld->extSetSize; i++ )  {
+			if ( (pOld->extSet[i] != CAN4OSX_FILTER_EMPTY) && (pOld->extSet[i] != skipId) )  {
+				CAN4OSX_FilterExtInsert(pNew, pOld->extSet[i]);
+			}
+		}
 	}
+
+	return(pNew);
 }
 
 
 /******************************************************************************/
-static UInt8 CAN4OSX_TestEmptyCanEventBuffer(
-		CAN_EVENT_MSG_BUF_T* bufferRef
+static void CAN4OSX_FilterPublish(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		CAN4OSX_FILTER_T *pNew
 	)
 {
-	if ( bufferRef->bufferCount == 0 )  {
-		return(1);
+CAN4OSX_FILTER_T *pOld = atomic_exchange(&pSelf->acceptFilter, pNew);
+
+	/* a decoder that loaded pOld has already counted itself */
+	while ( atomic_load(&pSelf->acceptFilterReaders) != 0u )  {
+		sched_yield();
+	}
+
+	CAN4OSX_FilterFree(pOld);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_FilterAccept - test a received frame against the filter
+*
+* Called from the decode paths before the frame is converted and buffered.
+*
+* \return true if the frame should be passed on
+*/
+Boolean CAN4OSX_FilterAccept(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		UInt32 id,
+		UInt32 flags
+	)
+{
+CAN4OSX_FILTER_T *pFilter;
+Boolean accept = true;
+
+	/* no filter set, the usual case */
+	if ( atomic_load_explicit(&pSelf->acceptFilter, memory_order_relaxed) == NULL )  {
+		return(true);
+	}
+
+	atomic_fetch_add(&pSelf->acceptFilterReaders, 1u);
+	pFilter = atomic_load(&pSelf->acceptFilter);
+
+	if ( pFilter != NULL )  {
+		if ( flags & canMSG_EXT )  {
+			id &= CAN4OSX_FILTER_EXT_MASK;
+			if ( pFilter->extList )  {
+				accept = CAN4OSX_FilterExtFind(pFilter, id);
+			} else {
+				accept = (((id ^ pFilter->extCode) & pFilter->extMask) == 0u) && !CAN4OSX_FilterExtFind(pFilter, id);
+			}
+		} else {
+			id &= CAN4OSX_FILTER_STD_MASK;
+			accept = (pFilter->stdAccept[id >> 5] & (1u << (id & 31u))) != 0u;
+		}
+	}
+
+	atomic_fetch_sub(&pSelf->acceptFilterReaders, 1u);
+
+	return(accept);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_FilterSetCodeMask - set code and mask of one id type
+*
+* A frame passes if (id & mask) == (code & mask). Ids set with
+* CAN4OSX_FilterSetId for this type are dropped.
+*
+* \return canStatus
+*/
+canStatus CAN4OSX_FilterSetCodeMask(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		UInt32 code,
+		UInt32 mask,
+		int isExtended
+	)
+{
+CAN4OSX_FILTER_T *pNew;
+
+	pthread_mutex_lock(&can4osxFilterMutex);
+
+	pNew = CAN4OSX_FilterCopy(atomic_load(&pSelf->acceptFilter), CAN4OSX_FILTER_EMPTY);
+	if ( pNew == NULL )  {
+		pthread_mutex_unlock(&can4osxFilterMutex);
+		return(canERR_NOMEM);
+	}
+
+	if ( isExtended )  {
+		pNew->extCode = code;
+		pNew->extMask = mask;
+		pNew->extList = false;
+		pNew->extSetCount = 0u;
+		memset(pNew->extSet, 0xFF, pNew->extSetSize * sizeof(UInt32));
 	} else {
-		return(0);
+		pNew->stdCode = code;
+		pNew->stdMask = mask;
+		CAN4OSX_FilterBuildStd(pNew);
 	}
+
+	CAN4OSX_FilterPublish(pSelf, pNew);
+
+	pthread_mutex_unlock(&can4osxFilterMutex);
+
+	return(canOK);
 }
 
 
 /******************************************************************************/
-UInt8 CAN4OSX_WriteCanEventBuffer(
-		CAN_EVENT_MSG_BUF_T* bufferRef,
-		CanMsg newEvent
+void CAN4OSX_FilterGetCodeMask(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		UInt32 *pCode,
+		UInt32 *pMask,
+		int isExtended
+	)
+{
+CAN4OSX_FILTER_T *pFilter;
+
+	pthread_mutex_lock(&can4osxFilterMutex);
+
+	pFilter = atomic_load(&pSelf->acceptFilter);
+	*pCode = 0u;
+	*pMask = 0u;
+	if ( pFilter != NULL )  {
+		*pCode = isExtended ? pFilter->extCode : pFilter->stdCode;
+		*pMask = isExtended ? pFilter->extMask : pFilter->stdMask;
+	}
+
+	pthread_mutex_unlock(&can4osxFilterMutex);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_FilterSetId - accept or reject a single id
+*
+* The first accepted id of a type turns the filter of that type into an id
+* list, only listed ids pass from then on. Rejecting an id removes it from the
+* list, or, without a list, blocks it in addition to code and mask.
+*
+* \return canStatus
+*/
+canStatus CAN4OSX_FilterSetId(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		UInt32 id,
+		int isExtended,
+		Boolean accept
 	)
 {
-__block UInt8 retval = 1;
+CAN4OSX_FILTER_T *pOld;
+CAN4OSX_FILTER_T *pNew;
+
+	if ( (isExtended && (id > CAN4OSX_FILTER_EXT_MASK)) ||
+		 (!isExtended && (id > CAN4OSX_FILTER_STD_MASK)) )  {
+		return(canERR_PARAM);
+	}
+
+	pthread_mutex_lock(&can4osxFilterMutex);
+
+	pOld = atomic_load(&pSelf->acceptFilter);
+	/* an id rejected from the list has to leave the set */
+	if ( isExtended && (pOld != NULL) && pOld->extList && !accept )  {
+		pNew = CAN4OSX_FilterCopy(pOld, id);
+	} else {
+		pNew = CAN4OSX_FilterCopy(pOld, CAN4OSX_FILTER_EMPTY);
+	}
+	if ( pNew == NULL )  {
+		pthread_mutex_unlock(&can4osxFilterMutex);
+		return(canERR_NOMEM);
+	}
 
-	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
-		if (CAN4OSX_TestFullCanEventBuffer(bufferRef))  {
-			retval = 0;
+	if ( isExtended )  {
+		if ( accept && !pNew->extList )  {
+			pNew->extList = true;
+			pNew->extSetCount = 0u;
+			memset(pNew->extSet, 0xFF, pNew->extSetSize * sizeof(UInt32));
+		}
+		if ( accept || !pNew->extList )  {
+			CAN4OSX_FilterExtInsert(pNew, id);
+		}
+	} else {
+		if ( accept )  {
+			/* the list replaces code and mask */
+			if ( (pNew->stdCode != CAN4OSX_FILTER_EMPTY) || (pNew->stdMask != CAN4OSX_FILTER_EMPTY) )  {
+				pNew->stdCode = CAN4OSX_FILTER_EMPTY;
+				pNew->stdMask = CAN4OSX_FILTER_EMPTY;
+				memset(pNew->stdAccept, 0, sizeof(pNew->stdAccept));
+			}
+			pNew->stdAccept[id >> 5] |= (1u << (id & 31u));
 		} else {
-			bufferRef->canMsgRef[(bufferRef->bufferFirst + bufferRef->bufferCount++) % bufferRef->bufferSize] = newEvent;
+			pNew->stdAccept[id >> 5] &= ~(1u << (id & 31u));
 		}
-	});
+	}
 
-	return(retval);
+	CAN4OSX_FilterPublish(pSelf, pNew);
+
+	pthread_mutex_unlock(&can4osxFilterMutex);
+
+	return(canOK);
 }
 
 
 /******************************************************************************/
-UInt8 CAN4OSX_ReadCanEventBuffer(
-		CAN_EVENT_MSG_BUF_T* bufferRef,
-		CanMsg* readEvent
+/**
+* \brief CAN4OSX_FilterRejectsAll - test if no id of a type can pass
+*
+* Used by devices that can only switch a frame type off as a whole.
+*
+* \return true if every frame of the type is dropped
+*/
+Boolean CAN4OSX_FilterRejectsAll(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		int isExtended
 	)
 {
-__block UInt8 retval = 1;
+CAN4OSX_FILTER_T *pFilter;
+Boolean rejectsAll = false;
+UInt32 i;
 
-	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
-		if (CAN4OSX_TestEmptyCanEventBuffer(bufferRef))  {
-			retval = 0;
+	pthread_mutex_lock(&can4osxFilterMutex);
+
+	pFilter = atomic_load(&pSelf->acceptFilter);
+	if ( pFilter != NULL )  {
+		if ( isExtended )  {
+			if ( pFilter->extList )  {
+				rejectsAll = (pFilter->extSetCount == 0u);
+			} else {
+				/* a code bit outside of the id range can never match */
+				rejectsAll = ((pFilter->extCode & pFilter->extMask & ~CAN4OSX_FILTER_EXT_MASK) != 0u);
+			}
 		} else {
-			bufferRef->bufferCount--;
-			*readEvent = bufferRef->canMsgRef[bufferRef->bufferFirst++ % bufferRef->bufferSize];
+			rejectsAll = true;
+			for ( i = 0u; i < (CAN4OSX_FILTER_STD_IDS / 32u); i++ )  {
+				if ( pFilter->stdAccept[i] != 0u )  {
+					rejectsAll = false;
+					break;
+				}
+			}
 		}
+	}
 
-	});
+	pthread_mutex_unlock(&can4osxFilterMutex);
 
-	return(retval);
+	return(rejectsAll);
+}
 
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_FilterRelease - remove the filter, everything passes again
+*/
+void CAN4OSX_FilterRelease(
+		Can4osxUsbDeviceHandleEntry* pSelf
+	)
+{
+	pthread_mutex_lock(&can4osxFilterMutex);
+	CAN4OSX_FilterPublish(pSelf, NULL);
+	pthread_mutex_unlock(&can4osxFilterMutex);
 }
 
 
@@ -274,7 +2425,9 @@ UInt8 CAN4OSX_encodeFdDlc(
 
 /******************************************************************************/
 /**
-* \brief OSX_getMilliseconds - get the actual milliseconds
+* \brief OSX_getMilliseconds - get the milliseconds of the monotonic host clock
+*
+* Follows the virtual time, see CAN4OSX_ClockSetVirtual.
 *
 * \return milliseconds
 */
@@ -282,9 +2435,7 @@ UInt64 CAN$OSX_getMilliseconds(
 		void
 	)
 {
-struct timeval time;
-
-	gettimeofday(&time, NULL);
-	return(time.tv_sec * 1000) + (time.tv_usec / 1000);
+	// Used for timeouts, must not jump with the wall clock
+	return(CAN4OSX_HostNs() / 1000000u);
 }
 
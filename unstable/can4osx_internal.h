@@ -46,12 +46,17 @@
 #define CAN4OSX_INTERN_H 1
 
 #include <stdio.h>
+#include <stdatomic.h>
 
+#include <dispatch/dispatch.h>
+
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOMessage.h>
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/usb/IOUSBLib.h>
+#endif
 
 #include "can4osx.h"
 
@@ -59,7 +64,40 @@
 /* internal buffers */
 #define CAN4OSX_CAN_MAX_MSG_LEN 64
 
+/* keeps data of the producer and the consumer on separate cache lines */
+#define CAN4OSX_CACHE_LINE_SIZE 64
+
+#ifdef __APPLE__
 #define CAN4OSX_USB_INTERFACE IOUSBInterfaceInterface182
+#else
+/* endpoints of the interface libusb opened, the pipes are numbered from 1 */
+#define CAN4OSX_USB_MAX_PIPES 16u
+#endif
+
+/* default depth of the receive and transmit buffers in frames */
+#ifndef CAN4OSX_RX_QUEUE_SIZE
+#define CAN4OSX_RX_QUEUE_SIZE 1024u
+#endif
+#ifndef CAN4OSX_TX_QUEUE_SIZE
+#define CAN4OSX_TX_QUEUE_SIZE 1024u
+#endif
+/* largest depth canSetQueueSize accepts */
+#define CAN4OSX_QUEUE_SIZE_MAX (1u << 20)
+
+/* number of bulk-in reads kept in flight per device */
+#ifndef CAN4OSX_USB_BULKIN_BUFFER_COUNT
+#define CAN4OSX_USB_BULKIN_BUFFER_COUNT 4u
+#endif
+
+/* number of bulk-out transfers kept in flight per device */
+#ifndef CAN4OSX_USB_BULKOUT_BUFFER_COUNT
+#define CAN4OSX_USB_BULKOUT_BUFFER_COUNT 3u
+#endif
+
+/* states of the bulk-out pipe */
+#define CAN4OSX_BULKOUT_IDLE    0u  /* nobody fills the pipe */
+#define CAN4OSX_BULKOUT_BUSY    1u  /* one thread fills and submits buffers */
+#define CAN4OSX_BULKOUT_RERUN   2u  /* new data arrived while busy, fill again */
 
 /* Structure for CAN_CHIP_STATE */
 #define CHIPSTAT_BUSOFF              0x01
@@ -77,14 +115,63 @@ typedef struct{
 }CAN4OSX_DEV_ENTRY_T;
 
 typedef struct {
-    UInt32 canTimestamp;
+    UInt64 canTimestamp;    /* nanoseconds */
+    UInt64 canHostTimestamp;/* CAN4OSX_HostNs domain */
     UInt32 canId;
-    UInt32  canFlags;
+    UInt32 canFlags;
     UInt8  canDlc;
     UInt8  canChannel;
     UInt8  padding;
     UInt8  canData[CAN4OSX_CAN_MAX_MSG_LEN];
-} __attribute__ ((packed)) CanMsg;
+} CanMsg;
+
+/* the 32 bit time of canRead and CanFrame, microseconds */
+#define CAN4OSX_TIME_US(ns) ((UInt32)((ns) / 1000u))
+
+/* widens the free running timer of a device to 64 bit, only used by the
+   driver thread, see CAN4OSX_TimeBaseNs */
+typedef struct {
+    UInt64 timerMask;       /* 2^bits - 1 of the device timer */
+    UInt64 timerLast;       /* last raw value */
+    UInt64 timerWraps;      /* wraps seen so far */
+    UInt32 timerFreq;       /* ticks per second */
+} CAN4OSX_TIME_BASE_T;
+
+/* running fit of the host clock over the device time of a channel, only used
+   by the driver thread, see CAN4OSX_ClockSyncNs */
+#define CAN4OSX_CLOCK_SYNC_POINTS   16u
+#define CAN4OSX_CLOCK_SYNC_INTERVAL 1000000000ull   /* host ns per point */
+#define CAN4OSX_CLOCK_SYNC_RESET    100000000ll     /* off the fit by more, start over */
+
+typedef struct {
+    /* host = dev + fitOffset + fitDrift * (dev - fitBase) */
+    UInt64 fitBase;
+    SInt64 fitOffset;
+    double fitDrift;
+    UInt64 fitError;        /* largest distance of a point to the fit */
+    /* the transfer latency only adds to host - dev, the smallest offset of
+       an interval is the one closest to the truth */
+    UInt64 intervalEnd;
+    UInt64 intervalDev;
+    SInt64 intervalOffset;
+    UInt8  intervalValid;
+    /* the points of the fit */
+    UInt64 pointDev[CAN4OSX_CLOCK_SYNC_POINTS];
+    SInt64 pointOffset[CAN4OSX_CLOCK_SYNC_POINTS];
+    UInt32 pointCount;
+    UInt32 pointNext;
+} CAN4OSX_CLOCK_SYNC_T;
+
+/* a frame as stored in the receive ring, only canDlc data bytes follow the
+   header and the record is padded to CAN4OSX_RX_RECORD_ALIGN. canReadPeek
+   hands them out as CanRxFrame, canDlc CAN4OSX_RX_RECORD_PAD skips to the
+   ring start and is never seen by the user */
+typedef CanRxFrame CAN4OSX_RX_RECORD_T;
+
+#define CAN4OSX_RX_RECORD_ALIGN 8u
+#define CAN4OSX_RX_RECORD_PAD   0xFFu
+#define CAN4OSX_RX_RECORD_SIZE(dlc) \
+	((sizeof(CAN4OSX_RX_RECORD_T) + (dlc) + CAN4OSX_RX_RECORD_ALIGN - 1u) & ~(CAN4OSX_RX_RECORD_ALIGN - 1u))
 
 typedef struct {
     UInt8 chipBusStatus;
@@ -97,15 +184,71 @@ typedef union {
     ChipState chipState;
 } EventTagData;
 
-/* holds the actual buffer */
+/* holds the actual buffer, a lock free single producer/single consumer ring
+   of CAN4OSX_RX_RECORD_T, head and tail are byte offsets */
 typedef struct {
-	int bufferSize;
-	int bufferFirst;
-	int bufferCount;
-    dispatch_queue_t bufferGDCqueueRef;
-	CanMsg *canMsgRef;
+    /* constant after creation, bufferSize is the size in bytes, a power of two */
+    UInt32 bufferSize;
+    UInt32 bufferMask;
+    UInt8 *bufferRef;
+    /* canOVERRUN_DROP_OLDEST, only changed on the producer thread while no
+       reader is active */
+    UInt8 dropOldest;
+    /* written by the producer (USB run loop) only */
+    _Atomic UInt32 bufferHead __attribute__ ((aligned(CAN4OSX_CACHE_LINE_SIZE)));
+    _Atomic UInt32 framesIn;
+    UInt32 bufferTailCache;
+    /* head after the record of the last CAN4OSX_ReserveCanEventBuffer */
+    UInt32 bufferHeadReserved;
+    /* frames lost because the ring was full and the part of them the producer
+       took back from the consumer side with dropOldest */
+    _Atomic UInt32 framesDropped;
+    _Atomic UInt32 framesEvicted;
+    /* canMSGERR_xxx_OVERRUN bits for the next stored frame */
+    UInt32 overrunPending;
+    /* written by the consumer (reading thread) only, with dropOldest the
+       producer may advance bufferTail too, see CAN4OSX_EvictCanEventBuffer */
+    _Atomic UInt32 bufferTail __attribute__ ((aligned(CAN4OSX_CACHE_LINE_SIZE)));
+    _Atomic UInt32 framesOut;
+    UInt32 bufferHeadCache;
+    /* tail last published by the consumer, differs from bufferTail after
+       the producer evicted frames */
+    UInt32 bufferTailOwn;
+    /* most frames the reader found waiting, canGetQueueStatistics */
+    UInt32 framesHighWater;
+    /* a reader blocked in CAN4OSX_ReadCanEventBufferWait, the producer only
+       signals readSema while this is not zero */
+    _Atomic UInt32 readWaiters;
+    dispatch_semaphore_t readSema;
+    /* counted up when the handle is closed or its device removed, the
+       waiting readers give up, see CAN4OSX_CancelCanEventBufferWait */
+    _Atomic UInt32 readCancel;
+    /* pollable descriptor, eventFdWrite is -1 until canGetEventFd is called.
+       eventFdSignalled is set by the producer when it makes the fd readable
+       and cleared by the consumer once it found the ring empty */
+    int eventFdRead;
+    _Atomic int eventFdWrite;
+    _Atomic UInt32 eventFdSignalled;
 } CAN_EVENT_MSG_BUF_T;
 
+/* acceptance filter of a handle, never changed once published */
+#define CAN4OSX_FILTER_STD_IDS 2048u
+
+typedef struct {
+    UInt32 stdCode;
+    UInt32 stdMask;
+    /* one bit per standard id, built from code/mask or the canFILTER_ACCEPT list */
+    UInt32 stdAccept[CAN4OSX_FILTER_STD_IDS / 32u];
+    UInt32 extCode;
+    UInt32 extMask;
+    /* extList false: extSet holds rejected ids, true: extSet holds the only
+       accepted ids. Open addressing, extSetSize is a power of two */
+    Boolean extList;
+    UInt32 extSetCount;
+    UInt32 extSetSize;
+    UInt32 *extSet;
+} CAN4OSX_FILTER_T;
+
 typedef struct {
     canStatus (*can4osxhwInitRef) (const CanHandle hnd);
     CanHandle (*can4osxhwCanOpenChannel)(int channel, int flags);
@@ -114,14 +257,50 @@ typedef struct {
     canStatus (*can4osxhwCanSetBusParamsRef) (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
     canStatus (*can4osxhwCanSetBusParamsFdRef) (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
     canStatus (*can4osxhwCanWriteRef) (const CanHandle hnd,UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
+    canStatus (*can4osxhwCanWriteBatchRef) (const CanHandle hnd, const CanFrame *frames, UInt32 count, UInt32 *sent);
     canStatus (*can4osxhwCanReadRef) (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
     canStatus (*can4osxhwCanCloseRef) (const CanHandle hnd);
+    /* optional, called after the host filter changed to move it to the device */
+    canStatus (*can4osxhwCanSetAcceptanceFilterRef) (const CanHandle hnd);
+    /* optional, resize the transmit buffer to frames (a power of two) and
+       read its size and high-water mark */
+    canStatus (*can4osxhwCanSetTxQueueSizeRef) (const CanHandle hnd, UInt32 frames);
+    void (*can4osxhwCanGetTxQueueStatRef) (const CanHandle hnd, UInt32 *pSize, UInt32 *pHighWater);
+    /* optional, runs block while no producer of the receive ring runs. NULL
+       runs it on the driver thread, where the USB decoders are the producers */
+    void (*can4osxhwRunExclusiveRef) (const CanHandle hnd, dispatch_block_t block);
 }CAN4OSX_HW_FUNC_T;
 
 typedef struct {
-   void (*bulkReadCompletion)(void *refCon, IOReturn result, void *arg0);
+   /* decodes the data of one completed bulk-in transfer */
+   void (*bulkInDecode)(void *refCon, const UInt8 *pBuffer, UInt32 size);
+   /* fills one bulk-out buffer, returns the number of bytes to send or 0 */
+   UInt16 (*bulkOutFill)(void *refCon, UInt8 *pBuffer, UInt16 maxSize);
 } CAN4OSX_USB_FUNC_T;
 
+struct Can4osxUsbDeviceHandleEntry;
+
+/* how the USB transfers of a device reach it, the device codecs only use
+   these through the CAN4OSX_usbXxx functions. The asynchronous submits end
+   in CAN4OSX_usbBulkInDone and CAN4OSX_usbBulkOutDone, called in order on
+   the driver thread */
+typedef struct {
+    canStatus (*bulkInSubmit) (struct Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pBuffer, UInt32 size);
+    canStatus (*bulkOutSubmit) (struct Can4osxUsbDeviceHandleEntry *pSelf, const UInt8 *pBuffer, UInt32 size);
+    /* synchronous, for the command exchange while the device is set up */
+    canStatus (*bulkInRead) (struct Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pBuffer, UInt32 *pSize);
+    canStatus (*bulkOutWrite) (struct Can4osxUsbDeviceHandleEntry *pSelf, const UInt8 *pBuffer, UInt32 size);
+    /* vendor request on the default pipe, in or out by the direction bit of requestType */
+    canStatus (*controlRequest) (struct Can4osxUsbDeviceHandleEntry *pSelf, UInt8 requestType, UInt8 request,
+                                 UInt16 value, UInt16 index, void *pData, UInt16 length, UInt16 *pDone);
+    /* a transfer failed, the device is gone */
+    void (*close) (struct Can4osxUsbDeviceHandleEntry *pSelf);
+} CAN4OSX_USB_TRANSPORT_T;
+
+/* requestType of controlRequest, like USBmakebmRequestType(dir, kUSBVendor, kUSBDevice) */
+#define CAN4OSX_USB_VENDOR_OUT  0x40u
+#define CAN4OSX_USB_VENDOR_IN   0xC0u
+
 
 typedef struct {
     UInt8 rxErrorCounter;
@@ -136,10 +315,21 @@ typedef struct {
 } CAN4OSX_DEV_INFO_T;
 
 
-typedef struct {
+typedef struct Can4osxUsbDeviceHandleEntry {
+#ifdef __APPLE__
 	IOUSBDeviceInterface182 **can4osxDeviceInterface;
     CAN4OSX_USB_INTERFACE **can4osxInterfaceInterface;
+    /* set by the first close of the interface, shared by the copies */
+    _Atomic Boolean *can4osxInterfaceClosed;
     io_object_t				can4osxNotification;
+#else
+    struct libusb_device_handle *can4osxDeviceHandle;
+    // endpoint address of each pipe, endpointNumberBulkIn/Out index this
+    UInt8 usbPipeAddress[CAN4OSX_USB_MAX_PIPES + 1u];
+#endif
+    const CAN4OSX_USB_TRANSPORT_T *usbTransport;
+    /* state of the transport for this channel, not taken over by the copies */
+    void * _Atomic usbTransportChannel;
     
     CAN_EVENT_MSG_BUF_T* canEventMsgBuff;
     
@@ -147,17 +337,27 @@ typedef struct {
     
     int deviceChannelCount;
     int deviceChannel;
-    // virtual channel number
+    // virtual channel number, -1 once the device is gone
     int channelNumber;
-    // BulkIn info/pointer
+    // slot in the channel table, kept after the device is gone
+    UInt32 channelIndex;
+    // goes up with canClose and the removal, see CAN4OSX_HANDLE
+    _Atomic UInt32 generation;
+    // BulkIn info/pointer, endpointBulkInCount buffers of endpointMaxSizeBulkIn
     int endpointMaxSizeBulkIn;
     int endpointNumberBulkIn;
     char* endpointBufferBulkInRef;
-    // BulkOut info/pointer
+    UInt32 endpointBulkInCount;
+    UInt32 endpointBulkInNext;
+    UInt32 endpointBulkInPending;
+    // BulkOut info/pointer, endpointBulkOutCount buffers of endpointMaxSizeBulkOut
     int endpointMaxSizeBulkOut;
     int endpointNumberBulkOut;
     UInt8* endpointBufferBulkOutRef;
-    bool endpoitBulkOutBusy;
+    UInt32 endpointBulkOutCount;
+    UInt32 endpointBulkOutNext;
+    _Atomic UInt32 endpointBulkOutInFlight;
+    _Atomic UInt32 endpointBulkOutState;
     
     void *privateData; //Here every instace can save private stuff
     
@@ -165,23 +365,144 @@ typedef struct {
     CAN4OSX_DEV_INFO_T	devInfo;
     CAN4OSX_HW_FUNC_T	hwFunctions;
     CAN4OSX_USB_FUNC_T	usbFunctions;
+    CanUsbStatistics	usbStatistics;
+    
+    /* canNOTIFY_TX and canNOTIFY_STATUS events not yet seen by canWaitForEvent */
+    _Atomic UInt32	eventFlags;
+    
+    /* notification callback, the pending values collect the events of the
+       current USB transfer and are only touched by the driver thread */
+    CanNotifyCallback	notifyCallback;
+    void				*notifyContext;
+    UInt32				notifyFlags;
+    UInt32				notifyPendingFlags;
+    UInt32				notifyPendingFrames;
+    
+    /* NULL accepts everything, acceptFilterReaders counts decoders using it */
+    CAN4OSX_FILTER_T * _Atomic	acceptFilter;
+    _Atomic UInt32	acceptFilterReaders;
+    
+    /* overruns reported by the device, counted by the driver thread. The seen
+       values are what canReadStatus compares with, taken at canBusOn */
+    _Atomic UInt32	rxHwOverruns;
+    UInt32	rxHwOverrunsSeen;
+    UInt32	rxSwOverrunsSeen;
+    
+    /* device timer of the received frames, set up by the backend init */
+    CAN4OSX_TIME_BASE_T	timeBase;
+    CAN4OSX_CLOCK_SYNC_T	clockSync;
+    /* the tick rate of the device timer is not known, the frames carry the
+       host time of their transfer and canReadNs, canGetClockSync refuse */
+    Boolean	deviceTimeUnknown;
+    
+    /* the device of the slot is gone, the slot waits on the free list;
+       a replaced entry is kept on the retired list through pNextFree */
+    Boolean	slotFree;
+    struct Can4osxUsbDeviceHandleEntry *pNextFree;
 }Can4osxUsbDeviceHandleEntry;
 
 
 
-extern Can4osxUsbDeviceHandleEntry can4osxUsbDeviceHandle[CAN4OSX_MAX_CHANNEL_COUNT];
+/* The channel table, it grows by chunks of CAN4OSX_TABLE_CHUNK slots as the
+   devices come. Chunks and entries are allocated on the first use and never
+   go away, the lookup needs no lock. The channels of a device have
+   consecutive slots, the slots of a removed device are used again for the
+   next one. Only the driver thread changes the table. */
+#define CAN4OSX_TABLE_CHUNK_BITS    6
+#define CAN4OSX_TABLE_CHUNK         (1u << CAN4OSX_TABLE_CHUNK_BITS)
+
+extern Can4osxUsbDeviceHandleEntry **can4osxUsbDeviceHandle[CAN4OSX_MAX_CHANNEL_COUNT / CAN4OSX_TABLE_CHUNK];
+
+/* A handle is the slot of the channel with its generation above it, a handle
+   of an earlier generation is stale. The backends get checked handles or
+   slot numbers, CAN4OSX_CHANNEL takes both. */
+#define CAN4OSX_HANDLE_INDEX_BITS   12
+#define CAN4OSX_HANDLE_INDEX_MASK   ((1 << CAN4OSX_HANDLE_INDEX_BITS) - 1)
+#define CAN4OSX_HANDLE_GEN_MASK     0x7FFFFu
+
+#define CAN4OSX_CHANNEL(hnd)    (can4osxUsbDeviceHandle[((hnd) & CAN4OSX_HANDLE_INDEX_MASK) >> CAN4OSX_TABLE_CHUNK_BITS] \
+                                                       [(hnd) & (CAN4OSX_TABLE_CHUNK - 1u)])
+#define CAN4OSX_HANDLE(pEntry)  ((CanHandle)(((atomic_load(&(pEntry)->generation) & CAN4OSX_HANDLE_GEN_MASK) << CAN4OSX_HANDLE_INDEX_BITS) | \
+                                             (pEntry)->channelIndex))
+
+#define CAN4OSX_MAX_GROUP_COUNT     16
+#define CAN4OSX_MAX_GROUP_MEMBERS   64
+
+/* channels read as one stream ordered by canHostTimestamp, see canOpenGroup.
+   Only the reading thread touches a group once it is open */
+typedef struct {
+    UInt8     inUse;
+    UInt32    memberCount;
+    UInt64    windowNs;         /* how long a frame waits for earlier ones */
+    CanHandle member[CAN4OSX_MAX_GROUP_MEMBERS];
+    /* the next frame of every member, already taken out of its buffer */
+    CanMsg    head[CAN4OSX_MAX_GROUP_MEMBERS];
+    UInt8     headValid[CAN4OSX_MAX_GROUP_MEMBERS];
+} CAN4OSX_GROUP_T;
 
 
 CAN_EVENT_MSG_BUF_T* CAN4OSX_CreateCanEventBuffer( UInt32 bufferSize );
 void CAN4OSX_ReleaseCanEventBuffer( CAN_EVENT_MSG_BUF_T* bufferRef );
-UInt8 CAN4OSX_WriteCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, CanMsg newEvent);
+CAN4OSX_RX_RECORD_T* CAN4OSX_ReserveCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, UInt8 canDlc);
+void CAN4OSX_CommitCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, CAN4OSX_RX_RECORD_T *pRecord);
+UInt8 CAN4OSX_WriteCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, const CanMsg *pEvent);
 UInt8 CAN4OSX_ReadCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, CanMsg* readEvent);
+UInt8 CAN4OSX_ReadCanEventBufferWait(CAN_EVENT_MSG_BUF_T* bufferRef, CanMsg* readEvent, UInt32 timeout);
+void CAN4OSX_CancelCanEventBufferWait(CAN_EVENT_MSG_BUF_T* bufferRef);
+UInt32 CAN4OSX_ReadCanEventBufferBatch(CAN_EVENT_MSG_BUF_T* bufferRef, CanFrame* pFrames, UInt32 maxFrames);
+UInt32 CAN4OSX_PeekCanEventBufferRun(CAN_EVENT_MSG_BUF_T* bufferRef, const CAN4OSX_RX_RECORD_T **ppRecord);
+UInt32 CAN4OSX_ReleaseCanEventBufferRun(CAN_EVENT_MSG_BUF_T* bufferRef, UInt32 frames);
+UInt32 CAN4OSX_CanEventBufferCount(CAN_EVENT_MSG_BUF_T* bufferRef);
+UInt32 CAN4OSX_CanEventBufferFrames(CAN_EVENT_MSG_BUF_T* bufferRef);
+UInt32 CAN4OSX_CanEventBufferDropped(CAN_EVENT_MSG_BUF_T* bufferRef);
+void CAN4OSX_CountHwOverrun(Can4osxUsbDeviceHandleEntry *pSelf);
+
+UInt64 CAN4OSX_TicksToNs(UInt64 ticks, UInt32 freq);
+void CAN4OSX_InitTimeBase(CAN4OSX_TIME_BASE_T *pTimeBase, UInt32 bits, UInt32 freq);
+UInt64 CAN4OSX_TimeBaseNs(CAN4OSX_TIME_BASE_T *pTimeBase, UInt64 ticks);
+void CAN4OSX_TimeBaseWrapped(CAN4OSX_TIME_BASE_T *pTimeBase, UInt32 wraps);
+
+UInt64 CAN4OSX_HostNs(void);
+void CAN4OSX_ClockSetVirtual(Boolean enable);
+void CAN4OSX_ClockAdvance(UInt64 ns);
+long CAN4OSX_SemaphoreWait(dispatch_semaphore_t sema, UInt64 timeoutNs);
+void CAN4OSX_ClockSyncTransfer(void);
+UInt64 CAN4OSX_ClockSyncTransferNs(void);
+UInt64 CAN4OSX_ClockSyncNs(CAN4OSX_CLOCK_SYNC_T *pSync, UInt64 deviceNs);
+void CAN4OSX_MoveCanEventBuffer(CAN_EVENT_MSG_BUF_T* newRef, CAN_EVENT_MSG_BUF_T* oldRef);
+int CAN4OSX_GetCanEventBufferFd(CAN_EVENT_MSG_BUF_T* bufferRef);
+void CAN4OSX_ClearCanEventBufferFd(CAN_EVENT_MSG_BUF_T* bufferRef);
+
+/* event readiness for canWaitForEvent */
+void CAN4OSX_NotifyEvent(Can4osxUsbDeviceHandleEntry* pSelf, UInt32 flags);
+void CAN4OSX_FlushNotify(Can4osxUsbDeviceHandleEntry* pSelf);
+void CAN4OSX_WakeWaiters(Can4osxUsbDeviceHandleEntry* pSelf);
+int CAN4OSX_WaitForEvent(const CanHandle *pHandles, UInt32 count, UInt32 *pReadyFlags, UInt32 timeout);
+
+/* channel groups, merge the members by host time */
+int CAN4OSX_OpenGroup(const CanHandle *pHandles, UInt32 count, UInt64 windowNs);
+CAN4OSX_GROUP_T* CAN4OSX_GetGroup(int group);
+void CAN4OSX_CloseGroup(CAN4OSX_GROUP_T *pGroup);
+int CAN4OSX_ReadGroup(CAN4OSX_GROUP_T *pGroup, CanMsg *pMsg, CanHandle *pHandle);
+int CAN4OSX_ReadGroupWait(CAN4OSX_GROUP_T *pGroup, CanMsg *pMsg, CanHandle *pHandle, UInt32 timeout);
+
+/* acceptance filter, the decoders call CAN4OSX_FilterAccept for every received frame */
+Boolean CAN4OSX_FilterAccept(Can4osxUsbDeviceHandleEntry* pSelf, UInt32 id, UInt32 flags);
+canStatus CAN4OSX_FilterSetCodeMask(Can4osxUsbDeviceHandleEntry* pSelf, UInt32 code, UInt32 mask, int isExtended);
+void CAN4OSX_FilterGetCodeMask(Can4osxUsbDeviceHandleEntry* pSelf, UInt32 *pCode, UInt32 *pMask, int isExtended);
+canStatus CAN4OSX_FilterSetId(Can4osxUsbDeviceHandleEntry* pSelf, UInt32 id, int isExtended, Boolean accept);
+Boolean CAN4OSX_FilterRejectsAll(Can4osxUsbDeviceHandleEntry* pSelf, int isExtended);
+void CAN4OSX_FilterRelease(Can4osxUsbDeviceHandleEntry* pSelf);
 
 /* helper functions for all devices */
 UInt8 CAN4OSX_decodeFdDlc(UInt8 dlc);
 UInt8 CAN4OSX_encodeFdDlc(UInt8 dlc);
 UInt64 CAN$OSX_getMilliseconds(void);
 
+/* the channel table */
+UInt32 CAN4OSX_ChannelCount(void);
+Can4osxUsbDeviceHandleEntry* CAN4OSX_GetHandleEntry(const CanHandle hnd);
+
 canStatus CAN4OSX_GetChannelData(Can4osxUsbDeviceHandleEntry* pSelf, SInt32 cmd, void* pBuffer, size_t bufsize);
 
 
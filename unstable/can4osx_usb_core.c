@@ -44,19 +44,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <string.h>
 
 #include <sys/time.h>
 
 #include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
 #include "can4osx_debug.h"
 
 
+// Only used by the driver thread, see CAN4OSX_usbSetBulkInTap
+static CAN4OSX_USB_BULKIN_TAP_T can4osxBulkInTap = NULL;
+static void *can4osxBulkInTapCtx = NULL;
 
 
 /******************************************************************************/
@@ -66,45 +65,310 @@ canStatus CAN4OSX_usbSendCommand(
 		size_t cmdLen
 	)
 {
-IOReturn retVal = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **ppInterface = pSelf->can4osxInterfaceInterface;
+canStatus retVal;
 
-	if( pSelf->endpoitBulkOutBusy == FALSE )  {
-		pSelf->endpoitBulkOutBusy = TRUE;
+	// The command is written from pCmd, the bulk-out buffers are not touched
+	retVal = pSelf->usbTransport->bulkOutWrite(pSelf, (const UInt8 *)pCmd, (UInt32)cmdLen);
 
-		retVal = (*ppInterface)->WritePipe(ppInterface,
-										 pSelf->endpointNumberBulkOut,
-										 pCmd, (UInt32)cmdLen);
+	if (retVal != canOK)  {
+		CAN4OSX_DEBUG_PRINT("Unable to perform synchronous bulk write (%d)\n", retVal);
+		pSelf->usbTransport->close(pSelf);
+	    return(canERR_INTERNAL);
+	}
+	return(canOK);
+}
 
-		if (retVal != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("Unable to perform synchronous bulk write (%08x)\n", retVal);
-			(void)(*ppInterface)->USBInterfaceClose(ppInterface);
-			(void)(*ppInterface)->Release(ppInterface);
-		}
 
-		pSelf->endpoitBulkOutBusy = FALSE;
-	} else {
-		retVal = kIOReturnError;
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReceiveCommand - read one transfer from the bulk-in pipe
+ *
+ * Synchronous, only for the command exchange before the reads are queued.
+ * pSize has the size of pCmd and gets the number of bytes read.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_usbReceiveCommand(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		void *pCmd,
+		UInt32 *pSize
+	)
+{
+	return(pSelf->usbTransport->bulkInRead(pSelf, (UInt8 *)pCmd, pSize));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbControlRequest - vendor request on the default pipe
+ *
+ * requestType is CAN4OSX_USB_VENDOR_OUT or CAN4OSX_USB_VENDOR_IN. pDone gets
+ * the number of bytes transferred, it may be NULL.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_usbControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt8 requestType,
+		UInt8 request,
+		UInt16 value,
+		UInt16 index,
+		void *pData,
+		UInt16 length,
+		UInt16 *pDone
+	)
+{
+UInt16 done = 0u;
+canStatus retVal;
+
+	retVal = pSelf->usbTransport->controlRequest(pSelf, requestType, request, value, index, pData, length, &done);
+
+	if ( pDone != NULL )  {
+		*pDone = done;
 	}
 
-	if (retVal != kIOReturnSuccess)  {
-	    return(canERR_INTERNAL);
+	return(retVal);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbCreateEndpointBuffer - allocate the endpoint buffers
+ *
+ * The bulk-in side gets CAN4OSX_USB_BULKIN_BUFFER_COUNT buffers in one block,
+ * so several reads can be queued on the endpoint at the same time.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_usbCreateEndpointBuffer(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+	pSelf->endpointBulkInCount = CAN4OSX_USB_BULKIN_BUFFER_COUNT;
+	pSelf->endpointBulkInNext = 0u;
+	pSelf->endpointBulkInPending = 0u;
+	memset(&pSelf->usbStatistics, 0, sizeof(pSelf->usbStatistics));
+	pSelf->usbStatistics.bulkInBuffers = pSelf->endpointBulkInCount;
+
+	pSelf->endpointBufferBulkInRef = calloc( pSelf->endpointBulkInCount , pSelf->endpointMaxSizeBulkIn);
+
+	pSelf->endpointBulkOutCount = CAN4OSX_USB_BULKOUT_BUFFER_COUNT;
+	pSelf->endpointBulkOutNext = 0u;
+	atomic_init(&pSelf->endpointBulkOutInFlight, 0u);
+	atomic_init(&pSelf->endpointBulkOutState, CAN4OSX_BULKOUT_IDLE);
+
+	pSelf->endpointBufferBulkOutRef = calloc( pSelf->endpointBulkOutCount , pSelf->endpointMaxSizeBulkOut);
+
+	if ( (pSelf->endpointBufferBulkInRef == NULL) || (pSelf->endpointBufferBulkOutRef == NULL) )  {
+		CAN4OSX_usbReleaseEndpointBuffer(pSelf);
+		return(canERR_NOMEM);
 	}
+
 	return(canOK);
 }
 
 
 /******************************************************************************/
+void CAN4OSX_usbReleaseEndpointBuffer(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+	if(pSelf->endpointBufferBulkInRef)  {
+		free(pSelf->endpointBufferBulkInRef);
+		pSelf->endpointBufferBulkInRef = NULL;
+	}
+
+	if(pSelf->endpointBufferBulkOutRef)  {
+		free(pSelf->endpointBufferBulkOutRef);
+		pSelf->endpointBufferBulkOutRef = NULL;
+	}
+
+	pSelf->endpointBulkInCount = 0u;
+	pSelf->endpointBulkOutCount = 0u;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbBulkOutDone - a bulk-out transfer finished
+ *
+ * Called by the transport for every bulkOutSubmit.
+ */
+void CAN4OSX_usbBulkOutDone(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		canStatus result
+	)
+{
+	atomic_fetch_sub_explicit(&pSelf->endpointBulkOutInFlight, 1u, memory_order_release);
+
+	if (result != canOK)  {
+		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%d)\n", result);
+		pSelf->usbTransport->close(pSelf);
+		return;
+	}
+
+	// The frames left the host, there is room in the transmit buffer again
+	CAN4OSX_NotifyEvent(pSelf, canNOTIFY_TX);
+	CAN4OSX_FlushNotify(pSelf);
+
+	CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbWriteToBulkOutPipe - start sending queued data
+ *
+ * Called by the writers after they queued data and by the write completion.
+ * The first caller moves the pipe from idle to busy and keeps filling free
+ * buffers with the devices bulkOutFill function until either all buffers are
+ * in flight or nothing is left. A caller that finds the pipe busy only sets
+ * it to rerun, the owner then does another pass before it goes idle.
+ */
+void CAN4OSX_usbWriteToBulkOutPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+UInt32 state = CAN4OSX_BULKOUT_IDLE;
+
+	while ( !atomic_compare_exchange_weak(&pSelf->endpointBulkOutState, &state, CAN4OSX_BULKOUT_BUSY) )  {
+		if ( state == CAN4OSX_BULKOUT_RERUN )  {
+			return;
+		}
+		if ( (state == CAN4OSX_BULKOUT_BUSY) &&
+			 atomic_compare_exchange_weak(&pSelf->endpointBulkOutState, &state, CAN4OSX_BULKOUT_RERUN) )  {
+			return;
+		}
+		// state changed under us, try again from idle
+		state = CAN4OSX_BULKOUT_IDLE;
+	}
+
+	do {
+		atomic_store(&pSelf->endpointBulkOutState, CAN4OSX_BULKOUT_BUSY);
+
+		while ( atomic_load_explicit(&pSelf->endpointBulkOutInFlight, memory_order_acquire) < pSelf->endpointBulkOutCount )  {
+			// Completions come in order, so the oldest buffer is free again
+			UInt8 *pBuffer = &pSelf->endpointBufferBulkOutRef[pSelf->endpointBulkOutNext * pSelf->endpointMaxSizeBulkOut];
+			UInt16 size = pSelf->usbFunctions.bulkOutFill(pSelf, pBuffer, pSelf->endpointMaxSizeBulkOut);
+			canStatus retval;
+
+			if ( size == 0u )  {
+				break;
+			}
+
+			atomic_fetch_add(&pSelf->endpointBulkOutInFlight, 1u);
+			pSelf->endpointBulkOutNext = (pSelf->endpointBulkOutNext + 1u) % pSelf->endpointBulkOutCount;
+
+			retval = pSelf->usbTransport->bulkOutSubmit(pSelf, pBuffer, size);
+
+			if (retval != canOK)  {
+				CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%d)\n", retval);
+				atomic_fetch_sub(&pSelf->endpointBulkOutInFlight, 1u);
+				pSelf->usbTransport->close(pSelf);
+				atomic_store(&pSelf->endpointBulkOutState, CAN4OSX_BULKOUT_IDLE);
+				return;
+			}
+		}
+
+		state = CAN4OSX_BULKOUT_BUSY;
+	} while ( !atomic_compare_exchange_strong(&pSelf->endpointBulkOutState, &state, CAN4OSX_BULKOUT_IDLE) );
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReadFromBulkInPipe - queue reads on the bulk-in pipe
+ *
+ * Submits reads until all bulk-in buffers are queued. The buffers are used
+ * in order, so the completions arrive in the same order. Called once to
+ * prime the pipe and from CAN4OSX_usbBulkInDone after the data of the
+ * completed buffer was decoded.
+ */
 void CAN4OSX_usbReadFromBulkInPipe(
 		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
 	)
 {
-IOReturn ret = (*(pSelf->can4osxInterfaceInterface))->ReadPipeAsync(pSelf->can4osxInterfaceInterface, pSelf->endpointNumberBulkIn, pSelf->endpointBufferBulkInRef, pSelf->endpointMaxSizeBulkIn, pSelf->usbFunctions.bulkReadCompletion, (void*)pSelf);
+	while ( pSelf->endpointBulkInPending < pSelf->endpointBulkInCount )  {
+		UInt32 index = (pSelf->endpointBulkInNext + pSelf->endpointBulkInPending) % pSelf->endpointBulkInCount;
+		char *pBuffer = &pSelf->endpointBufferBulkInRef[index * pSelf->endpointMaxSizeBulkIn];
 
-	if (ret != kIOReturnSuccess)  {
-		CAN4OSX_DEBUG_PRINT("Unable to read async interface (%08x)\n", ret);
+		canStatus ret = pSelf->usbTransport->bulkInSubmit(pSelf, (UInt8 *)pBuffer, pSelf->endpointMaxSizeBulkIn);
+
+		if (ret != canOK)  {
+			CAN4OSX_DEBUG_PRINT("Unable to read async interface (%d)\n", ret);
+			break;
+		}
+
+		pSelf->endpointBulkInPending++;
 	}
 }
 
 
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbBulkInDone - a bulk-in transfer finished
+ *
+ * Called by the transport for every bulkInSubmit, in submit order. Hands the
+ * data to the bulkInDecode function of the device, sends one notification
+ * for the whole transfer and queues the buffer again.
+ */
+void CAN4OSX_usbBulkInDone(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		canStatus result,
+		UInt32 size
+	)
+{
+char *pBuffer = &pSelf->endpointBufferBulkInRef[pSelf->endpointBulkInNext * pSelf->endpointMaxSizeBulkIn];
+
+	// The frames of this transfer are paired with the time it arrived
+	CAN4OSX_ClockSyncTransfer();
+
+	pSelf->endpointBulkInNext = (pSelf->endpointBulkInNext + 1u) % pSelf->endpointBulkInCount;
+	pSelf->endpointBulkInPending--;
+
+	CAN4OSX_DEBUG_PRINT("Asynchronous bulk read complete (%ld)\n", (long)size);
+
+	if (result != canOK)  {
+		CAN4OSX_DEBUG_PRINT("Error from async bulk read (%d)\n", result);
+		pSelf->usbTransport->close(pSelf);
+		return;
+	}
+
+	pSelf->usbStatistics.bulkInTransfers++;
+	// Nothing left on the endpoint while we decode
+	if ( pSelf->endpointBulkInPending == 0u )  {
+		pSelf->usbStatistics.bulkInDry++;
+	}
+
+	if ( size > 0u )  {
+		if ( can4osxBulkInTap != NULL )  {
+			can4osxBulkInTap(can4osxBulkInTapCtx, pSelf, (const UInt8 *)pBuffer, size);
+		}
+		pSelf->usbFunctions.bulkInDecode(pSelf, (const UInt8 *)pBuffer, size);
+	}
+
+	// One notification for the whole transfer
+	CAN4OSX_FlushNotify(pSelf);
+
+	CAN4OSX_usbReadFromBulkInPipe(pSelf);
+}
+
 
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbSetBulkInTap - see the raw bulk-in data of all devices
+ *
+ * tap gets every bulk-in transfer with data before it is decoded, on the
+ * driver thread. Meant for recording transfers to replay them later into
+ * the decoder, see examples/decodeBench. NULL removes the tap.
+ */
+void CAN4OSX_usbSetBulkInTap(
+		CAN4OSX_USB_BULKIN_TAP_T tap,
+		void *ctx
+	)
+{
+	CAN4OSX_usbRunOnDriverThread(^{
+		can4osxBulkInTap = tap;
+		can4osxBulkInTapCtx = ctx;
+	});
+}
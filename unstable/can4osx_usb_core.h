@@ -47,18 +47,52 @@
 
 #include <stdio.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
-
 #include "can4osx.h"
 #include "can4osx_internal.h"
 
 
 canStatus CAN4OSX_usbSendCommand(Can4osxUsbDeviceHandleEntry *pSelf, void *pCmd, size_t cmdLen);
+canStatus CAN4OSX_usbReceiveCommand(Can4osxUsbDeviceHandleEntry *pSelf, void *pCmd, UInt32 *pSize);
+canStatus CAN4OSX_usbControlRequest(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 requestType, UInt8 request,
+                                    UInt16 value, UInt16 index, void *pData, UInt16 length, UInt16 *pDone);
+canStatus CAN4OSX_usbCreateEndpointBuffer(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_usbReleaseEndpointBuffer(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_usbWriteToBulkOutPipe(Can4osxUsbDeviceHandleEntry *pSelf);
 void CAN4OSX_usbReadFromBulkInPipe(Can4osxUsbDeviceHandleEntry *pSelf);
 
+/* called by the transports when a submitted transfer finished */
+void CAN4OSX_usbBulkInDone(Can4osxUsbDeviceHandleEntry *pSelf, canStatus result, UInt32 size);
+void CAN4OSX_usbBulkOutDone(Can4osxUsbDeviceHandleEntry *pSelf, canStatus result);
+
+/* sees the data of every bulk-in transfer before the decoder, for recordings */
+typedef void (*CAN4OSX_USB_BULKIN_TAP_T)(void *ctx, Can4osxUsbDeviceHandleEntry *pSelf, const UInt8 *pBuffer, UInt32 size);
+void CAN4OSX_usbSetBulkInTap(CAN4OSX_USB_BULKIN_TAP_T tap, void *ctx);
+
+/* the device list of can4osx.c, the platform code matches against it */
+extern const CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[];
+extern const UInt32 can4osxSupportedDeviceCount;
+
+Boolean CAN4OSX_usbSupportedDevice(UInt16 vendorId, UInt16 productId);
+Can4osxUsbDeviceHandleEntry* CAN4OSX_usbNextDevice(void);
+void CAN4OSX_usbAddDevice(Can4osxUsbDeviceHandleEntry *pDevice, UInt16 productId);
+void CAN4OSX_usbRemoveDevice(Can4osxUsbDeviceHandleEntry *pSelf);
+/* the devices of the list which are not on USB, see virtualCan.c */
+void CAN4OSX_AddVirtualDevices(void);
+
+/* provided by the platform code, can4osx_usb_iokit.c or can4osx_usb_libusb.c.
+ * The driver thread finds the devices and runs all completions, it signals
+ * semaStarted once the devices present at start and the virtual ones are
+ * set up. */
+void CAN4OSX_usbDriverThread(dispatch_semaphore_t semaStarted);
+void CAN4OSX_usbRunOnDriverThread(dispatch_block_t block);
+
+#ifdef __APPLE__
+/* the transport of the devices found by IOKit, can4osx_usb_iokit.c */
+extern const CAN4OSX_USB_TRANSPORT_T can4osxUsbIoKitTransport;
+#else
+/* the transport of the devices found by libusb, can4osx_usb_libusb.c */
+extern const CAN4OSX_USB_TRANSPORT_T can4osxUsbLibusbTransport;
+#endif
+
 
 #endif /* CAN4OSX_USB_CORE_H */
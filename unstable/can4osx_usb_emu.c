@@ -0,0 +1,1630 @@
+//
+//  can4osx_usb_emu.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "can4osx.h"
+#include "can4osx_debug.h"
+#include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
+#include "can4osx_usb_emu.h"
+
+#include "kvaserLeaf.h"
+#include "kvaserLeafPro.h"
+#include "ixxatUsbFd.h"
+
+
+#if CAN4OSX_USB_EMULATION
+
+/* The emulated devices sit below the device codecs as one more USB
+ * transport. A small model of the firmware answers the commands the codec
+ * writes and puts the frames of its channels, in the format of the real
+ * device, into the queued bulk-in reads at the configured frame rate. One
+ * emulator thread serves all devices and hands the completions to the
+ * driver thread like the platform transports, so the codecs, the receive
+ * rings and the notifications run as with the hardware.
+ */
+
+/* packet size of the emulated bulk endpoints, high speed */
+#define CAN4OSX_USB_EMU_PACKET_SIZE     512u
+/* largest message of the firmwares, proCmdFdRxMessage_t */
+#define CAN4OSX_USB_EMU_MSG_SIZE        96u
+/* answers and TX acknowledges waiting for a read of the host */
+#define CAN4OSX_USB_EMU_RESPONSES       128u
+/* most channels of one emulated device */
+#define CAN4OSX_USB_EMU_MAX_CHANNELS    8u
+/* hydra entity of the first Leaf Pro channel */
+#define CAN4OSX_USB_EMU_HE_FIRST        0x10u
+/* serial number of all emulated devices */
+#define CAN4OSX_USB_EMU_SERIAL          4711u
+/* rate of the IXXAT message timer of the model, the codec does not rely on it */
+#define CAN4OSX_USB_EMU_IXXAT_FREQ      1000000u
+
+/* the completions of one round of the emulator thread */
+#define CAN4OSX_USB_EMU_DONE_MAX        (CAN4OSX_USB_EMU_MAX_DEVICES * CAN4OSX_USB_EMU_MAX_CHANNELS * \
+                                         (CAN4OSX_USB_BULKIN_BUFFER_COUNT + CAN4OSX_USB_BULKOUT_BUFFER_COUNT))
+
+struct CAN4OSX_USB_EMU_DEVICE_S;
+
+/* one channel of an emulated device */
+typedef struct {
+	Boolean busOn;
+	Boolean overrun;        /* frames were lost, the next one tells */
+	UInt32 frameRate;
+	UInt64 frameBaseNs;     /* device time of the frame rate start */
+	UInt64 frameSlot;       /* frames since frameBaseNs */
+	UInt32 frameCounter;
+	UInt32 idNext;
+	UInt32 timerWraps;      /* wraps of a 32 bit timer the host knows of */
+	UInt32 txFrames;        /* frames the host sent on the channel */
+} CAN4OSX_USB_EMU_CHANNEL_T;
+
+/* the endpoints of one handle, the reads and writes in submit order */
+typedef struct {
+	struct CAN4OSX_USB_EMU_DEVICE_S *pDevice;
+	Can4osxUsbDeviceHandleEntry *pSelf;
+	UInt8 *pRead[CAN4OSX_USB_BULKIN_BUFFER_COUNT];
+	UInt32 readSize[CAN4OSX_USB_BULKIN_BUFFER_COUNT];
+	UInt32 readFirst;
+	UInt32 readCount;
+	const UInt8 *pWrite[CAN4OSX_USB_BULKOUT_BUFFER_COUNT];
+	UInt32 writeSize[CAN4OSX_USB_BULKOUT_BUFFER_COUNT];
+	UInt32 writeFirst;
+	UInt32 writeCount;
+	UInt8 response[CAN4OSX_USB_EMU_RESPONSES][CAN4OSX_USB_EMU_MSG_SIZE];
+	UInt8 responseSize[CAN4OSX_USB_EMU_RESPONSES];
+	UInt32 responseFirst;
+	UInt32 responseCount;
+	Boolean closed;
+} CAN4OSX_USB_EMU_PIPE_T;
+
+/* a received frame before the firmware puts it into its format */
+typedef struct {
+	UInt64 timeNs;
+	UInt32 canId;
+	UInt8 flags;            /* CAN4OSX_USB_EMU_xxx */
+	UInt8 length;
+	Boolean overrun;
+	UInt8 data[CAN4OSX_CAN_MAX_MSG_LEN];
+} CAN4OSX_USB_EMU_FRAME_T;
+
+typedef struct CAN4OSX_USB_EMU_DEVICE_S CAN4OSX_USB_EMU_DEVICE_T;
+
+typedef struct {
+	UInt16 productId;
+	UInt8 channelCount;     /* of the real device */
+	UInt8 channelMax;       /* the codec can take */
+	Boolean sharedPipe;     /* all channels use the pipes of the first one */
+	Boolean fdCapable;
+	/* the commands of one bulk-out transfer or synchronous write */
+	void (*command)(CAN4OSX_USB_EMU_DEVICE_T *pDevice, CAN4OSX_USB_EMU_PIPE_T *pPipe, const UInt8 *pData, UInt32 size);
+	/* vendor request on the default pipe, NULL for none */
+	canStatus (*control)(CAN4OSX_USB_EMU_DEVICE_T *pDevice, UInt8 requestType, void *pData, UInt16 length, UInt16 *pDone);
+	/* puts the frame of a channel at pBuffer, returns its size, 0 without space */
+	UInt32 (*frame)(CAN4OSX_USB_EMU_DEVICE_T *pDevice, UInt8 channel, const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+					UInt8 *pBuffer, UInt32 space);
+} CAN4OSX_USB_EMU_FIRMWARE_T;
+
+struct CAN4OSX_USB_EMU_DEVICE_S {
+	const CAN4OSX_USB_EMU_FIRMWARE_T *pFirmware;
+	CAN4OSX_USB_EMU_CONFIG_T config;
+	UInt8 channelCount;
+	UInt64 startNs;         /* host time of the device timer 0 */
+	pthread_mutex_t mutex;  /* the device, its channels and pipes */
+	CAN4OSX_USB_EMU_CHANNEL_T channel[CAN4OSX_USB_EMU_MAX_CHANNELS];
+	CAN4OSX_USB_EMU_PIPE_T *pPipe[CAN4OSX_USB_EMU_MAX_CHANNELS];
+	/* the last vendor request, answered by the next read of the host */
+	UInt8 control[IXXUSBFD_CMD_BUFFER_SIZE];
+};
+
+/* a transfer the emulator thread finished */
+typedef struct {
+	Can4osxUsbDeviceHandleEntry *pSelf;
+	UInt32 size;
+	Boolean bulkIn;
+} CAN4OSX_USB_EMU_DONE_T;
+
+static void CAN4OSX_usbEmuLeafCommand(CAN4OSX_USB_EMU_DEVICE_T *pDevice, CAN4OSX_USB_EMU_PIPE_T *pPipe, const UInt8 *pData, UInt32 size);
+static UInt32 CAN4OSX_usbEmuLeafFrame(CAN4OSX_USB_EMU_DEVICE_T *pDevice, UInt8 channel, const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+									  UInt8 *pBuffer, UInt32 space);
+static void CAN4OSX_usbEmuLeafProCommand(CAN4OSX_USB_EMU_DEVICE_T *pDevice, CAN4OSX_USB_EMU_PIPE_T *pPipe, const UInt8 *pData, UInt32 size);
+static UInt32 CAN4OSX_usbEmuLeafProFrame(CAN4OSX_USB_EMU_DEVICE_T *pDevice, UInt8 channel, const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+										 UInt8 *pBuffer, UInt32 space);
+static void CAN4OSX_usbEmuIxxatCommand(CAN4OSX_USB_EMU_DEVICE_T *pDevice, CAN4OSX_USB_EMU_PIPE_T *pPipe, const UInt8 *pData, UInt32 size);
+static canStatus CAN4OSX_usbEmuIxxatControl(CAN4OSX_USB_EMU_DEVICE_T *pDevice, UInt8 requestType, void *pData, UInt16 length, UInt16 *pDone);
+static UInt32 CAN4OSX_usbEmuIxxatFrame(CAN4OSX_USB_EMU_DEVICE_T *pDevice, UInt8 channel, const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+									   UInt8 *pBuffer, UInt32 space);
+
+static const CAN4OSX_USB_EMU_FIRMWARE_T can4osxUsbEmuFirmware[] = {
+	{	/* Kvaser Leaf Light v.2 */
+		.productId = 0x0120, .channelCount = 1u, .channelMax = 1u, .sharedPipe = false, .fdCapable = false,
+		.command = CAN4OSX_usbEmuLeafCommand, .control = NULL, .frame = CAN4OSX_usbEmuLeafFrame
+	},
+	{	/* Kvaser Leaf Pro HS v.2 */
+		.productId = 0x0107, .channelCount = 1u, .channelMax = 5u, .sharedPipe = true, .fdCapable = true,
+		.command = CAN4OSX_usbEmuLeafProCommand, .control = NULL, .frame = CAN4OSX_usbEmuLeafProFrame
+	},
+	{	/* Kvaser USBcan Pro 2xHS v2 */
+		.productId = 0x0108, .channelCount = 2u, .channelMax = 5u, .sharedPipe = true, .fdCapable = true,
+		.command = CAN4OSX_usbEmuLeafProCommand, .control = NULL, .frame = CAN4OSX_usbEmuLeafProFrame
+	},
+	{	/* IXXAT USB-TO-CAN FD Automotive */
+		.productId = 0x0017, .channelCount = 2u, .channelMax = CAN4OSX_USB_EMU_MAX_CHANNELS, .sharedPipe = false, .fdCapable = true,
+		.command = CAN4OSX_usbEmuIxxatCommand, .control = CAN4OSX_usbEmuIxxatControl, .frame = CAN4OSX_usbEmuIxxatFrame
+	},
+};
+
+static CAN4OSX_USB_EMU_DEVICE_T can4osxUsbEmuDevice[CAN4OSX_USB_EMU_MAX_DEVICES];
+static UInt32 can4osxUsbEmuDeviceCount = 0u;
+static Boolean can4osxUsbEmuAttached = false;
+
+static dispatch_queue_t queueUsbEmu = NULL;
+static dispatch_semaphore_t semaUsbEmuWork = NULL;
+static CAN4OSX_USB_EMU_DONE_T can4osxUsbEmuDone[CAN4OSX_USB_EMU_DONE_MAX];
+
+
+#pragma mark helper
+/******************************************************************************/
+static UInt64 CAN4OSX_usbEmuNow(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice
+	)
+{
+	return(CAN4OSX_HostNs() - pDevice->startNs);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuTicks - device time to timer ticks
+ *
+ * The reverse of CAN4OSX_TicksToNs, split up the same way.
+ *
+ * \return ticks of a timer running at freq Hz
+ */
+static UInt64 CAN4OSX_usbEmuTicks(
+		UInt64 ns,
+		UInt32 freq
+	)
+{
+	return(((ns / 1000000000u) * freq) + (((ns % 1000000000u) * freq) / 1000000000u));
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuFrameTime - device time of the next frame of a channel
+ *
+ * Counted from the start of the frame rate, so the rounding does not add up.
+ *
+ */
+static UInt64 CAN4OSX_usbEmuFrameTime(
+		const CAN4OSX_USB_EMU_CHANNEL_T *pChannel
+	)
+{
+	return(pChannel->frameBaseNs + ((pChannel->frameSlot / pChannel->frameRate) * 1000000000u)
+		   + (((pChannel->frameSlot % pChannel->frameRate) * 1000000000u) / pChannel->frameRate));
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuFrameStart(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_CHANNEL_T *pChannel
+	)
+{
+	pChannel->frameBaseNs = CAN4OSX_usbEmuNow(pDevice);
+	pChannel->frameSlot = 0u;
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuBusOn(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 channel,
+		Boolean busOn
+	)
+{
+CAN4OSX_USB_EMU_CHANNEL_T *pChannel = &pDevice->channel[channel];
+
+	if (channel >= pDevice->channelCount)  {
+		return;
+	}
+
+	if (busOn && !pChannel->busOn)  {
+		CAN4OSX_usbEmuFrameStart(pDevice, pChannel);
+		pChannel->overrun = false;
+	}
+	pChannel->busOn = busOn;
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuCatchUp - drop the frames the firmware has no room for
+ *
+ * A host which does not read leaves at most CAN4OSX_USB_EMU_FW_QUEUE frames
+ * per channel, the older ones are lost like in the real device.
+ *
+ */
+static void CAN4OSX_usbEmuCatchUp(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_CHANNEL_T *pChannel,
+		UInt64 nowNs
+	)
+{
+UInt64 elapsedNs;
+UInt64 dueSlot;
+
+	if ( !pChannel->busOn || (pChannel->frameRate == 0u) || (nowNs < pChannel->frameBaseNs) )  {
+		return;
+	}
+
+	elapsedNs = nowNs - pChannel->frameBaseNs;
+	dueSlot = ((elapsedNs / 1000000000u) * pChannel->frameRate)
+			+ (((elapsedNs % 1000000000u) * pChannel->frameRate) / 1000000000u);
+
+	if ( dueSlot > (pChannel->frameSlot + CAN4OSX_USB_EMU_FW_QUEUE) )  {
+	UInt64 lost = dueSlot - CAN4OSX_USB_EMU_FW_QUEUE - pChannel->frameSlot;
+
+		pChannel->frameSlot += lost;
+		pChannel->frameCounter += (UInt32)lost;
+		pChannel->idNext = (UInt32)((pChannel->idNext + lost) % pDevice->config.idCount);
+		pChannel->overrun = true;
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuNextFrame(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_CHANNEL_T *pChannel,
+		CAN4OSX_USB_EMU_FRAME_T *pFrame
+	)
+{
+UInt8 i;
+
+	pFrame->timeNs = CAN4OSX_usbEmuFrameTime(pChannel);
+	pFrame->canId = pDevice->config.canId + pChannel->idNext;
+	pFrame->flags = pDevice->config.flags;
+	pFrame->length = pDevice->config.dataLength;
+	pFrame->overrun = pChannel->overrun;
+
+	// The counter first, a pattern behind it
+	for ( i = 0u; i < pFrame->length; i++ )  {
+		pFrame->data[i] = (i < 4u) ? (UInt8)(pChannel->frameCounter >> (8u * i)) : i;
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuFrameSent(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_CHANNEL_T *pChannel
+	)
+{
+	pChannel->frameSlot++;
+	pChannel->frameCounter++;
+	pChannel->overrun = false;
+
+	pChannel->idNext++;
+	if ( pChannel->idNext >= pDevice->config.idCount )  {
+		pChannel->idNext = 0u;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuRespond - queue an answer of the firmware
+ *
+ * The answers go into the next read of the host, before any frame.
+ *
+ */
+static void CAN4OSX_usbEmuRespond(
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		const void *pMsg,
+		UInt32 size
+	)
+{
+UInt32 index;
+
+	if ( (pPipe->responseCount >= CAN4OSX_USB_EMU_RESPONSES) || (size > CAN4OSX_USB_EMU_MSG_SIZE) )  {
+		CAN4OSX_DEBUG_PRINT("%s : answer lost\n", __func__);
+		return;
+	}
+
+	index = (pPipe->responseFirst + pPipe->responseCount) % CAN4OSX_USB_EMU_RESPONSES;
+	memcpy(pPipe->response[index], pMsg, size);
+	pPipe->responseSize[index] = (UInt8)size;
+	pPipe->responseCount++;
+}
+
+
+#pragma mark Kvaser Leaf
+/******************************************************************************/
+static void CAN4OSX_usbEmuLeafTime(
+		void *pTime, /**< time[3] of a packed command */
+		UInt64 ns
+	)
+{
+UInt64 ticks = CAN4OSX_usbEmuTicks(ns, LEAF_TIMER_FREQ);
+UInt16 time[3];
+
+	time[0] = (UInt16)ticks;
+	time[1] = (UInt16)(ticks >> 16u);
+	time[2] = (UInt16)(ticks >> 32u);
+
+	memcpy(pTime, time, sizeof(time));
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuLeafChipState(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		UInt8 busStatus
+	)
+{
+leafCmd event;
+
+	memset(&event, 0u, sizeof(event));
+	event.chipStateEvent.cmdLen = sizeof(cmdChipStateEvent);
+	event.chipStateEvent.cmdNo = CMD_CHIP_STATE_EVENT;
+	CAN4OSX_usbEmuLeafTime(event.chipStateEvent.time, CAN4OSX_usbEmuNow(pDevice));
+	event.chipStateEvent.busStatus = busStatus;
+
+	CAN4OSX_usbEmuRespond(pPipe, &event, sizeof(cmdChipStateEvent));
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuLeafTxAck - a sent frame comes back as log message
+ *
+ */
+static void CAN4OSX_usbEmuLeafTxAck(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		const cmdTxCanMessage *pTx
+	)
+{
+const UInt8 *pRaw = pTx->rawMessage;
+leafCmd ack;
+
+	if ( !pDevice->channel[0].busOn )  {
+		return;
+	}
+
+	memset(&ack, 0u, sizeof(ack));
+	ack.logMessage.cmdLen = sizeof(cmdLogMessage);
+	ack.logMessage.cmdNo = CMD_LOG_MESSAGE;
+	ack.logMessage.channel = pTx->channel;
+	ack.logMessage.flags = LEAF_MSG_FLAG_TXACK | (pTx->flags & LEAF_MSG_FLAG_REMOTE_FRAME);
+	CAN4OSX_usbEmuLeafTime(ack.logMessage.time, CAN4OSX_usbEmuNow(pDevice));
+
+	if (pTx->cmdNo == CMD_TX_EXT_MESSAGE)  {
+		ack.logMessage.ident = LEAF_EXT_MSG | ((UInt32)(pRaw[0] & 0x1fu) << 24u) | ((UInt32)(pRaw[1] & 0x3fu) << 18u)
+							 | ((UInt32)(pRaw[2] & 0x0fu) << 14u) | ((UInt32)pRaw[3] << 6u) | (pRaw[4] & 0x3fu);
+	} else {
+		ack.logMessage.ident = ((UInt32)(pRaw[0] & 0x1fu) << 6u) | (pRaw[1] & 0x3fu);
+	}
+
+	ack.logMessage.dlc = pRaw[5] & 0x0fu;
+	memcpy(ack.logMessage.data, &pRaw[6], sizeof(ack.logMessage.data));
+
+	CAN4OSX_usbEmuRespond(pPipe, &ack, sizeof(cmdLogMessage));
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuLeafCommand(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		const UInt8 *pData,
+		UInt32 size
+	)
+{
+UInt32 count = 0u;
+
+	// A command length of 0 ends the commands of the transfer
+	while ( (count + sizeof(cmdHead)) <= size )  {
+	const leafCmd *pCmd = (const leafCmd *)&pData[count];
+	leafCmd resp;
+
+		if ( (pCmd->head.cmdLen < sizeof(cmdHead)) || ((count + pCmd->head.cmdLen) > size) )  {
+			break;
+		}
+		count += pCmd->head.cmdLen;
+
+		memset(&resp, 0u, sizeof(resp));
+
+		switch (pCmd->head.cmdNo)  {
+			case CMD_TX_STD_MESSAGE:
+			case CMD_TX_EXT_MESSAGE:
+				pDevice->channel[0].txFrames++;
+				CAN4OSX_usbEmuLeafTxAck(pDevice, pPipe, &pCmd->txCanMessage);
+				break;
+			case CMD_START_CHIP_REQ:
+				CAN4OSX_usbEmuBusOn(pDevice, 0u, true);
+				resp.startChipReq.cmdLen = sizeof(cmdStartChipReq);
+				resp.startChipReq.cmdNo = CMD_START_CHIP_RESP;
+				resp.startChipReq.transId = pCmd->startChipReq.transId;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, sizeof(cmdStartChipReq));
+				CAN4OSX_usbEmuLeafChipState(pDevice, pPipe, 0u);
+				break;
+			case CMD_STOP_CHIP_REQ:
+				CAN4OSX_usbEmuBusOn(pDevice, 0u, false);
+				resp.startChipReq.cmdLen = sizeof(cmdStartChipReq);
+				resp.startChipReq.cmdNo = CMD_STOP_CHIP_RESP;
+				resp.startChipReq.transId = pCmd->startChipReq.transId;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, sizeof(cmdStartChipReq));
+				CAN4OSX_usbEmuLeafChipState(pDevice, pPipe, M16C_BUS_RESET);
+				break;
+			case CMD_GET_CARD_INFO_REQ:
+				resp.getCardInfoResp.cmdLen = sizeof(cmdGetCardInfoResp);
+				resp.getCardInfoResp.cmdNo = CMD_GET_CARD_INFO_RESP;
+				resp.getCardInfoResp.transId = pCmd->getCardInfoReq.transId;
+				resp.getCardInfoResp.channelCount = pDevice->channelCount;
+				resp.getCardInfoResp.serialNumber = CAN4OSX_USB_EMU_SERIAL;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, sizeof(cmdGetCardInfoResp));
+				break;
+			case CMD_GET_SOFTWARE_INFO_REQ:
+				resp.getSoftwareResp.cmdLen = sizeof(cmdGetSoftwareInfoResp);
+				resp.getSoftwareResp.cmdNo = CMD_GET_SOFTWARE_INFO_RESP;
+				resp.getSoftwareResp.transId = pCmd->getSoftwareReq.transId;
+				resp.getSoftwareResp.maxOutstandingTx = CAN4OSX_TX_QUEUE_SIZE;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, sizeof(cmdGetSoftwareInfoResp));
+				break;
+			default:
+				// Bus parameters and the like are taken as they are
+				break;
+		}
+	}
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_usbEmuLeafFrame(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 channel,
+		const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+		UInt8 *pBuffer,
+		UInt32 space
+	)
+{
+cmdLogMessage msg;
+
+	(void)pDevice;
+
+	if (space < sizeof(msg))  {
+		return(0u);
+	}
+
+	memset(&msg, 0u, sizeof(msg));
+	msg.cmdLen = sizeof(msg);
+	msg.cmdNo = CMD_LOG_MESSAGE;
+	msg.channel = channel;
+	msg.flags = pFrame->overrun ? LEAF_MSG_FLAG_OVERRUN : 0u;
+	CAN4OSX_usbEmuLeafTime(msg.time, pFrame->timeNs);
+	msg.dlc = pFrame->length;
+	msg.ident = pFrame->canId | ((pFrame->flags & CAN4OSX_USB_EMU_EXT) ? LEAF_EXT_MSG : 0u);
+	memcpy(msg.data, pFrame->data, pFrame->length);
+
+	memcpy(pBuffer, &msg, sizeof(msg));
+
+	return(sizeof(msg));
+}
+
+
+#pragma mark Kvaser Leaf Pro
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuLeafProHead - header of a message of the device
+ *
+ * The hydra entity of the sender is split over address and transitionId.
+ *
+ */
+static void CAN4OSX_usbEmuLeafProHead(
+		proCmdHead_t *pHead,
+		UInt8 cmdNo,
+		UInt8 he
+	)
+{
+	pHead->cmdNo = cmdNo;
+	pHead->address = (UInt8)((he & 0x30u) << 2u);
+	pHead->transitionId = (UInt16)((he & 0x0fu) << 12u);
+}
+
+
+/******************************************************************************/
+static UInt8 CAN4OSX_usbEmuLeafProChannel(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 address
+	)
+{
+UInt8 he = address & 0x3fu;
+
+	if ( (he < CAN4OSX_USB_EMU_HE_FIRST) || ((he - CAN4OSX_USB_EMU_HE_FIRST) >= pDevice->channelCount) )  {
+		return(pDevice->channelCount);
+	}
+	return(he - CAN4OSX_USB_EMU_HE_FIRST);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuLeafProCommand(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		const UInt8 *pData,
+		UInt32 size
+	)
+{
+UInt32 count = 0u;
+
+	while ( (count + sizeof(proCmdFdHead_t)) <= size )  {
+	const proCommand_t *pCmd = (const proCommand_t *)&pData[count];
+	UInt32 cmdSize = LEAFPRO_COMMAND_SIZE;
+	UInt8 channel;
+	proCommand_t resp;
+
+		// A command number of 0 ends the commands of the transfer
+		if (pCmd->proCmdHead.cmdNo == 0u)  {
+			break;
+		}
+		if (pCmd->proCmdHead.cmdNo == LEAFPRO_CMD_CAN_FD)  {
+			cmdSize = pCmd->proCommandExt.proCmdFdHead.len;
+		}
+		if ( (cmdSize < sizeof(proCmdFdHead_t)) || ((count + cmdSize) > size) )  {
+			break;
+		}
+		count += cmdSize;
+
+		channel = CAN4OSX_usbEmuLeafProChannel(pDevice, pCmd->proCmdHead.address);
+		memset(&resp, 0u, sizeof(resp));
+
+		switch (pCmd->proCmdHead.cmdNo)  {
+			case LEAFPRO_CMD_MAP_CHANNEL_REQ:
+				CAN4OSX_usbEmuLeafProHead(&resp.proCmdHead, LEAFPRO_CMD_MAP_CHANNEL_RESP, LEAFPRO_HE_ROUTER);
+				resp.proCmdHead.transitionId = pCmd->proCmdHead.transitionId;
+				if ( (strncmp(pCmd->proCmdMapChannelReq.name, "CAN", sizeof(pCmd->proCmdMapChannelReq.name)) == 0)
+					&& (pCmd->proCmdMapChannelReq.channel < pDevice->channelCount) )  {
+					resp.proCmdMapChannelResp.heAddress = CAN4OSX_USB_EMU_HE_FIRST + pCmd->proCmdMapChannelReq.channel;
+					resp.proCmdMapChannelResp.position = pCmd->proCmdMapChannelReq.channel;
+				} else {
+					resp.proCmdMapChannelResp.heAddress = LEAFPRO_HE_ILLEGAL;
+				}
+				CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				break;
+			case LEAFPRO_CMD_GET_CARD_INFO_REQ:
+				CAN4OSX_usbEmuLeafProHead(&resp.proCmdHead, LEAFPRO_CMD_GET_CARD_INFO_RESP, LEAFPRO_HE_ROUTER);
+				resp.proCmdHead.transitionId = pCmd->proCmdHead.transitionId;
+				resp.proCmdCardInfoResp.serial_number = CAN4OSX_USB_EMU_SERIAL;
+				resp.proCmdCardInfoResp.nchannels = pDevice->channelCount;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				break;
+			case LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ:
+				CAN4OSX_usbEmuLeafProHead(&resp.proCmdHead, LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP, LEAFPRO_HE_ROUTER);
+				resp.proCmdHead.transitionId = pCmd->proCmdHead.transitionId;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				break;
+			case LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ:
+				// No LEASPRO_SUPPORT_EXTENDED, the codec sends the old commands
+				CAN4OSX_usbEmuLeafProHead(&resp.proCmdHead, LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP, LEAFPRO_HE_ROUTER);
+				resp.proCmdHead.transitionId = pCmd->proCmdHead.transitionId;
+				resp.proCcmdGetSoftwareDetailsResp.maxBitrate = 8000000u;
+				CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				break;
+			case LEAFPRO_CMD_SET_BUSPARAMS_REQ:
+			case LEAFPRO_CMD_SET_BUSPARAMS_FD_REQ:
+				if (channel < pDevice->channelCount)  {
+					CAN4OSX_usbEmuLeafProHead(&resp.proCmdHead, (pCmd->proCmdHead.cmdNo == LEAFPRO_CMD_SET_BUSPARAMS_REQ)
+											  ? LEAFPRO_CMD_SET_BUSPARAMS_RESP : LEAFPRO_CMD_SET_BUSPARAMS_FD_RESP,
+											  CAN4OSX_USB_EMU_HE_FIRST + channel);
+					CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				}
+				break;
+			case LEAFPRO_CMD_START_CHIP_REQ:
+				if (channel < pDevice->channelCount)  {
+					CAN4OSX_usbEmuBusOn(pDevice, channel, true);
+					CAN4OSX_usbEmuLeafProHead(&resp.proCmdHead, LEAFPRO_CMD_START_CHIP_RESP, CAN4OSX_USB_EMU_HE_FIRST + channel);
+					CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				}
+				break;
+			case LEAFPRO_CMD_TX_CAN_MESSAGE:
+				// The sent frame is only acknowledged, the codec asks for no echo
+				if ( (channel < pDevice->channelCount) && pDevice->channel[channel].busOn )  {
+					pDevice->channel[channel].txFrames++;
+					CAN4OSX_usbEmuLeafProHead(&resp.proCommandExt.proCmdFdHead.header, LEAFPRO_CMD_CAN_FD,
+											  CAN4OSX_USB_EMU_HE_FIRST + channel);
+					resp.proCommandExt.proCmdFdHead.len = LEAFPRO_COMMAND_SIZE;
+					resp.proCommandExt.proCmdFdHead.cmd = LEAFPRO_CMD_TX_ACKNOWLEDGE_FD;
+					CAN4OSX_usbEmuRespond(pPipe, &resp, LEAFPRO_COMMAND_SIZE);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_usbEmuLeafProFrame(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 channel,
+		const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+		UInt8 *pBuffer,
+		UInt32 space
+	)
+{
+UInt8 he = CAN4OSX_USB_EMU_HE_FIRST + channel;
+
+	(void)pDevice;
+
+	// The codec takes log messages for the first channel only
+	if ( (channel == 0u) && !(pFrame->flags & CAN4OSX_USB_EMU_FD) )  {
+	proCmdLogMessage_t msg;
+
+		if (space < sizeof(msg))  {
+			return(0u);
+		}
+
+		memset(&msg, 0u, sizeof(msg));
+		CAN4OSX_usbEmuLeafProHead(&msg.header, LEAFPRO_CMD_LOG_MESSAGE, he);
+		msg.cmdLen = sizeof(msg) - sizeof(proCmdHead_t);
+		msg.cmdNo = LEAFPRO_CMD_LOG_MESSAGE;
+		msg.channel = channel;
+		msg.flags = pFrame->overrun ? LEAFPRO_MSG_FLAG_OVERRUN : 0u;
+		CAN4OSX_usbEmuLeafTime(msg.time, pFrame->timeNs);
+		msg.dlc = pFrame->length;
+		msg.canId = pFrame->canId | ((pFrame->flags & CAN4OSX_USB_EMU_EXT) ? LEAFPRO_EXT_MSG : 0u);
+		memcpy(msg.data, pFrame->data, pFrame->length);
+
+		memcpy(pBuffer, &msg, sizeof(msg));
+
+		return(sizeof(msg));
+	} else {
+	proCmdFdRxMessage_t msg;
+	UInt32 size = (offsetof(proCmdFdRxMessage_t, data) + pFrame->length + 3u) & ~3u;
+
+		if (space < size)  {
+			return(0u);
+		}
+
+		memset(&msg, 0u, sizeof(msg));
+		CAN4OSX_usbEmuLeafProHead(&msg.fdHeader.header, LEAFPRO_CMD_CAN_FD, he);
+		msg.fdHeader.len = (UInt16)size;
+		msg.fdHeader.cmd = LEAFPRO_CMD_RX_MESSAGE_FD;
+
+		if (pFrame->flags & CAN4OSX_USB_EMU_EXT)  {
+			msg.flags |= LEAFPRO_MSG_FLAG_EXTENDED;
+			msg.canId = pFrame->canId | LEAFPRO_EXT_MSG;
+		} else {
+			msg.canId = pFrame->canId;
+		}
+		if (pFrame->overrun)  {
+			msg.flags |= LEAFPRO_MSG_FLAG_OVERRUN;
+		}
+		if (pFrame->flags & CAN4OSX_USB_EMU_FD)  {
+			msg.flags |= LEAFPRO_MSGFLAG_FDF;
+			if (pFrame->flags & CAN4OSX_USB_EMU_BRS)  {
+				msg.flags |= LEAFPRO_MSGFLAG_BRS;
+			}
+			msg.control = (UInt32)CAN4OSX_encodeFdDlc(pFrame->length) << 8u;
+		} else {
+			msg.control = (UInt32)pFrame->length << 8u;
+		}
+		msg.timestamp = CAN4OSX_usbEmuTicks(pFrame->timeNs, LEAFPRO_TIMER_FREQ);
+		memcpy(msg.data, pFrame->data, pFrame->length);
+
+		memcpy(pBuffer, &msg, size);
+
+		return(size);
+	}
+}
+
+
+#pragma mark IXXAT USB-TO-CAN FD
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuIxxatControl - the vendor requests of the IXXAT
+ *
+ * The host writes a request and reads the answer with a second request, the
+ * answer is made when it is read.
+ *
+ */
+static canStatus CAN4OSX_usbEmuIxxatControl(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 requestType,
+		void *pData,
+		UInt16 length,
+		UInt16 *pDone
+	)
+{
+const IXXUSBFDMSGREQHEAD_T *pReq = (const IXXUSBFDMSGREQHEAD_T *)pDevice->control;
+UInt8 data[IXXUSBFD_CMD_BUFFER_SIZE];
+IXXUSBFDMSGRESPHEAD_T *pResp = (IXXUSBFDMSGRESPHEAD_T *)data;
+UInt16 port = pReq->reqPort;
+
+	if (length > sizeof(data))  {
+		length = sizeof(data);
+	}
+
+	if (requestType == CAN4OSX_USB_VENDOR_OUT)  {
+		memcpy(pDevice->control, pData, length);
+		*pDone = length;
+		return(canOK);
+	}
+
+	if (length < sizeof(IXXUSBFDMSGRESPHEAD_T))  {
+		return(canERR_PARAM);
+	}
+
+	memset(data, 0u, sizeof(data));
+	pResp->respSize = length;
+	pResp->retSize = length;
+	pResp->retCode = 0u;
+
+	switch (pReq->reqCode)  {
+		case IXXUSBFD_CMD_POWER_DEV:
+		case IXXUSBFD_CMD_FREQ_CHIP:
+			break;
+		case IXXUSBFD_CMD_CAPS_DEV:
+			((IXXUSBFDDEVICECAPSRESP_T *)data)->caps.chanCount = pDevice->channelCount;
+			for (UInt8 i = 0u; i < pDevice->channelCount; i++)  {
+				((IXXUSBFDDEVICECAPSRESP_T *)data)->caps.chanTypes[i] = 0x100u;
+			}
+			break;
+		case IXXUSBFD_CMD_START_CHIP:
+			if (port < pDevice->channelCount)  {
+			UInt64 ticks = CAN4OSX_usbEmuTicks(CAN4OSX_usbEmuNow(pDevice), CAN4OSX_USB_EMU_IXXAT_FREQ);
+
+				CAN4OSX_usbEmuBusOn(pDevice, (UInt8)port, true);
+				pDevice->channel[port].timerWraps = (UInt32)(ticks >> 32u);
+				((IXXUSBFDCANSTARTRESP_T *)data)->startTime = (UInt32)ticks;
+			} else {
+				pResp->retCode = 1u;
+			}
+			break;
+		case IXXUSBFD_CMD_STOP_CHIP:
+			if (port < pDevice->channelCount)  {
+				CAN4OSX_usbEmuBusOn(pDevice, (UInt8)port, false);
+			} else {
+				pResp->retCode = 1u;
+			}
+			break;
+		default:
+			pResp->retCode = 1u;
+			break;
+	}
+
+	memcpy(pData, data, length);
+	*pDone = length;
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuIxxatCommand(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		const UInt8 *pData,
+		UInt32 size
+	)
+{
+UInt32 count = 0u;
+CAN4OSX_USB_EMU_CHANNEL_T *pChannel = &pDevice->channel[pPipe->pSelf->deviceChannel];
+
+	// The frames leave on the bus, the IXXAT has no echo to send back
+	while (count < size)  {
+	const IXXUSBFDCANMSG_T *pMsg = (const IXXUSBFDCANMSG_T *)&pData[count];
+
+		// A size of 0 ends the messages of the transfer
+		if (pMsg->size == 0u)  {
+			break;
+		}
+		count += pMsg->size + 1u;
+		pChannel->txFrames++;
+	}
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_usbEmuIxxatFrame(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 channel,
+		const CAN4OSX_USB_EMU_FRAME_T *pFrame,
+		UInt8 *pBuffer,
+		UInt32 space
+	)
+{
+CAN4OSX_USB_EMU_CHANNEL_T *pChannel = &pDevice->channel[channel];
+UInt64 ticks = CAN4OSX_usbEmuTicks(pFrame->timeNs, CAN4OSX_USB_EMU_IXXAT_FREQ);
+UInt32 wraps = (UInt32)(ticks >> 32u);
+UInt32 headSize = sizeof(IXXUSBFDCANMSG_T) - CAN4OSX_CAN_MAX_MSG_LEN;
+UInt32 fill = 0u;
+IXXUSBFDCANMSG_T msg;
+
+	if ( space < (headSize + pFrame->length + ((wraps != pChannel->timerWraps) ? headSize : 0u)) )  {
+		return(0u);
+	}
+
+	// The 32 bit us timer wrapped since the last frame, tell the host first
+	if (wraps != pChannel->timerWraps)  {
+		memset(&msg, 0u, headSize);
+		msg.size = (UInt8)(headSize - 1u);
+		msg.time = (UInt32)ticks;
+		msg.canId = wraps - pChannel->timerWraps;
+		msg.flags = IXXUSBFD_CAN_TIMEOVR;
+		memcpy(pBuffer, &msg, headSize);
+		fill = headSize;
+		pChannel->timerWraps = wraps;
+	}
+
+	memset(&msg, 0u, headSize);
+	msg.size = (UInt8)(headSize - 1u + pFrame->length);
+	msg.time = (UInt32)ticks;
+	msg.canId = pFrame->canId;
+	msg.flags = IXXUSBFD_CAN_DATA;
+	if (pFrame->flags & CAN4OSX_USB_EMU_EXT)  {
+		msg.flags |= IXXUSBFD_MSG_FLAG_EXT;
+	}
+	if (pFrame->flags & CAN4OSX_USB_EMU_FD)  {
+		msg.flags |= IXXUSBFD_MSG_FLAG_EDL;
+		if (pFrame->flags & CAN4OSX_USB_EMU_BRS)  {
+			msg.flags |= IXXUSBFD_MSG_FLAG_FDR;
+		}
+		msg.flags |= (UInt32)CAN4OSX_encodeFdDlc(pFrame->length) << 16u;
+	} else {
+		msg.flags |= (UInt32)pFrame->length << 16u;
+	}
+	if (pFrame->overrun)  {
+		msg.flags |= IXXUSBFD_MSG_FLAG_OVR;
+	}
+	memcpy(msg.data, pFrame->data, pFrame->length);
+
+	memcpy(&pBuffer[fill], &msg, headSize + pFrame->length);
+
+	return(fill + headSize + pFrame->length);
+}
+
+
+#pragma mark pipes
+/******************************************************************************/
+static CAN4OSX_USB_EMU_PIPE_T* CAN4OSX_usbEmuCreatePipe(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = calloc(1u, sizeof(CAN4OSX_USB_EMU_PIPE_T));
+
+	if (pPipe == NULL)  {
+		return(NULL);
+	}
+
+	pPipe->pDevice = pDevice;
+	pPipe->pSelf = pSelf;
+
+	// The pipe of the handle is usbTransportChannel, created only once
+	pthread_mutex_lock(&pDevice->mutex);
+	if (atomic_load(&pSelf->usbTransportChannel) != NULL)  {
+		free(pPipe);
+		pPipe = atomic_load(&pSelf->usbTransportChannel);
+	} else {
+		pDevice->pPipe[pSelf->deviceChannel] = pPipe;
+		atomic_store(&pSelf->usbTransportChannel, pPipe);
+	}
+	pthread_mutex_unlock(&pDevice->mutex);
+
+	return(pPipe);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuGetPipe - the pipe of a handle
+ *
+ * The further channels of a device are copies of the first one, they get
+ * their own pipe on the first transfer unless the device has one for all.
+ *
+ * \return the pipe, NULL for no emulated device
+ */
+static CAN4OSX_USB_EMU_PIPE_T* CAN4OSX_usbEmuGetPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+Can4osxUsbDeviceHandleEntry *pFirst = CAN4OSX_CHANNEL(pSelf->channelIndex - pSelf->deviceChannel);
+CAN4OSX_USB_EMU_PIPE_T *pPipe = atomic_load(&pFirst->usbTransportChannel);
+
+	if ( (pPipe == NULL) || (pSelf == pFirst) || pPipe->pDevice->pFirmware->sharedPipe )  {
+		return(pPipe);
+	}
+
+	if (atomic_load(&pSelf->usbTransportChannel) != NULL)  {
+		return(atomic_load(&pSelf->usbTransportChannel));
+	}
+
+	return(CAN4OSX_usbEmuCreatePipe(pPipe->pDevice, pSelf));
+}
+
+
+/******************************************************************************/
+static CAN4OSX_USB_EMU_PIPE_T* CAN4OSX_usbEmuChannelPipe(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		UInt8 channel
+	)
+{
+	return(pDevice->pFirmware->sharedPipe ? pDevice->pPipe[0] : pDevice->pPipe[channel]);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuFillRead - the data of one bulk-in transfer
+ *
+ * The answers first, then the due frames of the channels on this pipe by
+ * time. pFull tells that the transfer had no room for everything.
+ *
+ * \return number of bytes in pBuffer
+ */
+static UInt32 CAN4OSX_usbEmuFillRead(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_PIPE_T *pPipe,
+		UInt8 *pBuffer,
+		UInt32 size,
+		UInt64 nowNs,
+		Boolean *pFull
+	)
+{
+UInt32 fill = 0u;
+
+	while (pPipe->responseCount > 0u)  {
+	UInt32 length = pPipe->responseSize[pPipe->responseFirst];
+
+		if ((fill + length) > size)  {
+			*pFull = true;
+			return(fill);
+		}
+
+		memcpy(&pBuffer[fill], pPipe->response[pPipe->responseFirst], length);
+		fill += length;
+		pPipe->responseFirst = (pPipe->responseFirst + 1u) % CAN4OSX_USB_EMU_RESPONSES;
+		pPipe->responseCount--;
+	}
+
+	for (;;)  {
+	CAN4OSX_USB_EMU_FRAME_T frame;
+	UInt8 next = pDevice->channelCount;
+	UInt64 nextNs = nowNs;
+	UInt32 length;
+
+		// The earliest due frame of all channels
+		for (UInt8 i = 0u; i < pDevice->channelCount; i++)  {
+		CAN4OSX_USB_EMU_CHANNEL_T *pChannel = &pDevice->channel[i];
+
+			if ( pChannel->busOn && (pChannel->frameRate != 0u) && (CAN4OSX_usbEmuChannelPipe(pDevice, i) == pPipe)
+				&& (CAN4OSX_usbEmuFrameTime(pChannel) <= nextNs) )  {
+				next = i;
+				nextNs = CAN4OSX_usbEmuFrameTime(pChannel);
+			}
+		}
+
+		if (next >= pDevice->channelCount)  {
+			break;
+		}
+
+		CAN4OSX_usbEmuNextFrame(pDevice, &pDevice->channel[next], &frame);
+		length = pDevice->pFirmware->frame(pDevice, next, &frame, &pBuffer[fill], size - fill);
+		if (length == 0u)  {
+			*pFull = true;
+			break;
+		}
+		fill += length;
+		CAN4OSX_usbEmuFrameSent(pDevice, &pDevice->channel[next]);
+	}
+
+	return(fill);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuWork - one round of the firmware of a device
+ *
+ * Takes the written commands while there is room for the answers and fills
+ * the queued reads. The finished transfers are put to pDone.
+ *
+ * \return number of finished transfers
+ */
+static UInt32 CAN4OSX_usbEmuWork(
+		CAN4OSX_USB_EMU_DEVICE_T *pDevice,
+		CAN4OSX_USB_EMU_DONE_T *pDone,
+		Boolean *pMore
+	)
+{
+UInt32 count = 0u;
+UInt64 nowNs;
+
+	pthread_mutex_lock(&pDevice->mutex);
+
+	nowNs = CAN4OSX_usbEmuNow(pDevice);
+
+	for (UInt8 i = 0u; i < pDevice->channelCount; i++)  {
+		CAN4OSX_usbEmuCatchUp(pDevice, &pDevice->channel[i], nowNs);
+	}
+
+	for (UInt8 i = 0u; i < pDevice->channelCount; i++)  {
+	CAN4OSX_USB_EMU_PIPE_T *pPipe = pDevice->pPipe[i];
+	Boolean full = false;
+	UInt32 reads = 0u;
+
+		if ( (pPipe == NULL) || pPipe->closed )  {
+			continue;
+		}
+
+		while ( (pPipe->writeCount > 0u) && (pPipe->responseCount <= (CAN4OSX_USB_EMU_RESPONSES / 2u)) )  {
+			pDevice->pFirmware->command(pDevice, pPipe, pPipe->pWrite[pPipe->writeFirst], pPipe->writeSize[pPipe->writeFirst]);
+			pPipe->writeFirst = (pPipe->writeFirst + 1u) % CAN4OSX_USB_BULKOUT_BUFFER_COUNT;
+			pPipe->writeCount--;
+
+			pDone[count].pSelf = pPipe->pSelf;
+			pDone[count].size = 0u;
+			pDone[count].bulkIn = false;
+			count++;
+		}
+
+		while (pPipe->readCount > 0u)  {
+		UInt32 size;
+
+			full = false;
+			size = CAN4OSX_usbEmuFillRead(pDevice, pPipe, pPipe->pRead[pPipe->readFirst], pPipe->readSize[pPipe->readFirst],
+										  nowNs, &full);
+			if (size == 0u)  {
+				break;
+			}
+			pPipe->readFirst = (pPipe->readFirst + 1u) % CAN4OSX_USB_BULKIN_BUFFER_COUNT;
+			pPipe->readCount--;
+			reads++;
+
+			pDone[count].pSelf = pPipe->pSelf;
+			pDone[count].size = size;
+			pDone[count].bulkIn = true;
+			count++;
+
+			if (!full)  {
+				break;
+			}
+		}
+
+		// Go on once the host got the reads back, it gives them again
+		if ( (reads > 0u) && (full || (pPipe->writeCount > 0u)) )  {
+			*pMore = true;
+		}
+	}
+
+	pthread_mutex_unlock(&pDevice->mutex);
+
+	return(count);
+}
+
+
+#pragma mark emulator thread
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuRun - the emulator thread
+ *
+ * Wakes up on every tick and on new transfers. The finished transfers go to
+ * the driver thread in order, outside of the device locks, since the
+ * completions give the next transfers right away.
+ *
+ */
+static void CAN4OSX_usbEmuRun(
+		void
+	)
+{
+	for (;;)  {
+	Boolean more;
+
+		(void)CAN4OSX_SemaphoreWait(semaUsbEmuWork, (UInt64)CAN4OSX_USB_EMU_TICK_US * 1000u);
+
+		do {
+		UInt32 count = 0u;
+		CAN4OSX_USB_EMU_DONE_T *pDone = can4osxUsbEmuDone;
+
+			more = false;
+
+			for (UInt32 i = 0u; i < can4osxUsbEmuDeviceCount; i++)  {
+				count += CAN4OSX_usbEmuWork(&can4osxUsbEmuDevice[i], &can4osxUsbEmuDone[count], &more);
+			}
+
+			if (count > 0u)  {
+				CAN4OSX_usbRunOnDriverThread(^{
+					for (UInt32 k = 0u; k < count; k++)  {
+						if (pDone[k].bulkIn)  {
+							CAN4OSX_usbBulkInDone(pDone[k].pSelf, canOK, pDone[k].size);
+						} else {
+							CAN4OSX_usbBulkOutDone(pDone[k].pSelf, canOK);
+						}
+					}
+				});
+			}
+		} while (more);
+	}
+}
+
+
+#pragma mark transport
+/******************************************************************************/
+static canStatus CAN4OSX_usbEmuBulkInSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = CAN4OSX_usbEmuGetPipe(pSelf);
+canStatus retVal = canOK;
+Boolean wake = false;
+
+	if (pPipe == NULL)  {
+		return(canERR_HARDWARE);
+	}
+
+	pthread_mutex_lock(&pPipe->pDevice->mutex);
+	if ( pPipe->closed || (pPipe->readCount >= CAN4OSX_USB_BULKIN_BUFFER_COUNT) )  {
+		retVal = canERR_HARDWARE;
+	} else {
+	UInt32 index = (pPipe->readFirst + pPipe->readCount) % CAN4OSX_USB_BULKIN_BUFFER_COUNT;
+
+		pPipe->pRead[index] = pBuffer;
+		pPipe->readSize[index] = size;
+		pPipe->readCount++;
+		// Frames wait for the tick, answers do not
+		wake = (pPipe->responseCount > 0u);
+	}
+	pthread_mutex_unlock(&pPipe->pDevice->mutex);
+
+	if (wake && (semaUsbEmuWork != NULL))  {
+		dispatch_semaphore_signal(semaUsbEmuWork);
+	}
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_usbEmuBulkOutSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = CAN4OSX_usbEmuGetPipe(pSelf);
+canStatus retVal = canOK;
+
+	if (pPipe == NULL)  {
+		return(canERR_HARDWARE);
+	}
+
+	pthread_mutex_lock(&pPipe->pDevice->mutex);
+	if ( pPipe->closed || (pPipe->writeCount >= CAN4OSX_USB_BULKOUT_BUFFER_COUNT) )  {
+		retVal = canERR_HARDWARE;
+	} else {
+	UInt32 index = (pPipe->writeFirst + pPipe->writeCount) % CAN4OSX_USB_BULKOUT_BUFFER_COUNT;
+
+		pPipe->pWrite[index] = pBuffer;
+		pPipe->writeSize[index] = size;
+		pPipe->writeCount++;
+	}
+	pthread_mutex_unlock(&pPipe->pDevice->mutex);
+
+	if ( (retVal == canOK) && (semaUsbEmuWork != NULL) )  {
+		dispatch_semaphore_signal(semaUsbEmuWork);
+	}
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuBulkInRead - synchronous read of one answer
+ *
+ * Without an answer the read times out after a tick, the codecs try again
+ * within their own time limit.
+ *
+ */
+static canStatus CAN4OSX_usbEmuBulkInRead(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 *pBuffer,
+		UInt32 *pSize
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = CAN4OSX_usbEmuGetPipe(pSelf);
+canStatus retVal = canERR_TIMEOUT;
+
+	if (pPipe == NULL)  {
+		return(canERR_HARDWARE);
+	}
+
+	pthread_mutex_lock(&pPipe->pDevice->mutex);
+	if (pPipe->closed)  {
+		retVal = canERR_HARDWARE;
+	} else if ( (pPipe->responseCount > 0u) && (pPipe->responseSize[pPipe->responseFirst] <= *pSize) )  {
+		*pSize = pPipe->responseSize[pPipe->responseFirst];
+		memcpy(pBuffer, pPipe->response[pPipe->responseFirst], *pSize);
+		pPipe->responseFirst = (pPipe->responseFirst + 1u) % CAN4OSX_USB_EMU_RESPONSES;
+		pPipe->responseCount--;
+		retVal = canOK;
+	}
+	pthread_mutex_unlock(&pPipe->pDevice->mutex);
+
+	if (retVal == canERR_TIMEOUT)  {
+		*pSize = 0u;
+		usleep(CAN4OSX_USB_EMU_TICK_US);
+	}
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_usbEmuBulkOutWrite(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = CAN4OSX_usbEmuGetPipe(pSelf);
+canStatus retVal = canOK;
+
+	if (pPipe == NULL)  {
+		return(canERR_HARDWARE);
+	}
+
+	pthread_mutex_lock(&pPipe->pDevice->mutex);
+	if (pPipe->closed)  {
+		retVal = canERR_HARDWARE;
+	} else {
+		pPipe->pDevice->pFirmware->command(pPipe->pDevice, pPipe, pBuffer, size);
+	}
+	pthread_mutex_unlock(&pPipe->pDevice->mutex);
+
+	// The answers may be waited for on a queued read
+	if ( (retVal == canOK) && (semaUsbEmuWork != NULL) )  {
+		dispatch_semaphore_signal(semaUsbEmuWork);
+	}
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_usbEmuControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 requestType,
+		UInt8 request,
+		UInt16 value,
+		UInt16 index,
+		void *pData,
+		UInt16 length,
+		UInt16 *pDone
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = CAN4OSX_usbEmuGetPipe(pSelf);
+canStatus retVal;
+
+	(void)request;
+	(void)value;
+	(void)index;
+
+	if ( (pPipe == NULL) || (pPipe->pDevice->pFirmware->control == NULL) )  {
+		return(canERR_HARDWARE);
+	}
+
+	pthread_mutex_lock(&pPipe->pDevice->mutex);
+	retVal = pPipe->pDevice->pFirmware->control(pPipe->pDevice, requestType, pData, length, pDone);
+	pthread_mutex_unlock(&pPipe->pDevice->mutex);
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbEmuClose(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+CAN4OSX_USB_EMU_PIPE_T *pPipe = CAN4OSX_usbEmuGetPipe(pSelf);
+
+	if (pPipe != NULL)  {
+		pthread_mutex_lock(&pPipe->pDevice->mutex);
+		pPipe->closed = true;
+		pthread_mutex_unlock(&pPipe->pDevice->mutex);
+	}
+}
+
+
+const CAN4OSX_USB_TRANSPORT_T can4osxUsbEmuTransport = {
+	.bulkInSubmit = CAN4OSX_usbEmuBulkInSubmit,
+	.bulkOutSubmit = CAN4OSX_usbEmuBulkOutSubmit,
+	.bulkInRead = CAN4OSX_usbEmuBulkInRead,
+	.bulkOutWrite = CAN4OSX_usbEmuBulkOutWrite,
+	.controlRequest = CAN4OSX_usbEmuControlRequest,
+	.close = CAN4OSX_usbEmuClose,
+};
+
+
+#pragma mark API
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbEmuAddDevice - add an emulated USB device
+ *
+ * productId picks the firmware, one of the devices of can4osxSupportedDevices.
+ * Must be called before canInitializeLibrary, the devices are attached with
+ * the virtual ones after the real devices.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_usbEmuAddDevice(
+		UInt16 productId,
+		const CAN4OSX_USB_EMU_CONFIG_T *pConfig
+	)
+{
+const CAN4OSX_USB_EMU_FIRMWARE_T *pFirmware = NULL;
+CAN4OSX_USB_EMU_DEVICE_T *pDevice;
+UInt32 idCount;
+UInt32 idMax;
+UInt8 channelCount;
+
+	if (pConfig == NULL)  {
+		return(canERR_PARAM);
+	}
+
+	if (can4osxUsbEmuAttached)  {
+		return(canERR_NOT_IMPLEMENTED);
+	}
+
+	for (UInt32 i = 0u; i < (sizeof(can4osxUsbEmuFirmware) / sizeof(can4osxUsbEmuFirmware[0])); i++)  {
+		if (can4osxUsbEmuFirmware[i].productId == productId)  {
+			pFirmware = &can4osxUsbEmuFirmware[i];
+		}
+	}
+	if (pFirmware == NULL)  {
+		return(canERR_PARAM);
+	}
+
+	channelCount = (pConfig->channelCount != 0u) ? pConfig->channelCount : pFirmware->channelCount;
+	idCount = (pConfig->idCount != 0u) ? pConfig->idCount : 1u;
+	idMax = (pConfig->flags & CAN4OSX_USB_EMU_EXT) ? 0x1fffffffu : 0x7ffu;
+
+	if ( (channelCount > pFirmware->channelMax) || (pConfig->canId > idMax) || ((idCount - 1u) > (idMax - pConfig->canId)) )  {
+		return(canERR_PARAM);
+	}
+
+	if (pConfig->flags & (CAN4OSX_USB_EMU_FD | CAN4OSX_USB_EMU_BRS))  {
+		if ( !pFirmware->fdCapable || !(pConfig->flags & CAN4OSX_USB_EMU_FD)
+			|| (CAN4OSX_encodeFdDlc(pConfig->dataLength) == 0xffu) )  {
+			return(canERR_PARAM);
+		}
+	} else if (pConfig->dataLength > 8u)  {
+		return(canERR_PARAM);
+	}
+
+	if (can4osxUsbEmuDeviceCount >= CAN4OSX_USB_EMU_MAX_DEVICES)  {
+		return(canERR_NOMEM);
+	}
+
+	pDevice = &can4osxUsbEmuDevice[can4osxUsbEmuDeviceCount];
+	memset(pDevice, 0u, sizeof(CAN4OSX_USB_EMU_DEVICE_T));
+	pDevice->pFirmware = pFirmware;
+	pDevice->config = *pConfig;
+	pDevice->config.idCount = idCount;
+	pDevice->channelCount = channelCount;
+	pthread_mutex_init(&pDevice->mutex, NULL);
+
+	for (UInt8 i = 0u; i < channelCount; i++)  {
+		pDevice->channel[i].frameRate = pConfig->frameRate;
+	}
+
+	can4osxUsbEmuDeviceCount++;
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbEmuSetFrameRate - change the traffic of an emulated channel
+ *
+ * Takes effect right away, the new rate counts from now on. The frames of
+ * the old rate the host did not read yet are dropped.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_usbEmuSetFrameRate(
+		const CanHandle hnd,
+		UInt32 frameRate
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+CAN4OSX_USB_EMU_PIPE_T *pPipe;
+CAN4OSX_USB_EMU_DEVICE_T *pDevice;
+CAN4OSX_USB_EMU_CHANNEL_T *pChannel;
+
+	pSelf = CAN4OSX_GetHandleEntry(hnd);
+	if (pSelf == NULL)  {
+		return(canERR_INVHANDLE);
+	}
+
+	if (pSelf->usbTransport != &can4osxUsbEmuTransport)  {
+		return(canERR_NOTFOUND);
+	}
+
+	pPipe = atomic_load(&CAN4OSX_CHANNEL(pSelf->channelIndex - pSelf->deviceChannel)->usbTransportChannel);
+	if (pPipe == NULL)  {
+		return(canERR_NOTFOUND);
+	}
+
+	pDevice = pPipe->pDevice;
+	pChannel = &pDevice->channel[pSelf->deviceChannel];
+
+	pthread_mutex_lock(&pDevice->mutex);
+	pChannel->frameRate = frameRate;
+	CAN4OSX_usbEmuFrameStart(pDevice, pChannel);
+	pthread_mutex_unlock(&pDevice->mutex);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbEmuGetTxFrames - frames the firmware got from the host
+ *
+ * Counts the transmit commands that reached the emulated firmware for the
+ * channel of hnd, whatever pipe of the device they came through.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_usbEmuGetTxFrames(
+		const CanHandle hnd,
+		UInt32 *pFrames
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+CAN4OSX_USB_EMU_PIPE_T *pPipe;
+CAN4OSX_USB_EMU_DEVICE_T *pDevice;
+
+	pSelf = CAN4OSX_GetHandleEntry(hnd);
+	if ( (pSelf == NULL) || (pFrames == NULL) )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if (pSelf->usbTransport != &can4osxUsbEmuTransport)  {
+		return(canERR_NOTFOUND);
+	}
+
+	pPipe = atomic_load(&CAN4OSX_CHANNEL(pSelf->channelIndex - pSelf->deviceChannel)->usbTransportChannel);
+	if (pPipe == NULL)  {
+		return(canERR_NOTFOUND);
+	}
+
+	pDevice = pPipe->pDevice;
+
+	pthread_mutex_lock(&pDevice->mutex);
+	*pFrames = pDevice->channel[pSelf->deviceChannel].txFrames;
+	pthread_mutex_unlock(&pDevice->mutex);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbEmuAttachDevices - add the emulated devices
+ *
+ * Called on the driver thread with the virtual devices. Each device gets the
+ * entries of its channels like a real one, the emulator thread starts once
+ * the first one is there.
+ *
+ */
+void CAN4OSX_usbEmuAttachDevices(
+		void
+	)
+{
+	can4osxUsbEmuAttached = true;
+
+	for (UInt32 i = 0u; i < can4osxUsbEmuDeviceCount; i++)  {
+	CAN4OSX_USB_EMU_DEVICE_T *pDevice = &can4osxUsbEmuDevice[i];
+	Can4osxUsbDeviceHandleEntry *pEntry = CAN4OSX_usbNextDevice();
+
+		if (pEntry == NULL)  {
+			return;
+		}
+
+		pEntry->usbTransport = &can4osxUsbEmuTransport;
+		pEntry->endpointNumberBulkIn = 1u;
+		pEntry->endpointNumberBulkOut = 2u;
+		pEntry->endpointMaxSizeBulkIn = CAN4OSX_USB_EMU_PACKET_SIZE;
+		pEntry->endpointMaxSizeBulkOut = CAN4OSX_USB_EMU_PACKET_SIZE;
+		pEntry->deviceChannel = 0u;
+		pDevice->startNs = CAN4OSX_HostNs();
+
+		if (CAN4OSX_usbEmuCreatePipe(pDevice, pEntry) == NULL)  {
+			return;
+		}
+
+		if (queueUsbEmu == NULL)  {
+			semaUsbEmuWork = dispatch_semaphore_create(0);
+			queueUsbEmu = dispatch_queue_create("com.can4osx.usbemu", 0);
+			dispatch_async(queueUsbEmu, ^{
+				CAN4OSX_usbEmuRun();
+			});
+		}
+
+		CAN4OSX_usbAddDevice(pEntry, pDevice->pFirmware->productId);
+	}
+}
+
+#endif /* CAN4OSX_USB_EMULATION */
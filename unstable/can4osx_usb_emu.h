@@ -0,0 +1,111 @@
+//
+//  can4osx_usb_emu.h
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+#ifndef CAN4OSX_USB_EMU_H
+#define CAN4OSX_USB_EMU_H 1
+
+#include "can4osx.h"
+#include "can4osx_internal.h"
+
+/* Firmware emulation of the supported USB devices, see can4osx_usb_emu.c.
+ * Only for load tests and profiling of the device codecs, off by default. */
+#ifndef CAN4OSX_USB_EMULATION
+#define CAN4OSX_USB_EMULATION 0
+#endif
+
+#if CAN4OSX_USB_EMULATION
+
+/* most emulated devices, each one takes its channels from the channel table */
+#ifndef CAN4OSX_USB_EMU_MAX_DEVICES
+#define CAN4OSX_USB_EMU_MAX_DEVICES     4u
+#endif
+
+/* how often the firmware puts the due frames on the bus, in us */
+#ifndef CAN4OSX_USB_EMU_TICK_US
+#define CAN4OSX_USB_EMU_TICK_US         1000u
+#endif
+
+/* frames the firmware holds per channel when the host does not read, the
+ * frames beyond are lost and the next one carries the overrun flag */
+#ifndef CAN4OSX_USB_EMU_FW_QUEUE
+#define CAN4OSX_USB_EMU_FW_QUEUE        256u
+#endif
+
+/* flags of CAN4OSX_USB_EMU_CONFIG_T */
+#define CAN4OSX_USB_EMU_EXT     0x01u   /* 29 bit ids */
+#define CAN4OSX_USB_EMU_FD      0x02u   /* CAN FD frames, not for the Leaf */
+#define CAN4OSX_USB_EMU_BRS     0x04u   /* with bit rate switch */
+
+/* the traffic an emulated device receives on each channel that is on bus.
+ * The frames use the ids canId up to canId + idCount - 1 in turn, the first
+ * four data bytes are a counter per channel, so lost frames can be found */
+typedef struct {
+    UInt32 frameRate;       /* frames per second and channel, 0 for none */
+    UInt32 canId;
+    UInt32 idCount;         /* 0 is the same as 1 */
+    UInt8  dataLength;      /* bytes per frame, 8 at most without CAN4OSX_USB_EMU_FD */
+    UInt8  flags;           /* CAN4OSX_USB_EMU_xxx */
+    UInt8  channelCount;    /* 0 for the channels of the real device */
+} CAN4OSX_USB_EMU_CONFIG_T;
+
+
+/* Adds an emulated device with the product id of one of the supported
+   devices, before canInitializeLibrary. Its channels come after the USB ones */
+canStatus CAN4OSX_usbEmuAddDevice(UInt16 productId, const CAN4OSX_USB_EMU_CONFIG_T *pConfig);
+
+/* Changes the frame rate of one channel of an emulated device */
+canStatus CAN4OSX_usbEmuSetFrameRate(const CanHandle hnd, UInt32 frameRate);
+
+/* Transmit frames of a channel that reached the emulated firmware */
+canStatus CAN4OSX_usbEmuGetTxFrames(const CanHandle hnd, UInt32 *pFrames);
+
+/* called by the driver thread with the virtual devices */
+void CAN4OSX_usbEmuAttachDevices(void);
+
+extern const CAN4OSX_USB_TRANSPORT_T can4osxUsbEmuTransport;
+
+#endif /* CAN4OSX_USB_EMULATION */
+
+
+#endif /* CAN4OSX_USB_EMU_H */
@@ -0,0 +1,696 @@
+//
+//  can4osx_usb_iokit.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+#ifdef __APPLE__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOMessage.h>
+#include <IOKit/IOCFPlugIn.h>
+#include <IOKit/usb/IOUSBLib.h>
+
+#include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
+#include "can4osx_debug.h"
+
+
+/* The IOKit side of the USB transfers. The pipes are the ones of the
+ * interface CAN4OSX_FindInterfaces opened, the completions run on the run
+ * loop of the driver thread.
+ */
+
+static IONotificationPortRef can4osxUsbNotificationPortRef = 0;
+static io_iterator_t *can4osxIoIterator = NULL;
+static CFRunLoopRef can4osxRunLoopRef = NULL;
+
+
+static void CAN4OSX_DeviceAdded(void *refCon, io_iterator_t iterator);
+static IOReturn CAN4OSX_ConfigureDevice(IOUSBDeviceInterface182 **dev);
+static IOReturn CAN4OSX_FindInterfaces(Can4osxUsbDeviceHandleEntry *handle);
+static void CAN4OSX_DeviceNotification(void *refCon, io_service_t service, natural_t messageType, void *messageArgument);
+static IOReturn CAN4OSX_Dealloc(Can4osxUsbDeviceHandleEntry	*self);
+
+
+/******************************************************************************/
+static void CAN4OSX_iokitBulkInCompletion(
+		void *refCon,
+		IOReturn result,
+		void *arg0
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+
+	if (result != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("Error from async bulk read (%08x)\n", result);
+	}
+
+	CAN4OSX_usbBulkInDone(pSelf, (result == kIOReturnSuccess) ? canOK : canERR_HARDWARE, (UInt32)(uintptr_t)arg0);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_iokitBulkOutCompletion(
+		void *refCon,
+		IOReturn result,
+		void *arg0
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+
+	(void)arg0;
+
+	if (result != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
+	}
+
+	CAN4OSX_usbBulkOutDone(pSelf, (result == kIOReturnSuccess) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_iokitBulkInSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
+IOReturn ret;
+
+	if (atomic_load(pSelf->can4osxInterfaceClosed))  {
+		return(canERR_HARDWARE);
+	}
+
+	ret = (*interface)->ReadPipeAsync(interface, pSelf->endpointNumberBulkIn, pBuffer, size, CAN4OSX_iokitBulkInCompletion, (void*)pSelf);
+
+	return((ret == kIOReturnSuccess) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_iokitBulkOutSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
+IOReturn ret;
+
+	if (atomic_load(pSelf->can4osxInterfaceClosed))  {
+		return(canERR_HARDWARE);
+	}
+
+	ret = (*interface)->WritePipeAsync(interface, pSelf->endpointNumberBulkOut, (void *)pBuffer, size, CAN4OSX_iokitBulkOutCompletion, (void*)pSelf);
+
+	return((ret == kIOReturnSuccess) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_iokitBulkInRead(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 *pBuffer,
+		UInt32 *pSize
+	)
+{
+CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
+IOReturn ret;
+
+	if (atomic_load(pSelf->can4osxInterfaceClosed))  {
+		return(canERR_HARDWARE);
+	}
+
+	ret = (*interface)->ReadPipe(interface, pSelf->endpointNumberBulkIn, pBuffer, pSize);
+
+	return((ret == kIOReturnSuccess) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_iokitBulkOutWrite(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
+IOReturn ret;
+
+	if (atomic_load(pSelf->can4osxInterfaceClosed))  {
+		return(canERR_HARDWARE);
+	}
+
+	ret = (*interface)->WritePipe(interface, pSelf->endpointNumberBulkOut, (void *)pBuffer, size);
+
+	return((ret == kIOReturnSuccess) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_iokitControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 requestType,
+		UInt8 request,
+		UInt16 value,
+		UInt16 index,
+		void *pData,
+		UInt16 length,
+		UInt16 *pDone
+	)
+{
+IOUSBDevRequest devRequest;
+IOReturn ret;
+
+	devRequest.bmRequestType = requestType;
+	devRequest.bRequest = request;
+	devRequest.wValue = value;
+	devRequest.wIndex = index;
+	devRequest.wLength = length;
+	devRequest.pData = pData;
+	devRequest.wLenDone = 0u;
+
+	ret = (*(pSelf->can4osxDeviceInterface))->DeviceRequest(pSelf->can4osxDeviceInterface, &devRequest);
+
+	*pDone = (UInt16)devRequest.wLenDone;
+
+	return((ret == kIOReturnSuccess) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_iokitClose(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
+
+	// Every failed transfer of the channels of the device closes, once is enough
+	if (atomic_exchange(pSelf->can4osxInterfaceClosed, true))  {
+		return;
+	}
+
+	(void) (*interface)->USBInterfaceClose(interface);
+	(void) (*interface)->Release(interface);
+}
+
+
+const CAN4OSX_USB_TRANSPORT_T can4osxUsbIoKitTransport = {
+	.bulkInSubmit = CAN4OSX_iokitBulkInSubmit,
+	.bulkOutSubmit = CAN4OSX_iokitBulkOutSubmit,
+	.bulkInRead = CAN4OSX_iokitBulkInRead,
+	.bulkOutWrite = CAN4OSX_iokitBulkOutWrite,
+	.controlRequest = CAN4OSX_iokitControlRequest,
+	.close = CAN4OSX_iokitClose,
+};
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbDriverThread - find the devices and run the run loop
+ *
+ * Runs on the queue of canInitializeLibrary, returns only when the run loop
+ * is stopped.
+ *
+ */
+void CAN4OSX_usbDriverThread(
+		dispatch_semaphore_t semaStarted
+	)
+{
+UInt16 loopCount = 0;
+
+CFMutableDictionaryRef 	can4osxUsbMatchingDictRef;
+CFRunLoopSourceRef		can4osxRunLoopSourceRef;
+CFNumberRef				numberRef;
+
+	can4osxRunLoopRef = CFRunLoopGetCurrent();
+
+	can4osxUsbNotificationPortRef = IONotificationPortCreate(kIOMasterPortDefault);
+	can4osxRunLoopSourceRef = IONotificationPortGetRunLoopSource(can4osxUsbNotificationPortRef);
+
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), can4osxRunLoopSourceRef, kCFRunLoopDefaultMode);
+
+	can4osxIoIterator = calloc(can4osxSupportedDeviceCount, sizeof(io_iterator_t));
+	if (can4osxIoIterator == NULL)  {
+		dispatch_semaphore_signal(semaStarted);
+		return;
+	}
+
+	for ( loopCount = 0; loopCount < can4osxSupportedDeviceCount; loopCount++ ) {
+
+		// Not a USB device
+		if (can4osxSupportedDevices[loopCount].vendorId > 0xFFFFu)  {
+			continue;
+		}
+
+		can4osxUsbMatchingDictRef = IOServiceMatching(kIOUSBDeviceClassName);
+
+		// IOUSBDevice and its subclasses
+		if (can4osxUsbMatchingDictRef == NULL)  {
+			CAN4OSX_DEBUG_PRINT("%s : IOServiceMatching ret: NULL.\n",__func__);
+			return;
+		}
+
+		// Create a CFNumber for the idVendor and set the value in the dictionary
+		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].vendorId );
+		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBVendorID), numberRef);
+		CFRelease(numberRef);
+
+		// Create a CFNumber for the idProduct and set the value in the dictionary
+		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].productId);
+		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBProductID), numberRef);
+		CFRelease(numberRef);
+
+		IOServiceAddMatchingNotification(can4osxUsbNotificationPortRef, kIOFirstMatchNotification, can4osxUsbMatchingDictRef, CAN4OSX_DeviceAdded, NULL, &can4osxIoIterator[loopCount]);
+
+
+		numberRef = NULL;
+
+		CAN4OSX_DeviceAdded(NULL, can4osxIoIterator[loopCount]);
+
+	}
+
+	CAN4OSX_AddVirtualDevices();
+
+	dispatch_semaphore_signal(semaStarted);
+	CFRunLoopRun();
+
+	// if the runloop is stopped release
+	for ( loopCount = 0; loopCount < can4osxSupportedDeviceCount; loopCount++ ) {
+		IOObjectRelease(can4osxIoIterator[loopCount]);
+	}
+	free(can4osxIoIterator);
+	can4osxIoIterator = NULL;
+
+	IONotificationPortDestroy(can4osxUsbNotificationPortRef);
+
+}
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbRunOnDriverThread - run a block on the USB run loop
+ *
+ * All completions and so all decoders run on this run loop, while the block
+ * runs none of them touches a handle. Returns when the block is done.
+ *
+ */
+void CAN4OSX_usbRunOnDriverThread(
+		dispatch_block_t block
+	)
+{
+dispatch_semaphore_t semaDone;
+
+	if ( CFRunLoopGetCurrent() == can4osxRunLoopRef )  {
+		block();
+		return;
+	}
+
+	semaDone = dispatch_semaphore_create(0);
+
+	CFRunLoopPerformBlock(can4osxRunLoopRef, kCFRunLoopDefaultMode, ^{
+		block();
+		dispatch_semaphore_signal(semaDone);
+	});
+	CFRunLoopWakeUp(can4osxRunLoopRef);
+
+	dispatch_semaphore_wait(semaDone, DISPATCH_TIME_FOREVER);
+	dispatch_release(semaDone);
+}
+
+
+static void CAN4OSX_DeviceAdded(
+		void *refCon,
+		io_iterator_t iterator
+	)
+{
+kern_return_t kernRetVal;
+SInt32                 score;
+HRESULT                result;
+UInt16                 productId;
+
+io_service_t           can4osxUsbDevice;
+IOCFPlugInInterface  **can4osxPluginInterface = NULL;
+Can4osxUsbDeviceHandleEntry *pDevice;
+
+	while ( (can4osxUsbDevice = IOIteratorNext(iterator) ) )  {
+
+		CAN4OSX_DEBUG_PRINT("%s : Device added\n", __func__);
+
+		pDevice = CAN4OSX_usbNextDevice();
+		if (pDevice == NULL)  {
+			IOObjectRelease(can4osxUsbDevice);
+			return;
+		}
+
+
+		kernRetVal = IOCreatePlugInInterfaceForService(can4osxUsbDevice, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID,
+											   &can4osxPluginInterface, &score);
+
+		if ((kIOReturnSuccess != kernRetVal) || !can4osxPluginInterface)  {
+			CAN4OSX_DEBUG_PRINT("%s : IOCreatePlugInInterfaceForService ret: 0x%08x.\n",__func__,kernRetVal);
+			IOObjectRelease(can4osxUsbDevice);
+			continue;
+		}
+
+		// Use the plugin interface to retrieve the device interface.
+		result = (*can4osxPluginInterface)->QueryInterface(can4osxPluginInterface, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID),
+												 (LPVOID*) &(pDevice->can4osxDeviceInterface));
+
+		// Now done with the plugin interface.
+		(*can4osxPluginInterface)->Release(can4osxPluginInterface);
+
+		if (result || (pDevice->can4osxDeviceInterface == NULL) )  {
+			CAN4OSX_DEBUG_PRINT("%s : Could not create interface\n", __func__);
+			IODestroyPlugInInterface(can4osxPluginInterface);
+			IOObjectRelease(can4osxUsbDevice);
+			continue;
+		}
+
+
+		// Open the device to change its state
+		kernRetVal = (*pDevice->can4osxDeviceInterface)->USBDeviceOpen(pDevice->can4osxDeviceInterface);
+		if (kernRetVal != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to open device: %08x\n", __func__,kernRetVal);
+			(void) (*pDevice->can4osxDeviceInterface)->Release(pDevice->can4osxDeviceInterface);
+			IODestroyPlugInInterface(can4osxPluginInterface);
+			IOObjectRelease(can4osxUsbDevice);
+			continue;
+		}
+
+		//Configure device
+		kernRetVal = CAN4OSX_ConfigureDevice(pDevice->can4osxDeviceInterface);
+		if (kernRetVal != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to configure device: %08x\n", __func__,kernRetVal);
+			(void) (*pDevice->can4osxDeviceInterface)->USBDeviceClose(pDevice->can4osxDeviceInterface);
+			(void) (*pDevice->can4osxDeviceInterface)->Release(pDevice->can4osxDeviceInterface);
+			IODestroyPlugInInterface(can4osxPluginInterface);
+			IOObjectRelease(can4osxUsbDevice);
+			continue;
+		}
+
+
+		/*kernRetVal = */CAN4OSX_FindInterfaces(pDevice);
+
+		kernRetVal = IOServiceAddInterestNotification(can4osxUsbNotificationPortRef,			// notifyPort
+											  can4osxUsbDevice,                                 // service
+											  kIOGeneralInterest,                               // interestType
+											  CAN4OSX_DeviceNotification,                       // callback
+											  pDevice,											// refCon
+											  &(pDevice->can4osxNotification)					// notification
+											  );
+
+		if (KERN_SUCCESS != kernRetVal)  {
+			CAN4OSX_DEBUG_PRINT("%s : IOServiceAddInterestNotification ret: 0x%08x.\n",__func__,kernRetVal);
+		}
+
+		// Read out the product ID of the device
+		productId = 0u;
+		(*pDevice->can4osxDeviceInterface)->GetDeviceProduct(pDevice->can4osxDeviceInterface, &productId);
+
+		// Done with this USB device; release the reference added by IOIteratorNext
+		(void)IOObjectRelease(can4osxUsbDevice);
+
+		CAN4OSX_usbAddDevice(pDevice, productId);
+
+	}
+}
+
+
+static IOReturn CAN4OSX_ConfigureDevice(
+		IOUSBDeviceInterface182 **dev
+	)
+{
+UInt8 numConfig;
+IOReturn kr;
+IOUSBConfigurationDescriptorPtr configDesc;
+
+	/*kr = */(*dev)->GetNumberOfConfigurations(dev, &numConfig);
+	if (!numConfig)  {
+		return(-1);
+	}
+	//Get the configuration descriptor for index 0
+	kr = (*dev)->GetConfigurationDescriptorPtr(dev, 0, &configDesc);
+	if (kr)  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not get configuration descriptor for index %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
+		return(-1);
+	}
+	//Set the device’s configuration.
+	kr = (*dev)->SetConfiguration(dev, configDesc->bConfigurationValue);
+	if (kr)  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not set configuration to value %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
+		return(-1);
+	}
+	return(kIOReturnSuccess);
+}
+
+
+static IOReturn CAN4OSX_FindInterfaces(
+		Can4osxUsbDeviceHandleEntry *handle
+	)
+{
+IOReturn ret, ret2;
+IOUSBFindInterfaceRequest request;
+io_iterator_t iterator;
+io_service_t usbInterface;
+IOCFPlugInInterface **plugInInterface = NULL;
+CAN4OSX_USB_INTERFACE **interface = NULL;
+HRESULT result;
+SInt32 score;
+UInt8 interfaceNumEndpoints;
+IOUSBDeviceInterface182 **device = handle->can4osxDeviceInterface;
+int loopCount = 1;
+
+CFRunLoopSourceRef runLoopSource;
+
+	request.bInterfaceClass	= kIOUSBFindInterfaceDontCare;
+	request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
+	request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+	request.bAlternateSetting  = kIOUSBFindInterfaceDontCare;
+
+	//Get an iterator for the interfaces on the device
+	ret = (*device)->CreateInterfaceIterator(device, &request, &iterator);
+
+	if ( ret != kIOReturnSuccess )  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not create InterfaceIterator\n",__func__);
+		return(ret);
+	}
+
+	while ((usbInterface = IOIteratorNext(iterator)))  {
+		//Create an intermediate plug-in
+		ret = IOCreatePlugInInterfaceForService(usbInterface,
+											   kIOUSBInterfaceUserClientTypeID,
+											   kIOCFPlugInInterfaceID,
+											   &plugInInterface, &score);
+		//Release the usbInterface object after getting the plug-in
+		(void)IOObjectRelease(usbInterface);
+
+		if ((ret != kIOReturnSuccess) || !plugInInterface)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to create a plug-in\n", __func__);
+			break;
+		}
+
+		//Now create the device interface for the interface
+		result = (*plugInInterface)->QueryInterface(plugInInterface, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID *) &interface);
+		//No longer need the intermediate plug-in
+		(*plugInInterface)->Release(plugInInterface);
+		if (result || !interface)  {
+			CAN4OSX_DEBUG_PRINT("%s : Could not create a device interface for the interface (%08x)\n", __func__,(int) result);
+			break;
+		}
+
+		//Now open the interface. This will cause the pipes associated with
+		//the endpoints in the interface descriptor to be instantiated
+		ret = (*interface)->USBInterfaceOpen(interface);
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to open interface (%08x)\n", __func__,ret);
+			(void) (*interface)->Release(interface);
+			continue;
+		}
+
+		//Get the number of endpoints associated with this interface
+		ret = (*interface)->GetNumEndpoints(interface, &interfaceNumEndpoints);
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to get number of endpoints (%08x)\n",__func__ ,ret);
+			(void) (*interface)->USBInterfaceClose(interface);
+			(void) (*interface)->Release(interface);
+			continue;
+		}
+
+		CAN4OSX_DEBUG_PRINT("%s : Interface has %d endpoints\n",__func__, interfaceNumEndpoints);
+
+		// Reset the endpoint numbers
+		handle->endpointNumberBulkIn = 0u;
+		handle->endpointNumberBulkOut = 0u;
+
+		for (loopCount = 1; loopCount <= interfaceNumEndpoints; loopCount++ ) {
+			UInt8 direction;
+			UInt8 number;
+			UInt8 transferType;
+			UInt16 maxPacketSize;
+			UInt8 interval;
+
+			ret2 = (*interface)->GetPipeProperties(interface, loopCount, &direction, &number, &transferType, &maxPacketSize, &interval);
+
+			if (ret2 != kIOReturnSuccess)  {
+				CAN4OSX_DEBUG_PRINT("%s : Unable to get properties of pipe %d (%08x)\n",__func__ ,loopCount, ret2);
+			} else {
+				if ( (direction == kUSBOut) && (transferType == kUSBBulk) )  {
+					CAN4OSX_DEBUG_PRINT("%s : Found BulkOut endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
+					if (handle->endpointNumberBulkOut == 0)  {
+						handle->endpointNumberBulkOut = loopCount;
+						handle->endpointMaxSizeBulkOut = maxPacketSize;
+					}
+				}
+
+				if ( (direction == kUSBIn) && (transferType == kUSBBulk) )  {
+					CAN4OSX_DEBUG_PRINT("%s : Found BulkIn endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
+					if (handle->endpointNumberBulkIn == 0u)  {
+						handle->endpointNumberBulkIn = loopCount;
+						handle->endpointMaxSizeBulkIn = maxPacketSize;
+					}
+				}
+			}
+		}
+
+		// Not freed with the device, a late completion may still close
+		handle->can4osxInterfaceClosed = malloc(sizeof(_Atomic Boolean));
+		if (handle->can4osxInterfaceClosed == NULL)  {
+			(void) (*interface)->USBInterfaceClose(interface);
+			(void) (*interface)->Release(interface);
+			continue;
+		}
+		atomic_init(handle->can4osxInterfaceClosed, false);
+
+		ret = (*interface)->CreateInterfaceAsyncEventSource(interface, &runLoopSource);
+
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to create asynchronous event source (%08x)\n", __func__,ret);
+			(void) (*interface)->USBInterfaceClose(interface);
+			(void) (*interface)->Release(interface);
+			free(handle->can4osxInterfaceClosed);
+			handle->can4osxInterfaceClosed = NULL;
+			continue;
+		}
+		CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
+		CAN4OSX_DEBUG_PRINT("%s : Asynchronous event source added to run loop\n", __func__);
+
+		//Save the interface, the codecs reach it through the transport
+		handle->can4osxInterfaceInterface = interface;
+		handle->usbTransport = &can4osxUsbIoKitTransport;
+
+		//Right now only the first interface is supported
+		break;
+	}
+	return(ret);
+}
+
+
+static void CAN4OSX_DeviceNotification(
+		void *refCon, io_service_t service,
+		natural_t messageType,
+		void *messageArgument
+	)
+{
+Can4osxUsbDeviceHandleEntry	*pSelf = (Can4osxUsbDeviceHandleEntry *) refCon;
+
+	if (messageType == kIOMessageServiceIsTerminated)  {
+		CAN4OSX_DEBUG_PRINT("%s : Device removed. Channel number %d\n",__func__, pSelf->channelNumber);
+
+		CAN4OSX_Dealloc(pSelf);
+	}
+}
+
+
+static IOReturn CAN4OSX_Dealloc(
+		Can4osxUsbDeviceHandleEntry	*pSelf
+	)
+{
+kern_return_t retval;
+UInt32 first = pSelf->channelIndex - pSelf->deviceChannel;
+UInt32 count = (pSelf->deviceChannelCount > 1) ? (UInt32)pSelf->deviceChannelCount : 1u;
+UInt32 i;
+
+	// Release the usb stuff
+
+	if (pSelf->can4osxDeviceInterface)  {
+		/*retval = */(*pSelf->can4osxDeviceInterface)->Release(pSelf->can4osxDeviceInterface);
+	}
+
+	//if(self->can4osxInterfaceInterface) {
+	//	(void)(*self->can4osxInterfaceInterface)->Release(self->can4osxInterfaceInterface);
+	//}
+
+
+	// Release the notification
+
+	retval = IOObjectRelease(pSelf->can4osxNotification);
+
+	// FIXME test return value
+	if (0)  {
+		return(retval);
+	}
+
+	// Now release  the dive internal stuff, the refCon is the first channel
+	if (first + count > CAN4OSX_ChannelCount())  {
+		count = CAN4OSX_ChannelCount() - first;
+	}
+	for (i = 0u; i < count; i++)  {
+		Can4osxUsbDeviceHandleEntry *pChannel = CAN4OSX_CHANNEL(first + i);
+
+		if (pChannel->channelNumber >= 0)  {
+			CAN4OSX_usbRemoveDevice(pChannel);
+		}
+	}
+
+	return(retval);
+
+}
+
+#endif /* __APPLE__ */
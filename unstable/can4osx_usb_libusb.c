@@ -0,0 +1,765 @@
+//
+//  can4osx_usb_libusb.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+
+#ifndef __APPLE__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
+#include "can4osx_debug.h"
+
+
+/* The libusb side of the USB transfers, for hosts without IOKit. The driver
+ * thread owns the libusb context: it handles the events, so all completions
+ * run on it like on the run loop of the IOKit side, and it sets up and
+ * removes the devices. Every endpoint buffer has its own transfer, so all
+ * buffers of the core are queued on the endpoint at the same time.
+ */
+
+/* timeout of the synchronous transfers in ms, the queued reads have none */
+#define CAN4OSX_LIBUSB_TIMEOUT_MS 1000u
+
+/* only the first interface is supported, like on the IOKit side */
+#define CAN4OSX_LIBUSB_INTERFACE 0
+
+/* state of the transfers of a channel, allocated on the first use. Kept out
+ * of the handle, the channels of a multi channel device start as copies of
+ * the first one. */
+typedef struct {
+	struct libusb_transfer *transferIn[CAN4OSX_USB_BULKIN_BUFFER_COUNT];
+	struct libusb_transfer *transferOut[CAN4OSX_USB_BULKOUT_BUFFER_COUNT];
+	_Atomic UInt32 inFlight;
+	_Atomic Boolean closed;
+	Boolean removed;
+} CAN4OSX_LIBUSB_CHANNEL_T;
+
+// Stands in for the state of a channel when there is no memory for it
+static CAN4OSX_LIBUSB_CHANNEL_T can4osxLibusbNoChannel = { .closed = true };
+
+static libusb_context *can4osxLibusbContext = NULL;
+static pthread_t can4osxDriverThread;
+
+// CAN4OSX_usbRunOnDriverThread hands over one block at a time
+static pthread_mutex_t can4osxRunMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t can4osxRunPendingMutex = PTHREAD_MUTEX_INITIALIZER;
+static dispatch_block_t can4osxRunPending = NULL;
+static dispatch_semaphore_t can4osxRunDone = NULL;
+
+// Devices reported by the hotplug callback, set up after the events
+static libusb_device **can4osxLibusbArrived = NULL;
+static UInt32 can4osxLibusbArrivedCount = 0u;
+static UInt32 can4osxLibusbArrivedSize = 0u;
+
+
+/******************************************************************************/
+static CAN4OSX_LIBUSB_CHANNEL_T* CAN4OSX_libusbChannel(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+CAN4OSX_LIBUSB_CHANNEL_T *pChannel = atomic_load(&pSelf->usbTransportChannel);
+
+	if (pChannel == NULL)  {
+		CAN4OSX_LIBUSB_CHANNEL_T *pNew = calloc(1u, sizeof(CAN4OSX_LIBUSB_CHANNEL_T));
+
+		if (pNew == NULL)  {
+			return(&can4osxLibusbNoChannel);
+		}
+
+		// The synchronous transfers come from the application threads
+		if (atomic_compare_exchange_strong(&pSelf->usbTransportChannel, (void **)&pChannel, pNew))  {
+			pChannel = pNew;
+		} else {
+			free(pNew);
+		}
+	}
+
+	return(pChannel);
+}
+
+
+/******************************************************************************/
+static void LIBUSB_CALL CAN4OSX_libusbBulkInCompletion(
+		struct libusb_transfer *transfer
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)transfer->user_data;
+
+	atomic_fetch_sub(&CAN4OSX_libusbChannel(pSelf)->inFlight, 1u);
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)  {
+		CAN4OSX_DEBUG_PRINT("Error from async bulk read (%d)\n", transfer->status);
+	}
+
+	CAN4OSX_usbBulkInDone(pSelf, (transfer->status == LIBUSB_TRANSFER_COMPLETED) ? canOK : canERR_HARDWARE, (UInt32)transfer->actual_length);
+}
+
+
+/******************************************************************************/
+static void LIBUSB_CALL CAN4OSX_libusbBulkOutCompletion(
+		struct libusb_transfer *transfer
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)transfer->user_data;
+
+	atomic_fetch_sub(&CAN4OSX_libusbChannel(pSelf)->inFlight, 1u);
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)  {
+		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%d)\n", transfer->status);
+	}
+
+	CAN4OSX_usbBulkOutDone(pSelf, (transfer->status == LIBUSB_TRANSFER_COMPLETED) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_libusbSubmit - queue the transfer of an endpoint buffer
+ *
+ * The transfer of the buffer slot is allocated on the first use and filled
+ * again for every submit.
+ *
+ * \return canStatus
+ */
+static canStatus CAN4OSX_libusbSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		struct libusb_transfer **pTransfer,
+		int pipe,
+		UInt8 *pBuffer,
+		UInt32 size,
+		libusb_transfer_cb_fn callback
+	)
+{
+CAN4OSX_LIBUSB_CHANNEL_T *pChannel = CAN4OSX_libusbChannel(pSelf);
+int ret;
+
+	if ( atomic_load(&pChannel->closed) || (pipe <= 0) || (pipe > (int)CAN4OSX_USB_MAX_PIPES) )  {
+		return(canERR_HARDWARE);
+	}
+
+	if (*pTransfer == NULL)  {
+		*pTransfer = libusb_alloc_transfer(0);
+		if (*pTransfer == NULL)  {
+			return(canERR_NOMEM);
+		}
+	}
+
+	libusb_fill_bulk_transfer(*pTransfer, pSelf->can4osxDeviceHandle, pSelf->usbPipeAddress[pipe],
+							  pBuffer, (int)size, callback, pSelf, 0u);
+
+	atomic_fetch_add(&pChannel->inFlight, 1u);
+
+	ret = libusb_submit_transfer(*pTransfer);
+	if (ret != LIBUSB_SUCCESS)  {
+		atomic_fetch_sub(&pChannel->inFlight, 1u);
+		return(canERR_HARDWARE);
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_libusbBulkInSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+UInt32 slot = (UInt32)((pBuffer - (UInt8 *)pSelf->endpointBufferBulkInRef) / pSelf->endpointMaxSizeBulkIn);
+
+	if (slot >= CAN4OSX_USB_BULKIN_BUFFER_COUNT)  {
+		return(canERR_PARAM);
+	}
+
+	return(CAN4OSX_libusbSubmit(pSelf, &CAN4OSX_libusbChannel(pSelf)->transferIn[slot], pSelf->endpointNumberBulkIn,
+								pBuffer, size, CAN4OSX_libusbBulkInCompletion));
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_libusbBulkOutSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+UInt32 slot = (UInt32)((pBuffer - pSelf->endpointBufferBulkOutRef) / pSelf->endpointMaxSizeBulkOut);
+
+	if (slot >= CAN4OSX_USB_BULKOUT_BUFFER_COUNT)  {
+		return(canERR_PARAM);
+	}
+
+	return(CAN4OSX_libusbSubmit(pSelf, &CAN4OSX_libusbChannel(pSelf)->transferOut[slot], pSelf->endpointNumberBulkOut,
+								(UInt8 *)pBuffer, size, CAN4OSX_libusbBulkOutCompletion));
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_libusbBulkTransfer(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		int pipe,
+		UInt8 *pBuffer,
+		UInt32 *pSize
+	)
+{
+int done = 0;
+int ret;
+
+	if ( atomic_load(&CAN4OSX_libusbChannel(pSelf)->closed) || (pipe <= 0) || (pipe > (int)CAN4OSX_USB_MAX_PIPES) )  {
+		return(canERR_HARDWARE);
+	}
+
+	ret = libusb_bulk_transfer(pSelf->can4osxDeviceHandle, pSelf->usbPipeAddress[pipe], pBuffer, (int)*pSize, &done, CAN4OSX_LIBUSB_TIMEOUT_MS);
+
+	*pSize = (UInt32)done;
+
+	if (ret == LIBUSB_ERROR_TIMEOUT)  {
+		return(canERR_TIMEOUT);
+	}
+
+	return((ret == LIBUSB_SUCCESS) ? canOK : canERR_HARDWARE);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_libusbBulkInRead(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 *pBuffer,
+		UInt32 *pSize
+	)
+{
+	return(CAN4OSX_libusbBulkTransfer(pSelf, pSelf->endpointNumberBulkIn, pBuffer, pSize));
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_libusbBulkOutWrite(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
+{
+canStatus ret;
+UInt32 done = size;
+
+	ret = CAN4OSX_libusbBulkTransfer(pSelf, pSelf->endpointNumberBulkOut, (UInt8 *)pBuffer, &done);
+
+	if ( (ret == canOK) && (done != size) )  {
+		ret = canERR_HARDWARE;
+	}
+
+	return(ret);
+}
+
+
+/******************************************************************************/
+static canStatus CAN4OSX_libusbControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+		UInt8 requestType,
+		UInt8 request,
+		UInt16 value,
+		UInt16 index,
+		void *pData,
+		UInt16 length,
+		UInt16 *pDone
+	)
+{
+int ret;
+
+	*pDone = 0u;
+
+	if ( atomic_load(&CAN4OSX_libusbChannel(pSelf)->closed) )  {
+		return(canERR_HARDWARE);
+	}
+
+	ret = libusb_control_transfer(pSelf->can4osxDeviceHandle, requestType, request, value, index, pData, length, CAN4OSX_LIBUSB_TIMEOUT_MS);
+
+	if (ret < 0)  {
+		CAN4OSX_DEBUG_PRINT("%s : control request %02x failed (%d)\n", __func__, request, ret);
+		return((ret == LIBUSB_ERROR_TIMEOUT) ? canERR_TIMEOUT : canERR_HARDWARE);
+	}
+
+	*pDone = (UInt16)ret;
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_libusbClose - stop the transfers of a channel
+ *
+ * Cancels what is queued, the cancelled transfers still complete on the
+ * driver thread. The device itself is closed when it is removed.
+ */
+static void CAN4OSX_libusbClose(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+	)
+{
+CAN4OSX_LIBUSB_CHANNEL_T *pChannel = CAN4OSX_libusbChannel(pSelf);
+UInt32 i;
+
+	if ( atomic_exchange(&pChannel->closed, true) )  {
+		return;
+	}
+
+	// Not submitted ones return LIBUSB_ERROR_NOT_FOUND
+	for ( i = 0u; i < CAN4OSX_USB_BULKIN_BUFFER_COUNT; i++ )  {
+		if (pChannel->transferIn[i] != NULL)  {
+			(void)libusb_cancel_transfer(pChannel->transferIn[i]);
+		}
+	}
+	for ( i = 0u; i < CAN4OSX_USB_BULKOUT_BUFFER_COUNT; i++ )  {
+		if (pChannel->transferOut[i] != NULL)  {
+			(void)libusb_cancel_transfer(pChannel->transferOut[i]);
+		}
+	}
+}
+
+
+const CAN4OSX_USB_TRANSPORT_T can4osxUsbLibusbTransport = {
+	.bulkInSubmit = CAN4OSX_libusbBulkInSubmit,
+	.bulkOutSubmit = CAN4OSX_libusbBulkOutSubmit,
+	.bulkInRead = CAN4OSX_libusbBulkInRead,
+	.bulkOutWrite = CAN4OSX_libusbBulkOutWrite,
+	.controlRequest = CAN4OSX_libusbControlRequest,
+	.close = CAN4OSX_libusbClose,
+};
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_libusbFindDevice - first channel of a device
+ *
+ * \return the channel or NULL if the device is not in use
+ */
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_libusbFindDevice(
+		libusb_device *device
+	)
+{
+UInt32 i;
+
+	for ( i = 0u; i < CAN4OSX_ChannelCount(); i++ )  {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(i);
+
+		if ( (pSelf->channelNumber >= 0) && (pSelf->can4osxDeviceHandle != NULL) &&
+			 (libusb_get_device(pSelf->can4osxDeviceHandle) == device) )  {
+			return(pSelf);
+		}
+	}
+
+	return(NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_libusbFindEndpoints - number the endpoints like IOKit pipes
+ *
+ * The pipes are counted from 1 in the order of the interface descriptor, the
+ * drivers use these numbers. The first bulk pipe of each direction is taken.
+ */
+static void CAN4OSX_libusbFindEndpoints(
+		Can4osxUsbDeviceHandleEntry *handle,
+		const struct libusb_interface_descriptor *interface
+	)
+{
+int loopCount;
+
+	CAN4OSX_DEBUG_PRINT("%s : Interface has %d endpoints\n",__func__, interface->bNumEndpoints);
+
+	// Reset the endpoint numbers
+	handle->endpointNumberBulkIn = 0u;
+	handle->endpointNumberBulkOut = 0u;
+
+	for (loopCount = 1; (loopCount <= interface->bNumEndpoints) && (loopCount <= (int)CAN4OSX_USB_MAX_PIPES); loopCount++ ) {
+		const struct libusb_endpoint_descriptor *endpoint = &interface->endpoint[loopCount - 1];
+
+		handle->usbPipeAddress[loopCount] = endpoint->bEndpointAddress;
+
+		if ( (endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK )  {
+			continue;
+		}
+
+		if ( (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT )  {
+			CAN4OSX_DEBUG_PRINT("%s : Found BulkOut endpoint %d - maxPack: %d\n",__func__ ,loopCount, endpoint->wMaxPacketSize);
+			if (handle->endpointNumberBulkOut == 0)  {
+				handle->endpointNumberBulkOut = loopCount;
+				handle->endpointMaxSizeBulkOut = endpoint->wMaxPacketSize;
+			}
+		} else {
+			CAN4OSX_DEBUG_PRINT("%s : Found BulkIn endpoint %d - maxPack: %d\n",__func__ ,loopCount, endpoint->wMaxPacketSize);
+			if (handle->endpointNumberBulkIn == 0u)  {
+				handle->endpointNumberBulkIn = loopCount;
+				handle->endpointMaxSizeBulkIn = endpoint->wMaxPacketSize;
+			}
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_libusbDeviceAdded - open a device and start its driver
+ *
+ * Devices which are not in the list or already open are ignored.
+ */
+static void CAN4OSX_libusbDeviceAdded(
+		libusb_device *device
+	)
+{
+struct libusb_device_descriptor descriptor;
+struct libusb_config_descriptor *config = NULL;
+libusb_device_handle *deviceHandle = NULL;
+Can4osxUsbDeviceHandleEntry *pDevice;
+int configuration = 0;
+int ret;
+
+	if (libusb_get_device_descriptor(device, &descriptor) != LIBUSB_SUCCESS)  {
+		return;
+	}
+
+	if ( !CAN4OSX_usbSupportedDevice(descriptor.idVendor, descriptor.idProduct) ||
+		 (CAN4OSX_libusbFindDevice(device) != NULL) )  {
+		return;
+	}
+
+	CAN4OSX_DEBUG_PRINT("%s : Device added\n", __func__);
+
+	pDevice = CAN4OSX_usbNextDevice();
+	if (pDevice == NULL)  {
+		return;
+	}
+
+	ret = libusb_open(device, &deviceHandle);
+	if (ret != LIBUSB_SUCCESS)  {
+		CAN4OSX_DEBUG_PRINT("%s : Unable to open device: %d\n", __func__, ret);
+		return;
+	}
+
+	//Configure device with the first configuration, if it has not already
+	ret = libusb_get_config_descriptor(device, 0, &config);
+	if (ret == LIBUSB_SUCCESS)  {
+		(void)libusb_get_configuration(deviceHandle, &configuration);
+		if (configuration != config->bConfigurationValue)  {
+			ret = libusb_set_configuration(deviceHandle, config->bConfigurationValue);
+		}
+	}
+	if ( (ret == LIBUSB_SUCCESS) && (config->bNumInterfaces <= CAN4OSX_LIBUSB_INTERFACE) )  {
+		ret = LIBUSB_ERROR_NOT_FOUND;
+	}
+	if (ret == LIBUSB_SUCCESS)  {
+		(void)libusb_set_auto_detach_kernel_driver(deviceHandle, 1);
+		ret = libusb_claim_interface(deviceHandle, CAN4OSX_LIBUSB_INTERFACE);
+	}
+	if (ret != LIBUSB_SUCCESS)  {
+		CAN4OSX_DEBUG_PRINT("%s : Unable to configure device: %d\n", __func__, ret);
+		if (config != NULL)  {
+			libusb_free_config_descriptor(config);
+		}
+		libusb_close(deviceHandle);
+		return;
+	}
+
+	CAN4OSX_libusbFindEndpoints(pDevice, &config->interface[CAN4OSX_LIBUSB_INTERFACE].altsetting[0]);
+	libusb_free_config_descriptor(config);
+
+	pDevice->can4osxDeviceHandle = deviceHandle;
+	pDevice->usbTransport = &can4osxUsbLibusbTransport;
+
+	CAN4OSX_usbAddDevice(pDevice, descriptor.idProduct);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_libusbDeviceRemoved - stop the channels of a removed device
+ *
+ * The channels are released by CAN4OSX_libusbReleaseRemoved once their
+ * cancelled transfers came back.
+ */
+static void CAN4OSX_libusbDeviceRemoved(
+		libusb_device *device
+	)
+{
+UInt32 i;
+
+	for ( i = 0u; i < CAN4OSX_ChannelCount(); i++ )  {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(i);
+
+		if ( (pSelf->channelNumber >= 0) && (pSelf->can4osxDeviceHandle != NULL) &&
+			 (libusb_get_device(pSelf->can4osxDeviceHandle) == device) )  {
+			CAN4OSX_DEBUG_PRINT("%s : Device removed. Channel number %d\n",__func__, pSelf->channelNumber);
+			CAN4OSX_libusbClose(pSelf);
+			CAN4OSX_libusbChannel(pSelf)->removed = true;
+		}
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_libusbReleaseRemoved(
+		void
+	)
+{
+UInt32 i, k;
+
+	for ( i = 0u; i < CAN4OSX_ChannelCount(); i++ )  {
+		Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(i);
+		CAN4OSX_LIBUSB_CHANNEL_T *pChannel = atomic_load(&pSelf->usbTransportChannel);
+		libusb_device_handle *deviceHandle = pSelf->can4osxDeviceHandle;
+
+		if ( (pSelf->usbTransport != &can4osxUsbLibusbTransport) || (pChannel == NULL) ||
+			 !pChannel->removed || (atomic_load(&pChannel->inFlight) != 0u) )  {
+			continue;
+		}
+
+		for ( k = 0u; k < CAN4OSX_USB_BULKIN_BUFFER_COUNT; k++ )  {
+			libusb_free_transfer(pChannel->transferIn[k]);
+			pChannel->transferIn[k] = NULL;
+		}
+		for ( k = 0u; k < CAN4OSX_USB_BULKOUT_BUFFER_COUNT; k++ )  {
+			libusb_free_transfer(pChannel->transferOut[k]);
+			pChannel->transferOut[k] = NULL;
+		}
+		pChannel->removed = false;
+
+		CAN4OSX_usbRemoveDevice(pSelf);
+		pSelf->can4osxDeviceHandle = NULL;
+
+		// The slot starts clean for the next device
+		atomic_store(&pSelf->usbTransportChannel, NULL);
+		free(pChannel);
+
+		// The last channel of the device lets go of it
+		if (CAN4OSX_libusbFindDevice(libusb_get_device(deviceHandle)) == NULL)  {
+			(void)libusb_release_interface(deviceHandle, CAN4OSX_LIBUSB_INTERFACE);
+			libusb_close(deviceHandle);
+		}
+	}
+}
+
+
+/******************************************************************************/
+static int LIBUSB_CALL CAN4OSX_libusbHotplug(
+		libusb_context *context,
+		libusb_device *device,
+		libusb_hotplug_event event,
+		void *userData
+	)
+{
+	(void)context;
+	(void)userData;
+
+	// Opening is left to the driver thread after the events are handled
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)  {
+		if (can4osxLibusbArrivedCount == can4osxLibusbArrivedSize)  {
+			UInt32 size = (can4osxLibusbArrivedSize == 0u) ? 8u : (can4osxLibusbArrivedSize * 2u);
+			libusb_device **pArrived = realloc(can4osxLibusbArrived, size * sizeof(libusb_device *));
+
+			if (pArrived == NULL)  {
+				return(0);
+			}
+			can4osxLibusbArrived = pArrived;
+			can4osxLibusbArrivedSize = size;
+		}
+		can4osxLibusbArrived[can4osxLibusbArrivedCount++] = libusb_ref_device(device);
+	} else {
+		CAN4OSX_libusbDeviceRemoved(device);
+	}
+
+	return(0);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_libusbProcessArrived(
+		void
+	)
+{
+UInt32 i;
+
+	for ( i = 0u; i < can4osxLibusbArrivedCount; i++ )  {
+		CAN4OSX_libusbDeviceAdded(can4osxLibusbArrived[i]);
+		libusb_unref_device(can4osxLibusbArrived[i]);
+	}
+	can4osxLibusbArrivedCount = 0u;
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_libusbRunPending(
+		void
+	)
+{
+dispatch_block_t block;
+
+	pthread_mutex_lock(&can4osxRunPendingMutex);
+	block = can4osxRunPending;
+	can4osxRunPending = NULL;
+	pthread_mutex_unlock(&can4osxRunPendingMutex);
+
+	if (block != NULL)  {
+		block();
+		dispatch_semaphore_signal(can4osxRunDone);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbDriverThread - find the devices and handle the events
+ *
+ * Runs on the queue of canInitializeLibrary and does not return unless
+ * libusb cannot be initialized, then only the virtual devices are there. Devices plugged in later are found by the
+ * hotplug callback where the platform supports it.
+ *
+ */
+void CAN4OSX_usbDriverThread(
+		dispatch_semaphore_t semaStarted
+	)
+{
+libusb_hotplug_callback_handle hotplugHandle;
+libusb_device **deviceList;
+ssize_t deviceCount;
+ssize_t loopCount;
+int ret;
+
+	can4osxDriverThread = pthread_self();
+	can4osxRunDone = dispatch_semaphore_create(0);
+
+	ret = libusb_init(&can4osxLibusbContext);
+	if (ret != LIBUSB_SUCCESS)  {
+		CAN4OSX_DEBUG_PRINT("%s : libusb_init ret: %d\n", __func__, ret);
+		// Without USB the virtual devices still work
+		can4osxLibusbContext = NULL;
+		CAN4OSX_AddVirtualDevices();
+		dispatch_semaphore_signal(semaStarted);
+		return;
+	}
+
+	if ( libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) )  {
+		// Enumerate reports the devices already present as arrived
+		ret = libusb_hotplug_register_callback(can4osxLibusbContext,
+											   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+											   LIBUSB_HOTPLUG_ENUMERATE,
+											   LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+											   CAN4OSX_libusbHotplug, NULL, &hotplugHandle);
+		if (ret != LIBUSB_SUCCESS)  {
+			CAN4OSX_DEBUG_PRINT("%s : libusb_hotplug_register_callback ret: %d\n", __func__, ret);
+		}
+	} else {
+		deviceCount = libusb_get_device_list(can4osxLibusbContext, &deviceList);
+		for ( loopCount = 0; loopCount < deviceCount; loopCount++ )  {
+			CAN4OSX_libusbDeviceAdded(deviceList[loopCount]);
+		}
+		if (deviceCount >= 0)  {
+			libusb_free_device_list(deviceList, 1);
+		}
+	}
+
+	CAN4OSX_libusbProcessArrived();
+
+	CAN4OSX_AddVirtualDevices();
+
+	dispatch_semaphore_signal(semaStarted);
+
+	for (;;)  {
+		(void)libusb_handle_events_completed(can4osxLibusbContext, NULL);
+
+		CAN4OSX_libusbProcessArrived();
+		CAN4OSX_libusbReleaseRemoved();
+		CAN4OSX_libusbRunPending();
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_usbRunOnDriverThread - run a block on the driver thread
+ *
+ * All completions and so all decoders run on this thread, while the block
+ * runs none of them touches a handle. Returns when the block is done.
+ *
+ */
+void CAN4OSX_usbRunOnDriverThread(
+		dispatch_block_t block
+	)
+{
+	// Without a libusb context there are no completions to keep out
+	if ( pthread_equal(pthread_self(), can4osxDriverThread) || (can4osxLibusbContext == NULL) )  {
+		block();
+		return;
+	}
+
+	pthread_mutex_lock(&can4osxRunMutex);
+
+	pthread_mutex_lock(&can4osxRunPendingMutex);
+	can4osxRunPending = block;
+	pthread_mutex_unlock(&can4osxRunPendingMutex);
+
+	// Let the thread return from the event handling
+	libusb_interrupt_event_handler(can4osxLibusbContext);
+
+	dispatch_semaphore_wait(can4osxRunDone, DISPATCH_TIME_FOREVER);
+
+	pthread_mutex_unlock(&can4osxRunMutex);
+}
+
+#endif /* __APPLE__ */
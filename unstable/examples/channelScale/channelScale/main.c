@@ -0,0 +1,274 @@
+//
+//  main.c
+//  channelScale
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+// Scale test of the channel table with one virtual bus of 64 channels.
+//
+//   channelScale [frames per channel]
+//
+// Every channel goes on the bus and sends its frames, every other channel has
+// to receive all of them and the sender its acknowledges. Then the handle check is timed, once the handles
+// are closed they have to be refused, also after the channel was opened
+// again.
+//
+// Build it together with the library sources and 64 virtual channels, e.g.
+// on Linux with libdispatch and libusb:
+//
+//   clang -fblocks -O2 -DVIRTUAL_CHANNEL_COUNT=64u -I../.. main.c ../../*.c -ldispatch -lBlocksRuntime -lusb-1.0 -lpthread
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "can4osx.h"
+#include "can4osx_internal.h"
+
+
+#define CHANNELSCALE_CHANNELS       64
+#define CHANNELSCALE_FRAMES         10u
+#define CHANNELSCALE_TIMEOUT_NS     10000000000ull
+#define CHANNELSCALE_CHECKS         1000000u
+
+
+static CanHandle hnd[CHANNELSCALE_CHANNELS];
+static UInt32 received[CHANNELSCALE_CHANNELS][CHANNELSCALE_CHANNELS];
+static UInt32 acked[CHANNELSCALE_CHANNELS];
+static UInt32 wrongFrames;
+
+
+static void readAll(void)
+{
+	CanFrame frames[64];
+	UInt32 count;
+	UInt32 sender;
+	UInt32 i;
+	int c;
+
+	for (c = 0; c < CHANNELSCALE_CHANNELS; c++)  {
+		while ( (canReadBatch(hnd[c], frames, 64, &count) == canOK) && (count != 0) )  {
+			for (i = 0; i < count; i++)  {
+				// The sender gets its own frame back as acknowledge
+				if ( frames[i].flag & canMSG_TXACK )  {
+					acked[c]++;
+					continue;
+				}
+				sender = frames[i].id - 0x100;
+				if ( (sender >= CHANNELSCALE_CHANNELS) || (sender == (UInt32)c) ||
+					 (frames[i].dlc != 1) || (frames[i].msg[0] != (UInt8)sender) )  {
+					wrongFrames++;
+				} else {
+					received[c][sender]++;
+				}
+			}
+		}
+	}
+}
+
+
+static int openChannels(void)
+{
+	char name[64];
+	int channelCount;
+	int found = 0;
+	int i;
+
+	canInitializeLibrary();
+	canGetNumberOfChannels(&channelCount);
+
+	for (i = 0; (i < channelCount) && (found < CHANNELSCALE_CHANNELS); i++)  {
+		if ( (canGetChannelData(i, canCHANNELDATA_DEVDESCR_ASCII, name, sizeof(name)) == canOK) &&
+			 (strncmp(name, "can4osx Virtual CAN", 19) == 0) )  {
+			hnd[found] = canOpenChannel(i, canOPEN_ACCEPT_VIRTUAL);
+			if ( (hnd[found] < 0) ||
+				 (canSetBusParams(hnd[found], canBITRATE_1M, 0, 0, 0, 0, 0) != canOK) ||
+				 (canBusOn(hnd[found]) != canOK) )  {
+				printf("virtual channel %d failed to go on bus\n", i);
+				return(-1);
+			}
+			found++;
+		}
+	}
+
+	printf("%d channels in the table, %d virtual ones on bus\n", channelCount, found);
+	if ( found < CHANNELSCALE_CHANNELS )  {
+		printf("%d virtual channels needed, build with -DVIRTUAL_CHANNEL_COUNT=%du\n",
+			   CHANNELSCALE_CHANNELS, CHANNELSCALE_CHANNELS);
+		return(-1);
+	}
+
+	return(0);
+}
+
+
+static int sendAndReceive(UInt32 frameCount)
+{
+	UInt8 data;
+	UInt32 missing = 0;
+	UInt32 n;
+	UInt64 start;
+	int c;
+	int k;
+
+	start = CAN4OSX_HostNs();
+
+	for (n = 0; n < frameCount; n++)  {
+		for (c = 0; c < CHANNELSCALE_CHANNELS; c++)  {
+			data = (UInt8)c;
+			while ( canWrite(hnd[c], 0x100 + c, &data, 1, canMSG_STD) == canERR_TXBUFOFL )  {
+				readAll();
+				sched_yield();
+			}
+		}
+		readAll();
+	}
+
+	// Wait for the bus to carry the rest
+	do {
+		readAll();
+		missing = 0;
+		for (c = 0; c < CHANNELSCALE_CHANNELS; c++)  {
+			if ( acked[c] < frameCount )  {
+				missing += frameCount - acked[c];
+			}
+			for (k = 0; k < CHANNELSCALE_CHANNELS; k++)  {
+				if ( (k != c) && (received[c][k] < frameCount) )  {
+					missing += frameCount - received[c][k];
+				}
+			}
+		}
+		sched_yield();
+	} while ( (missing != 0) && ((CAN4OSX_HostNs() - start) < CHANNELSCALE_TIMEOUT_NS) );
+
+	printf("%u frames sent, %u receptions and acknowledges in %.3f s, %u missing, %u wrong\n",
+		   frameCount * CHANNELSCALE_CHANNELS, frameCount * CHANNELSCALE_CHANNELS * CHANNELSCALE_CHANNELS - missing,
+		   (double)(CAN4OSX_HostNs() - start) / 1e9, missing, wrongFrames);
+
+	return( ((missing == 0) && (wrongFrames == 0)) ? 0 : -1 );
+}
+
+
+static void timeHandleCheck(void)
+{
+	UInt64 start;
+	UInt32 valid = 0;
+	UInt32 i;
+	int c;
+
+	start = CAN4OSX_HostNs();
+	for (i = 0; i < CHANNELSCALE_CHECKS; i++)  {
+		for (c = 0; c < CHANNELSCALE_CHANNELS; c++)  {
+			valid += (CAN4OSX_GetHandleEntry(hnd[c]) != NULL);
+		}
+	}
+
+	printf("handle check: %.2f ns per handle, %u valid\n",
+		   (double)(CAN4OSX_HostNs() - start) / ((double)CHANNELSCALE_CHECKS * CHANNELSCALE_CHANNELS), valid);
+}
+
+
+static int checkStaleHandles(void)
+{
+	CanHandle stale[CHANNELSCALE_CHANNELS];
+	CanHandle again;
+	int failed = 0;
+	int c;
+
+	for (c = 0; c < CHANNELSCALE_CHANNELS; c++)  {
+		canBusOff(hnd[c]);
+		canClose(hnd[c]);
+		stale[c] = hnd[c];
+	}
+
+	for (c = 0; c < CHANNELSCALE_CHANNELS; c++)  {
+		if ( canBusOn(stale[c]) != canERR_INVHANDLE )  {
+			printf("closed handle %d still works\n", (int)stale[c]);
+			failed++;
+		}
+	}
+
+	// A new handle of the channel, the old one stays stale
+	again = canOpenChannel(stale[0] & CAN4OSX_HANDLE_INDEX_MASK, canOPEN_ACCEPT_VIRTUAL);
+	if ( (again < 0) || (again == stale[0]) || (canBusOn(again) != canOK) ||
+		 (canBusOn(stale[0]) != canERR_INVHANDLE) )  {
+		printf("reopened handle %d, the old one was %d\n", (int)again, (int)stale[0]);
+		failed++;
+	}
+	canBusOff(again);
+	canClose(again);
+
+	printf("%d closed handles refused, %d failures\n", CHANNELSCALE_CHANNELS, failed);
+
+	return( (failed == 0) ? 0 : -1 );
+}
+
+
+int main(int argc, const char * argv[])
+{
+	UInt32 frameCount = CHANNELSCALE_FRAMES;
+	int result = 0;
+
+	if ( argc > 1 )  {
+		frameCount = (UInt32)strtoul(argv[1], NULL, 0);
+	}
+
+	if ( openChannels() != 0 )  {
+		return(-1);
+	}
+
+	if ( sendAndReceive(frameCount) != 0 )  {
+		result = -1;
+	}
+
+	timeHandleCheck();
+
+	if ( checkStaleHandles() != 0 )  {
+		result = -1;
+	}
+
+	printf("%s\n", (result == 0) ? "passed" : "FAILED");
+
+	return(result);
+}
@@ -0,0 +1,305 @@
+//
+//  main.c
+//  decodeBench
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+// Decoder benchmark, replays recorded bulk-in transfers into the decoder of
+// a device and reports frames and bytes per second.
+//
+//   decodeBench leaf|leafpro|ixxat [rounds] [capture]
+//
+// The decoder belongs to an emulated device of the chosen kind. Without a
+// capture file, or when it does not exist yet, the transfers are recorded
+// from the traffic of the emulated firmware with CAN4OSX_usbSetBulkInTap
+// first, and saved to the file if one was given. An existing capture file is
+// replayed as it is, a recording of real hardware made with the tap works
+// the same way. The file holds the transfers one after the other, each one
+// a UInt32 size in host order followed by the data.
+//
+// The replay runs on the driver thread, so no completion decodes meanwhile.
+// The receive ring is emptied after each transfer, outside the measurement.
+//
+// Build it together with the library sources and CAN4OSX_USB_EMULATION=1,
+// e.g. on Linux with libdispatch and libusb:
+//
+//   clang -fblocks -O2 -DCAN4OSX_USB_EMULATION=1 -I../.. main.c ../../*.c -ldispatch -lBlocksRuntime -lusb-1.0 -lpthread
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "can4osx.h"
+#include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
+#include "can4osx_usb_emu.h"
+
+
+#define DECODEBENCH_ROUNDS          200u
+#define DECODEBENCH_TRANSFERS       2048u
+#define DECODEBENCH_RECORD_MS       2000u
+#define DECODEBENCH_FRAME_RATE      20000u
+
+typedef struct {
+    const char *name;
+    UInt16 productId;
+    const char *description;    /* start of the device string */
+} DecodeBenchDevice_t;
+
+typedef struct {
+    Can4osxUsbDeviceHandleEntry *pSelf;
+    UInt8 *pData;
+    UInt32 dataSize;
+    UInt32 *pSize;
+    UInt32 count;
+} DecodeBenchRecording_t;
+
+static const DecodeBenchDevice_t decodeBenchDevices[] = {
+    {"leaf",    0x0120, "Kvaser Leaf Light"},
+    {"leafpro", 0x0107, "Kvaser Leaf Pro"},
+    {"ixxat",   0x0017, "IXXAT USB-to-CAN FD"},
+};
+
+
+static void recordTap(void *ctx, Can4osxUsbDeviceHandleEntry *pSelf, const UInt8 *pBuffer, UInt32 size)
+{
+	DecodeBenchRecording_t *pRec = (DecodeBenchRecording_t *)ctx;
+
+	if ( (pSelf != pRec->pSelf) || (pRec->count >= DECODEBENCH_TRANSFERS) )  {
+		return;
+	}
+
+	memcpy(&pRec->pData[pRec->dataSize], pBuffer, size);
+	pRec->dataSize += size;
+	pRec->pSize[pRec->count++] = size;
+}
+
+
+static UInt32 drainChannel(CanHandle hnd)
+{
+	CanFrame frames[64];
+	UInt32 count;
+	UInt32 total = 0;
+
+	while ( (canReadBatch(hnd, frames, 64, &count) == canOK) && (count != 0) )  {
+		total += count;
+	}
+
+	return(total);
+}
+
+
+static int loadCapture(const char *pName, DecodeBenchRecording_t *pRec, UInt32 maxSize)
+{
+	FILE *pFile = fopen(pName, "rb");
+	UInt32 size;
+
+	if ( pFile == NULL )  {
+		return(-1);
+	}
+
+	while ( (pRec->count < DECODEBENCH_TRANSFERS) && (fread(&size, sizeof(size), 1, pFile) == 1) )  {
+		if ( (size == 0) || (size > maxSize) || (fread(&pRec->pData[pRec->dataSize], size, 1, pFile) != 1) )  {
+			break;
+		}
+		pRec->dataSize += size;
+		pRec->pSize[pRec->count++] = size;
+	}
+
+	fclose(pFile);
+
+	return(0);
+}
+
+
+static void saveCapture(const char *pName, const DecodeBenchRecording_t *pRec)
+{
+	FILE *pFile = fopen(pName, "wb");
+	UInt32 offset = 0;
+	UInt32 i;
+
+	if ( pFile == NULL )  {
+		printf("can not write %s\n", pName);
+		return;
+	}
+
+	for (i = 0; i < pRec->count; i++)  {
+		fwrite(&pRec->pSize[i], sizeof(UInt32), 1, pFile);
+		fwrite(&pRec->pData[offset], pRec->pSize[i], 1, pFile);
+		offset += pRec->pSize[i];
+	}
+
+	fclose(pFile);
+}
+
+
+int main(int argc, const char * argv[])
+{
+	const DecodeBenchDevice_t *pDevice = NULL;
+	CAN4OSX_USB_EMU_CONFIG_T config;
+	__block DecodeBenchRecording_t recording;
+	CanHandle hnd = -1;
+	char name[64];
+	int channelCount;
+	int i;
+	UInt32 rounds = DECODEBENCH_ROUNDS;
+	const char *pCapture = NULL;
+	__block UInt64 decodeNs = 0;
+	__block UInt64 frames = 0;
+	UInt32 round;
+	UInt32 waited;
+
+	for (i = 0; (argc > 1) && (i < (int)(sizeof(decodeBenchDevices) / sizeof(decodeBenchDevices[0]))); i++)  {
+		if ( strcmp(argv[1], decodeBenchDevices[i].name) == 0 )  {
+			pDevice = &decodeBenchDevices[i];
+		}
+	}
+	if ( pDevice == NULL )  {
+		printf("usage: decodeBench leaf|leafpro|ixxat [rounds] [capture]\n");
+		return(-1);
+	}
+	if ( argc > 2 )  {
+		rounds = (UInt32)strtoul(argv[2], NULL, 0);
+	}
+	if ( argc > 3 )  {
+		pCapture = argv[3];
+	}
+
+	// Classic frames with 8 bytes, as many ids as a busy bus
+	memset(&config, 0, sizeof(config));
+	config.frameRate = DECODEBENCH_FRAME_RATE;
+	config.canId = 0x100;
+	config.idCount = 64;
+	config.dataLength = 8;
+
+	if ( CAN4OSX_usbEmuAddDevice(pDevice->productId, &config) != canOK )  {
+		printf("CAN4OSX_usbEmuAddDevice failed\n");
+		return(-1);
+	}
+
+	canInitializeLibrary();
+	canGetNumberOfChannels(&channelCount);
+
+	for (i = 0; (i < channelCount) && (hnd < 0); i++)  {
+		if ( (canGetChannelData(i, canCHANNELDATA_DEVDESCR_ASCII, name, sizeof(name)) == canOK) &&
+			 (strncmp(name, pDevice->description, strlen(pDevice->description)) == 0) )  {
+			hnd = canOpenChannel(i, 0);
+		}
+	}
+
+	if ( (hnd < 0) ||
+		 (canSetBusParams(hnd, canBITRATE_1M, 0, 0, 0, 0, 0) != canOK) ||
+		 (canBusOn(hnd) != canOK) )  {
+		printf("no emulated %s channel on bus\n", pDevice->name);
+		return(-1);
+	}
+
+	memset(&recording, 0, sizeof(recording));
+	recording.pSelf = CAN4OSX_GetHandleEntry(hnd);
+	recording.pData = malloc(DECODEBENCH_TRANSFERS * recording.pSelf->endpointMaxSizeBulkIn);
+	recording.pSize = malloc(DECODEBENCH_TRANSFERS * sizeof(UInt32));
+	if ( (recording.pData == NULL) || (recording.pSize == NULL) )  {
+		printf("no memory for the recording\n");
+		return(-1);
+	}
+
+	if ( (pCapture == NULL) || (loadCapture(pCapture, &recording, recording.pSelf->endpointMaxSizeBulkIn) != 0) )  {
+		CAN4OSX_usbSetBulkInTap(recordTap, &recording);
+		for (waited = 0; (waited < DECODEBENCH_RECORD_MS) && (recording.count < DECODEBENCH_TRANSFERS); waited += 10)  {
+			drainChannel(hnd);
+			usleep(10000);
+		}
+		CAN4OSX_usbSetBulkInTap(NULL, NULL);
+		printf("recorded %u transfers, %u bytes\n", recording.count, recording.dataSize);
+
+		if ( pCapture != NULL )  {
+			saveCapture(pCapture, &recording);
+		}
+	} else {
+		printf("loaded %u transfers, %u bytes from %s\n", recording.count, recording.dataSize, pCapture);
+	}
+
+	// From here on only the replay feeds the decoder
+	CAN4OSX_usbEmuSetFrameRate(hnd, 0);
+	usleep(100000);
+	drainChannel(hnd);
+
+	if ( recording.count == 0 )  {
+		printf("nothing to replay\n");
+		return(-1);
+	}
+
+	for (round = 0; round < rounds; round++)  {
+		CAN4OSX_usbRunOnDriverThread(^{
+			Can4osxUsbDeviceHandleEntry *pSelf = recording.pSelf;
+			UInt32 offset = 0;
+			UInt32 k;
+
+			for (k = 0; k < recording.count; k++)  {
+				UInt64 start = CAN4OSX_HostNs();
+
+				pSelf->usbFunctions.bulkInDecode(pSelf, &recording.pData[offset], recording.pSize[k]);
+				decodeNs += CAN4OSX_HostNs() - start;
+				offset += recording.pSize[k];
+
+				frames += drainChannel(hnd);
+			}
+		});
+	}
+
+	printf("%s: %u rounds of %u transfers, %llu frames in %.3f s\n", pDevice->name, rounds, recording.count,
+		   (unsigned long long)frames, (double)decodeNs / 1e9);
+	printf("  %.0f frames/s, %.1f MB/s, %.0f ns per transfer\n",
+		   (double)frames * 1e9 / (double)decodeNs,
+		   (double)recording.dataSize * rounds * 1e3 / (double)decodeNs,
+		   (double)decodeNs / ((double)recording.count * rounds));
+
+	canBusOff(hnd);
+	canClose(hnd);
+
+	free(recording.pData);
+	free(recording.pSize);
+
+	return(0);
+}
@@ -0,0 +1,164 @@
+//
+//  main.c
+//  emuTx
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+// Transmit check on an emulated Kvaser USBcan Pro 2xHS. Both channels share
+// the bulk-out pipe of the first one, the frames written on each channel
+// have to reach the firmware:
+//
+//   emuTx [frames]
+//
+// Build it together with the library sources and CAN4OSX_USB_EMULATION=1,
+// e.g. on Linux with libdispatch and libusb:
+//
+//   clang -fblocks -O2 -DCAN4OSX_USB_EMULATION=1 -I../.. main.c ../../*.c -ldispatch -lBlocksRuntime -lusb-1.0 -lpthread
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "can4osx.h"
+#include "can4osx_internal.h"
+#include "can4osx_usb_emu.h"
+
+
+#define EMUTX_FRAMES        10000u
+#define EMUTX_BATCH         32u
+#define EMUTX_PRODUCT_ID    0x0108u     /* Kvaser USBcan Pro 2xHS v2 */
+
+
+int main(int argc, const char * argv[])
+{
+	CAN4OSX_USB_EMU_CONFIG_T config;
+	CanHandle hnd[2];
+	CanFrame frames[EMUTX_BATCH];
+	UInt32 written[2] = {0, 0};
+	UInt32 txFrames[2] = {0, 0};
+	UInt32 frameCount = EMUTX_FRAMES;
+	char name[64];
+	int channelCount;
+	int found = 0;
+	int i;
+	int wait;
+
+	if ( argc > 1 )  {
+		frameCount = (UInt32)strtoul(argv[1], NULL, 0);
+	}
+
+	// No received traffic, only what the host sends
+	memset(&config, 0, sizeof(config));
+	if ( CAN4OSX_usbEmuAddDevice(EMUTX_PRODUCT_ID, &config) != canOK )  {
+		printf("CAN4OSX_usbEmuAddDevice failed\n");
+		return(-1);
+	}
+
+	canInitializeLibrary();
+	canGetNumberOfChannels(&channelCount);
+
+	for (i = 0; (i < channelCount) && (found < 2); i++)  {
+		if ( (canGetChannelData(i, canCHANNELDATA_DEVDESCR_ASCII, name, sizeof(name)) == canOK) &&
+			 (strncmp(name, "Kvaser Leaf Pro", 15) == 0) )  {
+			hnd[found] = canOpenChannel(i, 0);
+			if ( (hnd[found] < 0) ||
+				 (canSetBusParams(hnd[found], canBITRATE_500K, 0, 0, 0, 0, 0) != canOK) ||
+				 (canBusOn(hnd[found]) != canOK) )  {
+				printf("emulated channel %d failed to go on bus\n", i);
+				return(-1);
+			}
+			found++;
+		}
+	}
+
+	if ( found < 2 )  {
+		printf("two emulated channels needed, found %d\n", found);
+		return(-1);
+	}
+
+	memset(frames, 0, sizeof(frames));
+
+	// Channel 1 with canWrite, channel 2 with canWriteBatch, interleaved
+	while ( (written[0] < frameCount) || (written[1] < frameCount) )  {
+		if ( (written[0] < frameCount) &&
+			 (canWrite(hnd[0], 0x100, &written[0], 4, canMSG_STD) == canOK) )  {
+			written[0]++;
+		}
+
+		if ( written[1] < frameCount )  {
+			UInt32 count = frameCount - written[1];
+			UInt32 sent = 0;
+
+			if ( count > EMUTX_BATCH )  {
+				count = EMUTX_BATCH;
+			}
+			for (i = 0; i < (int)count; i++)  {
+				frames[i].id = 0x200;
+				frames[i].flag = canMSG_STD;
+				frames[i].dlc = 4;
+				memcpy(frames[i].msg, &written[1], 4);
+			}
+			canWriteBatch(hnd[1], frames, count, &sent);
+			written[1] += sent;
+		}
+	}
+
+	// Give the pipe time to drain
+	for (wait = 0; wait < 100; wait++)  {
+		CAN4OSX_usbEmuGetTxFrames(hnd[0], &txFrames[0]);
+		CAN4OSX_usbEmuGetTxFrames(hnd[1], &txFrames[1]);
+		if ( (txFrames[0] >= frameCount) && (txFrames[1] >= frameCount) )  {
+			break;
+		}
+		usleep(10000);
+	}
+
+	for (i = 0; i < 2; i++)  {
+		printf("channel %d: %u written, %u reached the firmware\n", i + 1, written[i], txFrames[i]);
+		canBusOff(hnd[i]);
+		canClose(hnd[i]);
+	}
+
+	return(((txFrames[0] == frameCount) && (txFrames[1] == frameCount)) ? 0 : -1);
+}
@@ -0,0 +1,333 @@
+//
+//  main.c
+//  rxBench
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+// Receive path benchmark, frames per second and latency percentiles.
+//
+//   rxBench [ring|virtual] [frames]
+//
+// ring:    a thread in the role of the driver thread stores frames into a
+//          receive ring, the main thread reads them like canRead does. The
+//          first pass runs flat out for the rate, the second paces the
+//          producer to one frame every RXBENCH_PACE_NS and measures the time
+//          from the store to the read.
+// virtual: the frames go over the virtual bus, written with canWriteBatch on
+//          the first virtual channel and read with canReadHostNs on the
+//          second. The rate is bound by the bit rate of the bus, the latency
+//          is from the end of the frame on the bus to the read.
+//
+// Build it together with the library sources, e.g. on Linux with libdispatch
+// and libusb:
+//
+//   clang -fblocks -O2 -I../.. main.c ../../*.c -ldispatch -lBlocksRuntime -lusb-1.0 -lpthread
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "can4osx.h"
+#include "can4osx_internal.h"
+
+
+#define RXBENCH_FRAMES      2000000u
+#define RXBENCH_PACE_NS     10000u
+#define RXBENCH_DLC         8u
+
+
+static CAN_EVENT_MSG_BUF_T *pRing;
+static UInt32 frameCount;
+static UInt64 paceNs;
+static UInt64 producerFull;
+
+
+static int compareNs(const void *a, const void *b)
+{
+	UInt64 x = *(const UInt64 *)a;
+	UInt64 y = *(const UInt64 *)b;
+
+	return((x > y) - (x < y));
+}
+
+
+static void printLatency(UInt64 *pLatency, UInt32 count)
+{
+	if ( count == 0 )  {
+		printf("  no frames received\n");
+		return;
+	}
+
+	qsort(pLatency, count, sizeof(UInt64), compareNs);
+
+	printf("  latency ns    p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+		   (unsigned long long)pLatency[count / 2],
+		   (unsigned long long)pLatency[(UInt64)count * 90 / 100],
+		   (unsigned long long)pLatency[(UInt64)count * 99 / 100],
+		   (unsigned long long)pLatency[(UInt64)count * 999 / 1000],
+		   (unsigned long long)pLatency[count - 1]);
+}
+
+
+static void* ringProducer(void *arg)
+{
+	CanMsg canMsg;
+	UInt32 i;
+	UInt64 next = CAN4OSX_HostNs();
+
+	memset(&canMsg, 0, sizeof(canMsg));
+	canMsg.canDlc = RXBENCH_DLC;
+
+	for (i = 0; i < frameCount; i++)  {
+		if ( paceNs )  {
+			while ( CAN4OSX_HostNs() < next )  {
+				sched_yield();
+			}
+			next += paceNs;
+		}
+
+		canMsg.canId = i;
+		memcpy(canMsg.canData, &i, sizeof(i));
+		canMsg.canHostTimestamp = CAN4OSX_HostNs();
+
+		while ( !CAN4OSX_WriteCanEventBuffer(pRing, &canMsg) )  {
+			producerFull++;
+			sched_yield();
+			canMsg.canHostTimestamp = CAN4OSX_HostNs();
+		}
+	}
+
+	return(NULL);
+}
+
+
+static int ringPass(UInt64 pace, UInt64 *pLatency)
+{
+	pthread_t producer;
+	CanMsg canMsg;
+	UInt32 received = 0;
+	UInt64 start;
+	UInt64 elapsed;
+
+	pRing = CAN4OSX_CreateCanEventBuffer(CAN4OSX_RX_QUEUE_SIZE);
+	if ( pRing == NULL )  {
+		printf("CAN4OSX_CreateCanEventBuffer failed\n");
+		return(-1);
+	}
+
+	paceNs = pace;
+	producerFull = 0;
+	start = CAN4OSX_HostNs();
+
+	if ( pthread_create(&producer, NULL, ringProducer, NULL) != 0 )  {
+		printf("pthread_create failed\n");
+		return(-1);
+	}
+
+	while ( received < frameCount )  {
+		if ( CAN4OSX_ReadCanEventBuffer(pRing, &canMsg) )  {
+			if ( canMsg.canId != received )  {
+				printf("frame %u read as %u\n", received, canMsg.canId);
+				return(-1);
+			}
+			pLatency[received++] = CAN4OSX_HostNs() - canMsg.canHostTimestamp;
+		} else {
+			sched_yield();
+		}
+	}
+
+	elapsed = CAN4OSX_HostNs() - start;
+	pthread_join(producer, NULL);
+	CAN4OSX_ReleaseCanEventBuffer(pRing);
+
+	printf("  %u frames in %.3f s, %.0f frames/s, producer found the ring full %llu times\n",
+		   received, (double)elapsed / 1e9, (double)received * 1e9 / (double)elapsed,
+		   (unsigned long long)producerFull);
+
+	return(0);
+}
+
+
+static int benchRing(UInt64 *pLatency)
+{
+	printf("ring, %u frames, dlc %u, depth %u\n", frameCount, RXBENCH_DLC, CAN4OSX_RX_QUEUE_SIZE);
+
+	printf("flat out\n");
+	if ( ringPass(0, pLatency) != 0 )  {
+		return(-1);
+	}
+	printLatency(pLatency, frameCount);
+
+	printf("one frame every %u ns\n", RXBENCH_PACE_NS);
+	if ( ringPass(RXBENCH_PACE_NS, pLatency) != 0 )  {
+		return(-1);
+	}
+	printLatency(pLatency, frameCount);
+
+	return(0);
+}
+
+
+static int benchVirtual(UInt64 *pLatency)
+{
+	CanHandle hnd[2];
+	CanFrame frames[32];
+	char name[64];
+	int channelCount;
+	int found = 0;
+	int i;
+	UInt32 written = 0;
+	UInt32 received = 0;
+	UInt32 sent;
+	UInt32 id;
+	UInt16 dlc;
+	UInt32 flag;
+	UInt64 time;
+	UInt8 data[64];
+	UInt64 start;
+	UInt64 elapsed;
+
+	canInitializeLibrary();
+	canGetNumberOfChannels(&channelCount);
+
+	for (i = 0; (i < channelCount) && (found < 2); i++)  {
+		if ( (canGetChannelData(i, canCHANNELDATA_DEVDESCR_ASCII, name, sizeof(name)) == canOK) &&
+			 (strncmp(name, "can4osx Virtual CAN", 19) == 0) )  {
+			hnd[found] = canOpenChannel(i, 0);
+			if ( (hnd[found] < 0) ||
+				 (canSetBusParams(hnd[found], canBITRATE_1M, 0, 0, 0, 0, 0) != canOK) ||
+				 (canBusOn(hnd[found]) != canOK) )  {
+				printf("virtual channel %d failed to go on bus\n", i);
+				return(-1);
+			}
+			found++;
+		}
+	}
+
+	if ( found < 2 )  {
+		printf("two virtual channels needed, found %d\n", found);
+		return(-1);
+	}
+
+	printf("virtual, %u frames, dlc %u, 1 Mbit/s\n", frameCount, RXBENCH_DLC);
+
+	memset(frames, 0, sizeof(frames));
+	start = CAN4OSX_HostNs();
+
+	while ( received < frameCount )  {
+		if ( written < frameCount )  {
+			UInt32 count = frameCount - written;
+
+			if ( count > 32 )  {
+				count = 32;
+			}
+			for (i = 0; i < (int)count; i++)  {
+				frames[i].id = written + i;
+				frames[i].dlc = RXBENCH_DLC;
+			}
+			sent = 0;
+			canWriteBatch(hnd[0], frames, count, &sent);
+			written += sent;
+		}
+
+		while ( canReadHostNs(hnd[1], &id, data, &dlc, &flag, &time) == canOK )  {
+			if ( id != received )  {
+				printf("frame %u read as %u\n", received, id);
+				return(-1);
+			}
+			pLatency[received++] = CAN4OSX_HostNs() - time;
+		}
+		sched_yield();
+	}
+
+	elapsed = CAN4OSX_HostNs() - start;
+
+	printf("  %u frames in %.3f s, %.0f frames/s\n",
+		   received, (double)elapsed / 1e9, (double)received * 1e9 / (double)elapsed);
+	printLatency(pLatency, received);
+
+	canBusOff(hnd[0]);
+	canBusOff(hnd[1]);
+	canClose(hnd[0]);
+	canClose(hnd[1]);
+
+	return(0);
+}
+
+
+int main(int argc, const char * argv[])
+{
+	UInt64 *pLatency;
+	int virtualBus = 0;
+	int result;
+
+	frameCount = RXBENCH_FRAMES;
+
+	if ( argc > 1 )  {
+		virtualBus = (strcmp(argv[1], "virtual") == 0);
+	}
+	if ( argc > 2 )  {
+		frameCount = (UInt32)strtoul(argv[2], NULL, 0);
+	}
+	if ( frameCount == 0 )  {
+		frameCount = RXBENCH_FRAMES;
+	}
+
+	pLatency = malloc(frameCount * sizeof(UInt64));
+	if ( pLatency == NULL )  {
+		printf("no memory for %u frames\n", frameCount);
+		return(-1);
+	}
+
+	if ( virtualBus )  {
+		result = benchVirtual(pLatency);
+	} else {
+		result = benchRing(pLatency);
+	}
+
+	free(pLatency);
+
+	return(result);
+}
@@ -47,13 +47,9 @@
 ------------------------------------------------------------------------------*/
 #include <stdio.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
-
-#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 
 /* header of project specific types
@@ -70,6 +66,8 @@
 ------------------------------------------------------------------------------*/
 
 #define IXXCOMMANDBUF_SIZE (1000 * 10)
+/* messages canWriteBatch converts per transmit buffer access */
+#define IXXUSBFD_TX_BATCH_SIZE 32u
 
 /* local defined data types
 ------------------------------------------------------------------------------*/
@@ -78,8 +76,9 @@ typedef struct {
     int bufferSize;
     int bufferFirst;
     int bufferCount;
+    int bufferHighWater;
     dispatch_queue_t bufferGDCqueueRef;
-    IXXUSBFDCANMSG_T msgData[IXXCOMMANDBUF_SIZE];
+    IXXUSBFDCANMSG_T *msgData;
 } IXXUSBFDTRANSMITBUFFER_T;
 
 typedef struct {
@@ -94,7 +93,6 @@ typedef struct {
     UInt8   fd_tseg1;
     UInt8   fd_tseg2;
     UInt8   fd_sjw;
-    pthread_mutex_t mutex;
 } IXXUSBFDPRIVATEDATA_T;
 
 
@@ -119,6 +117,12 @@ static canStatus usbFdCanRead (const CanHandle hnd, UInt32 *id, void *msg,
 static canStatus usbFdCanWrite (const CanHandle hnd, UInt32 id, void *msg,
     	UInt16 dlc, UInt32 flag);
 
+static canStatus usbFdCanWriteBatch (const CanHandle hnd, const CanFrame *frames,
+        UInt32 count, UInt32 *sent);
+
+static canStatus usbFdCanSetAcceptanceFilter (const CanHandle hnd);
+static canStatus usbFdCanSetTxQueueSize (const CanHandle hnd, UInt32 frames);
+static void usbFdCanGetTxQueueStat (const CanHandle hnd, UInt32 *pSize, UInt32 *pHighWater);
 static canStatus usbFdCanTranslateBaud (SInt32 *const freq, unsigned int *const tseg1,
         unsigned int *const tseg2, unsigned int *const sjw, unsigned int *const nosamp,
         unsigned int *const syncMode);
@@ -130,13 +134,13 @@ static canStatus usbFdSetBitrates(Can4osxUsbDeviceHandleEntry *pSelf);
 static canStatus usbFdSendCmd(Can4osxUsbDeviceHandleEntry *pSelf, IXXUSBFDMSGREQHEAD_T *pCmd);
 static canStatus usbFdRecvCmd(Can4osxUsbDeviceHandleEntry *pSelf, IXXUSBFDMSGRESPHEAD_T *pCmd, int value);
 
-static void usbFdBulkReadCompletion(void *refCon, IOReturn result, void *arg0);
-static IOReturn usbFdWriteToBulkPipe(Can4osxUsbDeviceHandleEntry *pSelf);
-static UInt16 usbFdFillBulkPipeBuffer(IXXUSBFDTRANSMITBUFFER_T *pBufferRef, UInt8 *pipe, UInt16 maxPipeSize);
-static void usbFdBulkWriteCompletion(void *refCon, IOReturn result, void *arg0);
+static void usbFdBulkInDecode(void *refCon, const UInt8 *pBuffer, UInt32 size);
+static UInt16 usbFdFillBulkPipeBuffer(void *refCon, UInt8 *pipe, UInt16 maxPipeSize);
 
+static UInt8 usbFdTestEmptyTransmitBuffer(IXXUSBFDTRANSMITBUFFER_T * pBuffer);
 static UInt8 usbFdWriteTransmitBuffer(IXXUSBFDTRANSMITBUFFER_T* pBuffer, IXXUSBFDCANMSG_T newMsg);
-static UInt8 usbFdReadCommandBuffer(IXXUSBFDTRANSMITBUFFER_T* pBuffer, IXXUSBFDCANMSG_T* pCanMsg);
+static UInt32 usbFdWriteTransmitBufferBatch(IXXUSBFDTRANSMITBUFFER_T* pBuffer, const IXXUSBFDCANMSG_T *pNewMsgs, UInt32 count);
+static UInt8 usbFdResizeTransmitBuffer(IXXUSBFDTRANSMITBUFFER_T* pBuffer, UInt32 bufferSize);
 
 
 /* global variables
@@ -149,8 +153,12 @@ CAN4OSX_HW_FUNC_T ixxUsbFdHardwareFunctions = {
     .can4osxhwCanBusOnRef = usbFdCanStartChip,
     .can4osxhwCanBusOffRef = usbFdCanStopChip,
     .can4osxhwCanWriteRef = usbFdCanWrite,
+    .can4osxhwCanWriteBatchRef = usbFdCanWriteBatch,
     .can4osxhwCanReadRef = usbFdCanRead,
     .can4osxhwCanCloseRef = usbFdCanClose,
+    .can4osxhwCanSetAcceptanceFilterRef = usbFdCanSetAcceptanceFilter,
+    .can4osxhwCanSetTxQueueSizeRef = usbFdCanSetTxQueueSize,
+    .can4osxhwCanGetTxQueueStatRef = usbFdCanGetTxQueueStat,
 };
 
 
@@ -175,7 +183,7 @@ static canStatus usbFdInitHardware(
 		const CanHandle hnd
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 	
 	pSelf->privateData = calloc(1,sizeof(IXXUSBFDPRIVATEDATA_T));
     
@@ -183,11 +191,20 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
     	IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
      	pPriv->pParent = pSelf;
       
+      	pPriv->pTransBuff.msgData = malloc(IXXCOMMANDBUF_SIZE * sizeof(IXXUSBFDCANMSG_T));
+      	if (pPriv->pTransBuff.msgData == NULL)  {
+      		free(pPriv);
+      		pSelf->privateData = NULL;
+      		return(canERR_NOMEM);
+      	}
+
       	pPriv->pTransBuff.bufferGDCqueueRef = dispatch_queue_create("com.can4osx.ixxusbfdmsgqueue", 0);
+      	/* the rate of the message timer is not known, the frames get host times */
+      	pSelf->deviceTimeUnknown = true;
 		pPriv->pTransBuff.bufferCount = 0u;
         pPriv->pTransBuff.bufferFirst = 0u;
+        pPriv->pTransBuff.bufferHighWater = 0u;
         pPriv->pTransBuff.bufferSize = IXXCOMMANDBUF_SIZE;
-        pthread_mutex_init(&(pPriv->mutex), NULL);
     
     } else {
         return(canERR_NOMEM);
@@ -198,8 +215,7 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
     	usbFdGetDeviceCaps(pSelf);
     } else {
     	/* create new endpoint buffer */
-        pSelf->endpointBufferBulkInRef = calloc( 1 , pSelf->endpointMaxSizeBulkIn);
-    	pSelf->endpointBufferBulkOutRef = calloc( 1 , pSelf->endpointMaxSizeBulkOut);
+        (void)CAN4OSX_usbCreateEndpointBuffer(pSelf);
     }
     
     sprintf((char*)pSelf->devInfo.deviceString, "%s %d/%d",pDeviceString,pSelf->deviceChannel + 1, pSelf->deviceChannelCount);
@@ -210,7 +226,8 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
     /* correct the endpoint */
     pSelf->endpointNumberBulkOut += 2;
     pSelf->endpointNumberBulkIn += 2;
-    pSelf->usbFunctions.bulkReadCompletion  = usbFdBulkReadCompletion;
+    pSelf->usbFunctions.bulkInDecode = usbFdBulkInDecode;
+    pSelf->usbFunctions.bulkOutFill = usbFdFillBulkPipeBuffer;
 
 
     /* Trigger the read */
@@ -226,7 +243,7 @@ static CanHandle usbFdCanOpenChannel(
         int flags
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[channel];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(channel);
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
     
     // set CAN Mode
@@ -245,7 +262,7 @@ static canStatus usbFdCanClose(
 		const CanHandle hnd
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
     
     if (pSelf->privateData != NULL)  {
         IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
@@ -271,7 +288,7 @@ static canStatus usbFdCanSetBusParams(
         unsigned int syncmode
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
     
     CAN4OSX_DEBUG_PRINT("ixxat usb fd: _set_busparam\n");
@@ -311,7 +328,7 @@ static canStatus usbFdCanSetBusParamsFd(
         UInt32 sjw
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
 unsigned int dummy;
     
@@ -334,12 +351,80 @@ unsigned int dummy;
 }
 
 
+/******************************************************************************/
+/**
+*
+* \brief usbFdCanSetAcceptanceFilter - move the filter to the device
+*
+* The device can only switch standard or extended frames off as a whole, this
+* is done with the operating mode of the CAN init command. Everything else is
+* filtered on the host. Without bitrate the init is sent by canSetBusParams.
+*
+* \return canStatus
+*/
+static canStatus usbFdCanSetAcceptanceFilter(
+		const CanHandle hnd
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    if (pPriv->brp == 0u)  {
+        return(canOK);
+    }
+
+    return(usbFdSetBitrates(pSelf));
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanSetTxQueueSize(
+		const CanHandle hnd,
+        UInt32 frames
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    if (!usbFdResizeTransmitBuffer(&pPriv->pTransBuff, frames))  {
+        return(canERR_TXBUFOFL);
+    }
+
+    return(canOK);
+}
+
+
+/******************************************************************************/
+static void usbFdCanGetTxQueueStat(
+		const CanHandle hnd,
+        UInt32 *pSize,
+        UInt32 *pHighWater
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv != NULL)  {
+        *pSize = pPriv->pTransBuff.bufferSize;
+        *pHighWater = pPriv->pTransBuff.bufferHighWater;
+    }
+}
+
+
 /******************************************************************************/
 static canStatus usbFdCanStartChip(
         CanHandle hdl
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hdl);
 UInt8 data[IXXUSBFD_CMD_BUFFER_SIZE] = {0};
 IXXUSBFDCANSTARTREQ_T *pReq;
 IXXUSBFDCANSTARTRESP_T *pResp;
@@ -373,7 +458,7 @@ static canStatus usbFdCanStopChip(
         CanHandle hdl
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hdl);
 UInt8 data[IXXUSBFD_CMD_BUFFER_SIZE] = {0};
 IXXUSBFDCANSTOPREQ_T *pReq;
 IXXUSBFDCANSTOPRESP_T *pResp;
@@ -412,13 +497,13 @@ static canStatus usbFdCanRead (
         UInt32  *time
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 CanMsg canMsg;
     
     if ( CAN4OSX_ReadCanEventBuffer(pSelf->canEventMsgBuff, &canMsg) ) {
         *id = canMsg.canId;
         *dlc = canMsg.canDlc;
-        *time =canMsg.canTimestamp;
+        *time = CAN4OSX_TIME_US(canMsg.canTimestamp);
         *flag = canMsg.canFlags;
         memcpy(msg, canMsg.canData, *dlc);
         
@@ -431,6 +516,54 @@ CanMsg canMsg;
 }
 
 
+/******************************************************************************/
+static canStatus usbFdBuildCanMsg (
+        IXXUSBFDPRIVATEDATA_T *pPriv,
+        IXXUSBFDCANMSG_T *pCanMsg,
+        UInt32 id,
+        const void *msg,
+        UInt16 dlc,
+        UInt32 flag
+    )
+{
+    if (pPriv->canFd == 0u)  {
+        if (dlc > 8u)  {
+            dlc = 8u;
+        }
+    }
+
+    memset(pCanMsg, 0, sizeof(IXXUSBFDCANMSG_T));
+
+    pCanMsg->canId = id;
+
+    pCanMsg->flags = CAN4OSX_encodeFdDlc(dlc);
+    /* no valid dlc found */
+    if (pCanMsg->flags == 0xfful)  {
+        return(canERR_PARAM);
+    }
+    pCanMsg->flags <<= 16u;
+
+    if (flag & canMSG_EXT)  {
+        pCanMsg->flags |= IXXUSBFD_MSG_FLAG_EXT;
+    }
+    if (flag & canMSG_RTR)  {
+        pCanMsg->flags |= IXXUSBFD_MSG_FLAG_RTR;
+    }
+    if (flag & canFDMSG_FDF)  {
+        pCanMsg->flags |= IXXUSBFD_MSG_FLAG_EDL;
+        if (flag & canFDMSG_BRS)  {
+            pCanMsg->flags |= IXXUSBFD_MSG_FLAG_FDR;
+        }
+    }
+
+    memcpy(pCanMsg->data , msg, dlc);
+
+    pCanMsg->size = (sizeof(IXXUSBFDCANMSG_T) - 1u - 64u + dlc);
+
+    return(canOK);
+}
+
+
 /******************************************************************************/
 static canStatus usbFdCanWrite (
 		const CanHandle hnd,
@@ -440,53 +573,24 @@ static canStatus usbFdCanWrite (
         UInt32 flag
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 UInt8 retVal = 0u;
     
     if ( pSelf->privateData != NULL ) {
     IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
-	IXXUSBFDCANMSG_T canMsg = {0};
+	IXXUSBFDCANMSG_T canMsg;
 	
-		if (pPriv->canFd == 0u)  {
-            if (dlc > 8u)  {
-                 dlc = 8u;
-            }
-        }
-	
-		canMsg.canId = id;
-  
-  		canMsg.flags = 0u;
-    	canMsg.flags = CAN4OSX_encodeFdDlc(dlc);
-     	/* no valid dlc found */
-     	if (canMsg.flags == 0xfful)  {
-      		return(canERR_PARAM);
-        }
-     	canMsg.flags <<= 16u;
-  
-  		if (flag & canMSG_EXT)  {
-    		canMsg.flags |= IXXUSBFD_MSG_FLAG_EXT;
-        }
-        if (flag & canMSG_RTR)  {
-        	canMsg.flags |= IXXUSBFD_MSG_FLAG_RTR;
-        }
-        if (flag & canFDMSG_FDF)  {
-        	canMsg.flags |= IXXUSBFD_MSG_FLAG_EDL;
-         	if (flag & canFDMSG_BRS)  {
-          		canMsg.flags |= IXXUSBFD_MSG_FLAG_FDR;
-            }
+        if (usbFdBuildCanMsg(pPriv, &canMsg, id, msg, dlc, flag) != canOK)  {
+            return(canERR_PARAM);
         }
         
-        memcpy(canMsg.data , msg, dlc);
-	
-		canMsg.size = (sizeof(canMsg) - 1u - 64u + dlc);
-        
         retVal = usbFdWriteTransmitBuffer(&pPriv->pTransBuff, canMsg);
         
         if (retVal == 0u)  {
         	return(canERR_TXBUFOFL);
         }
         
-        usbFdWriteToBulkPipe(pSelf);
+        CAN4OSX_usbWriteToBulkOutPipe(pSelf);
         
         return(canOK);
         
@@ -497,6 +601,65 @@ UInt8 retVal = 0u;
 }
 
 
+/******************************************************************************/
+/**
+*
+* \brief usbFdCanWriteBatch - queue several messages at once
+*
+* The messages are converted in chunks and each chunk is put into the transmit
+* buffer with one queue access. The bulk pipe is started once at the end, so
+* the fill function can pack the messages into full USB transfers.
+*
+* \return canStatus
+*
+*/
+static canStatus usbFdCanWriteBatch (
+		const CanHandle hnd,
+        const CanFrame *frames,
+        UInt32 count,
+        UInt32 *sent
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+IXXUSBFDCANMSG_T canMsgs[IXXUSBFD_TX_BATCH_SIZE];
+canStatus status = canOK;
+
+    *sent = 0u;
+
+    if ( pSelf->privateData == NULL ) {
+        return(canERR_INTERNAL);
+    }
+
+    IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    while ((*sent < count) && (status == canOK))  {
+        UInt32 chunk = 0u;
+        UInt32 stored;
+
+        while ((chunk < IXXUSBFD_TX_BATCH_SIZE) && ((*sent + chunk) < count))  {
+            const CanFrame *pFrame = &frames[*sent + chunk];
+            status = usbFdBuildCanMsg(pPriv, &canMsgs[chunk], pFrame->id,
+                                      pFrame->msg, pFrame->dlc, pFrame->flag);
+            if (status != canOK)  {
+                break;
+            }
+            chunk++;
+        }
+
+        stored = usbFdWriteTransmitBufferBatch(&pPriv->pTransBuff, canMsgs, chunk);
+        *sent += stored;
+
+        if (stored < chunk)  {
+            status = canERR_TXBUFOFL;
+        }
+    }
+
+    CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+
+    return(status);
+}
+
+
 /******************************************************************************/
 // Translate from baud macro to bus params
 /******************************************************************************/
@@ -707,7 +870,17 @@ IXXUSBFDCANINITRESP_T *pResp;
     pReq->header.reqPort = pSelf->deviceChannel;
 
     pReq->exMode = 0u;
-    pReq->opMode = (IXXUSBFD_OPMODE_EXTENDED | IXXUSBFD_OPMODE_STANDARD);
+    /* frame types the acceptance filter drops completely stay on the device */
+    pReq->opMode = 0u;
+    if (!CAN4OSX_FilterRejectsAll(pSelf, 0))  {
+        pReq->opMode |= IXXUSBFD_OPMODE_STANDARD;
+    }
+    if (!CAN4OSX_FilterRejectsAll(pSelf, 1))  {
+        pReq->opMode |= IXXUSBFD_OPMODE_EXTENDED;
+    }
+    if (pReq->opMode == 0u)  {
+        pReq->opMode = IXXUSBFD_OPMODE_STANDARD;
+    }
     if (pPriv->canFd)  {
     	pReq->exMode = (IXXUSBFD_EXMODE_EXTDATA | IXXUSBFD_EXMODE_ISOFD | IXXUSBFD_EXMODE_FASTDATA);
     }
@@ -746,19 +919,12 @@ static canStatus usbFdSendCmd(
         IXXUSBFDMSGREQHEAD_T *pCmd
     )
 {
-IOUSBDevRequest request;
-IOReturn retVal;
-
-	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
-	request.bRequest = 0xff;
-	request.wValue = pCmd->reqPort;
-    request.wIndex = 0u;
-	request.wLength = pCmd->reqSize + sizeof(IXXUSBFDMSGRESPHEAD_T);
-	request.pData = pCmd;
+canStatus retVal;
 
 	for (int i = 0; i < 10; i++)  {
-		retVal = (*(pSelf->can4osxDeviceInterface))->DeviceRequest(pSelf->can4osxDeviceInterface, &request);
-		if (retVal == kIOReturnSuccess)  {
+		retVal = CAN4OSX_usbControlRequest(pSelf, CAN4OSX_USB_VENDOR_OUT, 0xff, pCmd->reqPort, 0u,
+										   pCmd, pCmd->reqSize + sizeof(IXXUSBFDMSGRESPHEAD_T), NULL);
+		if (retVal == canOK)  {
   			return(canOK);
         }
 	}
@@ -773,20 +939,13 @@ static canStatus usbFdRecvCmd(
         int value
     )
 {
-IOUSBDevRequest request;
-IOReturn retVal;
+canStatus retVal;
 UInt16 sizeToRead = pCmd->respSize;
-
-    request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBVendor, kUSBDevice);
-    request.bRequest = 0xff;
-    request.wLength = pCmd->respSize;
-    request.wValue = value;
-    request.wIndex = 0u;
-    request.pData = pCmd;
     
     for (int i = 0; i < 10; i++)  {
-        retVal = (*(pSelf->can4osxDeviceInterface))->DeviceRequest(pSelf->can4osxDeviceInterface, &request);
-        if (retVal == kIOReturnSuccess)  {
+        retVal = CAN4OSX_usbControlRequest(pSelf, CAN4OSX_USB_VENDOR_IN, 0xff, (UInt16)value, 0u,
+                                           pCmd, sizeToRead, NULL);
+        if (retVal == canOK)  {
         	if (sizeToRead <= pCmd->retSize)  {
               	return(canOK);
             }
@@ -803,47 +962,69 @@ static void usbFdDecodeMsg(
         IXXUSBFDCANMSG_T* pMsg
     )
 {
-CanMsg canMsg;
-
-	memset(&canMsg, 0u, sizeof(canMsg));
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt64 canTimestamp;
+UInt64 canHostTimestamp;
+UInt32 canFlags;
+UInt8 canDlc;
 
 	switch (pMsg->flags & IXXUSBFD_MSG_FLAG_TYPE)  {
     case IXXUSBFD_CAN_DATA:
-    	canMsg.canId = pMsg->canId;
-    	canMsg.canDlc = (pMsg->flags & IXXUSBFD_MSG_FLAG_DLC ) >> 16;
+    	/* pMsg->time ticks at an unknown rate, the transfer time stands in */
+    	canTimestamp = CAN4OSX_ClockSyncTransferNs();
+    	canHostTimestamp = canTimestamp;
+
+    	/* counted even if the frame is filtered, the next stored one carries it */
+    	if (pMsg->flags & IXXUSBFD_MSG_FLAG_OVR)  {
+    		CAN4OSX_CountHwOverrun(pSelf);
+    	}
+
+    	if ( !CAN4OSX_FilterAccept(pSelf, pMsg->canId,
+    							   (pMsg->flags & IXXUSBFD_MSG_FLAG_EXT) ? canMSG_EXT : canMSG_STD) )  {
+    		break;
+    	}
+
+    	canDlc = (pMsg->flags & IXXUSBFD_MSG_FLAG_DLC ) >> 16;
      
         /* decode dlc to length */
-    	canMsg.canDlc = CAN4OSX_decodeFdDlc(canMsg.canDlc);
+    	canDlc = CAN4OSX_decodeFdDlc(canDlc);
      
-     	canMsg.canFlags = 0u;
+     	canFlags = 0u;
      	if (pMsg->flags & IXXUSBFD_MSG_FLAG_EDL)  {
-      		canMsg.canFlags |= canFDMSG_FDF;
+      		canFlags |= canFDMSG_FDF;
         } else {
-        	if (canMsg.canDlc > 8u)  {
-         		canMsg.canDlc = 8u;
+        	if (canDlc > 8u)  {
+         		canDlc = 8u;
             }
         }
         if (pMsg->flags & IXXUSBFD_MSG_FLAG_FDR)  {
-            canMsg.canFlags |= canFDMSG_BRS;
+            canFlags |= canFDMSG_BRS;
         }
         if (pMsg->flags & IXXUSBFD_MSG_FLAG_EXT)  {
-            canMsg.canFlags |= canMSG_EXT;
+            canFlags |= canMSG_EXT;
         } else {
-            canMsg.canFlags |= canMSG_STD;
+            canFlags |= canMSG_STD;
         }
         if (pMsg->flags & IXXUSBFD_MSG_FLAG_RTR)  {
-            canMsg.canFlags |= canMSG_RTR;
-        } else {
-        	memcpy(canMsg.canData, pMsg->data, canMsg.canDlc);
+            canFlags |= canMSG_RTR;
         }
         
-        canMsg.canTimestamp = pMsg->time;
-      
-        CAN4OSX_WriteCanEventBuffer(pSelf->canEventMsgBuff,canMsg);
-        
-        if (pSelf->canNotification.notifacionCenter)  {
-                CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
-                    pSelf->canNotification.notificationString, NULL, NULL, true);
+        /* decoded right into the receive ring */
+        pRecord = CAN4OSX_ReserveCanEventBuffer(pSelf->canEventMsgBuff, canDlc);
+        if (pRecord != NULL)  {
+            pRecord->canId = pMsg->canId;
+            pRecord->canFlags = canFlags;
+            pRecord->canTimestamp = canTimestamp;
+            pRecord->canHostTimestamp = canHostTimestamp;
+            if (canFlags & canMSG_RTR)  {
+                memset(pRecord->canData, 0u, canDlc);
+            } else {
+                memcpy(pRecord->canData, pMsg->data, canDlc);
+            }
+            
+            CAN4OSX_CommitCanEventBuffer(pSelf->canEventMsgBuff, pRecord);
+
+            CAN4OSX_NotifyEvent(pSelf, canNOTIFY_RX);
         }
      
      	break;
@@ -852,6 +1033,7 @@ CanMsg canMsg;
         UInt8 newState = pMsg->data[0];
         	if (newState == 0u)  {
             	pSelf->canState.canState = CHIPSTAT_ERROR_ACTIVE;
+            	CAN4OSX_NotifyEvent(pSelf, canNOTIFY_STATUS);
              	return;
             }
       	}
@@ -863,129 +1045,63 @@ CanMsg canMsg;
 
 
 /******************************************************************************/
-static void usbFdBulkReadCompletion(void *refCon, IOReturn result, void *arg0)
+/**
+ * \brief usbFdBulkInDecode - decode the messages of one bulk-in transfer
+ *
+ * The size byte of a message does not count itself.
+ */
+static void usbFdBulkInDecode(
+		void *refCon,
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
 {
 Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-UInt32 numBytesRead = (UInt32) arg0;
 UInt32 count = 0u;
 IXXUSBFDCANMSG_T *pMsg;
-    
-    CAN4OSX_DEBUG_PRINT("Asynchronous bulk read complete (%ld)\n", (long)numBytesRead);
-    
-    if (result != kIOReturnSuccess)  {
-        CAN4OSX_DEBUG_PRINT("Error from async bulk read (%08x)\n", result);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
-    } else {
-    
-	    while (count < numBytesRead)  {
-    		pMsg = (IXXUSBFDCANMSG_T *)&(pSelf->endpointBufferBulkInRef[count]);
-     		usbFdDecodeMsg(pSelf, pMsg);
-    		count += pMsg->size;
-     		count++;
-    	}
 
-    	CAN4OSX_usbReadFromBulkInPipe(pSelf);
+    while (count < size)  {
+        pMsg = (IXXUSBFDCANMSG_T *)&(pBuffer[count]);
+        usbFdDecodeMsg(pSelf, pMsg);
+        count += pMsg->size;
+        count++;
     }
 }
 
 
-static IOReturn usbFdWriteToBulkPipe(
-		Can4osxUsbDeviceHandleEntry *pSelf
-    )
-{
-IOReturn retval = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
-UInt16 size = 0u;
-
-    pthread_mutex_lock(&pPriv->mutex);
-    
-	if ( pSelf->endpoitBulkOutBusy == FALSE ) {
-        pSelf->endpoitBulkOutBusy = TRUE;
-        size = usbFdFillBulkPipeBuffer(&pPriv->pTransBuff, pSelf->endpointBufferBulkOutRef, pSelf->endpointMaxSizeBulkOut );
-        if (size > 0) {
-
-            retval = (*interface)->WritePipeAsync(interface, pSelf->endpointNumberBulkOut, pSelf->endpointBufferBulkOutRef, size, usbFdBulkWriteCompletion, (void*)pSelf);
-        
-            if (retval != kIOReturnSuccess) {
-                CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", retval);
-                (void) (*interface)->USBInterfaceClose(interface);
-                (void) (*interface)->Release(interface);
-            }
-        } else {
-            pSelf->endpoitBulkOutBusy = FALSE;
-        }
-    }
-    pthread_mutex_unlock(&pPriv->mutex);
-    
-    return(retval);
-}
-
-
 /******************************************************************************/
 static UInt16 usbFdFillBulkPipeBuffer(
-		IXXUSBFDTRANSMITBUFFER_T *pBufferRef,
+		void *refCon,
         UInt8 *pipe,
         UInt16 maxPipeSize
     )
 {
-UInt16 fillState = 0;
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+IXXUSBFDTRANSMITBUFFER_T *pBufferRef = &((IXXUSBFDPRIVATEDATA_T *)pSelf->privateData)->pTransBuff;
+__block UInt16 fillState = 0;
     
-    while (fillState < maxPipeSize)  {
-        IXXUSBFDCANMSG_T cmd;
-        if (usbFdReadCommandBuffer(pBufferRef, &cmd))  {
-            memcpy(pipe, &cmd, cmd.size + 1);
-            fillState += cmd.size + 1;
-            pipe += cmd.size + 1;
-            //Will another command fir in the pipe?
-            if ( (fillState + sizeof(IXXUSBFDCANMSG_T)) >= maxPipeSize ) {
-                *pipe = 0;
+    /* pack messages until the next one does not fit, one queue access */
+    dispatch_sync(pBufferRef->bufferGDCqueueRef, ^{
+        while (!usbFdTestEmptyTransmitBuffer(pBufferRef))  {
+            IXXUSBFDCANMSG_T *pMsg = &pBufferRef->msgData[pBufferRef->bufferFirst];
+            UInt16 msgLen = pMsg->size + 1u;
+            
+            if ((fillState + msgLen) > maxPipeSize)  {
                 break;
             }
             
-        } else {
-            *pipe = 0;
-            break;
+            memcpy(&pipe[fillState], pMsg, msgLen);
+            fillState += msgLen;
+            pBufferRef->bufferFirst = (pBufferRef->bufferFirst + 1u) % pBufferRef->bufferSize;
+            pBufferRef->bufferCount--;
         }
-    }
-    
-    return(fillState);
-}
-
-
-/******************************************************************************/
-static void usbFdBulkWriteCompletion(
-		void *refCon,
-        IOReturn result,
-        void *arg0
-    )
-{
-Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-UInt32 numBytesWritten = (UInt32) arg0;
-IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
-
-    (void)numBytesWritten;
-    
-    CAN4OSX_DEBUG_PRINT("Asynchronous bulk write complete\n");
+    });
     
-    if (result != kIOReturnSuccess) {
-        CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
-        return;
+    if (fillState < maxPipeSize)  {
+        pipe[fillState] = 0;
     }
- 
- 	pthread_mutex_lock(&pPriv->mutex);
-    pSelf->endpoitBulkOutBusy = FALSE;
-    pthread_mutex_unlock(&pPriv->mutex);
-
-    CAN4OSX_DEBUG_PRINT("Wrote %ld bytes to bulk endpoint\n", (long)numBytesWritten);
-    
-    usbFdWriteToBulkPipe(pSelf);
     
+    return(fillState);
 }
 
 
@@ -1028,6 +1144,9 @@ __block UInt8 retval = 1u;
             retval = 0u;
         } else {
             pBuffer->msgData[(pBuffer->bufferFirst + pBuffer->bufferCount++) % pBuffer->bufferSize] = newMsg;
+            if (pBuffer->bufferCount > pBuffer->bufferHighWater)  {
+                pBuffer->bufferHighWater = pBuffer->bufferCount;
+            }
         }
     });
     
@@ -1036,22 +1155,71 @@ __block UInt8 retval = 1u;
 
 
 /******************************************************************************/
-static UInt8 usbFdReadCommandBuffer(
+static UInt32 usbFdWriteTransmitBufferBatch(
 		IXXUSBFDTRANSMITBUFFER_T* pBuffer,
-		IXXUSBFDCANMSG_T* pCanMsg
+        const IXXUSBFDCANMSG_T *pNewMsgs,
+        UInt32 count
     )
 {
-__block UInt8 retval = 1u;
+__block UInt32 stored = 0u;
     
     dispatch_sync(pBuffer->bufferGDCqueueRef, ^{
-        if (usbFdTestEmptyTransmitBuffer(pBuffer)) {
-            retval = 0u;
-        } else {
-            pBuffer->bufferCount--;
-            *pCanMsg = pBuffer->msgData[pBuffer->bufferFirst++ % pBuffer->bufferSize];
+        while ((stored < count) && !usbFdTestFullTransmitBuffer(pBuffer))  {
+            pBuffer->msgData[(pBuffer->bufferFirst + pBuffer->bufferCount++) % pBuffer->bufferSize] = pNewMsgs[stored++];
+        }
+        if (pBuffer->bufferCount > pBuffer->bufferHighWater)  {
+            pBuffer->bufferHighWater = pBuffer->bufferCount;
         }
     });
     
+    return(stored);
+}
+
+
+/******************************************************************************/
+/**
+*
+* \brief usbFdResizeTransmitBuffer - change the depth of the transmit buffer
+*
+* Queued messages are kept in order, fails if they do not fit.
+*
+* \return 1 on success
+*
+*/
+static UInt8 usbFdResizeTransmitBuffer(
+		IXXUSBFDTRANSMITBUFFER_T* pBuffer,
+        UInt32 bufferSize
+    )
+{
+__block IXXUSBFDCANMSG_T *pMsgData = malloc(bufferSize * sizeof(IXXUSBFDCANMSG_T));
+__block UInt8 retval = 1u;
+
+    if (pMsgData == NULL)  {
+        return(0u);
+    }
+
+    dispatch_sync(pBuffer->bufferGDCqueueRef, ^{
+        IXXUSBFDCANMSG_T *pOldData = pBuffer->msgData;
+        int i;
+
+        if (pBuffer->bufferCount > (int)bufferSize)  {
+            retval = 0u;
+            return;
+        }
+
+        for (i = 0; i < pBuffer->bufferCount; i++)  {
+            pMsgData[i] = pOldData[(pBuffer->bufferFirst + i) % pBuffer->bufferSize];
+        }
+
+        pBuffer->msgData = pMsgData;
+        pBuffer->bufferSize = bufferSize;
+        pBuffer->bufferFirst = 0;
+        pBuffer->bufferHighWater = pBuffer->bufferCount;
+        pMsgData = pOldData;
+    });
+
+    free(pMsgData);
+
     return(retval);
 }
 
@@ -45,11 +45,8 @@
 
 #include <stdio.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 /* can4osx */
@@ -71,21 +68,23 @@ static canStatus LeafCanStopChip(CanHandle hdl);
 
 static canStatus LeafCanSetBusParams (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
 static canStatus LeafCanWrite (const CanHandle hnd,UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
+static canStatus LeafCanWriteBatch (const CanHandle hnd, const CanFrame *frames, UInt32 count, UInt32 *sent);
 static canStatus LeafCanRead (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
 static canStatus LeafCanClose(const CanHandle hnd);
+static canStatus LeafCanSetTxQueueSize(const CanHandle hnd, UInt32 frames);
+static void LeafCanGetTxQueueStat(const CanHandle hnd, UInt32 *pSize, UInt32 *pHighWater);
 
 
 
 static LeafCommandMsgBuf* LeafCreateCommandBuffer( UInt32 bufferSize );
 static void LeafReleaseCommandBuffer( LeafCommandMsgBuf* bufferRef );
 static UInt8 LeafWriteCommandBuffer(LeafCommandMsgBuf* bufferRef, leafCmd newCommand);
-static UInt8 LeafReadCommandBuffer(LeafCommandMsgBuf* bufferRef, leafCmd* readCommand);
+static UInt32 LeafWriteCommandBufferBatch(LeafCommandMsgBuf* bufferRef, const leafCmd *newCommands, UInt32 count);
+static UInt8 LeafResizeCommandBuffer(LeafCommandMsgBuf* bufferRef, UInt32 bufferSize);
 
-static void LeafBulkWriteCompletion(void *refCon, IOReturn result, void *arg0);
-static IOReturn LeafWriteToBulkPipe(Can4osxUsbDeviceHandleEntry *self);
-static UInt16 LeafFillBulkPipeBuffer(LeafCommandMsgBuf* bufferRef, UInt8 *pipe, UInt16 maxPipeSize);
+static UInt16 LeafFillBulkPipeBuffer(void *refCon, UInt8 *pipe, UInt16 maxPipeSize);
 
-static void BulkReadCompletion(void *refCon, IOReturn result, void *arg0);
+static void LeafBulkInDecode(void *refCon, const UInt8 *pBuffer, UInt32 size);
 
 
 //Hardware interface function
@@ -99,8 +98,11 @@ CAN4OSX_HW_FUNC_T leafHardwareFunctions = {
 	.can4osxhwCanBusOnRef = LeafCanStartChip,
 	.can4osxhwCanBusOffRef = LeafCanStopChip,
 	.can4osxhwCanWriteRef = LeafCanWrite,
+	.can4osxhwCanWriteBatchRef = LeafCanWriteBatch,
 	.can4osxhwCanReadRef = LeafCanRead,
 	.can4osxhwCanCloseRef = LeafCanClose,
+	.can4osxhwCanSetTxQueueSizeRef = LeafCanSetTxQueueSize,
+	.can4osxhwCanGetTxQueueStatRef = LeafCanGetTxQueueStat,
 };
 
 
@@ -108,13 +110,13 @@ CAN4OSX_HW_FUNC_T leafHardwareFunctions = {
 
 canStatus LeafInitHardware(const CanHandle hnd)
 {
-	Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+	Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 	pSelf->privateData = calloc(1,sizeof(LeafPrivateData));
 
 	if ( pSelf->privateData != NULL )  {
 		LeafPrivateData *priv = (LeafPrivateData *)pSelf->privateData;
 
-		priv->cmdBufferRef = LeafCreateCommandBuffer(1000);
+		priv->cmdBufferRef = LeafCreateCommandBuffer(CAN4OSX_TX_QUEUE_SIZE);
 		if ( priv->cmdBufferRef == NULL )  {
 			free(priv);
 			return(canERR_NOMEM);
@@ -126,7 +128,10 @@ canStatus LeafInitHardware(const CanHandle hnd)
 		return(canERR_NOMEM);
 	}
 
-	pSelf->usbFunctions.bulkReadCompletion = BulkReadCompletion;
+	pSelf->usbFunctions.bulkInDecode = LeafBulkInDecode;
+	pSelf->usbFunctions.bulkOutFill = LeafFillBulkPipeBuffer;
+
+	CAN4OSX_InitTimeBase(&pSelf->timeBase, 48u, LEAF_TIMER_FREQ);
 	
 	// Set some device Infos
 	sprintf((char*)pSelf->devInfo.deviceString, "%s",pDeviceString);
@@ -142,7 +147,7 @@ canStatus LeafInitHardware(const CanHandle hnd)
 static canStatus LeafCanClose(const CanHandle hnd)
 {
 
-	Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+	Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
 
 	if ( self->privateData != NULL )  {
 		LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
@@ -159,6 +164,48 @@ static canStatus LeafCanClose(const CanHandle hnd)
 }
 
 
+static void LeafBuildTxCommand(
+		leafCmd *cmd,
+		UInt32 id,
+		const void *msg,
+		UInt16 dlc,
+		UInt32 flag
+	)
+{
+	cmd->txCanMessage.channel = 0;
+
+	cmd->txCanMessage.cmdLen = sizeof(cmdTxCanMessage);
+
+	if ( flag & canMSG_EXT )  {
+		// Extended ID
+		cmd->txCanMessage.cmdNo = CMD_TX_EXT_MESSAGE;
+
+		cmd->txCanMessage.rawMessage[0] = (UInt8)((id >> 24) & 0x1f);
+		cmd->txCanMessage.rawMessage[1] = (UInt8)((id >> 18) & 0x3f);
+		cmd->txCanMessage.rawMessage[2] = (UInt8)((id >> 14) & 0x0f);
+		cmd->txCanMessage.rawMessage[3] = (UInt8)((id >> 6 ) & 0xFF);
+		cmd->txCanMessage.rawMessage[4] = (UInt8)((id      ) & 0x3f);
+	} else {
+		// Standard CAN
+		cmd->txCanMessage.cmdNo = CMD_TX_STD_MESSAGE;
+
+		cmd->txCanMessage.rawMessage[0] = (UInt8)((id >>  6) & 0x1F);
+		cmd->txCanMessage.rawMessage[1] = (UInt8)((id      ) & 0x3F);
+	}
+
+	cmd->txCanMessage.flags = 0;
+
+	// RTR Frame
+	if ( flag & canMSG_RTR )  {
+		cmd->txCanMessage.flags |= LEAF_MSG_FLAG_REMOTE_FRAME;
+	}
+
+	// DLC and DATA
+	cmd->txCanMessage.rawMessage[5]   = dlc & 0x0F;
+	memcpy(&cmd->txCanMessage.rawMessage[6], msg, 8);
+}
+
+
 static canStatus LeafCanWrite(
 		const CanHandle hnd,
 		UInt32 id,
@@ -167,60 +214,83 @@ static canStatus LeafCanWrite(
 		UInt32 flag
 	)
 {
-Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
 
 	if ( self->privateData != NULL )  {
 		LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
 		leafCmd cmd;
-		cmd.txCanMessage.channel = 0;
+		LeafBuildTxCommand(&cmd, id, msg, dlc, flag);
 
-		cmd.txCanMessage.cmdLen = sizeof(cmdTxCanMessage);
+		// a full queue drops the frame, the caller has to try again
+		if ( !LeafWriteCommandBuffer(priv->cmdBufferRef, cmd) )  {
+			CAN4OSX_usbWriteToBulkOutPipe(self);
+			return(canERR_TXBUFOFL);
+		}
 
-		if ( flag & canMSG_EXT )  {
-			// Extended ID
-			cmd.txCanMessage.cmdNo = CMD_TX_EXT_MESSAGE;
+		CAN4OSX_usbWriteToBulkOutPipe(self);
 
-			cmd.txCanMessage.rawMessage[0] = (UInt8)((id >> 24) & 0x1f);
-			cmd.txCanMessage.rawMessage[1] = (UInt8)((id >> 18) & 0x3f);
-			cmd.txCanMessage.rawMessage[2] = (UInt8)((id >> 14) & 0x0f);
-			cmd.txCanMessage.rawMessage[3] = (UInt8)((id >> 6 ) & 0xFF);
-			cmd.txCanMessage.rawMessage[4] = (UInt8)((id      ) & 0x3f);
-		} else {
-			// Standard CAN
-			cmd.txCanMessage.cmdNo = CMD_TX_STD_MESSAGE;
+		return(canOK);
 
-			cmd.txCanMessage.rawMessage[0] = (UInt8)((id >>  6) & 0x1F);
-			cmd.txCanMessage.rawMessage[1] = (UInt8)((id      ) & 0x3F);
-		}
+	} else {
+		return(canERR_INTERNAL);
+	}
 
-		cmd.txCanMessage.flags = 0;
+}
 
-		// RTR Frame
-		if ( flag & canMSG_RTR )  {
-			cmd.txCanMessage.flags |= LEAF_MSG_FLAG_REMOTE_FRAME;
-		}
 
-		// DLC and DATA
-		cmd.txCanMessage.rawMessage[5]   = dlc & 0x0F;
-		memcpy(&cmd.txCanMessage.rawMessage[6], msg, 8);
+static canStatus LeafCanWriteBatch(
+		const CanHandle hnd,
+		const CanFrame *frames,
+		UInt32 count,
+		UInt32 *sent
+	)
+{
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
+leafCmd cmds[LEAF_TX_BATCH_SIZE];
+canStatus status = canOK;
 
-		LeafWriteCommandBuffer(priv->cmdBufferRef, cmd);
+	*sent = 0;
 
-		LeafWriteToBulkPipe(self);
+	if ( self->privateData == NULL )  {
+		return(canERR_INTERNAL);
+	}
 
-		return(canOK);
+	LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
-	} else {
-		return(canERR_INTERNAL);
+	while ( *sent < count )  {
+		UInt32 chunk = count - *sent;
+		UInt32 stored;
+		UInt32 i;
+
+		if ( chunk > LEAF_TX_BATCH_SIZE )  {
+			chunk = LEAF_TX_BATCH_SIZE;
+		}
+
+		for ( i = 0; i < chunk; i++ )  {
+			const CanFrame *pFrame = &frames[*sent + i];
+			LeafBuildTxCommand(&cmds[i], pFrame->id, pFrame->msg, pFrame->dlc, pFrame->flag);
+		}
+
+		stored = LeafWriteCommandBufferBatch(priv->cmdBufferRef, cmds, chunk);
+		*sent += stored;
+
+		if ( stored < chunk )  {
+			status = canERR_TXBUFOFL;
+			break;
+		}
 	}
 
+	// One kick for the whole batch, the fill function packs the pipe
+	CAN4OSX_usbWriteToBulkOutPipe(self);
+
+	return(status);
 }
 
 
 static canStatus LeafCanRead (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time)
 {
-Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
 
 	if ( self->privateData != NULL )  {
 
@@ -230,7 +300,7 @@ Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
 
 			*id = canMsg.canId;
 			*dlc = canMsg.canDlc;
-			*time =canMsg.canTimestamp;
+			*time = CAN4OSX_TIME_US(canMsg.canTimestamp);
 
 			memcpy(msg, canMsg.canData, *dlc);
 
@@ -246,6 +316,37 @@ Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
 }
 
 
+static canStatus LeafCanSetTxQueueSize(const CanHandle hnd, UInt32 frames)
+{
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
+
+	if ( self->privateData == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
+
+	if ( !LeafResizeCommandBuffer(priv->cmdBufferRef, frames) )  {
+		return(canERR_TXBUFOFL);
+	}
+
+	return(canOK);
+}
+
+
+static void LeafCanGetTxQueueStat(const CanHandle hnd, UInt32 *pSize, UInt32 *pHighWater)
+{
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
+
+	if ( self->privateData != NULL )  {
+		LeafCommandMsgBuf* bufferRef = ((LeafPrivateData *)self->privateData)->cmdBufferRef;
+
+		*pSize = bufferRef->bufferSize;
+		*pHighWater = bufferRef->bufferHighWater;
+	}
+}
+
+
 // The command buffer function
 LeafCommandMsgBuf* LeafCreateCommandBuffer( UInt32 bufferSize )
 {
@@ -257,6 +358,7 @@ LeafCommandMsgBuf* LeafCreateCommandBuffer( UInt32 bufferSize )
 	bufferRef->bufferSize = bufferSize;
 	bufferRef->bufferCount = 0;
 	bufferRef->bufferFirst = 0;
+	bufferRef->bufferHighWater = 0;
 
 	bufferRef->commandRef = malloc(bufferSize * sizeof(leafCmd));
 
@@ -316,6 +418,9 @@ __block UInt8 retval = 1;
 			retval = 0;
 		} else {
 			bufferRef->commandRef[(bufferRef->bufferFirst + bufferRef->bufferCount++) % bufferRef->bufferSize] = newCommand;
+			if ( bufferRef->bufferCount > bufferRef->bufferHighWater )  {
+				bufferRef->bufferHighWater = bufferRef->bufferCount;
+			}
 		}
 	});
 
@@ -323,45 +428,63 @@ __block UInt8 retval = 1;
 }
 
 
-static UInt8 LeafReadCommandBuffer(LeafCommandMsgBuf* bufferRef, leafCmd* readCommand)
+static UInt32 LeafWriteCommandBufferBatch(
+		LeafCommandMsgBuf* bufferRef,
+		const leafCmd *newCommands,
+		UInt32 count
+	)
 {
-__block UInt8 retval = 1;
+__block UInt32 stored = 0;
 
 	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
-		if (LeafTestEmptyCommandBuffer(bufferRef))  {
-			retval = 0;
-		} else {
-			bufferRef->bufferCount--;
-			*readCommand = bufferRef->commandRef[bufferRef->bufferFirst++ % bufferRef->bufferSize];
+		while ( (stored < count) && !LeafTestFullCommandBuffer(bufferRef) )  {
+			bufferRef->commandRef[(bufferRef->bufferFirst + bufferRef->bufferCount++) % bufferRef->bufferSize] = newCommands[stored++];
+		}
+		if ( bufferRef->bufferCount > bufferRef->bufferHighWater )  {
+			bufferRef->bufferHighWater = bufferRef->bufferCount;
 		}
-
 	});
 
-	return(retval);
+	return(stored);
 }
 
 
-static UInt32 LeafCalculateTimeStamp(
-		UInt16 *timerRef,
-		unsigned int hires_timer_fq
+// Queued commands are kept, fails if they do not fit
+static UInt8 LeafResizeCommandBuffer(
+		LeafCommandMsgBuf* bufferRef,
+		UInt32 bufferSize
 	)
 {
-unsigned long  ulTemp;
-UInt16 result[3];
-unsigned int   uiDivisor = 10 * hires_timer_fq;
-
-	result[0] = timerRef[2] / uiDivisor;
-	ulTemp	 = (timerRef[2] % uiDivisor) << 16;
+__block leafCmd *commandRef = malloc(bufferSize * sizeof(leafCmd));
+__block UInt8 retval = 1;
 
-	if (result[0] > 0)  {
+	if ( commandRef == NULL )  {
+		return(0);
 	}
 
-	result[1] = (unsigned short)((ulTemp + timerRef[1]) / uiDivisor);
-	ulTemp = ((ulTemp + timerRef[1]) % uiDivisor) << 16;
+	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
+		leafCmd *oldRef = bufferRef->commandRef;
+		int i;
+
+		if ( bufferRef->bufferCount > (int)bufferSize )  {
+			retval = 0;
+			return;
+		}
 
-	result[2] = (unsigned short)((ulTemp + timerRef[0]) / uiDivisor);
+		for ( i = 0; i < bufferRef->bufferCount; i++ )  {
+			commandRef[i] = oldRef[(bufferRef->bufferFirst + i) % bufferRef->bufferSize];
+		}
+
+		bufferRef->commandRef = commandRef;
+		bufferRef->bufferSize = bufferSize;
+		bufferRef->bufferFirst = 0;
+		bufferRef->bufferHighWater = bufferRef->bufferCount;
+		commandRef = oldRef;
+	});
 
-	return(((int)result[1] << 16) + result[2]);
+	free(commandRef);
+
+	return(retval);
 }
 
 
@@ -381,49 +504,68 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
 		case CMD_LOG_MESSAGE:
 		{
-			CanMsg canMsg;
-            
-   			memset(&canMsg, 0u, sizeof(canMsg));
+			CAN4OSX_RX_RECORD_T *pRecord;
+			UInt64 canTimestamp;
+			UInt64 canHostTimestamp;
+			UInt32 canId;
+			UInt32 canFlags;
+
+			// Even for filtered frames, the time base has to see every wrap
+			canTimestamp = CAN4OSX_TimeBaseNs(&self->timeBase, ((UInt64)cmd->logMessage.time[2] << 32) |
+												  ((UInt64)cmd->logMessage.time[1] << 16) | cmd->logMessage.time[0]);
+			canHostTimestamp = CAN4OSX_ClockSyncNs(&self->clockSync, canTimestamp);
 
 			if ( cmd->logMessage.ident & LEAF_EXT_MSG )  {
-				canMsg.canId = cmd->logMessage.ident & ~LEAF_EXT_MSG;
-				canMsg.canFlags = canMSG_EXT;
+				canId = cmd->logMessage.ident & ~LEAF_EXT_MSG;
+				canFlags = canMSG_EXT;
 			} else {
-				canMsg.canId = cmd->logMessage.ident;
-				canMsg.canFlags = canMSG_STD;
+				canId = cmd->logMessage.ident;
+				canFlags = canMSG_STD;
 			}
 
+			// Counted even if the frame is filtered, the next stored one carries it
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_OVERRUN)  {
-				//FIXME
-				//event.eventTagData.canMsg.canFlags |= canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN;
+				CAN4OSX_CountHwOverrun(self);
 			}
+
+			// Own frames coming back are not filtered
+			if ( !(cmd->logMessage.flags & LEAF_MSG_FLAG_TXACK) &&
+				 !CAN4OSX_FilterAccept(self, canId, canFlags) )  {
+				break;
+			}
+
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_REMOTE_FRAME)  {
-				canMsg.canFlags |= canMSG_RTR;
+				canFlags |= canMSG_RTR;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_ERROR_FRAME)  {
-				canMsg.canFlags |= canMSG_ERROR_FRAME;
+				canFlags |= canMSG_ERROR_FRAME;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_TXACK)  {
-				canMsg.canFlags |= canMSG_TXACK;
+				canFlags |= canMSG_TXACK;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_TXRQ)  {
-				canMsg.canFlags |= canMSG_TXRQ;
+				canFlags |= canMSG_TXRQ;
 			}
 
 			if ( cmd->logMessage.dlc > 8 )  {
 				cmd->logMessage.dlc = 8;
 			}
 
-			canMsg.canDlc = cmd->logMessage.dlc;
-
-			memcpy(canMsg.canData, cmd->logMessage.data, cmd->logMessage.dlc);
-
-			canMsg.canTimestamp = LeafCalculateTimeStamp(cmd->logMessage.time, 24) * 10;
-
-
-			CAN4OSX_WriteCanEventBuffer(self->canEventMsgBuff,canMsg);
-			if (self->canNotification.notifacionCenter)  {
-				CFNotificationCenterPostNotification (self->canNotification.notifacionCenter, self->canNotification.notificationString, NULL, NULL, true);
+			// Decoded right into the receive ring
+			pRecord = CAN4OSX_ReserveCanEventBuffer(self->canEventMsgBuff, cmd->logMessage.dlc);
+			if ( pRecord != NULL )  {
+				pRecord->canId = canId;
+				pRecord->canFlags = canFlags;
+				pRecord->canTimestamp = canTimestamp;
+				pRecord->canHostTimestamp = canHostTimestamp;
+				memcpy(pRecord->canData, cmd->logMessage.data, cmd->logMessage.dlc);
+
+				CAN4OSX_CommitCanEventBuffer(self->canEventMsgBuff, pRecord);
+
+				CAN4OSX_NotifyEvent(self, (canFlags & canMSG_TXACK) ? (canNOTIFY_RX | canNOTIFY_TX) : canNOTIFY_RX);
+			} else if (canFlags & canMSG_TXACK)  {
+				// The overrun counter has the lost frame, the transmit buffer has room anyway
+				CAN4OSX_NotifyEvent(self, canNOTIFY_TX);
 			}
 
 			CAN4OSX_DEBUG_PRINT("CMD_LOG_MESSAGE Channel: %d Id: %X Flags: %X\n", cmd->logMessage.channel, cmd->logMessage.ident, cmd->logMessage.flags);
@@ -476,6 +618,7 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
 			}
 
+			CAN4OSX_NotifyEvent(self, canNOTIFY_STATUS);
 			break;
 
 		case CMD_GET_CARD_INFO_RESP:
@@ -506,7 +649,11 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 			break;
 
 		case CMD_TREF_SOFNR:
-			CAN4OSX_DEBUG_PRINT("CMD_TREF_SOFNR - Ignored\n");
+			// Sent without bus traffic too, keeps the clock sync going
+			(void)CAN4OSX_ClockSyncNs(&self->clockSync,
+					CAN4OSX_TimeBaseNs(&self->timeBase, ((UInt64)cmd->trefSofNr.time[2] << 32) |
+									   ((UInt64)cmd->trefSofNr.time[1] << 16) | cmd->trefSofNr.time[0]));
+			CAN4OSX_DEBUG_PRINT("CMD_TREF_SOFNR\n");
 			break;
 
 		case CMD_CHECK_LICENSE_RESP:
@@ -649,95 +796,45 @@ canStatus LeafCanTranslateBaud(
 #pragma mark - Leaf USB functions
 #pragma mark - Leaf stuff
 static UInt16 LeafFillBulkPipeBuffer(
-		LeafCommandMsgBuf* bufferRef,
+		void *refCon,
 		UInt8 *pipe,
 		UInt16 maxPipeSize
 	)
 {
-	UInt16 fillState = 0;
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+LeafCommandMsgBuf* bufferRef = ((LeafPrivateData *)pSelf->privateData)->cmdBufferRef;
+__block UInt16 fillState = 0;
 
-	while ( fillState < maxPipeSize )  {
-		leafCmd cmd;
-		if ( LeafReadCommandBuffer(bufferRef, &cmd) )  {
-			memcpy(pipe, &cmd, cmd.head.cmdLen);
-			fillState += cmd.head.cmdLen;
-			pipe += cmd.head.cmdLen;
-			//Will another command fir in the pipe?
-			if ( (fillState + sizeof(leafCmd)) >= maxPipeSize )  {
-				*pipe = 0;
+	// Drain as many queued commands as fit into one packet in a single pass
+	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
+		while ( !LeafTestEmptyCommandBuffer(bufferRef) )  {
+			leafCmd *pCmd = &bufferRef->commandRef[bufferRef->bufferFirst];
+			UInt8 cmdLen = pCmd->head.cmdLen;
+
+			if ( (fillState + cmdLen) > maxPipeSize )  {
 				break;
 			}
 
-		} else {
-			*pipe = 0;
-			break;
-		}
-	}
-
-	return(fillState);
-}
-
-static void LeafBulkWriteCompletion(
-		void *refCon,
-		IOReturn result,
-		void *arg0
-	)
-{
-Can4osxUsbDeviceHandleEntry *self = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = self->can4osxInterfaceInterface;
-
-	UInt32 numBytesWritten = (UInt32) arg0;
+			memcpy(&pipe[fillState], pCmd, cmdLen);
+			fillState += cmdLen;
 
-	(void)numBytesWritten;
-
-	CAN4OSX_DEBUG_PRINT("Asynchronous bulk write complete\n");
+			bufferRef->bufferFirst = (bufferRef->bufferFirst + 1) % bufferRef->bufferSize;
+			bufferRef->bufferCount--;
+		}
+	});
 
-	if (result != kIOReturnSuccess)  {
-		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
-		(void) (*interface)->USBInterfaceClose(interface);
-		(void) (*interface)->Release(interface);
-		return;
+	if ( fillState == 0 )  {
+		return(0);
 	}
 
-	self->endpoitBulkOutBusy = FALSE;
-
-	CAN4OSX_DEBUG_PRINT("Wrote %ld bytes to bulk endpoint\n", (long)numBytesWritten);
-
-	LeafWriteToBulkPipe(self);
-
-}
-
-
-
-static IOReturn LeafWriteToBulkPipe(
-		Can4osxUsbDeviceHandleEntry *pSelf
-	)
-{
-IOReturn retval = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-	LeafPrivateData *priv = (LeafPrivateData *)pSelf->privateData;
-
-	if ( pSelf->endpoitBulkOutBusy == FALSE )  {
-		pSelf->endpoitBulkOutBusy = TRUE;
-
-		if (0 < LeafFillBulkPipeBuffer(priv->cmdBufferRef, pSelf->endpointBufferBulkOutRef, pSelf->endpointMaxSizeBulkOut ))  {
-
-			retval = (*interface)->WritePipeAsync(interface, pSelf->endpointNumberBulkOut, pSelf->endpointBufferBulkOutRef, pSelf->endpointMaxSizeBulkOut, LeafBulkWriteCompletion, (void*)pSelf);
-
-			if (retval != kIOReturnSuccess)  {
-				CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", retval);
-				(void) (*interface)->USBInterfaceClose(interface);
-				(void) (*interface)->Release(interface);
-			}
-		} else {
-			pSelf->endpoitBulkOutBusy = FALSE;
-		}
+	// A zero length terminates the command list, the packet is always sent in full
+	if ( fillState < maxPipeSize )  {
+		pipe[fillState] = 0;
 	}
 
-	return(retval);
+	return(maxPipeSize);
 }
 
-
 //Go bus on
 static canStatus LeafCanStartChip(
 		CanHandle hdl
@@ -745,7 +842,7 @@ static canStatus LeafCanStartChip(
 {
 int retVal = 0;
 leafCmd cmd;
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hdl);
 LeafPrivateData *priv = (LeafPrivateData*)pSelf->privateData;
 
 	CAN4OSX_DEBUG_PRINT("CAN BusOn Command %d\n", hdl);
@@ -757,7 +854,7 @@ LeafPrivateData *priv = (LeafPrivateData*)pSelf->privateData;
 
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, cmd.head.cmdLen);
 
-	if ( dispatch_semaphore_wait(priv->semaTimeout, dispatch_time(DISPATCH_TIME_NOW, LEAF_TIMEOUT_TEN_MS)) )  {
+	if ( CAN4OSX_SemaphoreWait(priv->semaTimeout, LEAF_TIMEOUT_TEN_MS) )  {
 		return(canERR_TIMEOUT);
 	} else {
 		return(retVal);
@@ -770,7 +867,7 @@ static canStatus LeafCanStopChip(CanHandle hdl)
 {
 	int retVal = 0;
 	leafCmd cmd;
-	Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+	Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hdl);
 	LeafPrivateData *priv = (LeafPrivateData*)pSelf->privateData;
 
 
@@ -783,7 +880,7 @@ static canStatus LeafCanStopChip(CanHandle hdl)
 
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, cmd.head.cmdLen);
 
-	if ( dispatch_semaphore_wait(priv->semaTimeout, dispatch_time(DISPATCH_TIME_NOW, LEAF_TIMEOUT_TEN_MS)) )  {
+	if ( CAN4OSX_SemaphoreWait(priv->semaTimeout, LEAF_TIMEOUT_TEN_MS) )  {
 		return(canERR_TIMEOUT);
 	} else {
 		return(retVal);
@@ -801,7 +898,7 @@ static canStatus LeafCanSetBusParams ( const CanHandle hnd, SInt32 freq, unsigne
 	leafCmd		cmd;
 	UInt32		 tmp, PScl;
 	int			retVal;
-	Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+	Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 
 	CAN4OSX_DEBUG_PRINT("leaf: _set_busparam\n");
 
@@ -841,42 +938,37 @@ static canStatus LeafCanSetBusParams ( const CanHandle hnd, SInt32 freq, unsigne
 }
 
 
-static void BulkReadCompletion(void *refCon, IOReturn result, void *arg0)
+/******************************************************************************/
+/**
+ * \brief LeafBulkInDecode - decode the commands of one bulk-in transfer
+ *
+ * Commands do not cross 512 byte blocks, a length of 0 skips to the next one.
+ */
+static void LeafBulkInDecode(
+		void *refCon,
+		const UInt8 *pBuffer,
+		UInt32 size
+	)
 {
 Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-UInt32 numBytesRead = (UInt32) arg0;
-
-	CAN4OSX_DEBUG_PRINT("Asynchronous bulk read complete (%ld)\n", (long)numBytesRead);
-
-	if (result != kIOReturnSuccess)  {
-		printf("Error from async bulk read (%08x)\n", result);
-		(void) (*interface)->USBInterfaceClose(interface);
-		(void) (*interface)->Release(interface);
-		return;
-	}
-
-	if(numBytesRead > 0)  {
-		int count = 0;
-		leafCmd *cmd;
-		int loopCounter = 512;
-
-		while ( count < numBytesRead )  {
-			if (loopCounter-- == 0) break;
-
-			cmd = (leafCmd *)&(pSelf->endpointBufferBulkInRef[count]);
-			if ( cmd->head.cmdLen == 0 )  {
-				count += 512;
-				count &= -512;
-				continue;
-			} else {
-				count += cmd->head.cmdLen;
-			}
-
-			LeafDecodeCommand(pSelf, cmd);
+UInt32 count = 0u;
+leafCmd *cmd;
+int loopCounter = 512;
+
+	while ( count < size )  {
+		if (loopCounter-- == 0) break;
+
+		cmd = (leafCmd *)&(pBuffer[count]);
+		if ( cmd->head.cmdLen == 0 )  {
+			count += 512;
+			count &= -512;
+			continue;
+		} else {
+			count += cmd->head.cmdLen;
 		}
+
+		LeafDecodeCommand(pSelf, cmd);
 	}
-	CAN4OSX_usbReadFromBulkInPipe(pSelf);
 }
 
 
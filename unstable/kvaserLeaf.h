@@ -175,6 +175,9 @@
 # define LEAF_MSG_FLAG_TXACK         0x40
 # define LEAF_MSG_FLAG_TXRQ          0x80
 
+// 48 bit timer of the log messages
+# define LEAF_TIMER_FREQ             24000000u
+
 
 
 #define M16C_BUS_RESET    0x01    // Chip is in Reset state
@@ -290,6 +293,15 @@ typedef struct {
     UInt16 padding2;
 } __attribute__ ((packed)) cmdChipStateEvent;
 
+typedef struct {
+    UInt8  cmdLen;
+    UInt8  cmdNo;
+    UInt8  channel;
+    UInt8  padding;
+    UInt16 sofNr;
+    UInt16 time[3];
+} __attribute__ ((packed)) cmdTrefSofNr;
+
 
 
 typedef union {
@@ -303,15 +315,20 @@ typedef union {
     cmdSetBusparamsReq      setBusparamsReq;
     cmdStartChipReq         startChipReq;
     cmdChipStateEvent       chipStateEvent;
+    cmdTrefSofNr            trefSofNr;
 } __attribute__ ((packed)) leafCmd;
 
 
 
+// Number of frames canWriteBatch converts per command buffer access
+#define LEAF_TX_BATCH_SIZE 64
+
 //holds the actual buffer
 typedef struct {
 	int bufferSize;
 	int bufferFirst;
 	int bufferCount;
+	int bufferHighWater;
     dispatch_queue_t bufferGDCqueueRef;
 	leafCmd *commandRef;
 } LeafCommandMsgBuf;
@@ -46,11 +46,8 @@
 
 #include <stdio.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 /* can4osx */
@@ -61,41 +58,8 @@
 
 #include "kvaserLeafPro.h"
 
-#define LEAFPRO_COMMAND_SIZE 32u
-
-#define LEAFPRO_CMD_SET_BUSPARAMS_REQ           16u
-#define LEAFPRO_CMD_CHIP_STATE_EVENT            20u
-#define LEAFPRO_CMD_SET_DRIVERMODE_REQ          21u
-#define LEAFPRO_CMD_START_CHIP_REQ              26u
-#define LEAFPRO_CMD_START_CHIP_RESP             27u
-#define LEAFPRO_CMD_TX_CAN_MESSAGE              33u
-#define LEAFPRO_CMD_GET_CARD_INFO_REQ           34u
-#define LEAFPRO_CMD_GET_CARD_INFO_RESP          35u
-#define LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ       38u
-#define LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP      39u
-#define LEAFPRO_CMD_SET_BUSPARAMS_FD_REQ        69u
-#define LEAFPRO_CMD_SET_BUSPARAMS_FD_RESP       70u
-#define LEAFPRO_CMD_SET_BUSPARAMS_RESP          85u
-#define LEAFPRO_CMD_LOG_MESSAGE                 106u
-#define LEAFPRO_CMD_MAP_CHANNEL_REQ             200u
-#define LEAFPRO_CMD_MAP_CHANNEL_RESP            201u
-#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ    202u
-#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP   203u
-
-#define LEAFPRO_CMD_TX_ACKNOWLEDGE_FD           225u
-#define LEAFPRO_CMD_RX_MESSAGE_FD               226u
-
-/* extended FD able command code */
-#define LEAFPRO_CMD_CAN_FD                      255u
-
-/* extended capabilty flag */
-#define LEASPRO_SUPPORT_EXTENDED                0x200u
-
-
-
-
-#define LEAFPRO_HE_ILLEGAL      0x3eu
-#define LEAFPRO_HE_ROUTER       0x00u
+/* frames canWriteBatch converts per command buffer access */
+#define LEAFPRO_TX_BATCH_SIZE 64u
 
 #define LEAFPRO_TIMEOUT_ONE_MS 1000000
 #define LEAFPRO_TIMEOUT_TEN_MS 10*LEAFPRO_TIMEOUT_ONE_MS
@@ -129,12 +93,20 @@ static canStatus LeafProCanWrite(const CanHandle hnd, UInt32 id, void *msg,
 static canStatus LeafProCanWriteExt(Can4osxUsbDeviceHandleEntry *pSelf,
             UInt32 id, void *pMsg, UInt16 dlc, UInt32 flag);
 
+static canStatus LeafProCanWriteBatch(const CanHandle hnd,
+            const CanFrame *frames, UInt32 count, UInt32 *sent);
+
+static canStatus LeafProCanSetTxQueueSize(const CanHandle hnd, UInt32 frames);
+
+static void LeafProCanGetTxQueueStat(const CanHandle hnd, UInt32 *pSize,
+            UInt32 *pHighWater);
+
 static canStatus LeafProCanTranslateBaud (SInt32 *const freq,
             unsigned int *const tseg1, unsigned int *const tseg2,
             unsigned int *const sjw, unsigned int *const nosamp,
             unsigned int *const syncMode);
 
-static IOReturn LeafProCommandWait(Can4osxUsbDeviceHandleEntry *pSelf,
+static canStatus LeafProCommandWait(Can4osxUsbDeviceHandleEntry *pSelf,
 			proCommand_t *pCmd, UInt8 cmdNo);
 
 static LeafProCommandMsgBuf_t* LeafProCreateCommandBuffer(UInt32 bufferSize);
@@ -143,13 +115,20 @@ static UInt8 LeafProTestFullCommandBuffer(LeafProCommandMsgBuf_t* bufferRef);
 static UInt8 LeafProTestEmptyCommandBuffer(LeafProCommandMsgBuf_t* pBufferRef);
 static UInt8 LeafProWriteCommandBuffer(LeafProCommandMsgBuf_t* pBufferRef,
                                        proCommand_t newCommand);
+static UInt32 LeafProWriteCommandBufferBatch(LeafProCommandMsgBuf_t* pBufferRef,
+                                       const proCommand_t *pNewCommands,
+                                       UInt32 count);
+static UInt8 LeafProResizeCommandBuffer(LeafProCommandMsgBuf_t* pBufferRef,
+                                       UInt32 bufferSize);
 
-static UInt16 LeafProFillBulkPipeBuffer(LeafProCommandMsgBuf_t* bufferRef,
-            UInt8 *pPipe, UInt16 maxPipeSize);
-static IOReturn LeafProWriteBulkPipe(Can4osxUsbDeviceHandleEntry *pSelf);
+static UInt16 LeafProDrainCommandBuffer(LeafProCommandMsgBuf_t* bufferRef,
+            UInt8 *pPipe, UInt16 fillStart, UInt16 maxPipeSize);
+static UInt16 LeafProFillBulkPipeBuffer(void *refCon, UInt8 *pPipe,
+            UInt16 maxPipeSize);
+static void LeafProWriteBulkPipe(Can4osxUsbDeviceHandleEntry *pSelf);
 
-static void LeafProBulkReadCompletion(void *refCon, IOReturn result,
-            void *arg0);
+static void LeafProBulkInDecode(void *refCon, const UInt8 *pBuffer,
+            UInt32 size);
 
 
 static UInt8 LeafProGetChanFromHe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 he);
@@ -171,8 +150,11 @@ CAN4OSX_HW_FUNC_T leafProHardwareFunctions = {
     .can4osxhwCanBusOnRef = LeafProCanStartChip,
     .can4osxhwCanBusOffRef = LeafProCanStopChip,
     .can4osxhwCanWriteRef = LeafProCanWrite,
+    .can4osxhwCanWriteBatchRef = LeafProCanWriteBatch,
     .can4osxhwCanReadRef = LeafProCanRead,
     .can4osxhwCanCloseRef = NULL,
+    .can4osxhwCanSetTxQueueSizeRef = LeafProCanSetTxQueueSize,
+    .can4osxhwCanGetTxQueueStatRef = LeafProCanGetTxQueueStat,
 };
 
 
@@ -180,7 +162,7 @@ static canStatus LeafProInitHardware(
         const CanHandle hnd
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 
 	if (pSelf->deviceChannel == 0u)  {
 		pSelf->privateData = calloc(1,sizeof(LeafProPrivateData_t));
@@ -197,7 +179,7 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
     if ( pSelf->privateData != NULL ) {
     LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
         
-        pPriv->cmdBufferRef = LeafProCreateCommandBuffer(1000);
+        pPriv->cmdBufferRef = LeafProCreateCommandBuffer(CAN4OSX_TX_QUEUE_SIZE);
         if ( pPriv->cmdBufferRef == NULL ) {
             free(pPriv);
             return(canERR_NOMEM);
@@ -205,6 +187,8 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
 
         pPriv->semaTimeout = dispatch_semaphore_create(0);
         
+        CAN4OSX_InitTimeBase(&pSelf->timeBase, 48u, LEAFPRO_TIMER_FREQ);
+        
     } else {
         return(canERR_NOMEM);
     }
@@ -222,7 +206,8 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
     	LeafProGetCardInfo(pSelf);
     
         /* Trigger next read */
-        pSelf->usbFunctions.bulkReadCompletion = LeafProBulkReadCompletion;
+        pSelf->usbFunctions.bulkInDecode = LeafProBulkInDecode;
+        pSelf->usbFunctions.bulkOutFill = LeafProFillBulkPipeBuffer;
         CAN4OSX_usbReadFromBulkInPipe(pSelf);
     }
     
@@ -235,7 +220,7 @@ static CanHandle LeafProCanOpenChannel(
         int flags
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[channel];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(channel);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
     
     // set CAN Mode
@@ -264,7 +249,7 @@ proCommand_t   cmd;
 // FIXME UInt32         tmp, PScl;
 int retVal;
     
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
     
     CAN4OSX_DEBUG_PRINT("leaf pro: _set_busparam\n");
@@ -332,7 +317,7 @@ unsigned int noSamp;
 proCommand_t   cmd;
 int            retVal;
     
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
     
     CAN4OSX_DEBUG_PRINT("leaf pro: _set_FD_busparam\n");
@@ -385,7 +370,7 @@ static canStatus LeafProCanStartChip(
 {
 int retVal = 0;
 proCommand_t        cmd;
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hdl);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
     memset(&cmd, 0u, sizeof(cmd));
@@ -427,7 +412,7 @@ static canStatus LeafProCanRead (
         UInt32  *time
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
     
     if ( pSelf->privateData != NULL ) {
         
@@ -437,7 +422,7 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
             
             *id = canMsg.canId;
             *dlc = canMsg.canDlc;
-            *time =canMsg.canTimestamp;
+            *time = CAN4OSX_TIME_US(canMsg.canTimestamp);
             
             memcpy(msg, canMsg.canData, *dlc);
             
@@ -454,6 +439,39 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
 }
 
 
+/******************************************************************************/
+static void LeafProBuildTxCommand(
+        Can4osxUsbDeviceHandleEntry *pSelf,
+        proCommand_t *pCmd,
+        UInt32 id,
+        const void *msg,
+        UInt16 dlc,
+        UInt32 flag
+    )
+{
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
+
+    if (flag & canMSG_EXT)  {
+        pCmd->proCmdTxMessage.canId = LEAFPRO_EXT_MSG;
+    } else {
+        pCmd->proCmdTxMessage.canId = 0u;
+    }
+    pCmd->proCmdTxMessage.canId += id;
+    pCmd->proCmdTxMessage.dlc = dlc & 0x0F;
+    memcpy(pCmd->proCmdTxMessage.data, msg, 8);
+
+    pCmd->proCmdTxMessage.flags = 0;
+
+    if ( flag & canMSG_RTR ) {
+        pCmd->proCmdTxMessage.flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
+    }
+
+    pCmd->proCmdHead.cmdNo = LEAFPRO_CMD_TX_CAN_MESSAGE;
+    pCmd->proCmdHead.address = pPriv->chan2he[pSelf->deviceChannel];
+    pCmd->proCmdHead.transitionId = 10;
+}
+
+
 /******************************************************************************/
 static canStatus LeafProCanWrite(
         const CanHandle hnd,
@@ -463,7 +481,8 @@ static canStatus LeafProCanWrite(
         UInt32 flag
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+canStatus status = canOK;
 
     if ( pSelf->privateData == NULL ) {
         return(canERR_INTERNAL);
@@ -474,36 +493,116 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
     if (pPriv->extendedMode == 0u)  {
         proCommand_t cmd;
         
-        if (flag & canMSG_EXT)  {
-            cmd.proCmdTxMessage.canId = LEAFPRO_EXT_MSG;
-        } else {
-            cmd.proCmdTxMessage.canId = 0u;
-        }
-        cmd.proCmdTxMessage.canId += id;
-        cmd.proCmdTxMessage.dlc = dlc & 0x0F;
-        memcpy(cmd.proCmdTxMessage.data, msg, 8);
+        LeafProBuildTxCommand(pSelf, &cmd, id, msg, dlc, flag);
         
-        cmd.proCmdTxMessage.flags = 0;
-
-        if ( flag & canMSG_RTR ) {
-            cmd.proCmdTxMessage.flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
+        /* a full queue drops the frame, the caller has to try again */
+        if ( !LeafProWriteCommandBuffer(pPriv->cmdBufferRef, cmd) ) {
+            status = canERR_TXBUFOFL;
         }
-    
-        cmd.proCmdHead.cmdNo = LEAFPRO_CMD_TX_CAN_MESSAGE;
-        cmd.proCmdHead.address = pPriv->chan2he[pSelf->deviceChannel];
-        cmd.proCmdHead.transitionId = 10;
-        
-        LeafProWriteCommandBuffer(pPriv->cmdBufferRef, cmd);
 
         LeafProWriteBulkPipe(pSelf);
     } else {
         (void)LeafProCanWriteExt(pSelf, id, msg, dlc, flag);
     }
         
+    return(status);
+}
+
+
+/******************************************************************************/
+static canStatus LeafProCanWriteBatch(
+        const CanHandle hnd,
+        const CanFrame *frames,
+        UInt32 count,
+        UInt32 *sent
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
+proCommand_t cmds[LEAFPRO_TX_BATCH_SIZE];
+canStatus status = canOK;
+
+    *sent = 0u;
+
+    if ( pPriv == NULL ) {
+        return(canERR_INTERNAL);
+    }
+
+    if (pPriv->extendedMode != 0u)  {
+        /* LeafProCanWriteExt does not build the frame yet, nothing is sent */
+        return(canERR_NOT_IMPLEMENTED);
+    }
+
+    while ( *sent < count ) {
+        UInt32 chunk = count - *sent;
+        UInt32 stored;
+        UInt32 i;
+
+        if ( chunk > LEAFPRO_TX_BATCH_SIZE ) {
+            chunk = LEAFPRO_TX_BATCH_SIZE;
+        }
+
+        for ( i = 0u; i < chunk; i++ ) {
+            const CanFrame *pFrame = &frames[*sent + i];
+            LeafProBuildTxCommand(pSelf, &cmds[i], pFrame->id, pFrame->msg,
+                                  pFrame->dlc, pFrame->flag);
+        }
+
+        stored = LeafProWriteCommandBufferBatch(pPriv->cmdBufferRef, cmds, chunk);
+        *sent += stored;
+
+        if ( stored < chunk ) {
+            status = canERR_TXBUFOFL;
+            break;
+        }
+    }
+
+    LeafProWriteBulkPipe(pSelf);
+
+    return(status);
+}
+
+
+/******************************************************************************/
+static canStatus LeafProCanSetTxQueueSize(
+        const CanHandle hnd,
+        UInt32 frames
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+    if ( pSelf->privateData == NULL ) {
+        return(canERR_INTERNAL);
+    }
+
+    LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
+
+    if ( !LeafProResizeCommandBuffer(pPriv->cmdBufferRef, frames) ) {
+        return(canERR_TXBUFOFL);
+    }
+
     return(canOK);
 }
 
 
+/******************************************************************************/
+static void LeafProCanGetTxQueueStat(
+        const CanHandle hnd,
+        UInt32 *pSize,
+        UInt32 *pHighWater
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+
+    if ( pSelf->privateData != NULL ) {
+        LeafProCommandMsgBuf_t *pBufferRef = ((LeafProPrivateData_t*)pSelf->privateData)->cmdBufferRef;
+
+        *pSize = pBufferRef->bufferSize;
+        *pHighWater = pBufferRef->bufferHighWater;
+    }
+}
+
+
 static canStatus LeafProCanWriteExt(
         Can4osxUsbDeviceHandleEntry *pSelf,
         UInt32 id,
@@ -691,58 +790,79 @@ static void LeafProDecodeCommand(
     )
 {
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-CanMsg canMsg;
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt64 canTimestamp;
+UInt64 canHostTimestamp;
+UInt32 canId;
+UInt32 canFlags;
 
     CAN4OSX_DEBUG_PRINT("Pro-Decode cmd %d\n",(UInt8)pCmd->proCmdHead.cmdNo);
 
-    memset(&canMsg, 0u, sizeof(canMsg));
-
     switch (pCmd->proCmdHead.cmdNo) {
         case LEAFPRO_CMD_CAN_FD:
             CAN4OSX_DEBUG_PRINT("LEAFPRO_CMD_CAN_FD\n");
             LeafProDecodeCommandExt(pSelf, (proCommandExt_t *)pCmd);
             break;
         case LEAFPRO_CMD_LOG_MESSAGE:
+            /* even for filtered frames, the time base has to see every wrap */
+            canTimestamp = CAN4OSX_TimeBaseNs(&pSelf->timeBase, ((UInt64)pCmd->proCmdLogMessage.time[2] << 32) |
+                                              ((UInt64)pCmd->proCmdLogMessage.time[1] << 16) |
+                                              pCmd->proCmdLogMessage.time[0]);
+            canHostTimestamp = CAN4OSX_ClockSyncNs(&pSelf->clockSync, canTimestamp);
+            
             if ( pCmd->proCmdLogMessage.canId & LEAFPRO_EXT_MSG ) {
-                canMsg.canId = pCmd->proCmdLogMessage.canId & ~LEAFPRO_EXT_MSG;
-                canMsg.canFlags = canMSG_EXT;
+                canId = pCmd->proCmdLogMessage.canId & ~LEAFPRO_EXT_MSG;
+                canFlags = canMSG_EXT;
             } else {
-                canMsg.canId = pCmd->proCmdLogMessage.canId;
-                canMsg.canFlags = canMSG_STD;
+                canId = pCmd->proCmdLogMessage.canId;
+                canFlags = canMSG_STD;
             }
             
+            /* counted even if the frame is filtered, the next stored one carries it */
             if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_OVERRUN) {
-                //canMsg.canFlags |= canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN;
+                CAN4OSX_CountHwOverrun(pSelf);
+            }
+            
+            /* own frames coming back are not filtered */
+            if ( !(pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXACK) &&
+                 !CAN4OSX_FilterAccept(pSelf, canId, canFlags) ) {
+                break;
             }
+            
             if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_REMOTE_FRAME) {
-                canMsg.canFlags |= canMSG_RTR;
+                canFlags |= canMSG_RTR;
             }
             if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_ERROR_FRAME) {
-                canMsg.canFlags |= canMSG_ERROR_FRAME;
+                canFlags |= canMSG_ERROR_FRAME;
             }
             if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXACK) {
-                canMsg.canFlags |= canMSG_TXACK;
+                canFlags |= canMSG_TXACK;
             }
             if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXRQ) {
-                canMsg.canFlags |= canMSG_TXRQ;
+                canFlags |= canMSG_TXRQ;
             }
             /* classical CAN dlc */
             if ( pCmd->proCmdLogMessage.dlc > 8u ) {
                 pCmd->proCmdLogMessage.dlc = 8u;
             }
             
-            canMsg.canDlc = pCmd->proCmdLogMessage.dlc;
-            
-            memcpy(canMsg.canData, pCmd->proCmdLogMessage.data,
-                   pCmd->proCmdLogMessage.dlc);
-            
-            // FIXME canMsg.canTimestamp = LeafCalculateTimeStamp(pCmd->proCmdLogMessage.time, 24) * 10;
-            
-            
-            CAN4OSX_WriteCanEventBuffer(pSelf->canEventMsgBuff,canMsg);
-            if (pSelf->canNotification.notifacionCenter) {
-                CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
-                                                      pSelf->canNotification.notificationString, NULL, NULL, true);
+            /* decoded right into the receive ring */
+            pRecord = CAN4OSX_ReserveCanEventBuffer(pSelf->canEventMsgBuff, pCmd->proCmdLogMessage.dlc);
+            if ( pRecord != NULL ) {
+                pRecord->canId = canId;
+                pRecord->canFlags = canFlags;
+                pRecord->canTimestamp = canTimestamp;
+                pRecord->canHostTimestamp = canHostTimestamp;
+                memcpy(pRecord->canData, pCmd->proCmdLogMessage.data,
+                       pCmd->proCmdLogMessage.dlc);
+                
+                CAN4OSX_CommitCanEventBuffer(pSelf->canEventMsgBuff, pRecord);
+
+                CAN4OSX_NotifyEvent(pSelf, (canFlags & canMSG_TXACK) ?
+                                    (canNOTIFY_RX | canNOTIFY_TX) : canNOTIFY_RX);
+            } else if ( canFlags & canMSG_TXACK ) {
+                /* the overrun counter has the lost frame, the transmit buffer has room anyway */
+                CAN4OSX_NotifyEvent(pSelf, canNOTIFY_TX);
             }
             
             
@@ -788,12 +908,23 @@ static void LeafProDecodeCommandExt(
     )
 {
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-CanMsg canMsg;
+Can4osxUsbDeviceHandleEntry *pChannel;
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt64 canTimestamp;
+UInt32 canFlags;
+UInt8 canDlc;
 UInt8 channel;
 UInt8 he;
 
     switch (pCmd->proCmdFdHead.cmd)  {
 		case LEAFPRO_CMD_TX_ACKNOWLEDGE_FD:
+            he = LeafProGetHe(&pCmd->proCmdFdHead.header);
+            channel = LeafProGetChanFromHe(pSelf, he);
+            if (channel >= pSelf->deviceChannelCount)  {
+                break;
+            }
+            pChannel = CAN4OSX_CHANNEL(pSelf->channelIndex + channel);
+            CAN4OSX_NotifyEvent(pChannel, canNOTIFY_TX);
 			break;
 		case LEAFPRO_CMD_RX_MESSAGE_FD:
             if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_ERROR_FRAME) {
@@ -801,14 +932,28 @@ UInt8 he;
                 break;
             }
 
-            memset(&canMsg, 0u, sizeof(canMsg));
+            he = LeafProGetHe(&pCmd->proCmdFdHead.header);
+            channel = LeafProGetChanFromHe(pSelf, he);
+            if (channel >= pSelf->deviceChannelCount)  {
+                break;
+            }
+            pChannel = CAN4OSX_CHANNEL(pSelf->channelIndex + channel);
             
-            canMsg.canTimestamp = pCmd->proCmdFdRxMessage.timestamp;
-        
-            canMsg.canId = pCmd->proCmdFdRxMessage.canId & ~LEAFPRO_EXT_MSG;
-            canMsg.canDlc = (pCmd->proCmdFdRxMessage.control>>8u) & 0x0fu;
+            if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_OVERRUN) {
+                CAN4OSX_CountHwOverrun(pChannel);
+            }
+            
+            if ( !CAN4OSX_FilterAccept(pChannel, pCmd->proCmdFdRxMessage.canId & ~LEAFPRO_EXT_MSG,
+                                       (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_EXTENDED) ? canMSG_EXT : canMSG_STD) ) {
+                break;
+            }
+
+            /* a 64 bit timer does not wrap */
+            canTimestamp = CAN4OSX_TicksToNs(pCmd->proCmdFdRxMessage.timestamp, LEAFPRO_TIMER_FREQ);
             
-            canMsg.canFlags = 0u;
+            canDlc = (pCmd->proCmdFdRxMessage.control>>8u) & 0x0fu;
+            
+            canFlags = 0u;
             
             if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSGFLAG_FDF)  {
                 /* insanity check */
@@ -816,39 +961,41 @@ UInt8 he;
                     return;
                 }
             
-                canMsg.canFlags |= canFDMSG_FDF;
+                canFlags |= canFDMSG_FDF;
                 
                 /* test for other FD flags */
                 if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSGFLAG_BRS)  {
-                    canMsg.canFlags |= canFDMSG_BRS;
+                    canFlags |= canFDMSG_BRS;
                 }
                 /* decode dlc to length */
-                canMsg.canDlc = CAN4OSX_decodeFdDlc(canMsg.canDlc);
+                canDlc = CAN4OSX_decodeFdDlc(canDlc);
                 
             } else {
                 CAN4OSX_DEBUG_PRINT("LEAFPRO_MESSAGE CLASSIC\n");
-                if (canMsg.canDlc > 8u)  {
-                    canMsg.canDlc = 8u;
+                if (canDlc > 8u)  {
+                    canDlc = 8u;
                 }
             }
             
             if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_EXTENDED) {
-                canMsg.canFlags |= canMSG_EXT;
+                canFlags |= canMSG_EXT;
             } else {
                 CAN4OSX_DEBUG_PRINT("LEAFPRO_MESSAGE STD\n");
-                canMsg.canFlags |= canMSG_STD;
+                canFlags |= canMSG_STD;
             }
             
-            memcpy(canMsg.canData, pCmd->proCmdFdRxMessage.data, canMsg.canDlc);
-
-			he = LeafProGetHe(&pCmd->proCmdFdHead.header);
-            channel = LeafProGetChanFromHe(pSelf, he);
+            /* decoded right into the receive ring */
+            pRecord = CAN4OSX_ReserveCanEventBuffer(pChannel->canEventMsgBuff, canDlc);
+            if ( pRecord != NULL ) {
+                pRecord->canTimestamp = canTimestamp;
+                pRecord->canHostTimestamp = CAN4OSX_ClockSyncNs(&pChannel->clockSync, canTimestamp);
+                pRecord->canId = pCmd->proCmdFdRxMessage.canId & ~LEAFPRO_EXT_MSG;
+                pRecord->canFlags = canFlags;
+                memcpy(pRecord->canData, pCmd->proCmdFdRxMessage.data, canDlc);
+                
+                CAN4OSX_CommitCanEventBuffer(pChannel->canEventMsgBuff, pRecord);
 
-            CAN4OSX_WriteCanEventBuffer(pSelf[channel].canEventMsgBuff,canMsg);
-            
-            if (pSelf->canNotification.notifacionCenter) {
-                CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
-                    pSelf->canNotification.notificationString, NULL, NULL, true);
+                CAN4OSX_NotifyEvent(pChannel, canNOTIFY_RX);
             }
             
             break;
@@ -872,7 +1019,7 @@ LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 proCommand_t cmd;
 proCommand_t resp;
 UInt8 i = 0u;
-IOReturn retVal;
+canStatus retVal;
 
     memset(&cmd, 0u, 32u);
     
@@ -888,7 +1035,7 @@ IOReturn retVal;
     	//LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_MAP_CHANNEL_RESP);
     	CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
     	retVal =LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_MAP_CHANNEL_RESP);
-        if (retVal == kIOReturnSuccess)  {
+        if (retVal == canOK)  {
             pPriv->chan2he[resp.proCmdHead.transitionId & 0xF] = resp.proCmdMapChannelResp.heAddress;
         }
     }
@@ -913,7 +1060,7 @@ static void LeafProGetCardInfo(
 {
 proCommand_t cmd;
 proCommand_t resp;
-IOReturn retVal;
+canStatus retVal;
 
 
     memset(&cmd, 0u, sizeof(cmd));
@@ -923,7 +1070,7 @@ IOReturn retVal;
     //LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_GET_CARD_INFO_RESP);
     CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
     retVal = LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_GET_CARD_INFO_RESP);
-	if (retVal == kIOReturnSuccess)  {
+	if (retVal == canOK)  {
 		pSelf->deviceChannelCount = resp.proCmdCardInfoResp.nchannels;
     }
 
@@ -968,7 +1115,8 @@ LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 			return(i);
 		}
 	}
-	return(0u);
+	/* no channel of ours, e.g. one that got no slot in the table */
+	return(pSelf->deviceChannelCount);
 }
 
 
@@ -987,6 +1135,7 @@ LeafProCommandMsgBuf_t* pBufferRef = malloc(sizeof(LeafProCommandMsgBuf_t));
     pBufferRef->bufferSize = bufferSize;
     pBufferRef->bufferCount = 0u;
     pBufferRef->bufferFirst = 0u;
+    pBufferRef->bufferHighWater = 0u;
     
     pBufferRef->commandRef = malloc(bufferSize * sizeof(proCommand_t));
     
@@ -1037,6 +1186,9 @@ __block UInt8 retval = 1u;
             pBufferRef->commandRef[(pBufferRef->bufferFirst +
                                     pBufferRef->bufferCount++)
                                    % pBufferRef->bufferSize] = newCommand;
+            if ( pBufferRef->bufferCount > pBufferRef->bufferHighWater ) {
+                pBufferRef->bufferHighWater = pBufferRef->bufferCount;
+            }
         }
     });
     
@@ -1045,24 +1197,73 @@ __block UInt8 retval = 1u;
 
 
 /******************************************************************************/
-static UInt8 LeafReadCommandBuffer(
+static UInt32 LeafProWriteCommandBufferBatch(
         LeafProCommandMsgBuf_t* pBufferRef,
-        proCommand_t* pReadCommand
+        const proCommand_t *pNewCommands,
+        UInt32 count
     )
 {
-__block UInt8 retval = 1u;
+__block UInt32 stored = 0u;
     
     dispatch_sync(pBufferRef->bufferGDCqueueRef, ^{
-        if (LeafProTestEmptyCommandBuffer(pBufferRef)) {
-            retval = 0u;
-        } else {
-            pBufferRef->bufferCount--;
-            *pReadCommand = pBufferRef->commandRef[pBufferRef->bufferFirst++
-                % pBufferRef->bufferSize];
+        while ( (stored < count) &&
+                !LeafProTestFullCommandBuffer(pBufferRef) ) {
+            pBufferRef->commandRef[(pBufferRef->bufferFirst +
+                                    pBufferRef->bufferCount++)
+                                   % pBufferRef->bufferSize] = pNewCommands[stored++];
+        }
+        if ( pBufferRef->bufferCount > pBufferRef->bufferHighWater ) {
+            pBufferRef->bufferHighWater = pBufferRef->bufferCount;
         }
-        
     });
     
+    return(stored);
+}
+
+
+/******************************************************************************/
+/**
+* \brief LeafProResizeCommandBuffer - change the depth of the command buffer
+*
+* Queued commands are kept in order, fails if they do not fit.
+*
+* \return 1 on success
+*/
+static UInt8 LeafProResizeCommandBuffer(
+        LeafProCommandMsgBuf_t* pBufferRef,
+        UInt32 bufferSize
+    )
+{
+__block proCommand_t *pCommandRef = malloc(bufferSize * sizeof(proCommand_t));
+__block UInt8 retval = 1u;
+
+    if ( pCommandRef == NULL ) {
+        return(0u);
+    }
+
+    dispatch_sync(pBufferRef->bufferGDCqueueRef, ^{
+        proCommand_t *pOldRef = pBufferRef->commandRef;
+        int i;
+
+        if ( pBufferRef->bufferCount > (int)bufferSize ) {
+            retval = 0u;
+            return;
+        }
+
+        for ( i = 0; i < pBufferRef->bufferCount; i++ ) {
+            pCommandRef[i] = pOldRef[(pBufferRef->bufferFirst + i) %
+                                     pBufferRef->bufferSize];
+        }
+
+        pBufferRef->commandRef = pCommandRef;
+        pBufferRef->bufferSize = bufferSize;
+        pBufferRef->bufferFirst = 0;
+        pBufferRef->bufferHighWater = pBufferRef->bufferCount;
+        pCommandRef = pOldRef;
+    });
+
+    free(pCommandRef);
+
     return(retval);
 }
 
@@ -1101,173 +1302,151 @@ static UInt8 LeafProTestEmptyCommandBuffer(
 /******************************************************************************/
 
 /******************************************************************************/
-static void LeafProBulkWriteCompletion(
-        void *refCon,
-        IOReturn result,
-        void *arg0
+static void LeafProWriteBulkPipe(
+        Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
     )
 {
-Can4osxUsbDeviceHandleEntry *self = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = self->can4osxInterfaceInterface;
-UInt32 numBytesWritten = (UInt32)arg0;
-    
-    (void)numBytesWritten;
-    
-    if (result != kIOReturnSuccess) {
-        CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
-        (void)(*interface)->USBInterfaceClose(interface);
-        (void)(*interface)->Release(interface);
-        return;
-    }
-    
-    self->endpoitBulkOutBusy = FALSE;
-    
-    LeafProWriteBulkPipe(self);
-    
-    return;
+    /* all channels share the pipe of the first channel, its fill takes the
+       commands of every channel */
+    CAN4OSX_usbWriteToBulkOutPipe(CAN4OSX_CHANNEL(pSelf->channelIndex - pSelf->deviceChannel));
 }
 
 
 /******************************************************************************/
-static IOReturn LeafProWriteBulkPipe(
-        Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
+static UInt16 LeafProDrainCommandBuffer(
+        LeafProCommandMsgBuf_t* bufferRef,
+        UInt8 *pPipe,
+        UInt16 fillStart,
+        UInt16 maxPipeSize
     )
 {
-IOReturn retval = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-    
-    if ( pSelf->endpoitBulkOutBusy == FALSE ) {
-        pSelf->endpoitBulkOutBusy = TRUE;
-        
-        if (0 < LeafProFillBulkPipeBuffer(pPriv->cmdBufferRef,
-                                       pSelf->endpointBufferBulkOutRef,
-                                       pSelf->endpointMaxSizeBulkOut )) {
-            
-            retval = (*interface)->WritePipeAsync(interface,
-                                                  pSelf->endpointNumberBulkOut,
-                                                  pSelf->endpointBufferBulkOutRef,
-                                                  pSelf->endpointMaxSizeBulkOut,
-                                                  LeafProBulkWriteCompletion,
-                                                  (void*)pSelf);
-            
-            if (retval != kIOReturnSuccess) {
-                CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", retval);
-                (void) (*interface)->USBInterfaceClose(interface);
-                (void) (*interface)->Release(interface);
-            }
-        } else {
-            pSelf->endpoitBulkOutBusy = FALSE;
+__block UInt16 fillState = fillStart;
+
+    /* move as many commands as fit into the packet under one queue access */
+    dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
+        while ( !LeafProTestEmptyCommandBuffer(bufferRef) &&
+                ((fillState + LEAFPRO_COMMAND_SIZE) <= maxPipeSize) ) {
+            memcpy(&pPipe[fillState],
+                   &bufferRef->commandRef[bufferRef->bufferFirst],
+                   LEAFPRO_COMMAND_SIZE);
+            fillState += LEAFPRO_COMMAND_SIZE;
+            bufferRef->bufferFirst = (bufferRef->bufferFirst + 1) %
+                                     bufferRef->bufferSize;
+            bufferRef->bufferCount--;
         }
-    }
-    
-    return(retval);
+    });
+
+    return(fillState);
 }
 
 
 /******************************************************************************/
 static UInt16 LeafProFillBulkPipeBuffer(
-        LeafProCommandMsgBuf_t* bufferRef,
+        void *refCon,
         UInt8 *pPipe,
         UInt16 maxPipeSize
     )
 {
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 UInt16 fillState = 0u;
-    
-    while ( fillState < maxPipeSize ) {
-        proCommand_t cmd;
-        if ( LeafReadCommandBuffer(bufferRef, &cmd) ) {
-            memcpy(pPipe, &cmd, LEAFPRO_COMMAND_SIZE);
-            fillState += LEAFPRO_COMMAND_SIZE;
-            pPipe += LEAFPRO_COMMAND_SIZE;
-            //Will another command for in the pipe?
-            if ( (fillState + LEAFPRO_COMMAND_SIZE) >= maxPipeSize ) {
-                *pPipe = 0u;
-                break;
-            }
-            
-        } else {
-            *pPipe = 0u;
-            break;
+UInt8 first;
+UInt8 i;
+
+    /* pSelf is the first channel, the owner of the pipe. Every channel has
+       its own command buffer, they take turns to start the packet so a busy
+       channel can not starve the others */
+    first = pPriv->txNextChannel;
+    if ( first >= pSelf->deviceChannelCount ) {
+        first = 0u;
+    }
+    pPriv->txNextChannel = first + 1u;
+
+    for ( i = 0u; i < pSelf->deviceChannelCount; i++ ) {
+        Can4osxUsbDeviceHandleEntry *pChannel = CAN4OSX_CHANNEL(pSelf->channelIndex + ((first + i) % pSelf->deviceChannelCount));
+        LeafProPrivateData_t *pChannelPriv = (LeafProPrivateData_t *)pChannel->privateData;
+
+        if ( (pChannelPriv == NULL) || (pChannelPriv->cmdBufferRef == NULL) ) {
+            continue;
         }
+
+        fillState = LeafProDrainCommandBuffer(pChannelPriv->cmdBufferRef, pPipe, fillState, maxPipeSize);
+    }
+
+    if ( fillState == 0u ) {
+        return(0u);
     }
     
-    return(fillState);
+    if ( fillState < maxPipeSize ) {
+        pPipe[fillState] = 0u;
+    }
+    
+    /* the device gets always a full packet */
+    return(maxPipeSize);
 }
 
 /******************************************************************************/
-static IOReturn LeafProCommandWait(
+static canStatus LeafProCommandWait(
         Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
         proCommand_t *pCmd,
         UInt8 cmdNo
     )
 {
-IOReturn retVal = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-
-UInt32 size = LEAFPRO_COMMAND_SIZE;
+UInt32 size;
 UInt64 timeout;
 
     timeout = CAN$OSX_getMilliseconds() + (10 * 5u);
     do {
-         (*interface)->ReadPipe(interface, pSelf->endpointNumberBulkIn, pCmd, &size);
-         printf("Size:%d ",size);
+        size = LEAFPRO_COMMAND_SIZE;
+        (void)CAN4OSX_usbReceiveCommand(pSelf, pCmd, &size);
+        CAN4OSX_DEBUG_PRINT("Size:%d ",size);
         if(pCmd->proCmdHead.cmdNo == cmdNo)  {
-            return(retVal);
+            return(canOK);
         }
     } while(CAN$OSX_getMilliseconds() < timeout);
     
-    return(kIOReturnError);
+    return(canERR_TIMEOUT);
 }
 
 
 /******************************************************************************/
-static void LeafProBulkReadCompletion(
+/**
+ * \brief LeafProBulkInDecode - decode the commands of one bulk-in transfer
+ *
+ * A command number of 0 skips to the next packet of the endpoint.
+ */
+static void LeafProBulkInDecode(
         void *refCon,
-        IOReturn result,
-        void *arg0
+        const UInt8 *pBuffer,
+        UInt32 size
     )
 {
 Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-UInt32 numBytesRead = (UInt32) arg0;
+UInt32 count = 0u;
+proCommand_t *pCmd;
+int loopCounter = pSelf->endpointMaxSizeBulkIn;
     
-    if (result != kIOReturnSuccess) {
-        (void)(*interface)->USBInterfaceClose(interface);
-        (void)(*interface)->Release(interface);
-        return;
-    }
-    
-    if (numBytesRead > 0u) {
-	int count = 0;
-	proCommand_t *pCmd;
-	int loopCounter = pSelf->endpointMaxSizeBulkIn;
+    while ( count < size ) {
+        if (loopCounter-- == 0) break;
         
-        while ( count < numBytesRead ) {
-            if (loopCounter-- == 0) break;
-            
-            pCmd = (proCommand_t *)&(pSelf->endpointBufferBulkInRef[count]);
-            
-            if (pCmd->proCmdHead.cmdNo != 0u) {
-                count += getCommandSize(pCmd);
-                LeafProDecodeCommand(pSelf, pCmd);
-            } else {
-                /* No command */
-                count += pSelf->endpointMaxSizeBulkIn;;
-                count &= -pSelf->endpointMaxSizeBulkIn;
-            }
-            
-            /* See if we had to wait */
-            if (pCmd->proCmdHead.cmdNo == pPriv->timeOutReason) {
-                pPriv->timeOutReason = 0;
-                dispatch_semaphore_signal(pPriv->semaTimeout);
-            }
+        pCmd = (proCommand_t *)&(pBuffer[count]);
+        
+        if (pCmd->proCmdHead.cmdNo != 0u) {
+            count += getCommandSize(pCmd);
+            LeafProDecodeCommand(pSelf, pCmd);
+        } else {
+            /* No command */
+            count += pSelf->endpointMaxSizeBulkIn;;
+            count &= -pSelf->endpointMaxSizeBulkIn;
+        }
+        
+        /* See if we had to wait */
+        if (pCmd->proCmdHead.cmdNo == pPriv->timeOutReason) {
+            pPriv->timeOutReason = 0;
+            dispatch_semaphore_signal(pPriv->semaTimeout);
         }
     }
-    
-    /* Trigger next read */
-    CAN4OSX_usbReadFromBulkInPipe(pSelf);
 }
 
 
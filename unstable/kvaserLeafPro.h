@@ -58,6 +58,9 @@ extern CAN4OSX_HW_FUNC_T leafProHardwareFunctions;
 # define LEAFPRO_MSG_FLAG_TXACK         0x40
 # define LEAFPRO_MSG_FLAG_TXRQ          0x80
 
+/* timer of the log messages (48 bit) and the FD messages (64 bit) */
+# define LEAFPRO_TIMER_FREQ             80000000u
+
 #define LEAFPRO_MSGFLAG_SSM_NACK        0x001000        // Single shot transmission failed.
 #define LEAFPRO_MSGFLAG_ABL             0x002000        // Single shot transmission failed due to ArBitration Loss.
 #define LEAFPRO_MSGFLAG_FDF             0x010000        // Message is an FD message (CAN FD)
@@ -66,6 +69,40 @@ extern CAN4OSX_HW_FUNC_T leafProHardwareFunctions;
 
 # define LEAFPRO_EXT_MSG 0x80000000
 
+/* all commands have this size, except LEAFPRO_CMD_CAN_FD which carries its own */
+#define LEAFPRO_COMMAND_SIZE 32u
+
+#define LEAFPRO_CMD_SET_BUSPARAMS_REQ           16u
+#define LEAFPRO_CMD_CHIP_STATE_EVENT            20u
+#define LEAFPRO_CMD_SET_DRIVERMODE_REQ          21u
+#define LEAFPRO_CMD_START_CHIP_REQ              26u
+#define LEAFPRO_CMD_START_CHIP_RESP             27u
+#define LEAFPRO_CMD_TX_CAN_MESSAGE              33u
+#define LEAFPRO_CMD_GET_CARD_INFO_REQ           34u
+#define LEAFPRO_CMD_GET_CARD_INFO_RESP          35u
+#define LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ       38u
+#define LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP      39u
+#define LEAFPRO_CMD_SET_BUSPARAMS_FD_REQ        69u
+#define LEAFPRO_CMD_SET_BUSPARAMS_FD_RESP       70u
+#define LEAFPRO_CMD_SET_BUSPARAMS_RESP          85u
+#define LEAFPRO_CMD_LOG_MESSAGE                 106u
+#define LEAFPRO_CMD_MAP_CHANNEL_REQ             200u
+#define LEAFPRO_CMD_MAP_CHANNEL_RESP            201u
+#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ    202u
+#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP   203u
+
+#define LEAFPRO_CMD_TX_ACKNOWLEDGE_FD           225u
+#define LEAFPRO_CMD_RX_MESSAGE_FD               226u
+
+/* extended FD able command code */
+#define LEAFPRO_CMD_CAN_FD                      255u
+
+/* extended capabilty flag */
+#define LEASPRO_SUPPORT_EXTENDED                0x200u
+
+/* hydra entity addresses */
+#define LEAFPRO_HE_ILLEGAL      0x3eu
+#define LEAFPRO_HE_ROUTER       0x00u
 
 
 // Header for every command.
@@ -239,6 +276,7 @@ typedef struct {
     int bufferSize;
     int bufferFirst;
     int bufferCount;
+    int bufferHighWater;
     dispatch_queue_t bufferGDCqueueRef;
     proCommand_t *commandRef;
 } LeafProCommandMsgBuf_t;
@@ -262,6 +300,7 @@ typedef struct {
     UInt8   fd_sjw;
     UInt8   fd_nosamp;
     UInt8	chan2he[5];
+    UInt8   txNextChannel;  /* first channel, starts the next bulk-out packet */
 } LeafProPrivateData_t;
 
 #endif /* can4osx_kvaserLeafPro_h */
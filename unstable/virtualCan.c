@@ -0,0 +1,1361 @@
+//
+//  virtualCan.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+#include "can4osx.h"
+#include "can4osx_debug.h"
+#include "can4osx_internal.h"
+
+#include "virtualCan.h"
+
+
+/* The virtual device has no USB side. Its channels are the nodes of one bus
+ * inside the process. A frame written on a channel waits in the transmit
+ * queue of the channel until it wins the arbitration against the queued
+ * frames of the other nodes, then takes the bus for the time its bits need
+ * at the bit rate, stuff bits included. At the end of the frame it goes into
+ * the receive rings of the other channels on the bus and back to the sender
+ * as TXACK, with the end of the frame as time stamp. A thread per bus runs
+ * the bus, under the bus mutex, which also serializes the producers of the
+ * receive rings. The notification callbacks run in that thread. */
+
+/* the frame of the load generator is on the bus, not one of a channel */
+#define VIRTUAL_LOAD_NODE       0xFFFFFFFFu
+
+/* bits of an error flag, its delimiter and the intermission */
+#define VIRTUAL_ERROR_BITS      17u
+/* bits of a frame after the CRC delimiter, ACK, EOF and intermission */
+#define VIRTUAL_TRAILER_BITS    12u
+
+/* a frame waiting for the bus */
+typedef struct {
+    UInt64 queuedNs;        /* when canWrite took it */
+    UInt32 id;
+    UInt32 flags;           /* canMSG_xxx and canFDMSG_xxx */
+    UInt8  length;
+    UInt8  data[CAN4OSX_CAN_MAX_MSG_LEN];
+} VirtualFrame_t;
+
+typedef struct {
+    /* recursive, a notification callback may write again */
+    pthread_mutex_t busMutex;
+    /* the channels are in consecutive slots from pFirst on */
+    Can4osxUsbDeviceHandleEntry *pFirst;
+    UInt32 channelCount;
+    UInt32 channelRefs;
+    UInt32 bitRate;
+    UInt32 bitRateFd;       /* of the data phase with BRS */
+    UInt64 busFreeNs;       /* end of the last frame on the bus */
+    UInt64 nextStartNs;     /* earliest start of the next frame, ~0 for none */
+    /* the frame on the bus */
+    Boolean busy;
+    Boolean txError;        /* ends in an error frame */
+    UInt32 txNode;
+    UInt64 txEndNs;
+    VirtualFrame_t txFrame;
+    /* the load generator, a node sending one frame every loadPeriodNs */
+    UInt32 loadPercent;
+    UInt64 loadPeriodNs;
+    VirtualFrame_t loadFrame;
+    /* the bus thread */
+    dispatch_queue_t busQueue;
+    dispatch_semaphore_t semaWork;
+    dispatch_semaphore_t semaClosed;
+    Boolean closing;
+} VirtualBus_t;
+
+typedef struct {
+    VirtualBus_t *pBus;
+    Boolean busOn;
+    Boolean canFd;
+    Boolean txInFlight;     /* the head of the queue is on the bus */
+    VirtualFrame_t txQueue[VIRTUAL_TX_QUEUE_SIZE];
+    UInt32 txFirst;
+    UInt32 txCount;
+    UInt32 txHighWater;
+    /* counted past 255, the chip state tells bus off from there */
+    UInt32 txErrorCounter;
+    UInt32 rxErrorCounter;
+    UInt32 injectErrors;    /* the next frames of the channel end in an error frame */
+} VirtualPrivateData_t;
+
+/* the bits of a frame on the wire */
+typedef struct {
+    UInt32 bits;            /* stuff bits included */
+    UInt8  level;           /* of the last bit */
+    UInt8  run;             /* bits of that level in a row */
+    UInt16 crc;             /* CRC-15 of a classic frame */
+} VirtualBitStream_t;
+
+
+static char* pDeviceString = "can4osx Virtual CAN";
+
+
+static canStatus VirtualInitHardware(const CanHandle hnd);
+static CanHandle VirtualCanOpenChannel(int channel, int flags);
+static canStatus VirtualCanBusOn(const CanHandle hnd);
+static canStatus VirtualCanBusOff(const CanHandle hnd);
+static canStatus VirtualCanSetBusParams(const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
+static canStatus VirtualCanSetBusParamsFd(const CanHandle hnd, SInt32 freq_brs, UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
+static canStatus VirtualCanWrite(const CanHandle hnd, UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
+static canStatus VirtualCanWriteBatch(const CanHandle hnd, const CanFrame *frames, UInt32 count, UInt32 *sent);
+static canStatus VirtualCanRead(const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
+static canStatus VirtualCanClose(const CanHandle hnd);
+static void VirtualCanGetTxQueueStat(const CanHandle hnd, UInt32 *pSize, UInt32 *pHighWater);
+static void VirtualRunExclusive(const CanHandle hnd, dispatch_block_t block);
+
+static void VirtualBusThread(VirtualBus_t *pBus);
+
+
+CAN4OSX_HW_FUNC_T virtualHardwareFunctions = {
+	.can4osxhwInitRef = VirtualInitHardware,
+	.can4osxhwCanOpenChannel = VirtualCanOpenChannel,
+	.can4osxhwCanSetBusParamsRef = VirtualCanSetBusParams,
+	.can4osxhwCanSetBusParamsFdRef = VirtualCanSetBusParamsFd,
+	.can4osxhwCanBusOnRef = VirtualCanBusOn,
+	.can4osxhwCanBusOffRef = VirtualCanBusOff,
+	.can4osxhwCanWriteRef = VirtualCanWrite,
+	.can4osxhwCanWriteBatchRef = VirtualCanWriteBatch,
+	.can4osxhwCanReadRef = VirtualCanRead,
+	.can4osxhwCanCloseRef = VirtualCanClose,
+	.can4osxhwCanSetTxQueueSizeRef = NULL,
+	.can4osxhwCanGetTxQueueStatRef = VirtualCanGetTxQueueStat,
+	.can4osxhwRunExclusiveRef = VirtualRunExclusive,
+};
+
+
+/******************************************************************************/
+static Can4osxUsbDeviceHandleEntry* VirtualChannel(
+		VirtualBus_t *pBus,
+		UInt32 node
+	)
+{
+	return(CAN4OSX_CHANNEL(pBus->pFirst->channelIndex + node));
+}
+
+
+/******************************************************************************/
+static UInt64 VirtualNow(
+		VirtualBus_t *pBus
+	)
+{
+	(void)pBus;
+
+	return(CAN4OSX_HostNs());
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualInitHardware - set up a channel of the virtual bus
+ *
+ * The first channel creates the bus and its thread and sets the channel
+ * count, the others are copies of the entry before them and join its bus.
+ *
+ * \return canStatus
+ */
+static canStatus VirtualInitHardware(
+		const CanHandle hnd
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv;
+VirtualBus_t *pBus;
+
+	pPriv = calloc(1, sizeof(VirtualPrivateData_t));
+	if ( pPriv == NULL )  {
+		return(canERR_NOMEM);
+	}
+
+	if ( pSelf->deviceChannelCount == 0 )  {
+		pthread_mutexattr_t attr;
+
+		pBus = calloc(1, sizeof(VirtualBus_t));
+		if ( pBus == NULL )  {
+			free(pPriv);
+			return(canERR_NOMEM);
+		}
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&pBus->busMutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+
+		pBus->pFirst = pSelf;
+		pBus->bitRate = VIRTUAL_DEFAULT_BITRATE;
+		pBus->bitRateFd = VIRTUAL_DEFAULT_BITRATE;
+		pBus->nextStartNs = ~0ull;
+
+		pBus->semaWork = dispatch_semaphore_create(0);
+		pBus->semaClosed = dispatch_semaphore_create(0);
+		pBus->busQueue = dispatch_queue_create("com.can4osx.virtualbus", 0);
+		dispatch_async(pBus->busQueue, ^{
+			VirtualBusThread(pBus);
+		});
+
+		pSelf->deviceChannelCount = VIRTUAL_CHANNEL_COUNT;
+	} else {
+		pBus = ((VirtualPrivateData_t *)pSelf->privateData)->pBus;
+	}
+
+	pthread_mutex_lock(&pBus->busMutex);
+	pBus->channelCount++;
+	pBus->channelRefs++;
+	pthread_mutex_unlock(&pBus->busMutex);
+
+	pPriv->pBus = pBus;
+	pSelf->privateData = pPriv;
+
+	sprintf((char*)pSelf->devInfo.deviceString, "%s %d/%d", pDeviceString, pSelf->deviceChannel + 1, pSelf->deviceChannelCount);
+	pSelf->devInfo.capability = canCHANNEL_CAP_VIRTUAL | canCHANNEL_CAP_CAN_FD;
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static CanHandle VirtualCanOpenChannel(
+		int channel,
+		int flags
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(channel);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+
+	// Like with canlib, virtual channels have to be asked for
+	if ( !(flags & canOPEN_ACCEPT_VIRTUAL) )  {
+		return(canERR_NOTFOUND);
+	}
+
+	if ( pPriv == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	pPriv->canFd = ((flags & canOPEN_CAN_FD) == canOPEN_CAN_FD);
+
+	return((CanHandle)channel);
+}
+
+
+#pragma mark error states
+/******************************************************************************/
+/**
+ * \brief VirtualUpdateState - chip state from the error counters
+ *
+ * Called with the bus mutex held. A change is a canNOTIFY_STATUS event.
+ */
+static void VirtualUpdateState(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		VirtualPrivateData_t *pPriv
+	)
+{
+UInt8 state;
+
+	if ( pPriv->txErrorCounter > 255u )  {
+		state = CHIPSTAT_BUSOFF;
+	} else if ( (pPriv->txErrorCounter >= 128u) || (pPriv->rxErrorCounter >= 128u) )  {
+		state = CHIPSTAT_ERROR_PASSIVE;
+	} else {
+		state = CHIPSTAT_ERROR_ACTIVE;
+	}
+
+	pSelf->canState.txErrorCounter = (pPriv->txErrorCounter > 255u) ? 255u : (UInt8)pPriv->txErrorCounter;
+	pSelf->canState.rxErrorCounter = (pPriv->rxErrorCounter > 255u) ? 255u : (UInt8)pPriv->rxErrorCounter;
+
+	if ( state != pSelf->canState.canState )  {
+		pSelf->canState.canState = state;
+		CAN4OSX_NotifyEvent(pSelf, canNOTIFY_STATUS);
+	}
+}
+
+
+/******************************************************************************/
+/* A channel takes part in the traffic while on bus and not bus off */
+static Boolean VirtualOnBus(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		VirtualPrivateData_t *pPriv
+	)
+{
+	return( (pPriv != NULL) && pPriv->busOn && (pSelf->canState.canState != CHIPSTAT_BUSOFF) );
+}
+
+
+/******************************************************************************/
+static canStatus VirtualCanSetBusOn(
+		const CanHandle hnd,
+		Boolean busOn
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+
+	if ( pPriv == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+
+	if ( busOn )  {
+		// Going on bus again is also the way out of bus off
+		pPriv->txErrorCounter = 0u;
+		pPriv->rxErrorCounter = 0u;
+		VirtualUpdateState(pSelf, pPriv);
+	} else {
+		// The queued frames are dropped, one on the bus gets no TXACK
+		pPriv->txCount = 0u;
+		pPriv->txInFlight = false;
+	}
+	pPriv->busOn = busOn;
+
+	CAN4OSX_FlushNotify(pPriv->pBus->pFirst);
+
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	dispatch_semaphore_signal(pPriv->pBus->semaWork);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static canStatus VirtualCanBusOn(
+		const CanHandle hnd
+	)
+{
+	return(VirtualCanSetBusOn(hnd, true));
+}
+
+
+/******************************************************************************/
+static canStatus VirtualCanBusOff(
+		const CanHandle hnd
+	)
+{
+	return(VirtualCanSetBusOn(hnd, false));
+}
+
+
+#pragma mark bit timing
+/******************************************************************************/
+// Translate from baud macro to the bit rate, the segments do not matter here
+/******************************************************************************/
+static canStatus VirtualCanTranslateBaud(
+		SInt32 freq,
+		UInt32 *pBitRate
+	)
+{
+	switch (freq)  {
+		case canFD_BITRATE_8M_60P:
+			*pBitRate = 8000000u;
+			break;
+		case canFD_BITRATE_4M_80P:
+			*pBitRate = 4000000u;
+			break;
+		case canFD_BITRATE_2M_80P:
+			*pBitRate = 2000000u;
+			break;
+		case canBITRATE_1M:
+		case canFD_BITRATE_1M_80P:
+			*pBitRate = 1000000u;
+			break;
+		case canBITRATE_500K:
+		case canFD_BITRATE_500K_80P:
+			*pBitRate = 500000u;
+			break;
+		case canBITRATE_250K:
+			*pBitRate = 250000u;
+			break;
+		case canBITRATE_125K:
+			*pBitRate = 125000u;
+			break;
+		case canBITRATE_100K:
+			*pBitRate = 100000u;
+			break;
+		case canBITRATE_83K:
+			*pBitRate = 83333u;
+			break;
+		case canBITRATE_62K:
+			*pBitRate = 62500u;
+			break;
+		case canBITRATE_50K:
+			*pBitRate = 50000u;
+			break;
+		case canBITRATE_10K:
+			*pBitRate = 10000u;
+			break;
+		default:
+			if ( (freq <= 0) || (freq > 8000000) )  {
+				return(canERR_PARAM);
+			}
+			*pBitRate = (UInt32)freq;
+			break;
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/* All nodes share one bit rate, the one set last counts */
+static canStatus VirtualCanSetBusParams(
+		const CanHandle hnd,
+		SInt32 freq,
+		UInt32 tseg1,
+		UInt32 tseg2,
+		UInt32 sjw,
+		UInt32 noSamp,
+		UInt32 syncmode
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+UInt32 bitRate;
+
+	(void)tseg1;
+	(void)tseg2;
+	(void)sjw;
+	(void)noSamp;
+	(void)syncmode;
+
+	if ( pPriv == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	if ( canOK != VirtualCanTranslateBaud(freq, &bitRate) )  {
+		return(canERR_PARAM);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	pPriv->pBus->bitRate = bitRate;
+	if ( pPriv->pBus->bitRateFd < bitRate )  {
+		pPriv->pBus->bitRateFd = bitRate;
+	}
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static canStatus VirtualCanSetBusParamsFd(
+		const CanHandle hnd,
+		SInt32 freq_brs,
+		UInt32 tseg1,
+		UInt32 tseg2,
+		UInt32 sjw
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+UInt32 bitRate;
+
+	(void)tseg1;
+	(void)tseg2;
+	(void)sjw;
+
+	if ( pPriv == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	if ( canOK != VirtualCanTranslateBaud(freq_brs, &bitRate) )  {
+		return(canERR_PARAM);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	pPriv->pBus->bitRateFd = bitRate;
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualPutBits - put bits on the wire, most significant first
+ *
+ * After five bits of the same level a stuff bit of the other level follows,
+ * it counts for the next run. crc feeds the bits into the CRC-15.
+ */
+static void VirtualPutBits(
+		VirtualBitStream_t *pStream,
+		UInt32 value,
+		UInt32 count,
+		Boolean crc
+	)
+{
+	while ( count > 0u )  {
+		UInt8 bit = (UInt8)((value >> (count - 1u)) & 1u);
+
+		count--;
+
+		if ( crc )  {
+			UInt8 crcNext = (UInt8)(((pStream->crc >> 14u) & 1u) ^ bit);
+
+			pStream->crc = (UInt16)((pStream->crc << 1u) & 0x7FFFu);
+			if ( crcNext )  {
+				pStream->crc ^= 0x4599u;
+			}
+		}
+
+		pStream->bits++;
+		if ( (pStream->run > 0u) && (bit == pStream->level) )  {
+			pStream->run++;
+		} else {
+			pStream->level = bit;
+			pStream->run = 1u;
+		}
+
+		if ( pStream->run == 5u )  {
+			pStream->bits++;
+			pStream->level = !bit;
+			pStream->run = 1u;
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualFrameBits - the bits a frame takes on the bus
+ *
+ * Counts the real stuff bits, so the time depends on id and data like on a
+ * real bus. For a CAN FD frame with BRS the bits from ESI to the CRC are at
+ * the data bit rate, the stuff count and CRC have their fixed stuff bits.
+ */
+static void VirtualFrameBits(
+		const VirtualFrame_t *pFrame,
+		UInt32 *pNominalBits,
+		UInt32 *pDataBits
+	)
+{
+VirtualBitStream_t stream;
+Boolean ext = ((pFrame->flags & canMSG_EXT) != 0u);
+UInt32 i;
+
+	memset(&stream, 0, sizeof(stream));
+
+	VirtualPutBits(&stream, 0u, 1u, true);                   // SOF
+	if ( ext )  {
+		VirtualPutBits(&stream, pFrame->id >> 18u, 11u, true);
+		VirtualPutBits(&stream, 0x3u, 2u, true);             // SRR, IDE
+		VirtualPutBits(&stream, pFrame->id & 0x3FFFFu, 18u, true);
+	} else {
+		VirtualPutBits(&stream, pFrame->id, 11u, true);
+	}
+
+	if ( pFrame->flags & canFDMSG_FDF )  {
+		UInt32 nominalBits;
+		UInt32 bits;
+
+		// RRS, IDE of a standard frame, FDF, res, BRS
+		VirtualPutBits(&stream, 0u, ext ? 1u : 2u, false);
+		VirtualPutBits(&stream, 0x2u, 2u, false);
+		VirtualPutBits(&stream, (pFrame->flags & canFDMSG_BRS) ? 1u : 0u, 1u, false);
+		nominalBits = stream.bits;
+
+		VirtualPutBits(&stream, 0u, 1u, false);              // ESI
+		VirtualPutBits(&stream, CAN4OSX_encodeFdDlc(pFrame->length), 4u, false);
+		for ( i = 0u; i < pFrame->length; i++ )  {
+			VirtualPutBits(&stream, pFrame->data[i], 8u, false);
+		}
+
+		// Stuff count and CRC-17 or CRC-21, one fixed stuff bit every 4 bits
+		if ( pFrame->length > 16u )  {
+			bits = stream.bits + 4u + 21u + 7u;
+		} else {
+			bits = stream.bits + 4u + 17u + 6u;
+		}
+
+		if ( pFrame->flags & canFDMSG_BRS )  {
+			*pNominalBits = nominalBits + VIRTUAL_TRAILER_BITS + 1u;
+			*pDataBits = bits - nominalBits;
+		} else {
+			*pNominalBits = bits + VIRTUAL_TRAILER_BITS + 1u;
+			*pDataBits = 0u;
+		}
+	} else {
+		UInt32 rtr = (pFrame->flags & canMSG_RTR) ? 1u : 0u;
+
+		// RTR, then r1 r0 or IDE r0
+		VirtualPutBits(&stream, rtr, 1u, true);
+		VirtualPutBits(&stream, 0u, 2u, true);
+		VirtualPutBits(&stream, pFrame->length, 4u, true);
+		if ( !rtr )  {
+			for ( i = 0u; i < pFrame->length; i++ )  {
+				VirtualPutBits(&stream, pFrame->data[i], 8u, true);
+			}
+		}
+		VirtualPutBits(&stream, stream.crc, 15u, false);
+
+		*pNominalBits = stream.bits + VIRTUAL_TRAILER_BITS + 1u;
+		*pDataBits = 0u;
+	}
+}
+
+
+/******************************************************************************/
+static UInt64 VirtualBitsNs(
+		UInt32 bits,
+		UInt32 bitRate
+	)
+{
+	return((((UInt64)bits * 1000000000u) + (bitRate / 2u)) / bitRate);
+}
+
+
+/******************************************************************************/
+static UInt64 VirtualFrameNs(
+		VirtualBus_t *pBus,
+		const VirtualFrame_t *pFrame
+	)
+{
+UInt32 nominalBits;
+UInt32 dataBits;
+
+	VirtualFrameBits(pFrame, &nominalBits, &dataBits);
+
+	return(VirtualBitsNs(nominalBits, pBus->bitRate) + VirtualBitsNs(dataBits, pBus->bitRateFd));
+}
+
+
+#pragma mark bus
+/******************************************************************************/
+/**
+ * \brief VirtualArbitration - the arbitration field as number
+ *
+ * Sent most significant bit first, the lower number has the first dominant
+ * bit and wins. A standard frame beats an extended one with the same base
+ * id at the latest with its IDE bit, a data frame a remote one with RTR.
+ */
+static UInt64 VirtualArbitration(
+		const VirtualFrame_t *pFrame
+	)
+{
+UInt64 rtr = (pFrame->flags & canMSG_RTR) ? 1u : 0u;
+
+	if ( pFrame->flags & canMSG_EXT )  {
+		return(((UInt64)(pFrame->id >> 18u) << 21u) | (3ull << 19u) | ((UInt64)(pFrame->id & 0x3FFFFu) << 1u) | rtr);
+	}
+	return(((UInt64)pFrame->id << 21u) | (rtr << 20u));
+}
+
+
+/******************************************************************************/
+/* The frame node i has ready for the bus, NULL for none */
+static VirtualFrame_t* VirtualHeadFrame(
+		VirtualBus_t *pBus,
+		UInt32 node
+	)
+{
+	if ( node == VIRTUAL_LOAD_NODE )  {
+		return( (pBus->loadPercent != 0u) ? &pBus->loadFrame : NULL );
+	} else {
+		Can4osxUsbDeviceHandleEntry *pEntry = VirtualChannel(pBus, node);
+		VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pEntry->privateData;
+
+		if ( !VirtualOnBus(pEntry, pPriv) || (pPriv->txCount == 0u) )  {
+			return(NULL);
+		}
+		return(&pPriv->txQueue[pPriv->txFirst]);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualBusArbitrate - put the next frame on the bus
+ *
+ * Called with the bus mutex held while the bus is idle. The arbitration is
+ * at the end of the last frame or when the first frame got ready, all frames
+ * ready by then take part.
+ *
+ * \return true if a frame started at nowNs or before
+ */
+static Boolean VirtualBusArbitrate(
+		VirtualBus_t *pBus,
+		UInt64 nowNs
+	)
+{
+VirtualFrame_t *pWinner = NULL;
+UInt32 winner = 0u;
+UInt64 startNs = ~0ull;
+UInt32 node;
+
+	// The first frame ready
+	for ( node = 0u; node <= pBus->channelCount; node++ )  {
+		UInt32 n = (node < pBus->channelCount) ? node : VIRTUAL_LOAD_NODE;
+		VirtualFrame_t *pFrame = VirtualHeadFrame(pBus, n);
+
+		if ( (pFrame != NULL) && (pFrame->queuedNs < startNs) )  {
+			startNs = pFrame->queuedNs;
+		}
+	}
+
+	if ( startNs == ~0ull )  {
+		pBus->nextStartNs = ~0ull;
+		return(false);
+	}
+	if ( startNs < pBus->busFreeNs )  {
+		startNs = pBus->busFreeNs;
+	}
+
+	pBus->nextStartNs = startNs;
+	if ( startNs > nowNs )  {
+		return(false);
+	}
+
+	// The lowest arbitration field of all frames ready at the start wins
+	for ( node = 0u; node <= pBus->channelCount; node++ )  {
+		UInt32 n = (node < pBus->channelCount) ? node : VIRTUAL_LOAD_NODE;
+		VirtualFrame_t *pFrame = VirtualHeadFrame(pBus, n);
+
+		if ( (pFrame != NULL) && (pFrame->queuedNs <= startNs) &&
+			 ((pWinner == NULL) || (VirtualArbitration(pFrame) < VirtualArbitration(pWinner))) )  {
+			pWinner = pFrame;
+			winner = n;
+		}
+	}
+
+	pBus->txNode = winner;
+	pBus->txFrame = *pWinner;
+	pBus->txEndNs = startNs + VirtualFrameNs(pBus, pWinner);
+	pBus->txError = false;
+
+	if ( winner != VIRTUAL_LOAD_NODE )  {
+		VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)VirtualChannel(pBus, winner)->privateData;
+
+		pPriv->txInFlight = true;
+		// The error flag is sent at the CRC delimiter, the frame is sent again
+		if ( pPriv->injectErrors > 0u )  {
+			pBus->txError = true;
+			pBus->txEndNs += VirtualBitsNs(VIRTUAL_ERROR_BITS, pBus->bitRate) - VirtualBitsNs(VIRTUAL_TRAILER_BITS, pBus->bitRate);
+		}
+	}
+
+	pBus->busy = true;
+
+	return(true);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualCanDeliver - put a frame into the receive ring of a channel
+ *
+ * Called with the bus mutex held.
+ */
+static void VirtualCanDeliver(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt32 id,
+		UInt32 flags,
+		const void *msg,
+		UInt8 length,
+		UInt64 timestamp
+	)
+{
+CAN4OSX_RX_RECORD_T *pRecord;
+UInt32 notify = canNOTIFY_RX;
+
+	pRecord = CAN4OSX_ReserveCanEventBuffer(pSelf->canEventMsgBuff, length);
+	if ( pRecord != NULL )  {
+		pRecord->canId = id;
+		pRecord->canFlags = flags;
+		// Device and host time are the same clock here
+		pRecord->canTimestamp = timestamp;
+		pRecord->canHostTimestamp = timestamp;
+		memcpy(pRecord->canData, msg, length);
+
+		CAN4OSX_CommitCanEventBuffer(pSelf->canEventMsgBuff, pRecord);
+	} else {
+		// The overrun counter has the lost frame, there is nothing to read
+		notify = 0u;
+	}
+
+	if ( flags & canMSG_TXACK )  {
+		notify |= canNOTIFY_TX;
+	}
+	if ( flags & canMSG_ERROR_FRAME )  {
+		notify |= canNOTIFY_ERROR;
+	}
+	if ( notify != 0u )  {
+		CAN4OSX_NotifyEvent(pSelf, notify);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualBusComplete - the end of the frame on the bus
+ *
+ * Called with the bus mutex held. The receivers get the frame through their
+ * acceptance filter, the sender gets it back as TXACK unfiltered. An error
+ * frame goes to all channels on the bus and counts on the error counters,
+ * the frame stays queued.
+ */
+static void VirtualBusComplete(
+		VirtualBus_t *pBus
+	)
+{
+const VirtualFrame_t *pFrame = &pBus->txFrame;
+UInt32 i;
+
+	pBus->busy = false;
+	pBus->busFreeNs = pBus->txEndNs;
+
+	for ( i = 0u; i < pBus->channelCount; i++ )  {
+		Can4osxUsbDeviceHandleEntry *pEntry = VirtualChannel(pBus, i);
+		VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pEntry->privateData;
+
+		if ( !VirtualOnBus(pEntry, pPriv) )  {
+			continue;
+		}
+
+		if ( pBus->txError )  {
+			VirtualCanDeliver(pEntry, 0u, canMSG_ERROR_FRAME, pFrame->data, 0u, pBus->txEndNs);
+			if ( i == pBus->txNode )  {
+				pPriv->txErrorCounter += 8u;
+				pPriv->injectErrors--;
+				pPriv->txInFlight = false;
+			} else if ( pPriv->rxErrorCounter < 255u )  {
+				pPriv->rxErrorCounter++;
+			}
+		} else if ( i == pBus->txNode )  {
+			if ( pPriv->txInFlight )  {
+				VirtualCanDeliver(pEntry, pFrame->id, pFrame->flags | canMSG_TXACK, pFrame->data, pFrame->length, pBus->txEndNs);
+				pPriv->txFirst = (pPriv->txFirst + 1u) % VIRTUAL_TX_QUEUE_SIZE;
+				pPriv->txCount--;
+				pPriv->txInFlight = false;
+			}
+			if ( pPriv->txErrorCounter > 0u )  {
+				pPriv->txErrorCounter--;
+			}
+		} else {
+			if ( pPriv->rxErrorCounter > 0u )  {
+				pPriv->rxErrorCounter--;
+			}
+			if ( CAN4OSX_FilterAccept(pEntry, pFrame->id, pFrame->flags) )  {
+				VirtualCanDeliver(pEntry, pFrame->id, pFrame->flags, pFrame->data, pFrame->length, pBus->txEndNs);
+			}
+		}
+
+		VirtualUpdateState(pEntry, pPriv);
+	}
+
+	// The load generator keeps its rate, but does not catch up after a jam
+	if ( !pBus->txError && (pBus->txNode == VIRTUAL_LOAD_NODE) )  {
+		pBus->loadFrame.queuedNs += pBus->loadPeriodNs;
+		if ( (pBus->loadFrame.queuedNs + pBus->loadPeriodNs) < pBus->busFreeNs )  {
+			pBus->loadFrame.queuedNs = pBus->busFreeNs;
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualBusRun - run the bus up to nowNs
+ *
+ * Called with the bus mutex held.
+ *
+ * \return the time of the next event on the bus, ~0 for none
+ */
+static UInt64 VirtualBusRun(
+		VirtualBus_t *pBus,
+		UInt64 nowNs
+	)
+{
+	for (;;)  {
+		if ( !pBus->busy && !VirtualBusArbitrate(pBus, nowNs) )  {
+			return(pBus->nextStartNs);
+		}
+
+		if ( pBus->txEndNs > nowNs )  {
+			return(pBus->txEndNs);
+		}
+
+		VirtualBusComplete(pBus);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualBusThread - the thread of a bus
+ *
+ * Sleeps until the next frame ends or starts, a write wakes it up earlier.
+ * Returns when the last channel closed the bus.
+ */
+static void VirtualBusThread(
+		VirtualBus_t *pBus
+	)
+{
+	for (;;)  {
+		UInt64 nextNs;
+		UInt64 nowNs;
+
+		pthread_mutex_lock(&pBus->busMutex);
+		if ( pBus->closing )  {
+			pthread_mutex_unlock(&pBus->busMutex);
+			break;
+		}
+		nextNs = VirtualBusRun(pBus, VirtualNow(pBus));
+		CAN4OSX_FlushNotify(pBus->pFirst);
+		pthread_mutex_unlock(&pBus->busMutex);
+
+		if ( nextNs == ~0ull )  {
+			(void)CAN4OSX_SemaphoreWait(pBus->semaWork, UINT64_MAX);
+		} else {
+			nowNs = VirtualNow(pBus);
+			(void)CAN4OSX_SemaphoreWait(pBus->semaWork, (nextNs > nowNs) ? (nextNs - nowNs) : 0u);
+		}
+	}
+
+	dispatch_semaphore_signal(pBus->semaClosed);
+}
+
+
+#pragma mark write and read
+/******************************************************************************/
+/**
+ * \brief VirtualCanQueue - queue one frame for the bus
+ *
+ * Called with the bus mutex held.
+ *
+ * \return canStatus
+ */
+static canStatus VirtualCanQueue(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt32 id,
+		const void *msg,
+		UInt16 dlc,
+		UInt32 flag
+	)
+{
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+VirtualFrame_t *pFrame;
+
+	if ( !pPriv->busOn )  {
+		return(canERR_NOTINITIALIZED);
+	}
+
+	if ( flag & canFDMSG_FDF )  {
+		if ( !pPriv->canFd || (dlc > 64u) || (CAN4OSX_encodeFdDlc((UInt8)dlc) == 0xff) )  {
+			return(canERR_PARAM);
+		}
+	}
+
+	if ( pPriv->txCount >= VIRTUAL_TX_QUEUE_SIZE )  {
+		return(canERR_TXBUFOFL);
+	}
+
+	pFrame = &pPriv->txQueue[(pPriv->txFirst + pPriv->txCount) % VIRTUAL_TX_QUEUE_SIZE];
+	memset(pFrame, 0, sizeof(VirtualFrame_t));
+
+	if ( flag & canFDMSG_FDF )  {
+		pFrame->length = (UInt8)dlc;
+		pFrame->flags = flag & (canMSG_EXT | canFDMSG_FDF | canFDMSG_BRS);
+	} else {
+		pFrame->length = (dlc > 8u) ? 8u : (UInt8)dlc;
+		pFrame->flags = flag & (canMSG_RTR | canMSG_EXT);
+	}
+
+	if ( pFrame->flags & canMSG_EXT )  {
+		pFrame->id = id & 0x1FFFFFFFu;
+	} else {
+		pFrame->id = id & 0x7FFu;
+		pFrame->flags |= canMSG_STD;
+	}
+
+	// A remote frame has a length, but no data
+	if ( !(pFrame->flags & canMSG_RTR) && (msg != NULL) )  {
+		memcpy(pFrame->data, msg, pFrame->length);
+	}
+
+	pFrame->queuedNs = VirtualNow(pPriv->pBus);
+
+	pPriv->txCount++;
+	if ( pPriv->txCount > pPriv->txHighWater )  {
+		pPriv->txHighWater = pPriv->txCount;
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static canStatus VirtualCanWrite(
+		const CanHandle hnd,
+		UInt32 id,
+		void *msg,
+		UInt16 dlc,
+		UInt32 flag
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+canStatus status;
+
+	if ( pPriv == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	status = VirtualCanQueue(pSelf, id, msg, dlc, flag);
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	if ( status == canOK )  {
+		dispatch_semaphore_signal(pPriv->pBus->semaWork);
+	}
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualCanWriteBatch - queue several frames for the bus
+ *
+ * The whole batch is queued under one lock, the bus thread is woken once.
+ *
+ * \return canStatus
+ */
+static canStatus VirtualCanWriteBatch(
+		const CanHandle hnd,
+		const CanFrame *frames,
+		UInt32 count,
+		UInt32 *sent
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+canStatus status = canOK;
+
+	*sent = 0;
+
+	if ( pPriv == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+
+	while ( *sent < count )  {
+		const CanFrame *pFrame = &frames[*sent];
+
+		status = VirtualCanQueue(pSelf, pFrame->id, pFrame->msg, pFrame->dlc, pFrame->flag);
+		if ( status != canOK )  {
+			break;
+		}
+		(*sent)++;
+	}
+
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	if ( *sent > 0u )  {
+		dispatch_semaphore_signal(pPriv->pBus->semaWork);
+	}
+
+	return(status);
+}
+
+
+/******************************************************************************/
+static void VirtualCanGetTxQueueStat(
+		const CanHandle hnd,
+		UInt32 *pSize,
+		UInt32 *pHighWater
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+
+	if ( pPriv == NULL )  {
+		return;
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	*pSize = pPriv->txCount;
+	*pHighWater = pPriv->txHighWater;
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualRunExclusive - run a block while the bus thread is out
+ *
+ * The bus thread fills the receive rings under the bus mutex, not on the
+ * driver thread.
+ */
+static void VirtualRunExclusive(
+		const CanHandle hnd,
+		dispatch_block_t block
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+
+	if ( pPriv == NULL )  {
+		block();
+		return;
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	block();
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+}
+
+
+/******************************************************************************/
+static canStatus VirtualCanRead(
+		const CanHandle hnd,
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt32 *time
+	)
+{
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_CHANNEL(hnd);
+CanMsg canMsg;
+
+	if ( self->privateData == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	if ( CAN4OSX_ReadCanEventBuffer(self->canEventMsgBuff, &canMsg) )  {
+
+		*id = canMsg.canId;
+		*dlc = canMsg.canDlc;
+		*time = CAN4OSX_TIME_US(canMsg.canTimestamp);
+
+		memcpy(msg, canMsg.canData, *dlc);
+
+		*flag = canMsg.canFlags;
+
+		return(canOK);
+	} else {
+		return(canERR_NOMSG);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief VirtualCanClose - leave the virtual bus
+ *
+ * The last channel that leaves stops the bus thread and frees the bus.
+ *
+ * \return canStatus
+ */
+static canStatus VirtualCanClose(
+		const CanHandle hnd
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_CHANNEL(hnd);
+VirtualPrivateData_t *pPriv = (VirtualPrivateData_t *)pSelf->privateData;
+VirtualBus_t *pBus;
+UInt32 refs;
+
+	if ( pPriv == NULL )  {
+		return(canERR_NOMEM);
+	}
+
+	pBus = pPriv->pBus;
+
+	pthread_mutex_lock(&pBus->busMutex);
+	pSelf->privateData = NULL;
+	refs = --pBus->channelRefs;
+	if ( refs == 0u )  {
+		pBus->closing = true;
+	}
+	pthread_mutex_unlock(&pBus->busMutex);
+
+	free(pPriv);
+
+	if ( refs == 0u )  {
+		dispatch_semaphore_signal(pBus->semaWork);
+		dispatch_semaphore_wait(pBus->semaClosed, DISPATCH_TIME_FOREVER);
+
+		dispatch_release(pBus->busQueue);
+		dispatch_release(pBus->semaWork);
+		dispatch_release(pBus->semaClosed);
+		pthread_mutex_destroy(&pBus->busMutex);
+		free(pBus);
+	}
+
+	return(canOK);
+}
+
+
+#pragma mark simulation control
+/******************************************************************************/
+/* The private data of a virtual channel, NULL for other channels */
+static VirtualPrivateData_t* VirtualGetPrivate(
+		const CanHandle hnd
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetHandleEntry(hnd);
+
+	if ( (pSelf == NULL) || (pSelf->hwFunctions.can4osxhwInitRef != VirtualInitHardware) )  {
+		return(NULL);
+	}
+
+	return((VirtualPrivateData_t *)pSelf->privateData);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_virtualSetBusLoad - load the bus of hnd with other traffic
+ *
+ * A node outside of the channels sends frames with id and dlc data bytes,
+ * so they take loadPercent of the bus time at the current bit rate. It
+ * takes part in the arbitration like the channels, the channels receive its
+ * frames. 0 stops it.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_virtualSetBusLoad(
+		const CanHandle hnd,
+		UInt32 loadPercent,
+		UInt32 id,
+		UInt8 dlc
+	)
+{
+VirtualPrivateData_t *pPriv = VirtualGetPrivate(hnd);
+VirtualBus_t *pBus;
+
+	if ( pPriv == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( (loadPercent > 100u) || (dlc > 8u) || (id > 0x7FFu) )  {
+		return(canERR_PARAM);
+	}
+
+	pBus = pPriv->pBus;
+
+	pthread_mutex_lock(&pBus->busMutex);
+
+	memset(&pBus->loadFrame, 0, sizeof(VirtualFrame_t));
+	pBus->loadFrame.id = id;
+	pBus->loadFrame.flags = canMSG_STD;
+	pBus->loadFrame.length = dlc;
+	pBus->loadFrame.queuedNs = VirtualNow(pBus);
+	pBus->loadPercent = loadPercent;
+	if ( loadPercent != 0u )  {
+		pBus->loadPeriodNs = (VirtualFrameNs(pBus, &pBus->loadFrame) * 100u) / loadPercent;
+	}
+
+	pthread_mutex_unlock(&pBus->busMutex);
+
+	dispatch_semaphore_signal(pBus->semaWork);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_virtualInjectErrors - destroy the next frames of a channel
+ *
+ * The next count frames hnd sends end in an error frame at the CRC
+ * delimiter and are sent again. Each one adds 8 to the transmit error
+ * counter of hnd and 1 to the receive error counters of the others, so 32
+ * of them in a row put hnd bus off.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_virtualInjectErrors(
+		const CanHandle hnd,
+		UInt32 count
+	)
+{
+VirtualPrivateData_t *pPriv = VirtualGetPrivate(hnd);
+
+	if ( pPriv == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	pPriv->injectErrors += count;
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_virtualBusOff - put a channel bus off right away
+ *
+ * Its queued frames stay until canBusOn brings it back.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_virtualBusOff(
+		const CanHandle hnd
+	)
+{
+VirtualPrivateData_t *pPriv = VirtualGetPrivate(hnd);
+
+	if ( pPriv == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	pthread_mutex_lock(&pPriv->pBus->busMutex);
+	pPriv->txErrorCounter = 256u;
+	VirtualUpdateState(CAN4OSX_CHANNEL(hnd), pPriv);
+	CAN4OSX_FlushNotify(pPriv->pBus->pFirst);
+	pthread_mutex_unlock(&pPriv->pBus->busMutex);
+
+	return(canOK);
+}
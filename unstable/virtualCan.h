@@ -0,0 +1,76 @@
+//
+//  virtualCan.h
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+
+#ifndef CAN4OSX_VIRTUALCAN_H
+#define CAN4OSX_VIRTUALCAN_H 1
+
+/* The entry of the virtual device in can4osxSupportedDevices. The vendor id
+ * does not fit into 16 bit, so no USB device ever matches it. */
+#define VIRTUAL_VENDOR_ID       0x10000u
+#define VIRTUAL_PRODUCT_ID      0xFFFFu
+
+/* number of channels on the virtual bus */
+#ifndef VIRTUAL_CHANNEL_COUNT
+#define VIRTUAL_CHANNEL_COUNT   2u
+#endif
+
+/* frames a channel can queue for the bus */
+#ifndef VIRTUAL_TX_QUEUE_SIZE
+#define VIRTUAL_TX_QUEUE_SIZE   64u
+#endif
+
+/* bit rate of the bus until canSetBusParams sets one */
+#define VIRTUAL_DEFAULT_BITRATE 500000u
+
+
+extern CAN4OSX_HW_FUNC_T virtualHardwareFunctions;
+
+/* simulation control, hnd is any virtual channel of the bus */
+canStatus CAN4OSX_virtualSetBusLoad(const CanHandle hnd, UInt32 loadPercent, UInt32 id, UInt8 dlc);
+canStatus CAN4OSX_virtualInjectErrors(const CanHandle hnd, UInt32 count);
+canStatus CAN4OSX_virtualBusOff(const CanHandle hnd);
+
+
+#endif /* CAN4OSX_VIRTUALCAN_H */